@@ -1,13 +1,27 @@
 /* C speedups for scandir module
 
-This is divided into four sections (each prefixed with a "SECTION:"
+This is divided into eighteen sections (each prefixed with a "SECTION:"
 comment):
 
 1) Python 2/3 compatibility
 2) Helper utilities from posixmodule.c, fileutils.h, etc
-3) SECTION: Main DirEntry and scandir implementation, taken from
+3) Instrumentation counters
+4) Lazy stat results (POSIX only)
+5) Batched directory reading (POSIX only)
+6) Glob pattern matching (POSIX only)
+7) SECTION: Main DirEntry and scandir implementation, taken from
    Python 3.5's posixmodule.c
-4) Module and method definitions and initialization code
+8) Native walk() implementation (POSIX only)
+9) Parallel walk engine (POSIX only)
+10) Bulk stat of directory entries (POSIX only)
+11) Columnar directory listing (POSIX only)
+12) Recursive glob support (POSIX only)
+13) Disk usage (POSIX only)
+14) Tree snapshots (POSIX only)
+15) Tree diffs (POSIX only)
+16) inotify watches (Linux only)
+17) Async readers (POSIX only)
+18) Module and method definitions and initialization code
 
 */
 
@@ -48,6 +62,14 @@ comment):
     PyUnicode_AsUnicode(unicode); *(addr_length) = PyUnicode_GetSize(unicode)
 #endif
 
+#if PY_MAJOR_VERSION < 3
+typedef long Py_hash_t;
+#endif
+
+#ifndef PyStructSequence_GET_ITEM
+#define PyStructSequence_GET_ITEM(op, i) (((PyStructSequence *)(op))->ob_item[i])
+#endif
+
 // Because on PyPy not working without
 #if PY_MAJOR_VERSION == 3 && PY_MINOR_VERSION > 2 && defined(PYPY_VERSION_NUM)
 #define _Py_IDENTIFIER(name) static char * PyId_##name = #name;
@@ -722,6 +744,189 @@ static PyStructSequence_Desc stat_result_desc = {
     10
 };
 
+#if !defined(MS_WINDOWS) && defined(__linux__)
+#include <fcntl.h>
+#include <sys/sysmacros.h>
+#if defined(STATX_BASIC_STATS) && defined(AT_STATX_DONT_SYNC)
+#define HAVE_STATX 1
+#endif
+#endif
+
+#ifdef HAVE_STATX
+/* stat_result field names and the statx mask bits needed to fill them in
+   (statx always returns st_dev, st_blksize and st_rdev). The time fields
+   share the index of their integer slot, fill_time() sets all three. */
+typedef struct {
+    const char *name;
+    unsigned int mask;
+    int index;
+} StatxField;
+
+static StatxField statx_fields[] = {
+    {"st_mode",     STATX_TYPE | STATX_MODE, 0},
+    {"st_ino",      STATX_INO, 1},
+    {"st_dev",      0, 2},
+    {"st_nlink",    STATX_NLINK, 3},
+    {"st_uid",      STATX_UID, 4},
+    {"st_gid",      STATX_GID, 5},
+    {"st_size",     STATX_SIZE, 6},
+    {"st_atime",    STATX_ATIME, 7},
+    {"st_mtime",    STATX_MTIME, 8},
+    {"st_ctime",    STATX_CTIME, 9},
+    {"st_atime_ns", STATX_ATIME, 7},
+    {"st_mtime_ns", STATX_MTIME, 8},
+    {"st_ctime_ns", STATX_CTIME, 9},
+#ifdef HAVE_STRUCT_STAT_ST_BLKSIZE
+    {"st_blksize",  0, ST_BLKSIZE_IDX},
+#endif
+#ifdef HAVE_STRUCT_STAT_ST_BLOCKS
+    {"st_blocks",   STATX_BLOCKS, ST_BLOCKS_IDX},
+#endif
+#ifdef HAVE_STRUCT_STAT_ST_RDEV
+    {"st_rdev",     0, ST_RDEV_IDX},
+#endif
+    {NULL}
+};
+
+#define STATX_WANT_ALL (~0UL)
+
+/* Convert a sequence of stat_result field names to the statx mask to ask
+   for and a bit set of stat_result indexes to fill in. Return 0 on success,
+   -1 with an exception set on error. */
+static int
+statx_parse_fields(PyObject *fields, unsigned int *mask, unsigned long *wanted)
+{
+    PyObject *seq;
+    PyObject *item;
+    PyObject *name_bytes = NULL;
+    const char *name;
+    Py_ssize_t i;
+    StatxField *field;
+
+    seq = PySequence_Fast(fields, "fields must be a sequence of field names");
+    if (!seq)
+        return -1;
+
+    *mask = 0;
+    *wanted = 0;
+    for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        item = PySequence_Fast_GET_ITEM(seq, i);
+#if PY_MAJOR_VERSION >= 3
+        name = PyUnicode_Check(item) ? PyUnicode_AsUTF8(item) : NULL;
+#else
+        if (PyUnicode_Check(item)) {
+            name_bytes = PyUnicode_AsASCIIString(item);
+            name = name_bytes ? PyString_AS_STRING(name_bytes) : NULL;
+        }
+        else
+            name = PyString_Check(item) ? PyString_AS_STRING(item) : NULL;
+#endif
+        if (!name) {
+            if (!PyErr_Occurred())
+                PyErr_Format(PyExc_TypeError,
+                             "field names must be str, not %.200s",
+                             Py_TYPE(item)->tp_name);
+            Py_DECREF(seq);
+            return -1;
+        }
+        for (field = statx_fields; field->name; field++) {
+            if (strcmp(field->name, name) == 0)
+                break;
+        }
+        if (!field->name) {
+            PyErr_Format(PyExc_ValueError, "unknown stat field '%.200s'", name);
+            Py_XDECREF(name_bytes);
+            Py_DECREF(seq);
+            return -1;
+        }
+        Py_CLEAR(name_bytes);
+        *mask |= field->mask;
+        *wanted |= 1UL << field->index;
+    }
+
+    Py_DECREF(seq);
+    return 0;
+}
+
+/* Pack a statx result into a stat_result, filling in only the fields in
+   wanted that the kernel returned; the rest are None */
+static PyObject *
+_pystat_fromstatx(struct statx *stx, unsigned long wanted)
+{
+    int i;
+    int num_fields;
+    StatxField *field;
+    PyObject *v = PyStructSequence_New(&StatResultType);
+    if (v == NULL)
+        return NULL;
+
+    num_fields = (int)(sizeof(stat_result_fields) /
+                       sizeof(stat_result_fields[0])) - 1;
+    for (i = 0; i < num_fields; i++)
+        PyStructSequence_SET_ITEM(v, i, NULL);
+
+    for (field = statx_fields; field->name; field++) {
+        if ((stx->stx_mask & field->mask) != field->mask)
+            wanted &= ~(1UL << field->index);
+    }
+
+#define WANTED(index) (wanted & (1UL << (index)))
+    if (WANTED(0))
+        PyStructSequence_SET_ITEM(v, 0, PyLong_FromLong((long)stx->stx_mode));
+    if (WANTED(1))
+        PyStructSequence_SET_ITEM(v, 1,
+                                  PyLong_FromUnsignedLongLong(stx->stx_ino));
+    if (WANTED(2))
+        PyStructSequence_SET_ITEM(v, 2, _PyLong_FromDev(
+            makedev(stx->stx_dev_major, stx->stx_dev_minor)));
+    if (WANTED(3))
+        PyStructSequence_SET_ITEM(v, 3, PyLong_FromLong((long)stx->stx_nlink));
+    if (WANTED(4))
+        PyStructSequence_SET_ITEM(v, 4, _PyLong_FromUid(stx->stx_uid));
+    if (WANTED(5))
+        PyStructSequence_SET_ITEM(v, 5, _PyLong_FromGid(stx->stx_gid));
+    if (WANTED(6))
+        PyStructSequence_SET_ITEM(v, 6,
+                                  PyLong_FromUnsignedLongLong(stx->stx_size));
+    if (WANTED(7))
+        fill_time(v, 7, (time_t)stx->stx_atime.tv_sec, stx->stx_atime.tv_nsec);
+    if (WANTED(8))
+        fill_time(v, 8, (time_t)stx->stx_mtime.tv_sec, stx->stx_mtime.tv_nsec);
+    if (WANTED(9))
+        fill_time(v, 9, (time_t)stx->stx_ctime.tv_sec, stx->stx_ctime.tv_nsec);
+#ifdef HAVE_STRUCT_STAT_ST_BLKSIZE
+    if (WANTED(ST_BLKSIZE_IDX))
+        PyStructSequence_SET_ITEM(v, ST_BLKSIZE_IDX,
+                                  PyLong_FromLong((long)stx->stx_blksize));
+#endif
+#ifdef HAVE_STRUCT_STAT_ST_BLOCKS
+    if (WANTED(ST_BLOCKS_IDX))
+        PyStructSequence_SET_ITEM(v, ST_BLOCKS_IDX,
+                                  PyLong_FromUnsignedLongLong(stx->stx_blocks));
+#endif
+#ifdef HAVE_STRUCT_STAT_ST_RDEV
+    if (WANTED(ST_RDEV_IDX))
+        PyStructSequence_SET_ITEM(v, ST_RDEV_IDX, PyLong_FromLong(
+            (long)makedev(stx->stx_rdev_major, stx->stx_rdev_minor)));
+#endif
+#undef WANTED
+
+    if (PyErr_Occurred()) {
+        Py_DECREF(v);
+        return NULL;
+    }
+
+    for (i = 0; i < num_fields; i++) {
+        if (!PyStructSequence_GET_ITEM(v, i)) {
+            Py_INCREF(Py_None);
+            PyStructSequence_SET_ITEM(v, i, Py_None);
+        }
+    }
+
+    return v;
+}
+#endif /* HAVE_STATX */
+
 
 #ifdef MS_WINDOWS
 static int
@@ -738,6 +943,7 @@ typedef struct {
     const char *function_name;
     const char *argument_name;
     int nullable;
+    int allow_fd;
     wchar_t *wide;
     char *narrow;
     int fd;
@@ -789,6 +995,29 @@ path_converter(PyObject *o, void *p) {
         return 1;
     }
 
+#ifndef MS_WINDOWS
+#if PY_MAJOR_VERSION >= 3
+    if (path->allow_fd && PyLong_Check(o)) {
+        long fd = PyLong_AsLong(o);
+#else
+    if (path->allow_fd && (PyInt_Check(o) || PyLong_Check(o))) {
+        long fd = PyInt_AsLong(o);
+#endif
+        if (fd == -1 && PyErr_Occurred())
+            return 0;
+        if (fd < 0 || fd > INT_MAX) {
+            FORMAT_EXCEPTION(PyExc_ValueError, "invalid file descriptor for %s");
+            return 0;
+        }
+        path->wide = NULL;
+        path->narrow = NULL;
+        path->length = 0;
+        path->object = o;
+        path->fd = (int)fd;
+        return 1;
+    }
+#endif
+
     unicode = PyUnicode_FromObject(o);
     if (unicode) {
 #ifdef MS_WINDOWS
@@ -896,437 +1125,8228 @@ path_error(path_t *path)
 }
 
 
-/* SECTION: Main DirEntry and scandir implementation, taken from
-   Python 3.5's posixmodule.c */
+/* SECTION: Instrumentation counters
 
-PyDoc_STRVAR(posix_scandir__doc__,
-"scandir(path='.') -> iterator of DirEntry objects for given path");
+Opt-in counts of the directory reads, stats and Python objects the
+native code makes, and how long it runs with the GIL released, so the
+cost of a slow scan can be attributed without strace. They're off by
+default, when each STATS_ADD() is just a test of a global flag. Worker
+threads update them without the GIL, so where the compiler supports it
+they're added to atomically (with no ordering, so stats() called in the
+middle of a scan may be slightly inconsistent).
+*/
 
-static char *follow_symlinks_keywords[] = {"follow_symlinks", NULL};
-#if PY_MAJOR_VERSION >= 3 && PY_MINOR_VERSION >= 3
-static char *follow_symlinks_format = "|$p:DirEntry.stat";
+typedef struct {
+    unsigned long long opendir;             /* directories opened */
+    unsigned long long readdir;             /* getdents64 (or readdir) calls */
+    unsigned long long stat;                /* stats following symlinks */
+    unsigned long long lstat;               /* stats not following symlinks */
+    unsigned long long name_bytes_decoded;  /* bytes of names decoded to str */
+    unsigned long long dir_entries;         /* DirEntry objects created */
+    unsigned long long stat_cache_hits;     /* DirEntry stat results reused */
+    unsigned long long lstat_cache_hits;    /* DirEntry lstat results reused */
+    unsigned long long gil_released_ns;     /* time spent without the GIL */
+} ScandirStats;
+
+/* In the same order as the fields of ScandirStats */
+static const char *scandir_stats_names[] = {
+    "opendir", "readdir", "stat", "lstat", "name_bytes_decoded",
+    "dir_entries", "stat_cache_hits", "lstat_cache_hits", "gil_released_ns",
+};
+
+static int scandir_stats_enabled = 0;
+static ScandirStats scandir_stats;
+
+#if defined(__GNUC__) || defined(__clang__)
+#define STATS_ATOMIC_ADD(counter, n) \
+    ((void)__atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED))
 #else
-static char *follow_symlinks_format = "|i:DirEntry.stat";
+#define STATS_ATOMIC_ADD(counter, n) ((void)((counter) += (n)))
 #endif
 
-typedef struct {
-    PyObject_HEAD
-    PyObject *name;
-    PyObject *path;
-    PyObject *stat;
-    PyObject *lstat;
-#ifdef MS_WINDOWS
-    struct _Py_stat_struct win32_lstat;
-    unsigned __int64 win32_file_index;
-    int got_file_index;
-#if PY_MAJOR_VERSION < 3
-    int name_path_bytes;
-#endif
-#else /* POSIX */
-#ifdef HAVE_DIRENT_D_TYPE
-    unsigned char d_type;
-#endif
-    ino_t d_ino;
-#endif
-} DirEntry;
+#define STATS_ADD(field, n) \
+    do { \
+        if (scandir_stats_enabled) \
+            STATS_ATOMIC_ADD(scandir_stats.field, (unsigned long long)(n)); \
+    } while (0)
 
-static void
-DirEntry_dealloc(DirEntry *entry)
+#ifndef MS_WINDOWS
+#include <time.h>
+
+/* Return the monotonic clock in nanoseconds if stats are enabled, else
+   0 (so the clock isn't read at all when they're off) */
+static unsigned long long
+stats_clock(void)
 {
-    Py_XDECREF(entry->name);
-    Py_XDECREF(entry->path);
-    Py_XDECREF(entry->stat);
-    Py_XDECREF(entry->lstat);
-    Py_TYPE(entry)->tp_free((PyObject *)entry);
-}
+    struct timespec ts;
 
-/* Forward reference */
-static int
-DirEntry_test_mode(DirEntry *self, int follow_symlinks, unsigned short mode_bits);
+    if (!scandir_stats_enabled || clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        return 0;
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
 
-/* Set exception and return -1 on error, 0 for False, 1 for True */
-static int
-DirEntry_is_symlink(DirEntry *self)
+static void
+stats_gil_released(unsigned long long start)
 {
-#ifdef MS_WINDOWS
-    return (self->win32_lstat.st_mode & S_IFMT) == S_IFLNK;
-#elif defined(HAVE_DIRENT_D_TYPE)
-    /* POSIX */
-    if (self->d_type != DT_UNKNOWN)
-        return self->d_type == DT_LNK;
-    else
-        return DirEntry_test_mode(self, 0, S_IFLNK);
+    unsigned long long end;
+
+    if (start && (end = stats_clock()) != 0)
+        STATS_ADD(gil_released_ns, end - start);
+}
+
+/* Like Py_BEGIN/END_ALLOW_THREADS, also adding up the time between them */
+#define SCANDIR_BEGIN_ALLOW_THREADS \
+    { unsigned long long _stats_start = stats_clock(); Py_BEGIN_ALLOW_THREADS
+#define SCANDIR_END_ALLOW_THREADS \
+    Py_END_ALLOW_THREADS stats_gil_released(_stats_start); }
 #else
-    /* POSIX without d_type */
-    return DirEntry_test_mode(self, 0, S_IFLNK);
+#define SCANDIR_BEGIN_ALLOW_THREADS Py_BEGIN_ALLOW_THREADS
+#define SCANDIR_END_ALLOW_THREADS Py_END_ALLOW_THREADS
 #endif
-}
+
+PyDoc_STRVAR(enable_stats__doc__,
+"enable_stats(flag=True) -> bool\n\n\
+Turn the counters returned by stats() on or off, returning the previous\n\
+setting. They're off by default.");
 
 static PyObject *
-DirEntry_py_is_symlink(DirEntry *self)
+scandir_enable_stats(PyObject *self, PyObject *args)
 {
-    int result;
+    int flag = 1;
+    int previous;
 
-    result = DirEntry_is_symlink(self);
-    if (result == -1)
+    if (!PyArg_ParseTuple(args, "|i:enable_stats", &flag))
         return NULL;
-    return PyBool_FromLong(result);
+    previous = scandir_stats_enabled;
+    scandir_stats_enabled = flag != 0;
+    return PyBool_FromLong(previous);
 }
 
+PyDoc_STRVAR(stats__doc__,
+"stats() -> dict\n\n\
+Return the counters added up by the native functions (including their\n\
+worker threads) while enable_stats() was on, since the last\n\
+reset_stats(): opendir (directories opened), readdir (getdents64 or\n\
+readdir calls), stat and lstat (stats following and not following\n\
+symlinks), name_bytes_decoded (bytes of names decoded to str),\n\
+dir_entries (DirEntry objects created), stat_cache_hits and\n\
+lstat_cache_hits (DirEntry stat results reused rather than fetched),\n\
+and gil_released_ns (nanoseconds spent with the GIL released, always 0\n\
+on Windows).");
+
 static PyObject *
-DirEntry_fetch_stat(DirEntry *self, int follow_symlinks)
+scandir_stats_dict(PyObject *self, PyObject *unused)
 {
-    int result;
-    struct _Py_stat_struct st;
-
-#ifdef MS_WINDOWS
-    wchar_t *path;
-
-    path = PyUnicode_AsUnicode(self->path);
-    if (!path)
-        return NULL;
-
-    Py_BEGIN_ALLOW_THREADS
-    if (follow_symlinks)
-        result = win32_stat_w(path, &st);
-    else
-        result = win32_lstat_w(path, &st);
-    Py_END_ALLOW_THREADS
-
-    if (result != 0) {
-        return PyErr_SetExcFromWindowsErrWithFilenameObject(PyExc_OSError,
-                                                            0, self->path);
-    }
-#else /* POSIX */
-    PyObject *bytes;
-    char *path;
+    unsigned long long *counters = (unsigned long long *)&scandir_stats;
+    PyObject *result;
+    PyObject *value;
+    size_t i;
 
-#if PY_MAJOR_VERSION >= 3
-    if (!PyUnicode_FSConverter(self->path, &bytes))
+    result = PyDict_New();
+    if (!result)
         return NULL;
-#else
-    if (PyString_Check(self->path)) {
-        bytes = self->path;
-        Py_INCREF(bytes);
-    } else {
-        bytes = PyUnicode_AsEncodedString(self->path, FS_ENCODING, "strict");
-        if (!bytes)
+    for (i = 0; i < sizeof(scandir_stats_names) / sizeof(scandir_stats_names[0]); i++) {
+        value = PyLong_FromUnsignedLongLong(counters[i]);
+        if (!value || PyDict_SetItemString(result, scandir_stats_names[i], value) < 0) {
+            Py_XDECREF(value);
+            Py_DECREF(result);
             return NULL;
+        }
+        Py_DECREF(value);
     }
-#endif
-    path = PyBytes_AS_STRING(bytes);
-
-    Py_BEGIN_ALLOW_THREADS
-    if (follow_symlinks)
-        result = STAT(path, &st);
-    else
-        result = LSTAT(path, &st);
-    Py_END_ALLOW_THREADS
-    Py_DECREF(bytes);
-
-    if (result != 0)
-        return PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, self->path);
-#endif
-
-    return _pystat_fromstructstat(&st);
+    return result;
 }
 
+PyDoc_STRVAR(reset_stats__doc__,
+"reset_stats()\n\n\
+Set all the counters returned by stats() back to zero.");
+
 static PyObject *
-DirEntry_get_lstat(DirEntry *self)
+scandir_reset_stats(PyObject *self, PyObject *unused)
 {
-    if (!self->lstat) {
-#ifdef MS_WINDOWS
-        self->lstat = _pystat_fromstructstat(&self->win32_lstat);
-#else /* POSIX */
-        self->lstat = DirEntry_fetch_stat(self, 0);
-#endif
-    }
-    Py_XINCREF(self->lstat);
-    return self->lstat;
+    memset(&scandir_stats, 0, sizeof(scandir_stats));
+    Py_RETURN_NONE;
 }
 
-static PyObject *
-DirEntry_get_stat(DirEntry *self, int follow_symlinks)
-{
-    if (!follow_symlinks)
-        return DirEntry_get_lstat(self);
 
-    if (!self->stat) {
-        int result = DirEntry_is_symlink(self);
-        if (result == -1)
-            return NULL;
-        else if (result)
-            self->stat = DirEntry_fetch_stat(self, 1);
-        else
-            self->stat = DirEntry_get_lstat(self);
-    }
+/* SECTION: Lazy stat results (POSIX only)
 
-    Py_XINCREF(self->stat);
-    return self->stat;
-}
+A StatInfo keeps the raw struct stat and only converts a field to a
+Python object when it's asked for, so entry.stat().st_size creates one
+int rather than a stat_result's twenty or so objects (each time field
+alone is an int, a float and a nanosecond int built by multiplying by
+a billion). It has the same attribute names as stat_result, and like
+it indexes, iterates, unpacks and compares as the 10-tuple (mode, ino,
+dev, nlink, uid, gid, size, atime, mtime, ctime) with integer times.
+*/
+
+#ifndef MS_WINDOWS
+
+typedef struct {
+    PyObject_HEAD
+    STRUCT_STAT st;
+} StatInfo;
+
+static PyTypeObject StatInfoType;
+
+#define STAT_INFO_LEN 10
+
+#define StatInfo_Check(op) (Py_TYPE(op) == &StatInfoType)
 
 static PyObject *
-DirEntry_stat(DirEntry *self, PyObject *args, PyObject *kwargs)
+StatInfo_from_stat(STRUCT_STAT *st)
 {
-    int follow_symlinks = 1;
+    StatInfo *info = PyObject_New(StatInfo, &StatInfoType);
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, follow_symlinks_format,
-                                     follow_symlinks_keywords, &follow_symlinks))
+    if (!info)
         return NULL;
-
-    return DirEntry_get_stat(self, follow_symlinks);
+    info->st = *st;
+    return (PyObject *)info;
 }
 
-/* Set exception and return -1 on error, 0 for False, 1 for True */
-static int
-DirEntry_test_mode(DirEntry *self, int follow_symlinks, unsigned short mode_bits)
+#ifdef HAVE_STATX
+/* Like StatInfo_from_stat(), for a statx result with all of
+   STATX_BASIC_STATS */
+static PyObject *
+StatInfo_from_statx(struct statx *stx)
 {
-    PyObject *stat = NULL;
-    PyObject *st_mode = NULL;
-    long mode;
-    int result;
-#if defined(MS_WINDOWS) || defined(HAVE_DIRENT_D_TYPE)
-    int is_symlink;
-    int need_stat;
-#endif
-#ifdef MS_WINDOWS
-    unsigned long dir_bits;
+    STRUCT_STAT st;
+
+    memset(&st, 0, sizeof(st));
+    st.st_mode = stx->stx_mode;
+    st.st_ino = stx->stx_ino;
+    st.st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st.st_nlink = stx->stx_nlink;
+    st.st_uid = stx->stx_uid;
+    st.st_gid = stx->stx_gid;
+    st.st_size = stx->stx_size;
+    st.st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st.st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st.st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st.st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st.st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st.st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+    st.st_blksize = stx->stx_blksize;
+    st.st_blocks = stx->stx_blocks;
+    st.st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    return StatInfo_from_stat(&st);
+}
 #endif
-    _Py_IDENTIFIER(st_mode);
 
-#ifdef MS_WINDOWS
-    is_symlink = (self->win32_lstat.st_mode & S_IFMT) == S_IFLNK;
-    need_stat = follow_symlinks && is_symlink;
-#elif defined(HAVE_DIRENT_D_TYPE)
-    is_symlink = self->d_type == DT_LNK;
-    need_stat = self->d_type == DT_UNKNOWN || (follow_symlinks && is_symlink);
+/* Get the seconds and nanoseconds of st's atime (which 0), mtime (1) or
+   ctime (2) */
+static void
+stat_info_time(STRUCT_STAT *st, int which, time_t *sec, unsigned long *nsec)
+{
+    switch (which) {
+    case 0:
+        *sec = st->st_atime;
+        break;
+    case 1:
+        *sec = st->st_mtime;
+        break;
+    default:
+        *sec = st->st_ctime;
+        break;
+    }
+#if defined(HAVE_STAT_TV_NSEC)
+    *nsec = which == 0 ? st->st_atim.tv_nsec :
+            which == 1 ? st->st_mtim.tv_nsec : st->st_ctim.tv_nsec;
+#elif defined(HAVE_STAT_TV_NSEC2)
+    *nsec = which == 0 ? st->st_atimespec.tv_nsec :
+            which == 1 ? st->st_mtimespec.tv_nsec : st->st_ctimespec.tv_nsec;
+#elif defined(HAVE_STAT_NSEC)
+    *nsec = which == 0 ? st->st_atime_nsec :
+            which == 1 ? st->st_mtime_nsec : st->st_ctime_nsec;
+#else
+    *nsec = 0;
 #endif
+}
 
-#if defined(MS_WINDOWS) || defined(HAVE_DIRENT_D_TYPE)
-    if (need_stat) {
+/* Return a new reference to the field at index, using the same indexes
+   as stat_result (so 7 to 9 are integer times, 10 to 12 float times and
+   13 to 15 nanosecond times) */
+static PyObject *
+StatInfo_field(StatInfo *self, Py_ssize_t index)
+{
+    STRUCT_STAT *st = &self->st;
+    time_t sec;
+    unsigned long nsec;
+
+    switch (index) {
+    case 0:
+        return PyLong_FromLong((long)st->st_mode);
+    case 1:
+#ifdef HAVE_LARGEFILE_SUPPORT
+        return PyLong_FromUnsignedLongLong(st->st_ino);
+#else
+        return PyLong_FromUnsignedLong((unsigned long)st->st_ino);
 #endif
-        stat = DirEntry_get_stat(self, follow_symlinks);
-        if (!stat) {
-            if (PyErr_ExceptionMatches(PyExc_FileNotFoundError)) {
-                /* If file doesn't exist (anymore), then return False
-                   (i.e., say it's not a file/directory) */
-                PyErr_Clear();
-                return 0;
-            }
-            goto error;
-        }
-        st_mode = _PyObject_GetAttrId(stat, &PyId_st_mode);
-        if (!st_mode)
-            goto error;
-
-        mode = PyLong_AsLong(st_mode);
-        if (mode == -1 && PyErr_Occurred())
-            goto error;
-        Py_CLEAR(st_mode);
-        Py_CLEAR(stat);
-        result = (mode & S_IFMT) == mode_bits;
-#if defined(MS_WINDOWS) || defined(HAVE_DIRENT_D_TYPE)
-    }
-    else if (is_symlink) {
-        assert(mode_bits != S_IFLNK);
-        result = 0;
+    case 2:
+        return _PyLong_FromDev(st->st_dev);
+    case 3:
+        return PyLong_FromLong((long)st->st_nlink);
+    case 4:
+        return _PyLong_FromUid(st->st_uid);
+    case 5:
+        return _PyLong_FromGid(st->st_gid);
+    case 6:
+#ifdef HAVE_LARGEFILE_SUPPORT
+        return PyLong_FromLongLong((PY_LONG_LONG)st->st_size);
+#else
+        return PyLong_FromLong(st->st_size);
+#endif
+    case 7: case 8: case 9:
+    case 10: case 11: case 12:
+        stat_info_time(st, (int)((index - 7) % 3), &sec, &nsec);
+        if (index >= 10 && _stat_float_times)
+            return PyFloat_FromDouble(sec + 1e-9 * nsec);
+#if SIZEOF_TIME_T > SIZEOF_LONG
+        return PyLong_FromLongLong((PY_LONG_LONG)sec);
+#elif PY_MAJOR_VERSION >= 3
+        return PyLong_FromLong((long)sec);
+#else
+        return PyInt_FromLong((long)sec);
+#endif
+    case 13: case 14: case 15:
+        stat_info_time(st, (int)(index - 13), &sec, &nsec);
+        return PyLong_FromLongLong((PY_LONG_LONG)sec * 1000000000 + (PY_LONG_LONG)nsec);
     }
-    else {
-        assert(mode_bits == S_IFDIR || mode_bits == S_IFREG);
-#ifdef MS_WINDOWS
-        dir_bits = self->win32_lstat.st_file_attributes & FILE_ATTRIBUTE_DIRECTORY;
-        if (mode_bits == S_IFDIR)
-            result = dir_bits != 0;
-        else
-            result = dir_bits == 0;
-#else /* POSIX */
-        if (mode_bits == S_IFDIR)
-            result = self->d_type == DT_DIR;
-        else
-            result = self->d_type == DT_REG;
+#ifdef HAVE_STRUCT_STAT_ST_BLKSIZE
+    if (index == ST_BLKSIZE_IDX)
+        return PyLong_FromLong((long)st->st_blksize);
+#endif
+#ifdef HAVE_STRUCT_STAT_ST_BLOCKS
+    if (index == ST_BLOCKS_IDX)
+        return PyLong_FromLong((long)st->st_blocks);
+#endif
+#ifdef HAVE_STRUCT_STAT_ST_RDEV
+    if (index == ST_RDEV_IDX)
+        return PyLong_FromLong((long)st->st_rdev);
+#endif
+#ifdef HAVE_STRUCT_STAT_ST_FLAGS
+    if (index == ST_FLAGS_IDX)
+        return PyLong_FromLong((long)st->st_flags);
+#endif
+#ifdef HAVE_STRUCT_STAT_ST_GEN
+    if (index == ST_GEN_IDX)
+        return PyLong_FromLong((long)st->st_gen);
+#endif
+#ifdef HAVE_STRUCT_STAT_ST_BIRTHTIME
+    if (index == ST_BIRTHTIME_IDX) {
+        unsigned long bsec, bnsec;
+
+        bsec = (long)st->st_birthtime;
+#ifdef HAVE_STAT_TV_NSEC2
+        bnsec = st->st_birthtimespec.tv_nsec;
+#else
+        bnsec = 0;
 #endif
+        if (_stat_float_times)
+            return PyFloat_FromDouble(bsec + 1e-9 * bnsec);
+        return PyLong_FromLong((long)bsec);
     }
 #endif
+    PyErr_SetString(PyExc_IndexError, "StatInfo index out of range");
+    return NULL;
+}
 
-    return result;
+static PyObject *
+StatInfo_getfield(StatInfo *self, void *closure)
+{
+    return StatInfo_field(self, (Py_ssize_t)closure);
+}
 
-error:
-    Py_XDECREF(st_mode);
-    Py_XDECREF(stat);
-    return -1;
+static Py_ssize_t
+StatInfo_length(StatInfo *self)
+{
+    return STAT_INFO_LEN;
 }
 
 static PyObject *
-DirEntry_py_test_mode(DirEntry *self, int follow_symlinks, unsigned short mode_bits)
+StatInfo_item(StatInfo *self, Py_ssize_t index)
 {
-    int result;
+    if (index < 0 || index >= STAT_INFO_LEN) {
+        PyErr_SetString(PyExc_IndexError, "StatInfo index out of range");
+        return NULL;
+    }
+    return StatInfo_field(self, index);
+}
 
-    result = DirEntry_test_mode(self, follow_symlinks, mode_bits);
-    if (result == -1)
+/* Return self as a 10-tuple, as it indexes */
+static PyObject *
+StatInfo_as_tuple(StatInfo *self)
+{
+    PyObject *tuple;
+    PyObject *item;
+    Py_ssize_t i;
+
+    tuple = PyTuple_New(STAT_INFO_LEN);
+    if (!tuple)
         return NULL;
-    return PyBool_FromLong(result);
+    for (i = 0; i < STAT_INFO_LEN; i++) {
+        item = StatInfo_field(self, i);
+        if (!item) {
+            Py_DECREF(tuple);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(tuple, i, item);
+    }
+    return tuple;
 }
 
 static PyObject *
-DirEntry_is_dir(DirEntry *self, PyObject *args, PyObject *kwargs)
+StatInfo_subscript(StatInfo *self, PyObject *key)
 {
-    int follow_symlinks = 1;
+    PyObject *tuple;
+    PyObject *result;
+    Py_ssize_t index;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, follow_symlinks_format,
-                                     follow_symlinks_keywords, &follow_symlinks))
+    if (PyIndex_Check(key)) {
+        index = PyNumber_AsSsize_t(key, PyExc_IndexError);
+        if (index == -1 && PyErr_Occurred())
+            return NULL;
+        if (index < 0)
+            index += STAT_INFO_LEN;
+        return StatInfo_item(self, index);
+    }
+    /* Slices */
+    tuple = StatInfo_as_tuple(self);
+    if (!tuple)
         return NULL;
+    result = PyObject_GetItem(tuple, key);
+    Py_DECREF(tuple);
+    return result;
+}
 
-    return DirEntry_py_test_mode(self, follow_symlinks, S_IFDIR);
+static PyObject *
+StatInfo_richcompare(PyObject *self, PyObject *other, int op)
+{
+    PyObject *a;
+    PyObject *b;
+    PyObject *result;
+
+    if (!StatInfo_Check(self) ||
+            (!PyTuple_Check(other) && !StatInfo_Check(other))) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+    a = StatInfo_as_tuple((StatInfo *)self);
+    if (!a)
+        return NULL;
+    if (StatInfo_Check(other)) {
+        b = StatInfo_as_tuple((StatInfo *)other);
+        if (!b) {
+            Py_DECREF(a);
+            return NULL;
+        }
+    }
+    else {
+        /* stat_result is a tuple, but with more fields than it shows */
+        b = PySequence_Tuple(other);
+        if (!b) {
+            Py_DECREF(a);
+            return NULL;
+        }
+    }
+    result = PyObject_RichCompare(a, b, op);
+    Py_DECREF(a);
+    Py_DECREF(b);
+    return result;
+}
+
+static Py_hash_t
+StatInfo_hash(StatInfo *self)
+{
+    PyObject *tuple;
+    Py_hash_t hash;
+
+    tuple = StatInfo_as_tuple(self);
+    if (!tuple)
+        return -1;
+    hash = PyObject_Hash(tuple);
+    Py_DECREF(tuple);
+    return hash;
 }
 
 static PyObject *
-DirEntry_is_file(DirEntry *self, PyObject *args, PyObject *kwargs)
+StatInfo_repr(StatInfo *self)
 {
-    int follow_symlinks = 1;
+    PyObject *tuple;
+    PyObject *result;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, follow_symlinks_format,
-                                     follow_symlinks_keywords, &follow_symlinks))
+    tuple = StatInfo_as_tuple(self);
+    if (!tuple)
         return NULL;
+    result = PyUnicode_FromFormat(
+        "scandir.StatInfo(st_mode=%R, st_ino=%R, st_dev=%R, st_nlink=%R, "
+        "st_uid=%R, st_gid=%R, st_size=%R, st_atime=%R, st_mtime=%R, st_ctime=%R)",
+        PyTuple_GET_ITEM(tuple, 0), PyTuple_GET_ITEM(tuple, 1),
+        PyTuple_GET_ITEM(tuple, 2), PyTuple_GET_ITEM(tuple, 3),
+        PyTuple_GET_ITEM(tuple, 4), PyTuple_GET_ITEM(tuple, 5),
+        PyTuple_GET_ITEM(tuple, 6), PyTuple_GET_ITEM(tuple, 7),
+        PyTuple_GET_ITEM(tuple, 8), PyTuple_GET_ITEM(tuple, 9));
+    Py_DECREF(tuple);
+    return result;
+}
 
-    return DirEntry_py_test_mode(self, follow_symlinks, S_IFREG);
+static void
+StatInfo_dealloc(StatInfo *self)
+{
+    PyObject_Del(self);
 }
 
-static PyObject *
-DirEntry_inode(DirEntry *self)
+#define STAT_INFO_FIELD(name, index, doc) \
+    {name, (getter)StatInfo_getfield, NULL, doc, (void *)(Py_ssize_t)(index)}
+
+static PyGetSetDef StatInfo_getset[] = {
+    STAT_INFO_FIELD("st_mode", 0, "protection bits"),
+    STAT_INFO_FIELD("st_ino", 1, "inode"),
+    STAT_INFO_FIELD("st_dev", 2, "device"),
+    STAT_INFO_FIELD("st_nlink", 3, "number of hard links"),
+    STAT_INFO_FIELD("st_uid", 4, "user ID of owner"),
+    STAT_INFO_FIELD("st_gid", 5, "group ID of owner"),
+    STAT_INFO_FIELD("st_size", 6, "total size, in bytes"),
+    STAT_INFO_FIELD("st_atime", 10, "time of last access"),
+    STAT_INFO_FIELD("st_mtime", 11, "time of last modification"),
+    STAT_INFO_FIELD("st_ctime", 12, "time of last change"),
+    STAT_INFO_FIELD("st_atime_ns", 13, "time of last access in nanoseconds"),
+    STAT_INFO_FIELD("st_mtime_ns", 14, "time of last modification in nanoseconds"),
+    STAT_INFO_FIELD("st_ctime_ns", 15, "time of last change in nanoseconds"),
+#ifdef HAVE_STRUCT_STAT_ST_BLKSIZE
+    STAT_INFO_FIELD("st_blksize", ST_BLKSIZE_IDX, "blocksize for filesystem I/O"),
+#endif
+#ifdef HAVE_STRUCT_STAT_ST_BLOCKS
+    STAT_INFO_FIELD("st_blocks", ST_BLOCKS_IDX, "number of blocks allocated"),
+#endif
+#ifdef HAVE_STRUCT_STAT_ST_RDEV
+    STAT_INFO_FIELD("st_rdev", ST_RDEV_IDX, "device type (if inode device)"),
+#endif
+#ifdef HAVE_STRUCT_STAT_ST_FLAGS
+    STAT_INFO_FIELD("st_flags", ST_FLAGS_IDX, "user defined flags for file"),
+#endif
+#ifdef HAVE_STRUCT_STAT_ST_GEN
+    STAT_INFO_FIELD("st_gen", ST_GEN_IDX, "generation number"),
+#endif
+#ifdef HAVE_STRUCT_STAT_ST_BIRTHTIME
+    STAT_INFO_FIELD("st_birthtime", ST_BIRTHTIME_IDX, "time of creation"),
+#endif
+    {NULL}
+};
+
+static PySequenceMethods StatInfo_as_sequence = {
+    (lenfunc)StatInfo_length,               /* sq_length */
+    0,                                      /* sq_concat */
+    0,                                      /* sq_repeat */
+    (ssizeargfunc)StatInfo_item,            /* sq_item */
+};
+
+static PyMappingMethods StatInfo_as_mapping = {
+    (lenfunc)StatInfo_length,               /* mp_length */
+    (binaryfunc)StatInfo_subscript,         /* mp_subscript */
+    0,                                      /* mp_ass_subscript */
+};
+
+PyDoc_STRVAR(StatInfo__doc__,
+"StatInfo: Result of DirEntry.stat() in the C extension on POSIX.\n\n\
+Like stat_result, this may be accessed either as a tuple of\n\
+  (mode, ino, dev, nlink, uid, gid, size, atime, mtime, ctime)\n\
+or via the attributes st_mode, st_ino, st_dev, st_nlink, st_uid, and so on,\n\
+but it holds the raw stat structure and only creates each attribute's\n\
+value when it's accessed.");
+
+static PyTypeObject StatInfoType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    MODNAME ".StatInfo",                    /* tp_name */
+    sizeof(StatInfo),                       /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    /* methods */
+    (destructor)StatInfo_dealloc,           /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    (reprfunc)StatInfo_repr,                /* tp_repr */
+    0,                                      /* tp_as_number */
+    &StatInfo_as_sequence,                  /* tp_as_sequence */
+    &StatInfo_as_mapping,                   /* tp_as_mapping */
+    (hashfunc)StatInfo_hash,                /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    StatInfo__doc__,                        /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    StatInfo_richcompare,                   /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    0,                                      /* tp_methods */
+    0,                                      /* tp_members */
+    StatInfo_getset,                        /* tp_getset */
+};
+
+#endif /* !MS_WINDOWS */
+
+
+/* SECTION: Batched directory reading (POSIX only)
+
+A DirReader reads directory entries in batches into a buffer, so that
+the GIL only needs to be released once per batch rather than once per
+entry. On Linux the buffer is filled directly by getdents64(); on other
+POSIX systems readdir() results are packed into the same buffer. None
+of the dir_reader_* functions touch Python objects, so they're safe to
+call with the GIL released.
+*/
+
+#ifndef MS_WINDOWS
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#ifdef SYS_getdents64
+#define HAVE_GETDENTS64 1
+#endif
+#endif
+
+#define DIR_READER_DEFAULT_BUFFER_SIZE 32768
+/* Must be big enough for at least one maximum-length record */
+#define DIR_READER_MIN_BUFFER_SIZE 1024
+/* getdents64()'s count is an unsigned int, and more than this only
+   wastes memory */
+#define DIR_READER_MAX_BUFFER_SIZE (64 * 1024 * 1024)
+/* Most directories a depth-first traversal keeps open for openat() and
+   fstatat() relative to them, like nftw()'s nopenfd. Ancestors further up
+   are closed once they've been read, and dir_reader_open_at() and
+   stat_at() fall back to their paths. */
+#define DIR_READER_OPEN_PARENTS 32
+
+#ifdef HAVE_GETDENTS64
+/* Not in any public header, see getdents64(2) */
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+#define DIRENT_RECORD struct linux_dirent64
+#else
+/* Record packed into the buffer by dir_reader_fill() */
+struct packed_dirent {
+    ino_t d_ino;
+    unsigned short d_reclen;
+    unsigned short d_namlen;
+    unsigned char d_type;
+    char d_name[1];
+};
+#define DIRENT_RECORD struct packed_dirent
+#endif
+
+typedef struct {
+    DIR *dirp;
+    char *buffer;
+    Py_ssize_t buffer_size;
+    Py_ssize_t pos;
+    Py_ssize_t len;
+#ifndef HAVE_GETDENTS64
+    struct dirent *pending;
+#endif
+} DirReader;
+
+typedef struct {
+    char *name;
+    Py_ssize_t name_len;
+    ino_t d_ino;
+    unsigned char d_type;       /* DT_UNKNOWN (0) if not supported */
+} DirRecord;
+
+/* Return a malloc'ed copy of "dirpath/name", like os.path.join(). Return
+   NULL with errno set on error. */
+static char *
+join_path_raw(const char *dirpath, const char *name, Py_ssize_t name_len)
 {
-#ifdef MS_WINDOWS
-    if (!self->got_file_index) {
-        wchar_t *path;
-        struct _Py_stat_struct stat;
+    size_t path_len = strlen(dirpath);
+    char *result;
 
-        path = PyUnicode_AsUnicode(self->path);
-        if (!path)
-            return NULL;
+    /* The +1's are for the path separator and the NUL */
+    result = malloc(path_len + 1 + name_len + 1);
+    if (!result) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(result, dirpath, path_len);
+    if (path_len > 0 && result[path_len - 1] != '/')
+        result[path_len++] = '/';
+    memcpy(result + path_len, name, name_len);
+    result[path_len + name_len] = '\0';
+    return result;
+}
 
-        if (win32_lstat_w(path, &stat) != 0) {
-            return PyErr_SetExcFromWindowsErrWithFilenameObject(PyExc_OSError,
-                                                                0, self->path);
-        }
+static void
+dir_reader_init(DirReader *reader)
+{
+    memset(reader, 0, sizeof(DirReader));
+}
 
-        self->win32_file_index = stat.st_ino;
-        self->got_file_index = 1;
+/* Open path for reading with a buffer of buffer_size bytes. Return 0 on
+   success, or -1 with errno set on error. Buffers are allocated with
+   malloc() rather than PyMem_Malloc() as readers may be used from
+   threads that don't hold the GIL. */
+static int
+dir_reader_open(DirReader *reader, const char *path, Py_ssize_t buffer_size)
+{
+    reader->buffer = malloc(buffer_size);
+    if (!reader->buffer) {
+        errno = ENOMEM;
+        return -1;
     }
-    return PyLong_FromUnsignedLongLong(self->win32_file_index);
-#else /* POSIX */
-#ifdef HAVE_LARGEFILE_SUPPORT
-    return PyLong_FromUnsignedLongLong(self->d_ino);
-#else
-    return PyLong_FromUnsignedLong((unsigned long)self->d_ino);
+    reader->buffer_size = buffer_size;
+    reader->pos = reader->len = 0;
+    STATS_ADD(opendir, 1);
+    reader->dirp = opendir(path);
+    if (!reader->dirp) {
+        int saved_errno = errno;
+        free(reader->buffer);
+        reader->buffer = NULL;
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+#if !defined(O_DIRECTORY)
+#define O_DIRECTORY 0
 #endif
+#if !defined(O_CLOEXEC)
+#define O_CLOEXEC 0
 #endif
+
+#if defined(HAVE_OPENAT) && defined(HAVE_FDOPENDIR)
+#define HAVE_DIR_READER_OPEN_FD 1
+
+/* Like dir_reader_open(), but read the directory open as fd. The reader
+   takes ownership of fd, even on error. */
+static int
+dir_reader_open_fd(DirReader *reader, int fd, Py_ssize_t buffer_size)
+{
+    int saved_errno;
+
+    reader->buffer = malloc(buffer_size);
+    if (!reader->buffer) {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    reader->buffer_size = buffer_size;
+    reader->pos = reader->len = 0;
+    STATS_ADD(opendir, 1);
+    reader->dirp = fdopendir(fd);
+    if (!reader->dirp) {
+        saved_errno = errno;
+        close(fd);
+        free(reader->buffer);
+        reader->buffer = NULL;
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
 }
+#endif
+
+/* Open the subdirectory name of the directory dirpath, which the reader
+   parent already has open. Uses openat() where available so the kernel
+   doesn't have to look up every component of the path again. */
+static int
+dir_reader_open_at(DirReader *reader, DirReader *parent, const char *dirpath,
+                   const char *name, Py_ssize_t name_len, Py_ssize_t buffer_size)
+{
+#ifdef HAVE_DIR_READER_OPEN_FD
+    int fd;
+
+    if (parent->dirp) {
+        fd = openat(dirfd(parent->dirp), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+            return -1;
+        return dir_reader_open_fd(reader, fd, buffer_size);
+    }
+#endif
+    {
+        char *path = join_path_raw(dirpath, name, name_len);
+        int result;
+
+        if (!path)
+            return -1;
+        result = dir_reader_open(reader, path, buffer_size);
+        free(path);
+        return result;
+    }
+}
+
+/* Free the reader's buffer once it's been read to the end, but keep the
+   directory open for *_at() calls */
+static void
+dir_reader_release_buffer(DirReader *reader)
+{
+    free(reader->buffer);
+    reader->buffer = NULL;
+    reader->pos = reader->len = 0;
+}
+
+/* stat() or lstat() the entry name in directory dirpath, which reader
+   has open. Uses fstatat() where available. */
+static int
+stat_at(DirReader *reader, const char *dirpath, const char *name,
+        Py_ssize_t name_len, struct stat *st, int follow_symlinks)
+{
+    if (follow_symlinks)
+        STATS_ADD(stat, 1);
+    else
+        STATS_ADD(lstat, 1);
+#ifdef HAVE_FSTATAT
+    if (reader && reader->dirp)
+        return fstatat(dirfd(reader->dirp), name, st,
+                       follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW);
+#endif
+    {
+        char *path = join_path_raw(dirpath, name, name_len);
+        int result;
+
+        if (!path)
+            return -1;
+        result = follow_symlinks ? STAT(path, st) : LSTAT(path, st);
+        free(path);
+        return result;
+    }
+}
+
+static void
+dir_reader_close(DirReader *reader)
+{
+    if (reader->dirp) {
+        closedir(reader->dirp);
+        reader->dirp = NULL;
+    }
+    free(reader->buffer);
+    reader->buffer = NULL;
+    reader->pos = reader->len = 0;
+}
+
+/* Read the next batch of entries into the buffer. Return 1 if there
+   are entries, 0 at end of directory, or -1 with errno set on error. */
+static int
+dir_reader_fill(DirReader *reader)
+{
+#ifdef HAVE_GETDENTS64
+    long n;
+
+    STATS_ADD(readdir, 1);
+    n = syscall(SYS_getdents64, dirfd(reader->dirp),
+                reader->buffer, (size_t)reader->buffer_size);
+    if (n < 0)
+        return -1;
+    reader->pos = 0;
+    reader->len = n;
+    return n > 0;
+#else
+    struct dirent *direntp;
+    struct packed_dirent *packed;
+    Py_ssize_t name_len, reclen;
+
+    reader->pos = reader->len = 0;
+    while (1) {
+        if (reader->pending) {
+            direntp = reader->pending;
+            reader->pending = NULL;
+        }
+        else {
+            errno = 0;
+            STATS_ADD(readdir, 1);
+            direntp = readdir(reader->dirp);
+            if (!direntp) {
+                if (errno != 0)
+                    return -1;
+                break;
+            }
+        }
+
+        name_len = NAMLEN(direntp);
+        reclen = offsetof(struct packed_dirent, d_name) + name_len + 1;
+        reclen = (reclen + sizeof(ino_t) - 1) & ~(Py_ssize_t)(sizeof(ino_t) - 1);
+        if (reader->len + reclen > reader->buffer_size) {
+            /* The dirent stays valid until the next readdir() call */
+            reader->pending = direntp;
+            break;
+        }
+
+        packed = (struct packed_dirent *)(reader->buffer + reader->len);
+        packed->d_ino = direntp->d_ino;
+        packed->d_reclen = (unsigned short)reclen;
+        packed->d_namlen = (unsigned short)name_len;
+#ifdef HAVE_DIRENT_D_TYPE
+        packed->d_type = direntp->d_type;
+#else
+        packed->d_type = 0;
+#endif
+        memcpy(packed->d_name, direntp->d_name, name_len);
+        packed->d_name[name_len] = '\0';
+        reader->len += reclen;
+    }
+    return reader->len > 0;
+#endif
+}
+
+/* When set (only by benchmarks and tests, via _set_ignore_d_type()),
+   dir_reader_next() reports every d_type as DT_UNKNOWN, as on file
+   systems that don't fill it in, so everything falls back to stat. */
+static int dir_reader_ignore_d_type = 0;
+
+/* Get the next entry from the buffer, skipping "." and "..". Return 1
+   if record was filled in, or 0 if the buffer needs refilling. */
+static int
+dir_reader_next(DirReader *reader, DirRecord *record)
+{
+    DIRENT_RECORD *d;
+    Py_ssize_t name_len;
+
+    while (reader->pos < reader->len) {
+        d = (DIRENT_RECORD *)(reader->buffer + reader->pos);
+        reader->pos += d->d_reclen;
+
+#ifdef HAVE_GETDENTS64
+        name_len = strlen(d->d_name);
+#else
+        name_len = d->d_namlen;
+#endif
+        /* Skip over . and .. */
+        if (d->d_name[0] == '.' &&
+                (name_len == 1 || (d->d_name[1] == '.' && name_len == 2)))
+            continue;
+
+        record->name = d->d_name;
+        record->name_len = name_len;
+        record->d_ino = (ino_t)d->d_ino;
+        record->d_type = dir_reader_ignore_d_type ? 0 : d->d_type;
+        return 1;
+    }
+    return 0;
+}
+
+#ifdef HAVE_DIRENT_D_TYPE
+#define RECORD_NEEDS_STAT(record) \
+    ((record)->d_type == DT_UNKNOWN || (record)->d_type == DT_LNK)
+#else
+#define RECORD_NEEDS_STAT(record) 1
+#endif
+
+/* Determine whether the entry in record (read by reader from directory
+   dirpath) is a directory (following symlinks) and whether it's a
+   symlink. As with DirEntry.is_dir() and is_symlink(), a failed stat is
+   treated as "not a directory" and "not a symlink". Only calls stat
+   when RECORD_NEEDS_STAT(record) is true. */
+static void
+dir_record_type(DirReader *reader, const char *dirpath, DirRecord *record,
+                int *is_dir, int *is_symlink)
+{
+    struct stat st;
+
+    *is_dir = *is_symlink = 0;
+#ifdef HAVE_DIRENT_D_TYPE
+    if (!RECORD_NEEDS_STAT(record)) {
+        *is_dir = record->d_type == DT_DIR;
+        return;
+    }
+    if (record->d_type == DT_LNK)
+        *is_symlink = 1;
+    else
+#endif
+    if (stat_at(reader, dirpath, record->name, record->name_len, &st, 0) == 0) {
+        *is_symlink = S_ISLNK(st.st_mode);
+        *is_dir = S_ISDIR(st.st_mode);
+    }
+    if (*is_symlink &&
+            stat_at(reader, dirpath, record->name, record->name_len, &st, 1) == 0)
+        *is_dir = S_ISDIR(st.st_mode);
+}
+
+/* Decode a name or path from the OS as str, or return it as bytes if
+   return_bytes is true */
+static PyObject *
+decode_fs_name(int return_bytes, const char *name, Py_ssize_t name_len)
+{
+    if (return_bytes)
+        return PyBytes_FromStringAndSize(name, name_len);
+    STATS_ADD(name_bytes_decoded, name_len);
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_DecodeFSDefaultAndSize(name, name_len);
+#else
+    return PyUnicode_Decode(name, name_len, FS_ENCODING, "strict");
+#endif
+}
+
+/* Return a new reference to name encoded as bytes for the OS */
+static PyObject *
+encode_fs_name(PyObject *name)
+{
+    PyObject *bytes;
+
+    if (PyBytes_Check(name)) {
+        Py_INCREF(name);
+        return name;
+    }
+#if PY_MAJOR_VERSION >= 3
+    if (!PyUnicode_FSConverter(name, &bytes))
+        return NULL;
+#else
+    bytes = PyUnicode_AsEncodedString(name, FS_ENCODING, "strict");
+#endif
+    return bytes;
+}
+
+/* Return 1 if obj is a str (or on Python 2, a str or unicode) equal to
+   the ASCII string value, else 0 */
+static int
+str_equals(PyObject *obj, const char *value)
+{
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_Check(obj) && PyUnicode_CompareWithASCIIString(obj, value) == 0;
+#else
+    PyObject *bytes;
+    int result;
+
+    if (PyString_Check(obj))
+        return strcmp(PyString_AS_STRING(obj), value) == 0;
+    if (!PyUnicode_Check(obj))
+        return 0;
+    bytes = PyUnicode_AsASCIIString(obj);
+    if (!bytes) {
+        PyErr_Clear();
+        return 0;
+    }
+    result = strcmp(PyString_AS_STRING(bytes), value) == 0;
+    Py_DECREF(bytes);
+    return result;
+#endif
+}
+
+/* Open-addressing hash set of (st_dev, st_ino) pairs, for the walks
+   that skip directories or hard links they've already seen. It's locked
+   so that worker threads can share one. */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    int used;
+} InodeSetSlot;
+
+typedef struct {
+    pthread_mutex_t lock;
+    InodeSetSlot *slots;
+    size_t size;                /* always a power of 2 */
+    size_t count;
+} InodeSet;
+
+static void
+inode_set_init(InodeSet *set)
+{
+    pthread_mutex_init(&set->lock, NULL);
+    set->slots = NULL;
+    set->size = set->count = 0;
+}
+
+static void
+inode_set_free(InodeSet *set)
+{
+    free(set->slots);
+    set->slots = NULL;
+    set->size = set->count = 0;
+    pthread_mutex_destroy(&set->lock);
+}
+
+static size_t
+inode_set_hash(dev_t dev, ino_t ino)
+{
+    unsigned long long h = (unsigned long long)ino * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h ^ (h >> 29) ^ ((unsigned long long)dev * 0xC2B2AE3D27D4EB4FULL));
+}
+
+/* Add (dev, ino) to the set. Return 1 if it was added, or 0 if it was
+   already there. If out of memory it's treated as new, so the worst
+   case is counting a hard link (or walking a directory) twice. */
+static int
+inode_set_add(InodeSet *set, dev_t dev, ino_t ino)
+{
+    InodeSetSlot *slot;
+    size_t i;
+    int added = 1;
+
+    pthread_mutex_lock(&set->lock);
+    if ((set->count + 1) * 2 > set->size) {
+        size_t new_size = set->size ? set->size * 2 : 1024;
+        InodeSetSlot *slots = calloc(new_size, sizeof(InodeSetSlot));
+
+        if (!slots)
+            goto done;
+        for (i = 0; i < set->size; i++) {
+            size_t j;
+
+            if (!set->slots[i].used)
+                continue;
+            j = inode_set_hash(set->slots[i].dev, set->slots[i].ino) & (new_size - 1);
+            while (slots[j].used)
+                j = (j + 1) & (new_size - 1);
+            slots[j] = set->slots[i];
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->size = new_size;
+    }
+
+    i = inode_set_hash(dev, ino) & (set->size - 1);
+    while ((slot = &set->slots[i])->used) {
+        if (slot->dev == dev && slot->ino == ino) {
+            added = 0;
+            goto done;
+        }
+        i = (i + 1) & (set->size - 1);
+    }
+    slot->dev = dev;
+    slot->ino = ino;
+    slot->used = 1;
+    set->count++;
+
+done:
+    pthread_mutex_unlock(&set->lock);
+    return added;
+}
+
+PyDoc_STRVAR(set_ignore_d_type__doc__,
+"_set_ignore_d_type(flag) -> bool\n\n\
+Make the native functions treat every entry's d_type as DT_UNKNOWN if\n\
+flag is true, as on file systems that don't provide it, and return the\n\
+previous setting. Only meant for benchmarks and tests; set it while no\n\
+other threads are reading directories.");
+
+static PyObject *
+scandir_set_ignore_d_type(PyObject *self, PyObject *args)
+{
+    int flag, previous;
+
+    if (!PyArg_ParseTuple(args, "i:_set_ignore_d_type", &flag))
+        return NULL;
+    previous = dir_reader_ignore_d_type;
+    dir_reader_ignore_d_type = flag != 0;
+    return PyBool_FromLong(previous);
+}
+
+#endif /* !MS_WINDOWS */
+
+
+/* SECTION: Glob pattern matching (POSIX only)
+
+A small fnmatch-style matcher for raw names: "*" matches any run of
+characters, "?" any one character, and "[...]" or "[!...]" one character
+in or not in a set of characters and ranges. Like fnmatchcase() it's
+case-sensitive and "*" matches a leading dot too. Patterns are compiled
+once to an array of tokens, so matching needs no allocation; patterns
+given as str match names a UTF-8 character (rather than a byte) at a
+time, with bytes that aren't valid UTF-8 matching as the surrogates
+os.fsdecode() would give them. A class's ASCII characters are kept in a
+bitmap, and any others as a list of code point ranges.
+*/
+
+#ifndef MS_WINDOWS
+
+#define GLOB_CHAR 0
+#define GLOB_ANY 1
+#define GLOB_STAR 2
+#define GLOB_CLASS 3
+
+typedef struct {
+    unsigned char type;
+    unsigned char ch;           /* GLOB_CHAR */
+    unsigned char negate;       /* GLOB_CLASS */
+    unsigned char bits[32];     /* GLOB_CLASS: bitmap of byte values */
+    Py_ssize_t first_range;     /* GLOB_CLASS: non-ASCII ranges, if utf8 */
+    Py_ssize_t num_ranges;
+} GlobToken;
+
+typedef struct {
+    GlobToken *tokens;
+    Py_ssize_t num_tokens;
+    Py_ssize_t min_len;         /* bytes needed by the non-star tokens */
+    int has_star;
+    int utf8;
+    Py_UCS4 *ranges;            /* pairs of first and last code points */
+    Py_ssize_t num_ranges;
+} GlobPattern;
+
+/* Decode the UTF-8 character starting at s into *ch and return its
+   length. A byte that doesn't start a valid character is decoded on its
+   own as a surrogate, as by the "surrogateescape" error handler. */
+static Py_ssize_t
+utf8_decode(const unsigned char *s, Py_ssize_t len, Py_UCS4 *ch)
+{
+    Py_ssize_t n, i;
+    Py_UCS4 c = s[0];
+
+    if (c < 0x80) {
+        *ch = c;
+        return 1;
+    }
+    if (c >= 0xC2 && c <= 0xDF) {
+        n = 2;
+        c &= 0x1F;
+    }
+    else if (c >= 0xE0 && c <= 0xEF) {
+        n = 3;
+        c &= 0x0F;
+    }
+    else if (c >= 0xF0 && c <= 0xF4) {
+        n = 4;
+        c &= 0x07;
+    }
+    else
+        goto escape;
+    if (n > len)
+        goto escape;
+    for (i = 1; i < n; i++) {
+        if ((s[i] & 0xC0) != 0x80)
+            goto escape;
+        c = (c << 6) | (s[i] & 0x3F);
+    }
+    /* Overlong forms, surrogates and code points past U+10FFFF */
+    if ((n == 3 && (c < 0x800 || (c >= 0xD800 && c <= 0xDFFF))) ||
+            (n == 4 && (c < 0x10000 || c > 0x10FFFF)))
+        goto escape;
+    *ch = c;
+    return n;
+
+escape:
+    *ch = 0xDC00 + s[0];
+    return 1;
+}
+
+/* Length of the UTF-8 character starting at s (1 for a stray byte) */
+static Py_ssize_t
+utf8_char_len(const unsigned char *s, Py_ssize_t len)
+{
+    Py_UCS4 ch;
+
+    return utf8_decode(s, len, &ch);
+}
+
+/* Read the character at p[i] of a pattern: a code point if utf8, else a
+   byte. Return its length. */
+static Py_ssize_t
+glob_pattern_char(const unsigned char *p, Py_ssize_t len, Py_ssize_t i,
+                  int utf8, Py_UCS4 *ch)
+{
+    if (utf8)
+        return utf8_decode(p + i, len - i, ch);
+    *ch = p[i];
+    return 1;
+}
+
+/* Parse the "[...]" starting at p[start] into token. Return the index
+   after the closing "]", 0 if there isn't one (so the "[" is literal),
+   or -1 with an exception set on error. */
+static Py_ssize_t
+glob_parse_class(GlobPattern *pattern, const unsigned char *p, Py_ssize_t len,
+                 Py_ssize_t start, GlobToken *token)
+{
+    Py_ssize_t i = start + 1;
+    Py_ssize_t first, n;
+    Py_UCS4 lo, hi, c;
+    Py_UCS4 *ranges;
+
+    if (i < len && p[i] == '!') {
+        token->negate = 1;
+        i++;
+    }
+    first = i;
+    token->first_range = pattern->num_ranges;
+    while (i < len && (p[i] != ']' || i == first)) {
+        n = glob_pattern_char(p, len, i, pattern->utf8, &lo);
+        hi = lo;
+        if (i + n + 1 < len && p[i + n] == '-' && p[i + n + 1] != ']') {
+            i += n + 1;
+            i += glob_pattern_char(p, len, i, pattern->utf8, &hi);
+        }
+        else
+            i += n;
+
+        for (c = lo; c <= hi && c < 0x100 && (c < 0x80 || !pattern->utf8); c++)
+            token->bits[c >> 3] |= 1 << (c & 7);
+        if (pattern->utf8 && hi >= 0x80 && lo <= hi) {
+            ranges = PyMem_Resize(pattern->ranges, Py_UCS4, 2 * (pattern->num_ranges + 1));
+            if (!ranges) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            pattern->ranges = ranges;
+            ranges[2 * pattern->num_ranges] = lo < 0x80 ? 0x80 : lo;
+            ranges[2 * pattern->num_ranges + 1] = hi;
+            pattern->num_ranges++;
+        }
+    }
+    if (i >= len) {
+        /* Not a class after all */
+        pattern->num_ranges = token->first_range;
+        return 0;
+    }
+    token->num_ranges = pattern->num_ranges - token->first_range;
+    return i + 1;
+}
+
+/* Return nonzero if class token's non-ASCII ranges include ch */
+static int
+glob_class_has(const GlobPattern *pattern, const GlobToken *token, Py_UCS4 ch)
+{
+    const Py_UCS4 *range = pattern->ranges + 2 * token->first_range;
+    Py_ssize_t i;
+
+    for (i = 0; i < token->num_ranges; i++, range += 2) {
+        if (ch >= range[0] && ch <= range[1])
+            return 1;
+    }
+    return 0;
+}
+
+static void
+glob_free(GlobPattern *pattern)
+{
+    PyMem_Free(pattern->tokens);
+    pattern->tokens = NULL;
+    PyMem_Free(pattern->ranges);
+    pattern->ranges = NULL;
+}
+
+/* Compile pattern; return 0 on success, -1 with an exception set */
+static int
+glob_compile(GlobPattern *pattern, const char *pattern_bytes, Py_ssize_t len,
+             int utf8)
+{
+    const unsigned char *p = (const unsigned char *)pattern_bytes;
+    GlobToken *token;
+    Py_ssize_t i = 0;
+    Py_ssize_t end;
+
+    pattern->ranges = NULL;
+    pattern->num_ranges = 0;
+    pattern->tokens = PyMem_New(GlobToken, len ? len : 1);
+    if (!pattern->tokens) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    pattern->num_tokens = 0;
+    pattern->min_len = 0;
+    pattern->has_star = 0;
+    pattern->utf8 = utf8;
+
+    while (i < len) {
+        token = &pattern->tokens[pattern->num_tokens];
+        memset(token, 0, sizeof(*token));
+        if (p[i] == '*') {
+            i++;
+            /* Runs of stars are the same as one */
+            if (pattern->num_tokens &&
+                    pattern->tokens[pattern->num_tokens - 1].type == GLOB_STAR)
+                continue;
+            token->type = GLOB_STAR;
+            pattern->has_star = 1;
+            pattern->num_tokens++;
+            continue;
+        }
+
+        if (p[i] == '?') {
+            token->type = GLOB_ANY;
+            i++;
+        }
+        else if (p[i] == '[' &&
+                 (end = glob_parse_class(pattern, p, len, i, token)) != 0) {
+            if (end < 0) {
+                glob_free(pattern);
+                return -1;
+            }
+            token->type = GLOB_CLASS;
+            i = end;
+        }
+        else {
+            memset(token, 0, sizeof(*token));
+            token->type = GLOB_CHAR;
+            token->ch = p[i++];
+        }
+        pattern->min_len++;
+        pattern->num_tokens++;
+    }
+    return 0;
+}
+
+
+/* Return 1 if name matches pattern, else 0. A star is matched by
+   backtracking to the most recent one, which is linear in practice. */
+static int
+glob_match(const GlobPattern *pattern, const char *name_bytes, Py_ssize_t len)
+{
+    const unsigned char *name = (const unsigned char *)name_bytes;
+    const GlobToken *token;
+    Py_ssize_t t = 0, n = 0;
+    Py_ssize_t star_t = -1, star_n = 0;
+    Py_ssize_t step;
+    Py_UCS4 ch;
+    int matched;
+
+    if (len < pattern->min_len)
+        return 0;
+    if (!pattern->has_star && !pattern->utf8 && len != pattern->min_len)
+        return 0;
+
+    while (n < len) {
+        matched = 0;
+        step = 1;
+        if (t < pattern->num_tokens) {
+            token = &pattern->tokens[t];
+            switch (token->type) {
+            case GLOB_STAR:
+                star_t = t++;
+                star_n = n;
+                continue;
+            case GLOB_ANY:
+                matched = 1;
+                if (pattern->utf8)
+                    step = utf8_char_len(name + n, len - n);
+                break;
+            case GLOB_CHAR:
+                matched = token->ch == name[n];
+                break;
+            case GLOB_CLASS:
+                if (pattern->utf8 && name[n] >= 0x80) {
+                    step = utf8_decode(name + n, len - n, &ch);
+                    matched = glob_class_has(pattern, token, ch) != token->negate;
+                }
+                else
+                    matched = ((token->bits[name[n] >> 3] >> (name[n] & 7)) & 1) !=
+                              token->negate;
+                break;
+            }
+        }
+        if (matched) {
+            t++;
+            n += step;
+        }
+        else if (star_t >= 0) {
+            /* Let the last star eat one more character and retry */
+            star_n += pattern->utf8 ? utf8_char_len(name + star_n, len - star_n) : 1;
+            t = star_t + 1;
+            n = star_n;
+        }
+        else
+            return 0;
+    }
+
+    while (t < pattern->num_tokens && pattern->tokens[t].type == GLOB_STAR)
+        t++;
+    return t == pattern->num_tokens;
+}
+
+/* Compile pattern_obj, a str or bytes pattern; return 0 on success or -1
+   with an exception set */
+static int
+glob_compile_object(GlobPattern *pattern, PyObject *pattern_obj)
+{
+    PyObject *bytes;
+    int result;
+
+#if PY_MAJOR_VERSION >= 3
+    if (!PyUnicode_Check(pattern_obj) && !PyBytes_Check(pattern_obj)) {
+#else
+    if (!PyUnicode_Check(pattern_obj) && !PyString_Check(pattern_obj)) {
+#endif
+        PyErr_Format(PyExc_TypeError, "pattern must be str or bytes, not %.200s",
+                     Py_TYPE(pattern_obj)->tp_name);
+        return -1;
+    }
+    bytes = encode_fs_name(pattern_obj);
+    if (!bytes)
+        return -1;
+    result = glob_compile(pattern, PyBytes_AS_STRING(bytes), PyBytes_GET_SIZE(bytes),
+                          PyUnicode_Check(pattern_obj));
+    Py_DECREF(bytes);
+    return result;
+}
+
+/* Compile obj, a single pattern or a sequence of them, into a new array.
+   Return 0 on success or -1 with an exception set; either way the array
+   is freed with glob_free_list(). */
+static int
+glob_compile_list(PyObject *obj, GlobPattern **patterns, Py_ssize_t *num_patterns)
+{
+    PyObject *seq;
+    Py_ssize_t i, n;
+
+    *patterns = NULL;
+    *num_patterns = 0;
+#if PY_MAJOR_VERSION >= 3
+    if (PyUnicode_Check(obj) || PyBytes_Check(obj))
+#else
+    if (PyUnicode_Check(obj) || PyString_Check(obj))
+#endif
+        seq = PyTuple_Pack(1, obj);
+    else
+        seq = PySequence_Fast(obj, "patterns must be a str, bytes or sequence");
+    if (!seq)
+        return -1;
+
+    n = PySequence_Fast_GET_SIZE(seq);
+    *patterns = PyMem_New(GlobPattern, n ? n : 1);
+    if (!*patterns) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        if (glob_compile_object(&(*patterns)[i],
+                                PySequence_Fast_GET_ITEM(seq, i)) < 0)
+            break;
+        (*num_patterns)++;
+    }
+    Py_DECREF(seq);
+    return i == n ? 0 : -1;
+}
+
+static void
+glob_free_list(GlobPattern *patterns, Py_ssize_t num_patterns)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < num_patterns; i++)
+        glob_free(&patterns[i]);
+    PyMem_Free(patterns);
+}
+
+static int
+glob_match_any(const GlobPattern *patterns, Py_ssize_t num_patterns,
+               const char *name, Py_ssize_t len)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < num_patterns; i++) {
+        if (glob_match(&patterns[i], name, len))
+            return 1;
+    }
+    return 0;
+}
+
+#endif /* !MS_WINDOWS */
+
+
+/* SECTION: Main DirEntry and scandir implementation, taken from
+   Python 3.5's posixmodule.c */
+
+PyDoc_STRVAR(posix_scandir__doc__,
+"scandir(path='.', buffer_size=32768, include=None, exclude=None, types=None,\n\
+        order=None) -> iterator of DirEntry objects for given path\n\n\
+On POSIX, path may also be an open directory file descriptor, and\n\
+buffer_size is the number of bytes of directory entries read from the\n\
+OS in each batch. Only entries whose names match one of the include glob\n\
+patterns, match none of the exclude patterns, and whose d_type is one of\n\
+types are yielded (POSIX only). order='name' or 'inode' reads the whole\n\
+directory and yields its entries sorted by name (bytewise) or inode\n\
+number; None or 'native' yields them in the order the OS returns them\n\
+(POSIX only).");
+
+static char *follow_symlinks_keywords[] = {"follow_symlinks", NULL};
+#if PY_MAJOR_VERSION >= 3 && PY_MINOR_VERSION >= 3
+static char *follow_symlinks_format = "|$p:DirEntry.stat";
+#else
+static char *follow_symlinks_format = "|i:DirEntry.stat";
+#endif
+
+static char *stat_keywords[] = {"follow_symlinks", "fields", "sync", NULL};
+#if PY_MAJOR_VERSION >= 3 && PY_MINOR_VERSION >= 3
+static char *stat_format = "|$pOp:DirEntry.stat";
+#else
+static char *stat_format = "|iOi:DirEntry.stat";
+#endif
+
+#ifndef MS_WINDOWS
+#define SCANDIR_ORDER_NATIVE 0
+#define SCANDIR_ORDER_NAME 1
+#define SCANDIR_ORDER_INODE 2
+
+/* Entry names are copied into a bump-pointer arena rather than allocated
+   one at a time. The arena is in a ScandirShared block that entries keep
+   alive instead of the iterator; whenever no entries are alive the arena
+   is rewound to reuse its first block. */
+#define SCANDIR_ARENA_BLOCK_SIZE 65536
+
+typedef struct ScandirArenaBlock {
+    struct ScandirArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[1];
+} ScandirArenaBlock;
+
+typedef struct {
+    ScandirArenaBlock *first;
+    ScandirArenaBlock *current;
+    /* "path/" prefix of each entry's path, copied once to the start of the
+       first block, which is never rewound past it */
+    char *prefix;
+    size_t prefix_len;
+    size_t base_used;
+} ScandirArena;
+
+static void
+scandir_arena_init(ScandirArena *arena)
+{
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->prefix = NULL;
+    arena->prefix_len = 0;
+    arena->base_used = 0;
+}
+
+/* Return space for size bytes, or NULL if out of memory */
+static char *
+scandir_arena_alloc(ScandirArena *arena, size_t size)
+{
+    ScandirArenaBlock *block = arena->current;
+    size_t block_size;
+    char *p;
+
+    if (!block || block->size - block->used < size) {
+        block_size = size > SCANDIR_ARENA_BLOCK_SIZE ? size : SCANDIR_ARENA_BLOCK_SIZE;
+        block = malloc(offsetof(ScandirArenaBlock, data) + block_size);
+        if (!block)
+            return NULL;
+        block->next = NULL;
+        block->size = block_size;
+        block->used = 0;
+        if (arena->current)
+            arena->current->next = block;
+        else
+            arena->first = block;
+        arena->current = block;
+    }
+
+    p = block->data + block->used;
+    block->used += size;
+    return p;
+}
+
+/* Copy path, plus a trailing slash if needed, to the arena as the prefix
+   of each entry's path. Return 0 on success, -1 if out of memory. */
+static int
+scandir_arena_set_prefix(ScandirArena *arena, const char *path)
+{
+    size_t len = strlen(path);
+    int add_sep = len > 0 && path[len - 1] != '/';
+
+    arena->prefix = scandir_arena_alloc(arena, len + add_sep + 1);
+    if (!arena->prefix)
+        return -1;
+    memcpy(arena->prefix, path, len);
+    if (add_sep)
+        arena->prefix[len++] = '/';
+    arena->prefix[len] = '\0';
+    arena->prefix_len = len;
+    arena->base_used = arena->current->used;
+    return 0;
+}
+
+/* Free all but the first block, and rewind that to just after the prefix */
+static void
+scandir_arena_reset(ScandirArena *arena)
+{
+    ScandirArenaBlock *block, *next;
+
+    if (!arena->first)
+        return;
+    for (block = arena->first->next; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    arena->first->next = NULL;
+    arena->first->used = arena->base_used;
+    arena->current = arena->first;
+}
+
+static void
+scandir_arena_free(ScandirArena *arena)
+{
+    ScandirArenaBlock *block, *next;
+
+    for (block = arena->first; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    scandir_arena_init(arena);
+}
+
+/* What a DirEntry needs of its iterator, refcounted by the iterator and
+   each entry (under the GIL) so that the iterator can be closed and
+   freed while entries are still alive, as with os.scandir() */
+typedef struct {
+    Py_ssize_t refcount;
+    ScandirArena arena;
+    /* Decoded arena prefix, created when the first path is asked for */
+    PyObject *path_prefix;
+    int return_bytes;
+    /* Open until the iterator is exhausted, closed or freed; entries are
+       stat'ed relative to it until then, and by full path after */
+    DirReader reader;
+    /* Number of stat calls using the directory fd with the GIL released;
+       closing is deferred until they're done */
+    int fd_users;
+    int close_pending;
+    int path_fd;                /* the caller's fd if scanning one, else -1 */
+} ScandirShared;
+
+static ScandirShared *
+scandir_shared_new(void)
+{
+    ScandirShared *shared = PyMem_Malloc(sizeof(ScandirShared));
+
+    if (!shared)
+        return NULL;
+    shared->refcount = 1;
+    scandir_arena_init(&shared->arena);
+    shared->path_prefix = NULL;
+    shared->return_bytes = 0;
+    dir_reader_init(&shared->reader);
+    shared->fd_users = 0;
+    shared->close_pending = 0;
+    shared->path_fd = -1;
+    return shared;
+}
+
+/* Close the directory, or leave it to the last stat call using its fd */
+static void
+scandir_shared_close(ScandirShared *shared)
+{
+    if (!shared->reader.dirp)
+        return;
+    if (shared->fd_users > 0) {
+        /* A DirEntry is using the fd, it'll close it when done */
+        shared->close_pending = 1;
+        return;
+    }
+
+    SCANDIR_BEGIN_ALLOW_THREADS
+    /* Reset the offset shared with the caller's fd, like rewinddir() */
+    if (shared->path_fd != -1)
+        lseek(dirfd(shared->reader.dirp), 0, SEEK_SET);
+    dir_reader_close(&shared->reader);
+    SCANDIR_END_ALLOW_THREADS
+    shared->close_pending = 0;
+}
+
+/* Finish a stat call started with fd_users++ */
+static void
+scandir_shared_release_fd(ScandirShared *shared)
+{
+    if (--shared->fd_users == 0 && shared->close_pending)
+        scandir_shared_close(shared);
+}
+
+static void
+scandir_shared_decref(ScandirShared *shared)
+{
+    if (--shared->refcount > 0)
+        return;
+    scandir_shared_close(shared);
+    scandir_arena_free(&shared->arena);
+    Py_XDECREF(shared->path_prefix);
+    PyMem_Free(shared);
+}
+#endif
+
+typedef struct {
+    PyObject_HEAD
+    path_t path;
+#ifdef MS_WINDOWS
+    HANDLE handle;
+    WIN32_FIND_DATAW file_data;
+    int first_time;
+#else /* POSIX */
+    /* The directory reader and entry names */
+    ScandirShared *shared;
+    /* include/exclude patterns and d_type mask, applied to the raw names
+       before any DirEntry is created */
+    GlobPattern *include;
+    Py_ssize_t num_include;
+    GlobPattern *exclude;
+    Py_ssize_t num_exclude;
+    unsigned int types;         /* bit per d_type to keep, 0 keeps all */
+    /* For SCANDIR_ORDER_NAME and _INODE, the whole directory is read and
+       sorted on the first next() call; num_sorted is -1 until then */
+    int order;
+    DirRecord *sorted;
+    char *sorted_names;
+    Py_ssize_t num_sorted;
+    Py_ssize_t sorted_pos;
+#endif
+} ScandirIterator;
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *name;
+    PyObject *path;
+    PyObject *stat;
+    PyObject *lstat;
+#ifdef MS_WINDOWS
+    struct _Py_stat_struct win32_lstat;
+    unsigned __int64 win32_file_index;
+    int got_file_index;
+#if PY_MAJOR_VERSION < 3
+    int name_path_bytes;
+#endif
+#else /* POSIX */
+#ifdef HAVE_DIRENT_D_TYPE
+    unsigned char d_type;
+#endif
+    ino_t d_ino;
+    /* While the iterator is open, the entry is stat'ed relative to its
+       directory fd rather than by full path */
+    ScandirShared *shared;
+    /* name and path are only decoded when first asked for, from the raw
+       name (NUL-terminated) in the shared arena */
+    char *name_bytes;
+    Py_ssize_t name_len;
+#endif
+} DirEntry;
+
+/* Like CPython's float and tuple free lists, keep some deallocated
+   DirEntry objects for reuse, as a loop over scandir() usually drops each
+   entry before creating the next. While on the free list, an entry's stat
+   field links to the next one. */
+#define DIRENTRY_MAXFREELIST 128
+
+static DirEntry *dir_entry_free_list = NULL;
+static int dir_entry_numfree = 0;
+
+static PyTypeObject DirEntryType;
+
+static DirEntry *
+DirEntry_new(void)
+{
+    DirEntry *entry = dir_entry_free_list;
+
+    STATS_ADD(dir_entries, 1);
+    if (!entry)
+        return PyObject_New(DirEntry, &DirEntryType);
+    dir_entry_free_list = (DirEntry *)entry->stat;
+    dir_entry_numfree--;
+    (void)PyObject_INIT(entry, &DirEntryType);
+    return entry;
+}
+
+static void
+DirEntry_dealloc(DirEntry *entry)
+{
+    Py_XDECREF(entry->name);
+    Py_XDECREF(entry->path);
+    Py_XDECREF(entry->stat);
+    Py_XDECREF(entry->lstat);
+#ifndef MS_WINDOWS
+    scandir_shared_decref(entry->shared);
+#endif
+    if (dir_entry_numfree < DIRENTRY_MAXFREELIST) {
+        entry->stat = (PyObject *)dir_entry_free_list;
+        dir_entry_free_list = entry;
+        dir_entry_numfree++;
+        return;
+    }
+    Py_TYPE(entry)->tp_free((PyObject *)entry);
+}
+
+/* Forward reference */
+static void
+ScandirIterator_close(ScandirIterator *iterator);
+
+#ifndef MS_WINDOWS
+/* Return the entry's full path in a new PyMem buffer, NULL on error */
+static char *
+DirEntry_join_path(DirEntry *self)
+{
+    ScandirArena *arena = &self->shared->arena;
+    char *result;
+
+    result = PyMem_Malloc(arena->prefix_len + self->name_len + 1);
+    if (!result) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memcpy(result, arena->prefix, arena->prefix_len);
+    memcpy(result + arena->prefix_len, self->name_bytes, self->name_len + 1);
+    return result;
+}
+
+/* Return a borrowed reference to the entry's name, decoding it on first use */
+static PyObject *
+DirEntry_get_name(DirEntry *self)
+{
+    if (!self->name)
+        self->name = decode_fs_name(self->shared->return_bytes,
+                                    self->name_bytes, self->name_len);
+    return self->name;
+}
+
+/* Return a borrowed reference to the entry's path, joining and decoding it
+   on first use */
+static PyObject *
+DirEntry_get_path(DirEntry *self)
+{
+    ScandirShared *shared = self->shared;
+    PyObject *name;
+
+    if (self->path)
+        return self->path;
+    name = DirEntry_get_name(self);
+    if (!name)
+        return NULL;
+
+    /* When scanning a directory fd, path is just the name like os.scandir() */
+    if (shared->arena.prefix_len == 0) {
+        Py_INCREF(name);
+        self->path = name;
+        return self->path;
+    }
+
+    /* The prefix is only decoded once per iterator */
+    if (!shared->path_prefix) {
+        shared->path_prefix = decode_fs_name(shared->return_bytes, shared->arena.prefix,
+                                             shared->arena.prefix_len);
+        if (!shared->path_prefix)
+            return NULL;
+    }
+    self->path = PySequence_Concat(shared->path_prefix, name);
+    return self->path;
+}
+
+/* Raise OSError from errno for the entry's path, return NULL */
+static PyObject *
+DirEntry_error(DirEntry *self)
+{
+    int error = errno;
+    PyObject *path = DirEntry_get_path(self);
+
+    if (!path)
+        return NULL;
+    errno = error;
+    return PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+}
+#endif
+
+/* Forward reference */
+static int
+DirEntry_test_mode(DirEntry *self, int follow_symlinks, unsigned short mode_bits);
+
+/* Set exception and return -1 on error, 0 for False, 1 for True */
+static int
+DirEntry_is_symlink(DirEntry *self)
+{
+#ifdef MS_WINDOWS
+    return (self->win32_lstat.st_mode & S_IFMT) == S_IFLNK;
+#elif defined(HAVE_DIRENT_D_TYPE)
+    /* POSIX */
+    if (self->d_type != DT_UNKNOWN)
+        return self->d_type == DT_LNK;
+    else
+        return DirEntry_test_mode(self, 0, S_IFLNK);
+#else
+    /* POSIX without d_type */
+    return DirEntry_test_mode(self, 0, S_IFLNK);
+#endif
+}
+
+static PyObject *
+DirEntry_py_is_symlink(DirEntry *self)
+{
+    int result;
+
+    result = DirEntry_is_symlink(self);
+    if (result == -1)
+        return NULL;
+    return PyBool_FromLong(result);
+}
+
+#ifndef MS_WINDOWS
+/* Return the path (as bytes) to stat the entry by, setting *dir_fd to the
+   directory fd it's relative to (the path is then just the name), or -1
+   if it's the full path */
+static PyObject *
+DirEntry_stat_path(DirEntry *self, int *dir_fd)
+{
+    ScandirShared *shared = self->shared;
+    PyObject *bytes;
+    char *joined_path;
+
+    *dir_fd = -1;
+#ifdef HAVE_FSTATAT
+    if (shared->reader.dirp && !shared->close_pending)
+        *dir_fd = dirfd(shared->reader.dirp);
+    else if (shared->path_fd != -1)
+        *dir_fd = shared->path_fd;
+#endif
+
+    if (*dir_fd != -1 || shared->path_fd != -1)
+        return PyBytes_FromStringAndSize(self->name_bytes, self->name_len);
+
+    joined_path = DirEntry_join_path(self);
+    if (!joined_path)
+        return NULL;
+    bytes = PyBytes_FromString(joined_path);
+    PyMem_Free(joined_path);
+    return bytes;
+}
+#endif
+
+static PyObject *
+DirEntry_fetch_stat(DirEntry *self, int follow_symlinks)
+{
+    int result;
+    struct _Py_stat_struct st;
+
+#ifdef MS_WINDOWS
+    wchar_t *path;
+
+    path = PyUnicode_AsUnicode(self->path);
+    if (!path)
+        return NULL;
+
+    if (follow_symlinks)
+        STATS_ADD(stat, 1);
+    else
+        STATS_ADD(lstat, 1);
+    SCANDIR_BEGIN_ALLOW_THREADS
+    if (follow_symlinks)
+        result = win32_stat_w(path, &st);
+    else
+        result = win32_lstat_w(path, &st);
+    SCANDIR_END_ALLOW_THREADS
+
+    if (result != 0) {
+        return PyErr_SetExcFromWindowsErrWithFilenameObject(PyExc_OSError,
+                                                            0, self->path);
+    }
+#else /* POSIX */
+    PyObject *bytes;
+    char *path;
+    int dir_fd;
+
+    bytes = DirEntry_stat_path(self, &dir_fd);
+    if (!bytes)
+        return NULL;
+    path = PyBytes_AS_STRING(bytes);
+
+    if (follow_symlinks)
+        STATS_ADD(stat, 1);
+    else
+        STATS_ADD(lstat, 1);
+    self->shared->fd_users++;
+    SCANDIR_BEGIN_ALLOW_THREADS
+#ifdef HAVE_FSTATAT
+    if (dir_fd != -1)
+        result = fstatat(dir_fd, path, &st,
+                         follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW);
+    else
+#endif
+    if (follow_symlinks)
+        result = STAT(path, &st);
+    else
+        result = LSTAT(path, &st);
+    SCANDIR_END_ALLOW_THREADS
+    Py_DECREF(bytes);
+    scandir_shared_release_fd(self->shared);
+
+    if (result != 0)
+        return DirEntry_error(self);
+
+    return StatInfo_from_stat(&st);
+#endif
+
+    return _pystat_fromstructstat(&st);
+}
+
+static PyObject *
+DirEntry_get_lstat(DirEntry *self)
+{
+    if (self->lstat)
+        STATS_ADD(lstat_cache_hits, 1);
+    else {
+#ifdef MS_WINDOWS
+        self->lstat = _pystat_fromstructstat(&self->win32_lstat);
+#else /* POSIX */
+        self->lstat = DirEntry_fetch_stat(self, 0);
+#endif
+    }
+    Py_XINCREF(self->lstat);
+    return self->lstat;
+}
+
+static PyObject *
+DirEntry_get_stat(DirEntry *self, int follow_symlinks)
+{
+    if (!follow_symlinks)
+        return DirEntry_get_lstat(self);
+
+    if (self->stat)
+        STATS_ADD(stat_cache_hits, 1);
+    else {
+        int result = DirEntry_is_symlink(self);
+        if (result == -1)
+            return NULL;
+        else if (result)
+            self->stat = DirEntry_fetch_stat(self, 1);
+        else
+            self->stat = DirEntry_get_lstat(self);
+    }
+
+    Py_XINCREF(self->stat);
+    return self->stat;
+}
+
+#ifdef HAVE_STATX
+/* Fetch only the fields in mask with statx; the partial result isn't
+   cached. With sync false the kernel may return cached attributes rather
+   than revalidating them with a network file system's server. */
+static PyObject *
+DirEntry_fetch_statx(DirEntry *self, int follow_symlinks, unsigned int mask,
+                     unsigned long wanted, int sync)
+{
+    struct statx stx;
+    PyObject *bytes;
+    int dir_fd;
+    int flags;
+    int result;
+    int error;
+
+    bytes = DirEntry_stat_path(self, &dir_fd);
+    if (!bytes)
+        return NULL;
+
+    flags = follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW;
+    if (!sync)
+        flags |= AT_STATX_DONT_SYNC;
+    if (follow_symlinks)
+        STATS_ADD(stat, 1);
+    else
+        STATS_ADD(lstat, 1);
+
+    self->shared->fd_users++;
+    SCANDIR_BEGIN_ALLOW_THREADS
+    result = statx(dir_fd != -1 ? dir_fd : AT_FDCWD, PyBytes_AS_STRING(bytes),
+                   flags, mask, &stx);
+    error = errno;
+    SCANDIR_END_ALLOW_THREADS
+    Py_DECREF(bytes);
+    scandir_shared_release_fd(self->shared);
+
+    if (result != 0) {
+        /* Kernel without statx: fall back to a full stat */
+        if (error == ENOSYS)
+            return DirEntry_get_stat(self, follow_symlinks);
+        errno = error;
+        return DirEntry_error(self);
+    }
+
+    return _pystat_fromstatx(&stx, wanted);
+}
+#endif
+
+static PyObject *
+DirEntry_stat(DirEntry *self, PyObject *args, PyObject *kwargs)
+{
+    int follow_symlinks = 1;
+    PyObject *fields = Py_None;
+    int sync = 1;
+#ifdef HAVE_STATX
+    PyObject *cached;
+    unsigned int mask;
+    unsigned long wanted;
+#endif
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, stat_format, stat_keywords,
+                                     &follow_symlinks, &fields, &sync))
+        return NULL;
+
+    if (fields == Py_None && sync)
+        return DirEntry_get_stat(self, follow_symlinks);
+
+#ifdef HAVE_STATX
+    /* An already cached full result has every field asked for */
+    cached = follow_symlinks ? self->stat : self->lstat;
+    if (cached) {
+        if (follow_symlinks)
+            STATS_ADD(stat_cache_hits, 1);
+        else
+            STATS_ADD(lstat_cache_hits, 1);
+        Py_INCREF(cached);
+        return cached;
+    }
+
+    if (fields == Py_None) {
+        mask = STATX_BASIC_STATS;
+        wanted = STATX_WANT_ALL;
+    }
+    else if (statx_parse_fields(fields, &mask, &wanted) != 0)
+        return NULL;
+
+    return DirEntry_fetch_statx(self, follow_symlinks, mask, wanted, sync);
+#else
+    /* Without statx every field is fetched and cached as usual */
+    return DirEntry_get_stat(self, follow_symlinks);
+#endif
+}
+
+/* Set exception and return -1 on error, 0 for False, 1 for True */
+static int
+DirEntry_test_mode(DirEntry *self, int follow_symlinks, unsigned short mode_bits)
+{
+    PyObject *stat = NULL;
+    PyObject *st_mode = NULL;
+    long mode;
+    int result;
+#if defined(MS_WINDOWS) || defined(HAVE_DIRENT_D_TYPE)
+    int is_symlink;
+    int need_stat;
+#endif
+#ifdef MS_WINDOWS
+    unsigned long dir_bits;
+#endif
+    _Py_IDENTIFIER(st_mode);
+
+#ifdef MS_WINDOWS
+    is_symlink = (self->win32_lstat.st_mode & S_IFMT) == S_IFLNK;
+    need_stat = follow_symlinks && is_symlink;
+#elif defined(HAVE_DIRENT_D_TYPE)
+    is_symlink = self->d_type == DT_LNK;
+    need_stat = self->d_type == DT_UNKNOWN || (follow_symlinks && is_symlink);
+#endif
+
+#if defined(MS_WINDOWS) || defined(HAVE_DIRENT_D_TYPE)
+    if (need_stat) {
+#endif
+        stat = DirEntry_get_stat(self, follow_symlinks);
+        if (!stat) {
+            if (PyErr_ExceptionMatches(PyExc_FileNotFoundError)) {
+                /* If file doesn't exist (anymore), then return False
+                   (i.e., say it's not a file/directory) */
+                PyErr_Clear();
+                return 0;
+            }
+            goto error;
+        }
+#ifndef MS_WINDOWS
+        if (StatInfo_Check(stat))
+            mode = (long)((StatInfo *)stat)->st.st_mode;
+        else
+#endif
+        {
+            st_mode = _PyObject_GetAttrId(stat, &PyId_st_mode);
+            if (!st_mode)
+                goto error;
+
+            mode = PyLong_AsLong(st_mode);
+            if (mode == -1 && PyErr_Occurred())
+                goto error;
+            Py_CLEAR(st_mode);
+        }
+        Py_CLEAR(stat);
+        result = (mode & S_IFMT) == mode_bits;
+#if defined(MS_WINDOWS) || defined(HAVE_DIRENT_D_TYPE)
+    }
+    else if (is_symlink) {
+        assert(mode_bits != S_IFLNK);
+        result = 0;
+    }
+    else {
+        assert(mode_bits == S_IFDIR || mode_bits == S_IFREG);
+#ifdef MS_WINDOWS
+        dir_bits = self->win32_lstat.st_file_attributes & FILE_ATTRIBUTE_DIRECTORY;
+        if (mode_bits == S_IFDIR)
+            result = dir_bits != 0;
+        else
+            result = dir_bits == 0;
+#else /* POSIX */
+        if (mode_bits == S_IFDIR)
+            result = self->d_type == DT_DIR;
+        else
+            result = self->d_type == DT_REG;
+#endif
+    }
+#endif
+
+    return result;
+
+error:
+    Py_XDECREF(st_mode);
+    Py_XDECREF(stat);
+    return -1;
+}
+
+static PyObject *
+DirEntry_py_test_mode(DirEntry *self, int follow_symlinks, unsigned short mode_bits)
+{
+    int result;
+
+    result = DirEntry_test_mode(self, follow_symlinks, mode_bits);
+    if (result == -1)
+        return NULL;
+    return PyBool_FromLong(result);
+}
+
+static PyObject *
+DirEntry_is_dir(DirEntry *self, PyObject *args, PyObject *kwargs)
+{
+    int follow_symlinks = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, follow_symlinks_format,
+                                     follow_symlinks_keywords, &follow_symlinks))
+        return NULL;
+
+    return DirEntry_py_test_mode(self, follow_symlinks, S_IFDIR);
+}
+
+static PyObject *
+DirEntry_is_file(DirEntry *self, PyObject *args, PyObject *kwargs)
+{
+    int follow_symlinks = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, follow_symlinks_format,
+                                     follow_symlinks_keywords, &follow_symlinks))
+        return NULL;
+
+    return DirEntry_py_test_mode(self, follow_symlinks, S_IFREG);
+}
+
+static PyObject *
+DirEntry_inode(DirEntry *self)
+{
+#ifdef MS_WINDOWS
+    if (!self->got_file_index) {
+        wchar_t *path;
+        struct _Py_stat_struct stat;
+
+        path = PyUnicode_AsUnicode(self->path);
+        if (!path)
+            return NULL;
+
+        if (win32_lstat_w(path, &stat) != 0) {
+            return PyErr_SetExcFromWindowsErrWithFilenameObject(PyExc_OSError,
+                                                                0, self->path);
+        }
+
+        self->win32_file_index = stat.st_ino;
+        self->got_file_index = 1;
+    }
+    return PyLong_FromUnsignedLongLong(self->win32_file_index);
+#else /* POSIX */
+#ifdef HAVE_LARGEFILE_SUPPORT
+    return PyLong_FromUnsignedLongLong(self->d_ino);
+#else
+    return PyLong_FromUnsignedLong((unsigned long)self->d_ino);
+#endif
+#endif
+}
+
+#if PY_MAJOR_VERSION < 3 && defined(MS_WINDOWS)
+
+PyObject *DirEntry_name_getter(DirEntry *self, void *closure) {
+    if (self->name_path_bytes) {
+        return PyUnicode_EncodeMBCS(PyUnicode_AS_UNICODE(self->name),
+                                    PyUnicode_GetSize(self->name), "strict");
+    } else {
+        Py_INCREF(self->name);
+        return self->name;
+    }
+}
+
+PyObject *DirEntry_path_getter(DirEntry *self, void *closure) {
+    if (self->name_path_bytes) {
+        return PyUnicode_EncodeMBCS(PyUnicode_AS_UNICODE(self->path),
+                                    PyUnicode_GetSize(self->path), "strict");
+    } else {
+        Py_INCREF(self->path);
+        return self->path;
+    }
+}
+
+static PyGetSetDef DirEntry_getset[] = {
+    {"name", (getter)DirEntry_name_getter, NULL,
+     "the entry's base filename, relative to scandir() \"path\" argument", NULL},
+    {"path", (getter)DirEntry_path_getter, NULL,
+     "the entry's full path name; equivalent to os.path.join(scandir_path, entry.name)", NULL},
+    {NULL}
+};
+
+#elif defined(MS_WINDOWS)
+
+static PyMemberDef DirEntry_members[] = {
+    {"name", T_OBJECT_EX, offsetof(DirEntry, name), READONLY,
+     "the entry's base filename, relative to scandir() \"path\" argument"},
+    {"path", T_OBJECT_EX, offsetof(DirEntry, path), READONLY,
+     "the entry's full path name; equivalent to os.path.join(scandir_path, entry.name)"},
+    {NULL}
+};
+
+#else /* POSIX */
+
+PyObject *DirEntry_name_getter(DirEntry *self, void *closure) {
+    PyObject *name = DirEntry_get_name(self);
+    Py_XINCREF(name);
+    return name;
+}
+
+PyObject *DirEntry_path_getter(DirEntry *self, void *closure) {
+    PyObject *path = DirEntry_get_path(self);
+    Py_XINCREF(path);
+    return path;
+}
+
+static PyGetSetDef DirEntry_getset[] = {
+    {"name", (getter)DirEntry_name_getter, NULL,
+     "the entry's base filename, relative to scandir() \"path\" argument", NULL},
+    {"path", (getter)DirEntry_path_getter, NULL,
+     "the entry's full path name; equivalent to os.path.join(scandir_path, entry.name)", NULL},
+    {NULL}
+};
+
+#endif
+
+static PyObject *
+DirEntry_repr(DirEntry *self)
+{
+#if PY_MAJOR_VERSION >= 3 && defined(MS_WINDOWS)
+    return PyUnicode_FromFormat("<DirEntry %R>", self->name);
+#elif PY_MAJOR_VERSION >= 3
+    PyObject *name = DirEntry_get_name(self);
+
+    if (!name)
+        return NULL;
+    return PyUnicode_FromFormat("<DirEntry %R>", name);
+#elif defined(MS_WINDOWS)
+    PyObject *name;
+    PyObject *name_repr;
+    PyObject *entry_repr;
+
+    name = DirEntry_name_getter(self, NULL);
+    if (!name)
+        return NULL;
+    name_repr = PyObject_Repr(name);
+    Py_DECREF(name);
+    if (!name_repr)
+        return NULL;
+    entry_repr = PyString_FromFormat("<DirEntry %s>", PyString_AsString(name_repr));
+    Py_DECREF(name_repr);
+    return entry_repr;
+#else
+    PyObject *name;
+    PyObject *name_repr;
+    PyObject *entry_repr;
+
+    name = DirEntry_get_name(self);
+    if (!name)
+        return NULL;
+    name_repr = PyObject_Repr(name);
+    if (!name_repr)
+        return NULL;
+    entry_repr = PyString_FromFormat("<DirEntry %s>", PyString_AsString(name_repr));
+    Py_DECREF(name_repr);
+    return entry_repr;
+#endif
+}
+
+static PyMethodDef DirEntry_methods[] = {
+    {"is_dir", (PyCFunction)DirEntry_is_dir, METH_VARARGS | METH_KEYWORDS,
+     "return True if the entry is a directory; cached per entry"
+    },
+    {"is_file", (PyCFunction)DirEntry_is_file, METH_VARARGS | METH_KEYWORDS,
+     "return True if the entry is a file; cached per entry"
+    },
+    {"is_symlink", (PyCFunction)DirEntry_py_is_symlink, METH_NOARGS,
+     "return True if the entry is a symbolic link; cached per entry"
+    },
+    {"stat", (PyCFunction)DirEntry_stat, METH_VARARGS | METH_KEYWORDS,
+     "return stat_result object for the entry; cached per entry unless\n"
+     "only some fields are asked for, or sync is false"
+    },
+    {"inode", (PyCFunction)DirEntry_inode, METH_NOARGS,
+     "return inode of the entry; cached per entry",
+    },
+    {NULL}
+};
+
+static PyTypeObject DirEntryType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    MODNAME ".DirEntry",                    /* tp_name */
+    sizeof(DirEntry),                       /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    /* methods */
+    (destructor)DirEntry_dealloc,           /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    (reprfunc)DirEntry_repr,                /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    0,                                      /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    DirEntry_methods,                       /* tp_methods */
+#if PY_MAJOR_VERSION >= 3 && defined(MS_WINDOWS)
+    DirEntry_members,                       /* tp_members */
+    NULL,                                   /* tp_getset */
+#else
+    NULL,                                   /* tp_members */
+    DirEntry_getset,                        /* tp_getset */
+#endif
+};
+
+#ifdef MS_WINDOWS
+
+static wchar_t *
+join_path_filenameW(wchar_t *path_wide, wchar_t* filename)
+{
+    Py_ssize_t path_len;
+    Py_ssize_t size;
+    wchar_t *result;
+    wchar_t ch;
+
+    if (!path_wide) { /* Default arg: "." */
+        path_wide = L".";
+        path_len = 1;
+    }
+    else {
+        path_len = wcslen(path_wide);
+    }
+
+    /* The +1's are for the path separator and the NUL */
+    size = path_len + 1 + wcslen(filename) + 1;
+    result = PyMem_New(wchar_t, size);
+    if (!result) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    wcscpy(result, path_wide);
+    if (path_len > 0) {
+        ch = result[path_len - 1];
+        if (ch != SEP && ch != ALTSEP && ch != L':')
+            result[path_len++] = SEP;
+        wcscpy(result + path_len, filename);
+    }
+    return result;
+}
+
+static PyObject *
+DirEntry_from_find_data(path_t *path, WIN32_FIND_DATAW *dataW)
+{
+    DirEntry *entry;
+    BY_HANDLE_FILE_INFORMATION file_info;
+    ULONG reparse_tag;
+    wchar_t *joined_path;
+
+    entry = DirEntry_new();
+    if (!entry)
+        return NULL;
+    entry->name = NULL;
+    entry->path = NULL;
+    entry->stat = NULL;
+    entry->lstat = NULL;
+    entry->got_file_index = 0;
+#if PY_MAJOR_VERSION < 3
+    entry->name_path_bytes = path->object && PyBytes_Check(path->object);
+#endif
+
+    entry->name = PyUnicode_FromWideChar(dataW->cFileName, wcslen(dataW->cFileName));
+    if (!entry->name)
+        goto error;
+
+    joined_path = join_path_filenameW(path->wide, dataW->cFileName);
+    if (!joined_path)
+        goto error;
+
+    entry->path = PyUnicode_FromWideChar(joined_path, wcslen(joined_path));
+    PyMem_Free(joined_path);
+    if (!entry->path)
+        goto error;
+
+    find_data_to_file_info_w(dataW, &file_info, &reparse_tag);
+    _Py_attribute_data_to_stat(&file_info, reparse_tag, &entry->win32_lstat);
+
+    return (PyObject *)entry;
+
+error:
+    Py_DECREF(entry);
+    return NULL;
+}
+
+#else /* POSIX */
+
+static PyObject *
+DirEntry_from_posix_info(ScandirIterator *iterator, char *name,
+                         Py_ssize_t name_len, ino_t d_ino
+#ifdef HAVE_DIRENT_D_TYPE
+                         , unsigned char d_type
+#endif
+                         )
+{
+    ScandirShared *shared = iterator->shared;
+    DirEntry *entry;
+    char *name_bytes;
+
+    /* Only the iterator's reference is left, so nothing points into the
+       arena and its space can be reused */
+    if (shared->refcount == 1)
+        scandir_arena_reset(&shared->arena);
+
+    /* The name and path objects are only created when asked for */
+    name_bytes = scandir_arena_alloc(&shared->arena, name_len + 1);
+    if (!name_bytes)
+        return PyErr_NoMemory();
+    memcpy(name_bytes, name, name_len);
+    name_bytes[name_len] = '\0';
+
+    entry = DirEntry_new();
+    if (!entry)
+        return NULL;
+    entry->name = NULL;
+    entry->path = NULL;
+    entry->stat = NULL;
+    entry->lstat = NULL;
+    shared->refcount++;
+    entry->shared = shared;
+    entry->name_bytes = name_bytes;
+    entry->name_len = name_len;
+
+#ifdef HAVE_DIRENT_D_TYPE
+    entry->d_type = d_type;
+#endif
+    entry->d_ino = d_ino;
+
+    return (PyObject *)entry;
+}
+
+#endif
+
+
+#ifdef MS_WINDOWS
+
+static void
+ScandirIterator_close(ScandirIterator *iterator)
+{
+    if (iterator->handle == INVALID_HANDLE_VALUE)
+        return;
+
+    SCANDIR_BEGIN_ALLOW_THREADS
+    FindClose(iterator->handle);
+    SCANDIR_END_ALLOW_THREADS
+    iterator->handle = INVALID_HANDLE_VALUE;
+}
+
+static PyObject *
+ScandirIterator_iternext(ScandirIterator *iterator)
+{
+    WIN32_FIND_DATAW *file_data = &iterator->file_data;
+    BOOL success;
+
+    /* Happens if the iterator is iterated twice */
+    if (iterator->handle == INVALID_HANDLE_VALUE) {
+        PyErr_SetNone(PyExc_StopIteration);
+        return NULL;
+    }
+
+    while (1) {
+        if (!iterator->first_time) {
+            SCANDIR_BEGIN_ALLOW_THREADS
+            success = FindNextFileW(iterator->handle, file_data);
+            SCANDIR_END_ALLOW_THREADS
+            if (!success) {
+                if (GetLastError() != ERROR_NO_MORE_FILES)
+                    return path_error(&iterator->path);
+                /* No more files found in directory, stop iterating */
+                break;
+            }
+        }
+        iterator->first_time = 0;
+
+        /* Skip over . and .. */
+        if (wcscmp(file_data->cFileName, L".") != 0 &&
+                wcscmp(file_data->cFileName, L"..") != 0)
+            return DirEntry_from_find_data(&iterator->path, file_data);
+
+        /* Loop till we get a non-dot directory or finish iterating */
+    }
+
+    ScandirIterator_close(iterator);
+
+    PyErr_SetNone(PyExc_StopIteration);
+    return NULL;
+}
+
+#else /* POSIX */
+
+static void
+ScandirIterator_close(ScandirIterator *iterator)
+{
+    scandir_shared_close(iterator->shared);
+}
+
+/* Return 1 if the entry passes the iterator's filters, else 0. If
+   filtering by type and the OS didn't give one, the entry is lstat'ed
+   (without the GIL) and record->d_type filled in, so DirEntry needn't
+   stat it again. Return -1 if the iterator was closed meanwhile, as
+   record's name went with it. */
+static int
+ScandirIterator_filter(ScandirIterator *iterator, DirRecord *record)
+{
+    struct stat st;
+    int result;
+
+    if (iterator->include &&
+            !glob_match_any(iterator->include, iterator->num_include,
+                            record->name, record->name_len))
+        return 0;
+    if (iterator->num_exclude &&
+            glob_match_any(iterator->exclude, iterator->num_exclude,
+                           record->name, record->name_len))
+        return 0;
+    if (!iterator->types)
+        return 1;
+
+    if (record->d_type == 0) {
+        ScandirShared *shared = iterator->shared;
+
+        /* Closing waits for the stat, like DirEntry.stat() */
+        shared->fd_users++;
+        SCANDIR_BEGIN_ALLOW_THREADS
+        result = stat_at(&shared->reader,
+                         iterator->path.narrow ? iterator->path.narrow : ".",
+                         record->name, record->name_len, &st, 0);
+        SCANDIR_END_ALLOW_THREADS
+        if (--shared->fd_users == 0 && shared->close_pending) {
+            scandir_shared_close(shared);
+            return -1;
+        }
+        if (result != 0)
+            return 0;
+        /* d_type values are the file type bits of st_mode */
+        record->d_type = (unsigned char)((st.st_mode & S_IFMT) >> 12);
+    }
+    return (iterator->types >> record->d_type) & 1;
+}
+
+static int
+scandir_name_cmp(const void *a, const void *b)
+{
+    const DirRecord *x = a, *y = b;
+    int result = memcmp(x->name, y->name,
+                        x->name_len < y->name_len ? x->name_len : y->name_len);
+
+    if (result)
+        return result;
+    return x->name_len < y->name_len ? -1 : x->name_len > y->name_len;
+}
+
+static int
+scandir_inode_cmp(const void *a, const void *b)
+{
+    const DirRecord *x = a, *y = b;
+
+    if (x->d_ino != y->d_ino)
+        return x->d_ino < y->d_ino ? -1 : 1;
+    return scandir_name_cmp(a, b);
+}
+
+static void
+scandir_sorted_free(ScandirIterator *iterator)
+{
+    free(iterator->sorted);
+    iterator->sorted = NULL;
+    free(iterator->sorted_names);
+    iterator->sorted_names = NULL;
+}
+
+/* Read the rest of the directory into iterator->sorted (with the names,
+   NUL-terminated, in iterator->sorted_names) and sort it. Doesn't touch
+   Python objects. Return 0 on success or -1 with errno set. */
+static int
+scandir_read_sorted(ScandirIterator *iterator)
+{
+    DirRecord record;
+    Py_ssize_t num = 0, size = 0, names_len = 0, names_size = 0, offset, i;
+    int result;
+
+    while (1) {
+        if (!dir_reader_next(&iterator->shared->reader, &record)) {
+            result = dir_reader_fill(&iterator->shared->reader);
+            if (result < 0)
+                return -1;
+            if (result == 0)
+                break;
+            continue;
+        }
+        if (num == size) {
+            Py_ssize_t new_size = size ? size * 2 : 64;
+            DirRecord *sorted = realloc(iterator->sorted, new_size * sizeof(DirRecord));
+            if (!sorted)
+                goto nomem;
+            iterator->sorted = sorted;
+            size = new_size;
+        }
+        if (names_len + record.name_len + 1 > names_size) {
+            Py_ssize_t new_size = names_size ? names_size * 2 : 4096;
+            char *names;
+            while (new_size < names_len + record.name_len + 1)
+                new_size *= 2;
+            names = realloc(iterator->sorted_names, new_size);
+            if (!names)
+                goto nomem;
+            iterator->sorted_names = names;
+            names_size = new_size;
+        }
+        memcpy(iterator->sorted_names + names_len, record.name, record.name_len);
+        iterator->sorted_names[names_len + record.name_len] = '\0';
+        names_len += record.name_len + 1;
+        iterator->sorted[num++] = record;
+    }
+
+    /* The names buffer may have moved as it grew, so point the records
+       at their names (stored in order) now */
+    for (i = 0, offset = 0; i < num; i++) {
+        iterator->sorted[i].name = iterator->sorted_names + offset;
+        offset += iterator->sorted[i].name_len + 1;
+    }
+    if (num)
+        qsort(iterator->sorted, num, sizeof(DirRecord),
+              iterator->order == SCANDIR_ORDER_INODE ? scandir_inode_cmp : scandir_name_cmp);
+    iterator->num_sorted = num;
+    iterator->sorted_pos = 0;
+    return 0;
+
+nomem:
+    errno = ENOMEM;
+    return -1;
+}
+
+/* Return the next sorted entry, reading and sorting the directory first
+   if need be */
+static PyObject *
+ScandirIterator_next_sorted(ScandirIterator *iterator)
+{
+    DirRecord *record;
+    int result;
+
+    if (iterator->num_sorted < 0) {
+        SCANDIR_BEGIN_ALLOW_THREADS
+        result = scandir_read_sorted(iterator);
+        SCANDIR_END_ALLOW_THREADS
+        if (result < 0) {
+            if (errno == ENOMEM)
+                return PyErr_NoMemory();
+            return path_error(&iterator->path);
+        }
+    }
+
+    while (iterator->sorted_pos < iterator->num_sorted) {
+        record = &iterator->sorted[iterator->sorted_pos++];
+        result = ScandirIterator_filter(iterator, record);
+        if (result < 0)
+            break;
+        if (!result)
+            continue;
+        return DirEntry_from_posix_info(iterator, record->name,
+                                        record->name_len, record->d_ino
+#ifdef HAVE_DIRENT_D_TYPE
+                                        , record->d_type
+#endif
+                                        );
+    }
+
+    scandir_sorted_free(iterator);
+    ScandirIterator_close(iterator);
+
+    PyErr_SetNone(PyExc_StopIteration);
+    return NULL;
+}
+
+static PyObject *
+ScandirIterator_iternext(ScandirIterator *iterator)
+{
+    DirReader *reader = &iterator->shared->reader;
+    DirRecord record;
+    int result;
+
+    /* Happens if the iterator is iterated twice */
+    if (!reader->dirp || iterator->shared->close_pending) {
+        PyErr_SetNone(PyExc_StopIteration);
+        return NULL;
+    }
+    if (iterator->order != SCANDIR_ORDER_NATIVE)
+        return ScandirIterator_next_sorted(iterator);
+
+    while (1) {
+        /* Decode entries from the current batch while holding the GIL,
+           only releasing it to read the next batch */
+        if (dir_reader_next(reader, &record)) {
+            result = ScandirIterator_filter(iterator, &record);
+            if (result < 0)
+                break;
+            if (!result)
+                continue;
+            return DirEntry_from_posix_info(iterator, record.name,
+                                            record.name_len, record.d_ino
+#ifdef HAVE_DIRENT_D_TYPE
+                                            , record.d_type
+#endif
+                                            );
+        }
+
+        SCANDIR_BEGIN_ALLOW_THREADS
+        result = dir_reader_fill(reader);
+        SCANDIR_END_ALLOW_THREADS
+
+        if (result < 0)
+            return path_error(&iterator->path);
+        if (result == 0) {
+            /* No more files found in directory, stop iterating */
+            break;
+        }
+    }
+
+    ScandirIterator_close(iterator);
+
+    PyErr_SetNone(PyExc_StopIteration);
+    return NULL;
+}
+
+#endif
+
+static void
+ScandirIterator_dealloc(ScandirIterator *iterator)
+{
+#ifdef MS_WINDOWS
+    ScandirIterator_close(iterator);
+#else
+    /* Entries still alive keep the names, but not the directory open */
+    ScandirIterator_close(iterator);
+    scandir_shared_decref(iterator->shared);
+    scandir_sorted_free(iterator);
+    glob_free_list(iterator->include, iterator->num_include);
+    glob_free_list(iterator->exclude, iterator->num_exclude);
+#endif
+    Py_XDECREF(iterator->path.object);
+    path_cleanup(&iterator->path);
+    Py_TYPE(iterator)->tp_free((PyObject *)iterator);
+}
+
+static PyTypeObject ScandirIteratorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    MODNAME ".ScandirIterator",             /* tp_name */
+    sizeof(ScandirIterator),                /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    /* methods */
+    (destructor)ScandirIterator_dealloc,    /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    0,                                      /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    PyObject_SelfIter,                      /* tp_iter */
+    (iternextfunc)ScandirIterator_iternext, /* tp_iternext */
+};
+
+#ifndef MS_WINDOWS
+/* Convert types, a sequence of d_type values, to a bit mask. Return 0 on
+   success, -1 with an exception set on error. */
+static int
+scandir_types_mask(PyObject *types, unsigned int *mask)
+{
+    PyObject *seq;
+    Py_ssize_t i;
+    long d_type;
+
+    seq = PySequence_Fast(types, "types must be a sequence of d_type values");
+    if (!seq)
+        return -1;
+    *mask = 0;
+    for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        d_type = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+        if (d_type == -1 && PyErr_Occurred())
+            break;
+        if (d_type < 1 || d_type > 15) {
+            PyErr_Format(PyExc_ValueError, "scandir: invalid d_type %ld", d_type);
+            break;
+        }
+        *mask |= 1U << d_type;
+    }
+    Py_DECREF(seq);
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+/* Convert order (None or a string) to a SCANDIR_ORDER_* value. Return 0
+   on success, -1 with an exception set on error. */
+static int
+scandir_order(PyObject *order, int *value)
+{
+    static const char *names[] = {"native", "name", "inode"};
+    int i;
+
+    *value = SCANDIR_ORDER_NATIVE;
+    if (order == Py_None)
+        return 0;
+    for (i = 0; i < 3; i++) {
+        if (str_equals(order, names[i])) {
+            *value = i;
+            return 0;
+        }
+    }
+    PyErr_SetString(PyExc_ValueError,
+                    "scandir: order must be None, 'native', 'name' or 'inode'");
+    return -1;
+}
+#endif
+
+/* Return a new iterator with nothing open yet, for function_name */
+static ScandirIterator *
+ScandirIterator_new(const char *function_name)
+{
+    ScandirIterator *iterator;
+#ifndef MS_WINDOWS
+    ScandirShared *shared = scandir_shared_new();
+
+    if (!shared) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+#endif
+
+    iterator = PyObject_New(ScandirIterator, &ScandirIteratorType);
+    if (!iterator) {
+#ifndef MS_WINDOWS
+        scandir_shared_decref(shared);
+#endif
+        return NULL;
+    }
+    memset(&iterator->path, 0, sizeof(path_t));
+    iterator->path.function_name = function_name;
+    iterator->path.nullable = 1;
+    /* path_converter isn't called if path isn't given */
+    iterator->path.fd = -1;
+
+#ifdef MS_WINDOWS
+    iterator->handle = INVALID_HANDLE_VALUE;
+#else
+    iterator->shared = shared;
+    iterator->include = iterator->exclude = NULL;
+    iterator->num_include = iterator->num_exclude = 0;
+    iterator->types = 0;
+    iterator->order = SCANDIR_ORDER_NATIVE;
+    iterator->sorted = NULL;
+    iterator->sorted_names = NULL;
+    iterator->num_sorted = -1;
+    iterator->sorted_pos = 0;
+#endif
+    return iterator;
+}
+
+static PyObject *
+posix_scandir(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    ScandirIterator *iterator;
+    static char *keywords[] = {"path", "buffer_size", "include", "exclude",
+                               "types", "order", NULL};
+    Py_ssize_t buffer_size = -1;
+    PyObject *include = Py_None;
+    PyObject *exclude = Py_None;
+    PyObject *types = Py_None;
+    PyObject *order = Py_None;
+#ifdef MS_WINDOWS
+    wchar_t *path_strW;
+#else
+    char *path;
+    int result;
+#endif
+
+    iterator = ScandirIterator_new("scandir");
+    if (!iterator)
+        return NULL;
+#ifdef HAVE_DIR_READER_OPEN_FD
+    iterator->path.allow_fd = 1;
+#endif
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O&nOOOO:scandir", keywords,
+                                     path_converter, &iterator->path,
+                                     &buffer_size, &include, &exclude, &types,
+                                     &order))
+        goto error;
+
+    /* path_converter doesn't keep path.object around, so do it
+       manually for the lifetime of the iterator here (the refcount
+       is decremented in ScandirIterator_dealloc)
+    */
+    Py_XINCREF(iterator->path.object);
+
+#ifdef MS_WINDOWS
+    if (include != Py_None || exclude != Py_None || types != Py_None || order != Py_None) {
+        PyErr_SetString(PyExc_NotImplementedError,
+                        "scandir: include, exclude, types and order are only supported on POSIX");
+        goto error;
+    }
+    if (iterator->path.narrow) {
+        PyErr_SetString(PyExc_TypeError,
+                        "os.scandir() doesn't support bytes path on Windows, use Unicode instead");
+        goto error;
+    }
+    iterator->first_time = 1;
+
+    path_strW = join_path_filenameW(iterator->path.wide, L"*.*");
+    if (!path_strW)
+        goto error;
+
+    SCANDIR_BEGIN_ALLOW_THREADS
+    iterator->handle = FindFirstFileW(path_strW, &iterator->file_data);
+    SCANDIR_END_ALLOW_THREADS
+
+    PyMem_Free(path_strW);
+
+    if (iterator->handle == INVALID_HANDLE_VALUE) {
+        path_error(&iterator->path);
+        goto error;
+    }
+#else /* POSIX */
+    if (iterator->path.narrow)
+        path = iterator->path.narrow;
+    else
+        path = ".";
+
+    if (include != Py_None &&
+            glob_compile_list(include, &iterator->include, &iterator->num_include) < 0)
+        goto error;
+    if (exclude != Py_None &&
+            glob_compile_list(exclude, &iterator->exclude, &iterator->num_exclude) < 0)
+        goto error;
+    if (types != Py_None && scandir_types_mask(types, &iterator->types) < 0)
+        goto error;
+    if (scandir_order(order, &iterator->order) < 0)
+        goto error;
+
+    if (buffer_size == -1)
+        buffer_size = DIR_READER_DEFAULT_BUFFER_SIZE;
+    else if (buffer_size < DIR_READER_MIN_BUFFER_SIZE ||
+             buffer_size > DIR_READER_MAX_BUFFER_SIZE) {
+        PyErr_Format(PyExc_ValueError,
+                     "scandir: buffer_size must be between %d and %d",
+                     DIR_READER_MIN_BUFFER_SIZE, DIR_READER_MAX_BUFFER_SIZE);
+        goto error;
+    }
+
+    iterator->shared->path_fd = iterator->path.fd;
+    SCANDIR_BEGIN_ALLOW_THREADS
+#ifdef HAVE_DIR_READER_OPEN_FD
+    if (iterator->path.fd != -1) {
+        /* Read a duplicate so closing the iterator leaves the fd open */
+        int fd = dup(iterator->path.fd);
+        result = fd < 0 ? -1 : dir_reader_open_fd(&iterator->shared->reader, fd, buffer_size);
+    }
+    else
+#endif
+    result = dir_reader_open(&iterator->shared->reader, path, buffer_size);
+    SCANDIR_END_ALLOW_THREADS
+
+    if (result < 0) {
+        path_error(&iterator->path);
+        goto error;
+    }
+
+    /* When scanning a directory fd, path is just the name */
+    if (scandir_arena_set_prefix(&iterator->shared->arena,
+                                 iterator->path.fd != -1 ? "" : path) < 0) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    iterator->shared->return_bytes = iterator->path.narrow &&
+                                     PyBytes_Check(iterator->path.object);
+#endif
+
+    return (PyObject *)iterator;
+
+error:
+    Py_DECREF(iterator);
+    return NULL;
+}
+
+
+/* SECTION: Native walk() implementation (POSIX only)
+
+WalkIterator produces the same (top, dirs, nondirs) tuples as the
+Python _walk() in scandir.py, but keeps an explicit stack of WalkFrame
+structs instead of a chain of recursive generators, and reads each
+directory with a DirReader instead of creating DirEntry objects.
+
+With prefetch=N, a helper thread reads the next N subdirectories of each
+directory on the stack ahead of the walk, so that their inodes and
+directory blocks are in the cache by the time the walk (which is often
+waiting for the caller's processing of the previous directory) opens
+them. Requests go on a small LIFO stack, each directory's batch queued
+in reverse, so the helper works on the directory needed soonest: the
+first subdirectory of the one just read. Just reading the directory is
+what warms the cache; posix_fadvise() is also called, but most file
+systems keep directory blocks in the block device's cache where it has
+no effect.
+
+With order='bfs' the walk is breadth-first instead: the stack only
+ever holds the directory yielded last, and the paths still to be read
+are kept in a WalkFrontier, a FIFO of packed (level, path) records. A
+directory's subdirectories are only queued on the next call, so pruning
+dirnames works as when walking top-down. As a wide tree's frontier can
+get very big, once the records added exceed frontier_memory bytes
+they're appended to an unlinked temporary file, and read back (in
+order) when the walk gets to them.
+
+dedupe_dirs skips directories whose (st_dev, st_ino) has already been
+walked, which stops symlink cycles and bind mounts being walked again.
+That needs one fstat() of each directory opened, but no stat of its
+entries: dedupe_files drops files whose (st_dev, d_ino) has already
+been seen from filenames, taking st_dev from their directory.
+*/
+
+#ifndef MS_WINDOWS
+
+#include <pthread.h>
+
+#define WALK_ORDER_DFS 0
+#define WALK_ORDER_BFS 1
+#define WALK_FRONTIER_MEMORY (32 * 1024 * 1024)
+#define WALK_FRONTIER_CHUNK_SIZE 65536
+
+PyDoc_STRVAR(walk__doc__,
+"walk(top, topdown=True, onerror=None, followlinks=False, prefetch=0,\n\
+     order='dfs', max_depth=None, frontier_memory=32 MiB,\n\
+     dedupe_dirs=False, dedupe_files=False) ->\n\
+iterator of (dirpath, dirnames, filenames) tuples\n\n\
+Native version of os.walk() with the same arguments and semantics,\n\
+including in-place pruning of dirnames when walking top-down. If\n\
+prefetch is nonzero, a helper thread reads up to that many upcoming\n\
+subdirectories of each directory ahead of the walk to warm the cache.\n\
+order='bfs' walks top-down a level at a time, keeping the directories\n\
+still to be read in up to frontier_memory bytes of memory and the rest\n\
+in a temporary file. max_depth stops the walk descending more than\n\
+that many levels below top. dedupe_dirs skips directories already\n\
+walked (as reached through symlinks or bind mounts), and dedupe_files\n\
+leaves out hard links to files already listed.");
+
+/* A growable byte buffer, read from pos */
+typedef struct {
+    char *data;
+    Py_ssize_t pos;
+    Py_ssize_t len;
+    Py_ssize_t size;
+} WalkBuffer;
+
+/* FIFO of (level, path) records, each packed as an int then the
+   NUL-terminated path. Records are added to tail, which is written to
+   the end of the spill file when it's over the memory budget, and taken
+   from head, which is refilled from the spill file and then tail. */
+typedef struct {
+    WalkBuffer head;
+    WalkBuffer tail;
+    Py_ssize_t memory;
+    int fd;                     /* spill file, -1 until needed */
+    off_t read_offset;
+    off_t write_offset;
+    Py_ssize_t spilled;         /* total bytes written to the file */
+} WalkFrontier;
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* LIFO stack of malloc'ed paths to read; when full the oldest is
+       dropped */
+    char **paths;
+    Py_ssize_t count;
+    Py_ssize_t size;
+    int stop;
+} WalkPrefetcher;
+
+typedef struct {
+    PyObject *top;              /* dirpath as yielded to the caller */
+    char *path;                 /* top encoded for the OS */
+    /* Kept open after it's been read so subdirectories can be opened
+       and stat'ed relative to it, until DIR_READER_OPEN_PARENTS frames
+       deeper are pushed */
+    DirReader reader;
+    PyObject *dirs;
+    PyObject *nondirs;
+    /* Bottom-up only: NUL-separated names of subdirectories to walk
+       into, as they're found before the frame is yielded */
+    char *walk_into;
+    Py_ssize_t walk_into_len;
+    Py_ssize_t walk_into_size;
+    /* Top-down: index into dirs; bottom-up: offset into walk_into */
+    Py_ssize_t index;
+    /* With prefetch: subdirectories walked into (bottom-up) and queued
+       for prefetching so far, and the offset into walk_into of the next
+       one to queue (bottom-up) */
+    Py_ssize_t walked;
+    Py_ssize_t prefetched;
+    Py_ssize_t prefetch_pos;
+    dev_t dev;                  /* with dedupe_files */
+} WalkFrame;
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *top;
+    PyObject *onerror;
+    int topdown;
+    int followlinks;
+    int return_bytes;
+    int started;
+    int prefetch;               /* subdirectories to read ahead, 0 for none */
+    WalkPrefetcher *prefetcher; /* started when first needed */
+    WalkFrame *stack;
+    Py_ssize_t depth;
+    Py_ssize_t stack_size;
+    int order;                  /* WALK_ORDER_* */
+    Py_ssize_t max_depth;       /* levels below top to walk, -1 for all */
+    WalkFrontier frontier;      /* order='bfs' only */
+    int level;                  /* order='bfs': level of the frame yielded */
+    int dedupe_dirs;
+    int dedupe_files;
+    InodeSet seen_dirs;
+    InodeSet seen_files;
+} WalkIterator;
+
+/* Make room for n more bytes in buffer. Return -1 if out of memory. */
+static int
+walk_buffer_reserve(WalkBuffer *buffer, Py_ssize_t n)
+{
+    Py_ssize_t new_size;
+    char *data;
+
+    if (buffer->len + n <= buffer->size)
+        return 0;
+    new_size = buffer->size ? buffer->size * 2 : 4096;
+    while (new_size < buffer->len + n)
+        new_size *= 2;
+    data = realloc(buffer->data, new_size);
+    if (!data)
+        return -1;
+    buffer->data = data;
+    buffer->size = new_size;
+    return 0;
+}
+
+/* Create the unlinked spill file in $TMPDIR (or /tmp). Return the fd, or
+   -1 with errno set on error. */
+static int
+walk_frontier_open_file(void)
+{
+    const char *dir = getenv("TMPDIR");
+    static const char name[] = "scandir-frontier-XXXXXX";
+    char *template;
+    int fd, error;
+
+    if (!dir || !*dir)
+        dir = "/tmp";
+    template = join_path_raw(dir, name, sizeof(name) - 1);
+    if (!template) {
+        errno = ENOMEM;
+        return -1;
+    }
+    fd = mkstemp(template);
+    if (fd >= 0) {
+        error = errno;
+        unlink(template);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        errno = error;
+    }
+    free(template);
+    return fd;
+}
+
+/* Write the frontier's tail to the end of the spill file. Return -1 with
+   errno set on error. */
+static int
+walk_frontier_spill(WalkFrontier *frontier)
+{
+    WalkBuffer *tail = &frontier->tail;
+    Py_ssize_t pos = 0;
+    ssize_t n = 0;
+
+    if (frontier->fd == -1) {
+        frontier->fd = walk_frontier_open_file();
+        if (frontier->fd == -1)
+            return -1;
+    }
+    SCANDIR_BEGIN_ALLOW_THREADS
+    while (pos < tail->len) {
+        n = pwrite(frontier->fd, tail->data + pos, tail->len - pos,
+                   frontier->write_offset + pos);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        pos += n;
+    }
+    SCANDIR_END_ALLOW_THREADS
+    if (n < 0)
+        return -1;
+    frontier->write_offset += tail->len;
+    frontier->spilled += tail->len;
+    tail->len = 0;
+    return 0;
+}
+
+/* Add a record for path to the frontier. Return -1 with errno set on
+   error. */
+static int
+walk_frontier_push(WalkFrontier *frontier, int level, const char *path)
+{
+    WalkBuffer *tail = &frontier->tail;
+    Py_ssize_t path_len = strlen(path);
+
+    if (walk_buffer_reserve(tail, sizeof(int) + path_len + 1) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(tail->data + tail->len, &level, sizeof(int));
+    memcpy(tail->data + tail->len + sizeof(int), path, path_len + 1);
+    tail->len += sizeof(int) + path_len + 1;
+    if (tail->len > frontier->memory)
+        return walk_frontier_spill(frontier);
+    return 0;
+}
+
+/* Read the next chunk of the spill file into head, after what's left
+   of a partly read record. Return -1 with errno set on error. */
+static int
+walk_frontier_refill(WalkFrontier *frontier)
+{
+    WalkBuffer *head = &frontier->head;
+    Py_ssize_t chunk = WALK_FRONTIER_CHUNK_SIZE;
+    ssize_t n;
+
+    if (head->len > head->pos)
+        memmove(head->data, head->data + head->pos, head->len - head->pos);
+    head->len -= head->pos;
+    head->pos = 0;
+    if (frontier->write_offset - frontier->read_offset < chunk)
+        chunk = (Py_ssize_t)(frontier->write_offset - frontier->read_offset);
+    if (walk_buffer_reserve(head, chunk) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    SCANDIR_BEGIN_ALLOW_THREADS
+    do {
+        n = pread(frontier->fd, head->data + head->len, chunk, frontier->read_offset);
+    } while (n < 0 && errno == EINTR);
+    SCANDIR_END_ALLOW_THREADS
+    if (n <= 0) {
+        if (n == 0)
+            errno = EIO;
+        return -1;
+    }
+    head->len += n;
+    frontier->read_offset += n;
+    if (frontier->read_offset == frontier->write_offset) {
+        /* All read back: start the file again from the beginning */
+        frontier->read_offset = frontier->write_offset = 0;
+        if (ftruncate(frontier->fd, 0) < 0) {
+            /* Not a problem, the space will just be reused */
+        }
+    }
+    return 0;
+}
+
+/* Take the next record from the frontier, setting *path to a pointer
+   into its buffer that's valid until the next call. Return 1 if there
+   was one, 0 if the frontier is empty, or -1 with errno set on error. */
+static int
+walk_frontier_pop(WalkFrontier *frontier, int *level, char **path)
+{
+    WalkBuffer *head = &frontier->head, swap;
+    char *end;
+
+    while (1) {
+        if (head->len - head->pos > (Py_ssize_t)sizeof(int)) {
+            end = memchr(head->data + head->pos + sizeof(int), '\0',
+                         head->len - head->pos - sizeof(int));
+            if (end) {
+                memcpy(level, head->data + head->pos, sizeof(int));
+                *path = head->data + head->pos + sizeof(int);
+                head->pos = end + 1 - head->data;
+                return 1;
+            }
+        }
+        /* The spill file has the records added before those in tail */
+        if (frontier->read_offset < frontier->write_offset) {
+            if (walk_frontier_refill(frontier) < 0)
+                return -1;
+            continue;
+        }
+        if (frontier->tail.len == 0)
+            return 0;
+        swap = *head;
+        *head = frontier->tail;
+        head->pos = 0;
+        frontier->tail = swap;
+        frontier->tail.pos = frontier->tail.len = 0;
+    }
+}
+
+static void
+walk_frontier_free(WalkFrontier *frontier)
+{
+    free(frontier->head.data);
+    free(frontier->tail.data);
+    if (frontier->fd != -1)
+        close(frontier->fd);
+    memset(frontier, 0, sizeof(WalkFrontier));
+    frontier->fd = -1;
+}
+
+static void *
+walk_prefetch_worker(void *arg)
+{
+    WalkPrefetcher *prefetcher = arg;
+    DirReader reader;
+    char *path;
+
+    pthread_mutex_lock(&prefetcher->lock);
+    while (1) {
+        while (!prefetcher->count && !prefetcher->stop)
+            pthread_cond_wait(&prefetcher->cond, &prefetcher->lock);
+        if (prefetcher->stop)
+            break;
+        path = prefetcher->paths[--prefetcher->count];
+        pthread_mutex_unlock(&prefetcher->lock);
+
+        dir_reader_init(&reader);
+        if (dir_reader_open(&reader, path, DIR_READER_DEFAULT_BUFFER_SIZE) == 0) {
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+            posix_fadvise(dirfd(reader.dirp), 0, 0, POSIX_FADV_WILLNEED);
+#endif
+            while (dir_reader_fill(&reader) > 0)
+                ;
+            dir_reader_close(&reader);
+        }
+        free(path);
+
+        pthread_mutex_lock(&prefetcher->lock);
+    }
+    pthread_mutex_unlock(&prefetcher->lock);
+    return NULL;
+}
+
+/* Stop and free the prefetcher. Call with the GIL released, as it waits
+   for the current read to finish. */
+static void
+walk_prefetcher_free(WalkPrefetcher *prefetcher)
+{
+    pthread_mutex_lock(&prefetcher->lock);
+    prefetcher->stop = 1;
+    pthread_cond_signal(&prefetcher->cond);
+    pthread_mutex_unlock(&prefetcher->lock);
+    pthread_join(prefetcher->thread, NULL);
+
+    while (prefetcher->count)
+        free(prefetcher->paths[--prefetcher->count]);
+    free(prefetcher->paths);
+    pthread_mutex_destroy(&prefetcher->lock);
+    pthread_cond_destroy(&prefetcher->cond);
+    free(prefetcher);
+}
+
+/* Start the prefetch thread. Return NULL if it couldn't be started. */
+static WalkPrefetcher *
+walk_prefetcher_new(Py_ssize_t size)
+{
+    WalkPrefetcher *prefetcher = calloc(1, sizeof(WalkPrefetcher));
+
+    if (!prefetcher)
+        return NULL;
+    prefetcher->paths = malloc(size * sizeof(char *));
+    if (!prefetcher->paths) {
+        free(prefetcher);
+        return NULL;
+    }
+    prefetcher->size = size;
+    pthread_mutex_init(&prefetcher->lock, NULL);
+    pthread_cond_init(&prefetcher->cond, NULL);
+    if (pthread_create(&prefetcher->thread, NULL, walk_prefetch_worker, prefetcher) != 0) {
+        pthread_mutex_destroy(&prefetcher->lock);
+        pthread_cond_destroy(&prefetcher->cond);
+        free(prefetcher->paths);
+        free(prefetcher);
+        return NULL;
+    }
+    return prefetcher;
+}
+
+/* Queue paths[0:count] to be prefetched, taking ownership of them, so
+   that paths[0] is read first */
+static void
+walk_prefetch_paths(WalkIterator *it, char **paths, Py_ssize_t count)
+{
+    WalkPrefetcher *prefetcher = it->prefetcher;
+    Py_ssize_t i;
+
+    if (!prefetcher) {
+        /* Deep enough for a batch from each of a few levels */
+        prefetcher = it->prefetcher = walk_prefetcher_new(it->prefetch * 4);
+        if (!prefetcher) {
+            /* It's only a hint, so carry on without */
+            it->prefetch = 0;
+            for (i = 0; i < count; i++)
+                free(paths[i]);
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&prefetcher->lock);
+    for (i = count - 1; i >= 0; i--) {
+        if (prefetcher->count == prefetcher->size) {
+            free(prefetcher->paths[0]);
+            memmove(prefetcher->paths, prefetcher->paths + 1,
+                    (prefetcher->size - 1) * sizeof(char *));
+            prefetcher->count--;
+        }
+        prefetcher->paths[prefetcher->count++] = paths[i];
+    }
+    pthread_cond_signal(&prefetcher->cond);
+    pthread_mutex_unlock(&prefetcher->lock);
+}
+
+/* Queue frame's subdirectories from number next up to it->prefetch of
+   them (less any already queued) for prefetching. Return -1 with a
+   Python exception set on error. */
+static int
+walk_prefetch(WalkIterator *it, WalkFrame *frame, Py_ssize_t next)
+{
+    char **paths;
+    char *name;
+    Py_ssize_t count = 0, end = next + it->prefetch, name_len;
+    PyObject *name_bytes;
+
+    if (!it->prefetch || frame->prefetched >= end)
+        return 0;
+    /* Its subdirectories won't be walked */
+    if (it->max_depth >= 0 && frame - it->stack >= it->max_depth)
+        return 0;
+    paths = malloc(it->prefetch * sizeof(char *));
+    if (!paths) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    while (frame->prefetched < end) {
+        name_bytes = NULL;
+        if (it->topdown) {
+            if (frame->prefetched >= PyList_GET_SIZE(frame->dirs))
+                break;
+            name_bytes = encode_fs_name(PyList_GET_ITEM(frame->dirs, frame->prefetched));
+            if (!name_bytes)
+                break;
+            name = PyBytes_AS_STRING(name_bytes);
+            name_len = PyBytes_GET_SIZE(name_bytes);
+        }
+        else {
+            if (frame->prefetch_pos >= frame->walk_into_len)
+                break;
+            name = frame->walk_into + frame->prefetch_pos;
+            name_len = strlen(name);
+            frame->prefetch_pos += name_len + 1;
+        }
+        if (frame->prefetched++ >= next) {
+            paths[count] = join_path_raw(frame->path, name, name_len);
+            if (!paths[count]) {
+                Py_XDECREF(name_bytes);
+                PyErr_NoMemory();
+                break;
+            }
+            count++;
+        }
+        Py_XDECREF(name_bytes);
+    }
+
+    walk_prefetch_paths(it, paths, count);
+    free(paths);
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+static void
+walk_frame_clear(WalkFrame *frame)
+{
+    Py_CLEAR(frame->top);
+    Py_CLEAR(frame->dirs);
+    Py_CLEAR(frame->nondirs);
+    if (frame->reader.dirp) {
+        SCANDIR_BEGIN_ALLOW_THREADS
+        dir_reader_close(&frame->reader);
+        SCANDIR_END_ALLOW_THREADS
+    }
+    free(frame->path);
+    frame->path = NULL;
+    free(frame->walk_into);
+    frame->walk_into = NULL;
+}
+
+/* Append a subdirectory name to frame->walk_into. Return -1 with
+   errno set on error. */
+static int
+walk_frame_add_walk_into(WalkFrame *frame, const char *name, Py_ssize_t name_len)
+{
+    Py_ssize_t needed = frame->walk_into_len + name_len + 1;
+    char *buffer;
+
+    if (needed > frame->walk_into_size) {
+        Py_ssize_t new_size = frame->walk_into_size ? frame->walk_into_size * 2 : 256;
+        while (new_size < needed)
+            new_size *= 2;
+        buffer = realloc(frame->walk_into, new_size);
+        if (!buffer) {
+            errno = ENOMEM;
+            return -1;
+        }
+        frame->walk_into = buffer;
+        frame->walk_into_size = new_size;
+    }
+    memcpy(frame->walk_into + frame->walk_into_len, name, name_len);
+    frame->walk_into[frame->walk_into_len + name_len] = '\0';
+    frame->walk_into_len = needed;
+    return 0;
+}
+
+/* Call the onerror function (if any) with an OSError for the given
+   errno value and filename. Return 0 on success, -1 if onerror raised. */
+static int
+walk_onerror(PyObject *onerror, int error, PyObject *filename)
+{
+    PyObject *exc_type, *exc_value, *exc_tb, *result;
+
+    if (!onerror || onerror == Py_None)
+        return 0;
+
+    errno = error;
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, filename);
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    PyErr_NormalizeException(&exc_type, &exc_value, &exc_tb);
+    result = PyObject_CallFunctionObjArgs(onerror, exc_value, NULL);
+    Py_XDECREF(exc_type);
+    Py_XDECREF(exc_value);
+    Py_XDECREF(exc_tb);
+    if (!result)
+        return -1;
+    Py_DECREF(result);
+    return 0;
+}
+
+/* Read the directory open in frame->reader into frame->dirs and nondirs
+   (and walk_into when going bottom-up). Return 0 on success, -1 with
+   errno set on an OS error, or -2 with a Python exception set. */
+static int
+walk_scan(WalkIterator *it, WalkFrame *frame)
+{
+    DirRecord record;
+    PyObject *name;
+    int result, is_dir, is_symlink;
+
+    while (1) {
+        if (!dir_reader_next(&frame->reader, &record)) {
+            SCANDIR_BEGIN_ALLOW_THREADS
+            result = dir_reader_fill(&frame->reader);
+            SCANDIR_END_ALLOW_THREADS
+            if (result <= 0)
+                break;
+            continue;
+        }
+
+        if (RECORD_NEEDS_STAT(&record)) {
+            SCANDIR_BEGIN_ALLOW_THREADS
+            dir_record_type(&frame->reader, frame->path, &record, &is_dir, &is_symlink);
+            SCANDIR_END_ALLOW_THREADS
+        }
+        else
+            dir_record_type(&frame->reader, frame->path, &record, &is_dir, &is_symlink);
+
+        /* Another hard link to a file that's already been listed */
+        if (!is_dir && it->dedupe_files &&
+                !inode_set_add(&it->seen_files, frame->dev, record.d_ino))
+            continue;
+
+        name = decode_fs_name(it->return_bytes, record.name, record.name_len);
+        if (!name)
+            goto error;
+        result = PyList_Append(is_dir ? frame->dirs : frame->nondirs, name);
+        Py_DECREF(name);
+        if (result < 0)
+            goto error;
+
+        if (!it->topdown && is_dir && (it->followlinks || !is_symlink) &&
+                (it->max_depth < 0 || it->depth < it->max_depth)) {
+            if (walk_frame_add_walk_into(frame, record.name, record.name_len) < 0) {
+                PyErr_NoMemory();
+                goto error;
+            }
+        }
+    }
+
+    dir_reader_release_buffer(&frame->reader);
+    return result < 0 ? -1 : 0;
+
+error:
+    return -2;
+}
+
+/* Open and scan the directory at path and push a frame for it. If
+   name is not NULL, it's the subdirectory's name relative to the frame
+   at the top of the stack. Steals the reference to top and ownership
+   of path. Return 1 if a frame was pushed, 0 if the directory couldn't
+   be read (and the error was passed to onerror), or -1 with a Python
+   exception set. */
+static int
+walk_push(WalkIterator *it, PyObject *top, char *path,
+          const char *name, Py_ssize_t name_len)
+{
+    WalkFrame *frame, *parent;
+    int result;
+
+    if (it->depth == it->stack_size) {
+        Py_ssize_t new_size = it->stack_size ? it->stack_size * 2 : 16;
+        WalkFrame *stack = PyMem_Resize(it->stack, WalkFrame, new_size);
+        if (!stack) {
+            Py_DECREF(top);
+            free(path);
+            PyErr_NoMemory();
+            return -1;
+        }
+        it->stack = stack;
+        it->stack_size = new_size;
+    }
+
+    frame = &it->stack[it->depth];
+    memset(frame, 0, sizeof(WalkFrame));
+    frame->top = top;
+    frame->path = path;
+    frame->dirs = PyList_New(0);
+    frame->nondirs = PyList_New(0);
+    if (!frame->dirs || !frame->nondirs) {
+        walk_frame_clear(frame);
+        return -1;
+    }
+
+    parent = name ? &it->stack[it->depth - 1] : NULL;
+    SCANDIR_BEGIN_ALLOW_THREADS
+    if (parent)
+        result = dir_reader_open_at(&frame->reader, &parent->reader, parent->path,
+                                    name, name_len, DIR_READER_DEFAULT_BUFFER_SIZE);
+    else
+        result = dir_reader_open(&frame->reader, path, DIR_READER_DEFAULT_BUFFER_SIZE);
+    SCANDIR_END_ALLOW_THREADS
+
+    if (result == 0 && (it->dedupe_dirs || it->dedupe_files)) {
+        struct stat st;
+
+        STATS_ADD(stat, 1);
+        SCANDIR_BEGIN_ALLOW_THREADS
+        result = fstat(dirfd(frame->reader.dirp), &st);
+        SCANDIR_END_ALLOW_THREADS
+        if (result == 0) {
+            frame->dev = st.st_dev;
+            if (it->dedupe_dirs && !inode_set_add(&it->seen_dirs, st.st_dev, st.st_ino)) {
+                /* Already walked, say through a symlink or bind mount */
+                walk_frame_clear(frame);
+                return 0;
+            }
+        }
+    }
+    if (result == 0)
+        result = walk_scan(it, frame);
+    if (result == -1) {
+        result = walk_onerror(it->onerror, errno, top);
+        walk_frame_clear(frame);
+        return result;
+    }
+    if (result == -2) {
+        walk_frame_clear(frame);
+        return -1;
+    }
+
+    it->depth++;
+    /* The frame that's just gone over the budget has been read, and only
+       needs its path from now on */
+    if (it->depth > DIR_READER_OPEN_PARENTS) {
+        frame = &it->stack[it->depth - 1 - DIR_READER_OPEN_PARENTS];
+        if (frame->reader.dirp) {
+            SCANDIR_BEGIN_ALLOW_THREADS
+            dir_reader_close(&frame->reader);
+            SCANDIR_END_ALLOW_THREADS
+        }
+    }
+    return 1;
+}
+
+static PyObject *
+walk_frame_result(WalkFrame *frame)
+{
+    return PyTuple_Pack(3, frame->top, frame->dirs, frame->nondirs);
+}
+
+static void
+walk_pop(WalkIterator *it)
+{
+    it->depth--;
+    walk_frame_clear(&it->stack[it->depth]);
+}
+
+/* Prepare to descend into a subdirectory: set *top and *path to the new
+   references for name in the directory of the frame at the top of the
+   stack. Return -1 with a Python exception set on error. */
+static int
+walk_child(WalkIterator *it, const char *name, Py_ssize_t name_len,
+           PyObject **top, char **path)
+{
+    WalkFrame *frame = &it->stack[it->depth - 1];
+
+    *path = join_path_raw(frame->path, name, name_len);
+    if (!*path) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    *top = decode_fs_name(it->return_bytes, *path, strlen(*path));
+    if (!*top) {
+        free(*path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Return 1 if the subdirectory name of frame is a symlink the walk
+   shouldn't follow, else 0 */
+static int
+walk_skip_symlink(WalkIterator *it, WalkFrame *frame, const char *name,
+                  Py_ssize_t name_len)
+{
+    struct stat st;
+    int is_symlink;
+
+    if (it->followlinks)
+        return 0;
+    /* Like _walk(), use lstat rather than a cached is_symlink() as the
+       caller may have replaced the entry since we yielded (see Python
+       issue #23605) */
+    SCANDIR_BEGIN_ALLOW_THREADS
+    is_symlink = stat_at(&frame->reader, frame->path, name, name_len, &st, 0) == 0 &&
+                 S_ISLNK(st.st_mode);
+    SCANDIR_END_ALLOW_THREADS
+    return is_symlink;
+}
+
+/* Queue the subdirectories of the directory yielded last (now that the
+   caller has had the chance to prune them) and pop its frame. Return -1
+   with a Python exception set on error. */
+static int
+walk_bfs_queue_children(WalkIterator *it)
+{
+    WalkFrame *frame = &it->stack[0];
+    PyObject *name_bytes;
+    Py_ssize_t i;
+    char *path;
+    int result = 0;
+
+    if (it->max_depth >= 0 && it->level >= it->max_depth) {
+        walk_pop(it);
+        return 0;
+    }
+    for (i = 0; i < PyList_GET_SIZE(frame->dirs) && result == 0; i++) {
+        name_bytes = encode_fs_name(PyList_GET_ITEM(frame->dirs, i));
+        if (!name_bytes) {
+            result = -1;
+            break;
+        }
+        if (!walk_skip_symlink(it, frame, PyBytes_AS_STRING(name_bytes),
+                               PyBytes_GET_SIZE(name_bytes))) {
+            path = join_path_raw(frame->path, PyBytes_AS_STRING(name_bytes),
+                                 PyBytes_GET_SIZE(name_bytes));
+            if (!path || walk_frontier_push(&it->frontier, it->level + 1, path) < 0) {
+                if (!path)
+                    errno = ENOMEM;
+                PyErr_SetFromErrno(PyExc_OSError);
+                result = -1;
+            }
+            free(path);
+        }
+        Py_DECREF(name_bytes);
+    }
+    walk_pop(it);
+    return result;
+}
+
+static PyObject *
+walk_bfs_next(WalkIterator *it)
+{
+    PyObject *top;
+    char *path;
+    int level, popped, pushed;
+
+    if (!it->started) {
+        it->started = 1;
+        top = encode_fs_name(it->top);
+        if (!top)
+            return NULL;
+        if (walk_frontier_push(&it->frontier, 0, PyBytes_AS_STRING(top)) < 0) {
+            Py_DECREF(top);
+            return PyErr_SetFromErrno(PyExc_OSError);
+        }
+        Py_DECREF(top);
+    }
+    else if (it->depth > 0 && walk_bfs_queue_children(it) < 0)
+        return NULL;
+
+    while (1) {
+        popped = walk_frontier_pop(&it->frontier, &level, &path);
+        if (popped < 0)
+            return PyErr_SetFromErrno(PyExc_OSError);
+        if (!popped)
+            break;
+        path = strdup(path);
+        if (!path)
+            return PyErr_NoMemory();
+        top = decode_fs_name(it->return_bytes, path, strlen(path));
+        if (!top) {
+            free(path);
+            return NULL;
+        }
+        /* The top keeps the caller's spelling, like the other orders */
+        if (level == 0) {
+            Py_DECREF(top);
+            Py_INCREF(it->top);
+            top = it->top;
+        }
+        pushed = walk_push(it, top, path, NULL, 0);
+        if (pushed < 0)
+            return NULL;
+        if (pushed) {
+            it->level = level;
+            return walk_frame_result(&it->stack[0]);
+        }
+    }
+
+    PyErr_SetNone(PyExc_StopIteration);
+    return NULL;
+}
+
+static PyObject *
+WalkIterator_iternext(WalkIterator *it)
+{
+    WalkFrame *frame;
+    PyObject *top, *name, *name_bytes, *result;
+    char *path, *child_name;
+    Py_ssize_t name_len;
+    int pushed;
+
+    if (it->order == WALK_ORDER_BFS)
+        return walk_bfs_next(it);
+
+    if (!it->started) {
+        it->started = 1;
+        name_bytes = encode_fs_name(it->top);
+        if (!name_bytes)
+            return NULL;
+        path = strdup(PyBytes_AS_STRING(name_bytes));
+        Py_DECREF(name_bytes);
+        if (!path)
+            return PyErr_NoMemory();
+        Py_INCREF(it->top);
+        pushed = walk_push(it, it->top, path, NULL, 0);
+        if (pushed < 0)
+            return NULL;
+        if (pushed && it->topdown) {
+            /* Read ahead while the caller processes the top */
+            if (walk_prefetch(it, &it->stack[it->depth - 1], 0) < 0)
+                return NULL;
+            return walk_frame_result(&it->stack[it->depth - 1]);
+        }
+    }
+
+    while (it->depth > 0) {
+        frame = &it->stack[it->depth - 1];
+
+        if (it->topdown) {
+            /* Caller may have modified dirs in-place since we yielded */
+            if (frame->index >= PyList_GET_SIZE(frame->dirs) ||
+                    (it->max_depth >= 0 && it->depth > it->max_depth)) {
+                walk_pop(it);
+                continue;
+            }
+            name = PyList_GET_ITEM(frame->dirs, frame->index);
+            frame->index++;
+            if (walk_prefetch(it, frame, frame->index) < 0)
+                return NULL;
+
+            name_bytes = encode_fs_name(name);
+            if (!name_bytes)
+                return NULL;
+            child_name = PyBytes_AS_STRING(name_bytes);
+            name_len = PyBytes_GET_SIZE(name_bytes);
+
+            if (walk_skip_symlink(it, frame, child_name, name_len)) {
+                Py_DECREF(name_bytes);
+                continue;
+            }
+
+            if (walk_child(it, child_name, name_len, &top, &path) < 0) {
+                Py_DECREF(name_bytes);
+                return NULL;
+            }
+            pushed = walk_push(it, top, path, child_name, name_len);
+            Py_DECREF(name_bytes);
+            if (pushed < 0)
+                return NULL;
+            if (pushed) {
+                if (walk_prefetch(it, &it->stack[it->depth - 1], 0) < 0)
+                    return NULL;
+                return walk_frame_result(&it->stack[it->depth - 1]);
+            }
+        }
+        else {
+            if (frame->index >= frame->walk_into_len) {
+                /* All subdirectories done, yield after recursion */
+                result = walk_frame_result(frame);
+                walk_pop(it);
+                return result;
+            }
+            child_name = frame->walk_into + frame->index;
+            name_len = strlen(child_name);
+            frame->index += name_len + 1;
+            frame->walked++;
+            if (walk_prefetch(it, frame, frame->walked) < 0)
+                return NULL;
+
+            if (walk_child(it, child_name, name_len, &top, &path) < 0)
+                return NULL;
+            if (walk_push(it, top, path, child_name, name_len) < 0)
+                return NULL;
+        }
+    }
+
+    PyErr_SetNone(PyExc_StopIteration);
+    return NULL;
+}
+
+static void
+WalkIterator_dealloc(WalkIterator *it)
+{
+    while (it->depth > 0)
+        walk_pop(it);
+    PyMem_Free(it->stack);
+    if (it->prefetcher) {
+        SCANDIR_BEGIN_ALLOW_THREADS
+        walk_prefetcher_free(it->prefetcher);
+        SCANDIR_END_ALLOW_THREADS
+    }
+    walk_frontier_free(&it->frontier);
+    inode_set_free(&it->seen_dirs);
+    inode_set_free(&it->seen_files);
+    Py_XDECREF(it->top);
+    Py_XDECREF(it->onerror);
+    Py_TYPE(it)->tp_free((PyObject *)it);
+}
+
+static PyMemberDef WalkIterator_members[] = {
+    {"frontier_spilled", T_PYSSIZET, offsetof(WalkIterator, frontier.spilled), READONLY,
+     "order='bfs': bytes of the frontier written to the temporary file"},
+    {NULL}
+};
+
+static PyTypeObject WalkIteratorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    MODNAME ".WalkIterator",                /* tp_name */
+    sizeof(WalkIterator),                   /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    /* methods */
+    (destructor)WalkIterator_dealloc,       /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    0,                                      /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    PyObject_SelfIter,                      /* tp_iter */
+    (iternextfunc)WalkIterator_iternext,    /* tp_iternext */
+    0,                                      /* tp_methods */
+    WalkIterator_members,                   /* tp_members */
+};
+
+static PyObject *
+scandir_walk(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    WalkIterator *it;
+    static char *keywords[] = {"top", "topdown", "onerror", "followlinks", "prefetch",
+                               "order", "max_depth", "frontier_memory",
+                               "dedupe_dirs", "dedupe_files", NULL};
+    PyObject *top;
+    PyObject *onerror = Py_None;
+    PyObject *order_obj = Py_None;
+    PyObject *max_depth_obj = Py_None;
+    int topdown = 1;
+    int followlinks = 0;
+    int prefetch = 0;
+    int order = WALK_ORDER_DFS;
+    Py_ssize_t max_depth = -1;
+    Py_ssize_t frontier_memory = WALK_FRONTIER_MEMORY;
+    int dedupe_dirs = 0;
+    int dedupe_files = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iOiiOOnii:walk", keywords,
+                                     &top, &topdown, &onerror, &followlinks,
+                                     &prefetch, &order_obj, &max_depth_obj,
+                                     &frontier_memory, &dedupe_dirs, &dedupe_files))
+        return NULL;
+    if (prefetch < 0) {
+        PyErr_SetString(PyExc_ValueError, "walk: prefetch must not be negative");
+        return NULL;
+    }
+    if (order_obj != Py_None && !str_equals(order_obj, "dfs")) {
+        if (!str_equals(order_obj, "bfs")) {
+            PyErr_SetString(PyExc_ValueError, "walk: order must be 'dfs' or 'bfs'");
+            return NULL;
+        }
+        if (!topdown || prefetch) {
+            PyErr_SetString(PyExc_ValueError,
+                            "walk: order='bfs' is always top-down, without prefetch");
+            return NULL;
+        }
+        order = WALK_ORDER_BFS;
+    }
+    if (max_depth_obj != Py_None) {
+        max_depth = PyNumber_AsSsize_t(max_depth_obj, PyExc_OverflowError);
+        if (max_depth == -1 && PyErr_Occurred())
+            return NULL;
+        if (max_depth < 0) {
+            PyErr_SetString(PyExc_ValueError, "walk: max_depth must not be negative");
+            return NULL;
+        }
+    }
+    if (frontier_memory < 0) {
+        PyErr_SetString(PyExc_ValueError, "walk: frontier_memory must not be negative");
+        return NULL;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    if (!PyUnicode_Check(top) && !PyBytes_Check(top)) {
+#else
+    if (!PyUnicode_Check(top) && !PyString_Check(top)) {
+#endif
+        PyErr_SetString(PyExc_TypeError, "walk: top must be str or bytes");
+        return NULL;
+    }
+
+    it = PyObject_New(WalkIterator, &WalkIteratorType);
+    if (!it)
+        return NULL;
+    Py_INCREF(top);
+    it->top = top;
+    Py_INCREF(onerror);
+    it->onerror = onerror;
+    it->topdown = topdown;
+    it->followlinks = followlinks;
+    it->return_bytes = PyBytes_Check(top);
+    it->started = 0;
+    it->prefetch = prefetch;
+    it->prefetcher = NULL;
+    it->stack = NULL;
+    it->depth = 0;
+    it->stack_size = 0;
+    it->order = order;
+    it->max_depth = max_depth;
+    memset(&it->frontier, 0, sizeof(WalkFrontier));
+    it->frontier.fd = -1;
+    it->frontier.memory = frontier_memory;
+    it->level = 0;
+    it->dedupe_dirs = dedupe_dirs;
+    it->dedupe_files = dedupe_files;
+    inode_set_init(&it->seen_dirs);
+    inode_set_init(&it->seen_files);
+    return (PyObject *)it;
+}
+
+#endif /* !MS_WINDOWS */
+
+
+/* SECTION: Parallel walk engine (POSIX only)
+
+A Pwalk engine runs a pool of native threads that read directories
+without holding the GIL. Each worker takes directories from its own
+deque (newest first), and when that's empty steals from the other end
+of another worker's deque (oldest first, as those tend to be the
+biggest subtrees). Results are passed back to Python through a bounded
+queue, so the workers can't race arbitrarily far ahead of the caller.
+
+Directories are yielded in no particular order, and as a directory's
+subdirectories are queued before it's yielded, modifying dirnames has
+no effect on the walk.
+
+In du mode (see du() below) the workers also stat every entry and sum
+up sizes into each result, keeping only the names of the directories
+to walk into. Each directory gets an id, and its parent's id, so the
+totals can be rolled up the tree afterwards.
+
+In scan mode (for async_scandir() below) only the top directory is
+read, and its entries are passed back in batches of
+PWALK_SCAN_BATCH_SIZE with their d_type and inode, and optionally an
+lstat() result. If the engine has a notify fd, a worker writes to it
+whenever it queues a result or the walk finishes, so an event loop can
+wait for results without blocking a thread.
+*/
+
+#ifndef MS_WINDOWS
+
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__linux__)
+#include <stdint.h>
+#include <sys/eventfd.h>
+#define HAVE_EVENTFD 1
+#endif
+
+#define PWALK_DEFAULT_QUEUE_SIZE 64
+#define PWALK_MIN_WORKERS 4
+#define PWALK_SCAN_BATCH_SIZE 512
+
+/* Flags stored before each name in a PwalkResult (in scan mode it's the
+   d_type instead) */
+#define PWALK_ENTRY_DIR 1
+#define PWALK_ENTRY_WALK_INTO 2
+
+/* Scan mode flags */
+#define PWALK_SCAN 1
+#define PWALK_SCAN_STAT 2
+
+typedef struct {
+    char *path;
+    Py_ssize_t id;
+    Py_ssize_t parent;          /* id of the parent directory, or -1 */
+    unsigned long long size;    /* du mode: the directory's own size */
+} PwalkJob;
+
+/* Settings and shared state for du mode */
+typedef struct {
+    int apparent;               /* sum st_size rather than st_blocks * 512 */
+    int one_filesystem;
+    dev_t root_dev;
+    InodeSet seen;              /* hard links, or everything if following */
+} PwalkDu;
+
+typedef struct {
+    pthread_mutex_t lock;
+    PwalkJob *jobs;
+    Py_ssize_t head;            /* oldest job, where thieves take from */
+    Py_ssize_t count;
+    Py_ssize_t size;            /* always a power of 2 */
+} PwalkDeque;
+
+typedef struct PwalkResult {
+    struct PwalkResult *next;
+    char *path;
+    Py_ssize_t id;
+    Py_ssize_t parent;
+    int error;                  /* errno if the directory couldn't be read */
+    /* du mode: size of the directory and its files, and the sizes of the
+       subdirectories to walk into, in the order they appear in names */
+    unsigned long long du_bytes;
+    Py_ssize_t du_files;
+    unsigned long long *child_sizes;
+    Py_ssize_t num_child_sizes;
+    /* Scan mode: each entry's inode, and if PWALK_SCAN_STAT its lstat()
+       result (st_mode 0 if that failed) */
+    ino_t *inodes;
+    struct stat *stats;
+    /* Entries packed as a flags byte, then the NUL-terminated name */
+    Py_ssize_t num_entries;
+    char *names;
+    Py_ssize_t names_len;
+    Py_ssize_t names_size;
+} PwalkResult;
+
+typedef struct Pwalk Pwalk;
+
+typedef struct {
+    Pwalk *engine;
+    int index;
+} PwalkWorker;
+
+struct Pwalk {
+    int num_workers;
+    int followlinks;
+    PwalkDu *du;                /* NULL unless in du mode */
+    int scan;                   /* PWALK_SCAN* flags, 0 unless in scan mode */
+    int notify_fd;              /* written to when there's a result, or -1 */
+    pthread_t *threads;
+    PwalkWorker *workers;
+    int threads_started;
+    PwalkDeque *deques;
+    pthread_mutex_t lock;       /* protects everything below */
+    pthread_cond_t work_cond;   /* new jobs queued, or walk finished */
+    pthread_cond_t result_cond; /* result queued, or walk finished */
+    pthread_cond_t space_cond;  /* result queue has space */
+    Py_ssize_t pending;         /* jobs queued or being processed */
+    Py_ssize_t next_id;
+    unsigned long work_seq;     /* incremented whenever jobs are queued */
+    int stop;
+    PwalkResult *results_head;
+    PwalkResult *results_tail;
+    Py_ssize_t num_results;
+    Py_ssize_t max_results;
+};
+
+static int
+pwalk_deque_push(PwalkDeque *deque, PwalkJob *job)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->size) {
+        Py_ssize_t i, new_size = deque->size ? deque->size * 2 : 64;
+        PwalkJob *jobs = malloc(new_size * sizeof(PwalkJob));
+        if (!jobs) {
+            pthread_mutex_unlock(&deque->lock);
+            return -1;
+        }
+        for (i = 0; i < deque->count; i++)
+            jobs[i] = deque->jobs[(deque->head + i) & (deque->size - 1)];
+        free(deque->jobs);
+        deque->jobs = jobs;
+        deque->head = 0;
+        deque->size = new_size;
+    }
+    deque->jobs[(deque->head + deque->count) & (deque->size - 1)] = *job;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+/* Take a job from the newest end (owner) or oldest end (thief) of
+   deque. Return 1 if *job was filled in, 0 if the deque was empty. */
+static int
+pwalk_deque_take(PwalkDeque *deque, PwalkJob *job, int steal)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        if (steal) {
+            *job = deque->jobs[deque->head];
+            deque->head = (deque->head + 1) & (deque->size - 1);
+        }
+        else
+            *job = deque->jobs[(deque->head + deque->count - 1) & (deque->size - 1)];
+        deque->count--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int
+pwalk_get_job(Pwalk *engine, int index, PwalkJob *job)
+{
+    int i;
+
+    if (pwalk_deque_take(&engine->deques[index], job, 0))
+        return 1;
+    for (i = 1; i < engine->num_workers; i++) {
+        if (pwalk_deque_take(&engine->deques[(index + i) % engine->num_workers], job, 1))
+            return 1;
+    }
+    return 0;
+}
+
+static void
+pwalk_result_free(PwalkResult *result)
+{
+    free(result->path);
+    free(result->names);
+    free(result->child_sizes);
+    free(result->inodes);
+    free(result->stats);
+    free(result);
+}
+
+/* Size of a file as counted by du() */
+static unsigned long long
+du_size(PwalkDu *du, struct stat *st)
+{
+    if (du->apparent)
+        return (unsigned long long)st->st_size;
+    return (unsigned long long)st->st_blocks * 512;
+}
+
+/* du mode: stat the entry in record and add it to result's totals, or
+   return PWALK_ENTRY_DIR | PWALK_ENTRY_WALK_INTO with *size set if it's
+   a directory to walk into. Entries that vanish are ignored. */
+static int
+pwalk_du_entry(Pwalk *engine, DirReader *reader, const char *dirpath,
+               DirRecord *record, PwalkResult *result, unsigned long long *size)
+{
+    PwalkDu *du = engine->du;
+    struct stat st;
+
+    if (stat_at(reader, dirpath, record->name, record->name_len, &st,
+                engine->followlinks) < 0) {
+        /* Count a broken symlink itself when following symlinks */
+        if (!engine->followlinks ||
+                stat_at(reader, dirpath, record->name, record->name_len, &st, 0) < 0)
+            return 0;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        if (du->one_filesystem && st.st_dev != du->root_dev)
+            return 0;
+        /* Following symlinks, a directory may be reached more than once
+           (or loop back on itself), so only walk into it the first time */
+        if (engine->followlinks && !inode_set_add(&du->seen, st.st_dev, st.st_ino))
+            return 0;
+        *size = du_size(du, &st);
+        return PWALK_ENTRY_DIR | PWALK_ENTRY_WALK_INTO;
+    }
+
+    /* Like "du -L", following symlinks counts every file only once */
+    if ((st.st_nlink > 1 || engine->followlinks) &&
+            !inode_set_add(&du->seen, st.st_dev, st.st_ino))
+        return 0;
+    result->du_bytes += du_size(du, &st);
+    result->du_files++;
+    return 0;
+}
+
+static int
+pwalk_result_add(PwalkResult *result, int flags, const char *name, Py_ssize_t name_len)
+{
+    Py_ssize_t needed = result->names_len + 1 + name_len + 1;
+
+    if (needed > result->names_size) {
+        Py_ssize_t new_size = result->names_size ? result->names_size * 2 : 1024;
+        char *names;
+        while (new_size < needed)
+            new_size *= 2;
+        names = realloc(result->names, new_size);
+        if (!names)
+            return -1;
+        result->names = names;
+        result->names_size = new_size;
+    }
+    result->names[result->names_len] = (char)flags;
+    memcpy(result->names + result->names_len + 1, name, name_len);
+    result->names[result->names_len + 1 + name_len] = '\0';
+    result->names_len = needed;
+    result->num_entries++;
+    return 0;
+}
+
+/* Wake up whoever is watching the engine's notify fd, if it has one */
+static void
+pwalk_notify(Pwalk *engine)
+{
+#ifdef HAVE_EVENTFD
+    uint64_t one = 1;
+#else
+    char one = 1;
+#endif
+
+    if (engine->notify_fd == -1)
+        return;
+    if (write(engine->notify_fd, &one, sizeof(one)) < 0) {
+        /* The pipe is full (or the eventfd counter maxed out), so the
+           reader is already due to wake up */
+    }
+}
+
+/* Queue result for the caller, waiting for space if the queue is full.
+   Called with engine->lock held. */
+static void
+pwalk_queue_result(Pwalk *engine, PwalkResult *result)
+{
+    while (!engine->stop && engine->num_results >= engine->max_results)
+        pthread_cond_wait(&engine->space_cond, &engine->lock);
+    if (engine->stop) {
+        pwalk_result_free(result);
+        return;
+    }
+    if (engine->results_tail)
+        engine->results_tail->next = result;
+    else
+        engine->results_head = result;
+    engine->results_tail = result;
+    engine->num_results++;
+    pthread_cond_signal(&engine->result_cond);
+    pwalk_notify(engine);
+}
+
+/* Scan mode: allocate the per-entry arrays for a batch. Return -1 if out
+   of memory. */
+static int
+pwalk_scan_alloc(Pwalk *engine, PwalkResult *result)
+{
+    result->inodes = malloc(PWALK_SCAN_BATCH_SIZE * sizeof(ino_t));
+    if (!result->inodes)
+        return -1;
+    if (engine->scan & PWALK_SCAN_STAT) {
+        result->stats = malloc(PWALK_SCAN_BATCH_SIZE * sizeof(struct stat));
+        if (!result->stats)
+            return -1;
+    }
+    return 0;
+}
+
+/* Scan mode: add record to *result, first queueing that and starting a
+   new batch if it's full. Return -1 if out of memory. */
+static int
+pwalk_scan_add(Pwalk *engine, DirReader *reader, PwalkResult **result,
+               DirRecord *record)
+{
+    PwalkResult *batch = *result, *full;
+    Py_ssize_t i;
+
+    if (batch->num_entries == PWALK_SCAN_BATCH_SIZE) {
+        full = batch;
+        batch = calloc(1, sizeof(PwalkResult));
+        if (!batch)
+            return -1;
+        batch->path = strdup(full->path);
+        if (!batch->path || pwalk_scan_alloc(engine, batch) < 0) {
+            pwalk_result_free(batch);
+            return -1;
+        }
+        pthread_mutex_lock(&engine->lock);
+        pwalk_queue_result(engine, full);
+        pthread_mutex_unlock(&engine->lock);
+        *result = batch;
+    }
+
+    i = batch->num_entries;
+    if (pwalk_result_add(batch, record->d_type, record->name, record->name_len) < 0)
+        return -1;
+    batch->inodes[i] = record->d_ino;
+    if (batch->stats &&
+            stat_at(reader, batch->path, record->name, record->name_len,
+                    &batch->stats[i], 0) < 0)
+        batch->stats[i].st_mode = 0;
+    return 0;
+}
+
+/* Read the directory for job into a new result. Return NULL if out of
+   memory. */
+static PwalkResult *
+pwalk_read_dir(Pwalk *engine, PwalkJob *job, Py_ssize_t *num_children)
+{
+    PwalkResult *result;
+    DirReader reader;
+    DirRecord record;
+    int is_dir, is_symlink, flags, status;
+
+    *num_children = 0;
+    result = calloc(1, sizeof(PwalkResult));
+    if (!result)
+        return NULL;
+    result->path = job->path;
+    result->id = job->id;
+    result->parent = job->parent;
+    result->du_bytes = job->size;
+    if (engine->scan && pwalk_scan_alloc(engine, result) < 0) {
+        result->error = ENOMEM;
+        return result;
+    }
+
+    dir_reader_init(&reader);
+    if (dir_reader_open(&reader, job->path, DIR_READER_DEFAULT_BUFFER_SIZE) < 0) {
+        result->error = errno;
+        return result;
+    }
+    while (1) {
+        if (!dir_reader_next(&reader, &record)) {
+            status = dir_reader_fill(&reader);
+            if (status < 0)
+                result->error = errno;
+            if (status <= 0)
+                break;
+            continue;
+        }
+        if (engine->scan) {
+            if (pwalk_scan_add(engine, &reader, &result, &record) < 0) {
+                result->error = ENOMEM;
+                break;
+            }
+            continue;
+        }
+        if (engine->du) {
+            unsigned long long size;
+
+            flags = pwalk_du_entry(engine, &reader, job->path, &record, result, &size);
+            if (!flags)
+                continue;
+            if (result->num_child_sizes % 64 == 0) {
+                unsigned long long *sizes = realloc(
+                    result->child_sizes,
+                    (result->num_child_sizes + 64) * sizeof(unsigned long long));
+                if (!sizes) {
+                    result->error = ENOMEM;
+                    break;
+                }
+                result->child_sizes = sizes;
+            }
+            result->child_sizes[result->num_child_sizes++] = size;
+            (*num_children)++;
+        }
+        else {
+            dir_record_type(&reader, job->path, &record, &is_dir, &is_symlink);
+            flags = 0;
+            if (is_dir) {
+                flags |= PWALK_ENTRY_DIR;
+                if (engine->followlinks || !is_symlink) {
+                    flags |= PWALK_ENTRY_WALK_INTO;
+                    (*num_children)++;
+                }
+            }
+        }
+        if (pwalk_result_add(result, flags, record.name, record.name_len) < 0) {
+            result->error = ENOMEM;
+            break;
+        }
+    }
+    dir_reader_close(&reader);
+    if (result->error)
+        *num_children = 0;
+    return result;
+}
+
+/* Queue jobs for the subdirectories to walk into from result, with ids
+   starting at first_id */
+static void
+pwalk_push_children(Pwalk *engine, int index, PwalkResult *result,
+                    Py_ssize_t first_id)
+{
+    Py_ssize_t pos, name_len, i = 0;
+    const char *name;
+    PwalkJob child;
+
+    for (pos = 0; pos < result->names_len; pos += name_len + 2) {
+        name = result->names + pos + 1;
+        name_len = strlen(name);
+        if (!(result->names[pos] & PWALK_ENTRY_WALK_INTO))
+            continue;
+        child.id = first_id + i;
+        child.parent = result->id;
+        child.size = i < result->num_child_sizes ? result->child_sizes[i] : 0;
+        i++;
+        child.path = join_path_raw(result->path, name, name_len);
+        if (!child.path || pwalk_deque_push(&engine->deques[index], &child) < 0) {
+            /* Out of memory: account for the job we couldn't queue */
+            free(child.path);
+            pthread_mutex_lock(&engine->lock);
+            engine->pending--;
+            pthread_mutex_unlock(&engine->lock);
+        }
+    }
+}
+
+static void
+pwalk_process(Pwalk *engine, int index, PwalkJob *job)
+{
+    PwalkResult *result;
+    Py_ssize_t num_children, first_id;
+
+    result = pwalk_read_dir(engine, job, &num_children);
+    if (!result)
+        free(job->path);
+
+    if (num_children > 0) {
+        /* Count the children as pending before anyone can steal them,
+           so pending can't drop to zero while there's still work */
+        pthread_mutex_lock(&engine->lock);
+        engine->pending += num_children;
+        first_id = engine->next_id;
+        engine->next_id += num_children;
+        pthread_mutex_unlock(&engine->lock);
+        pwalk_push_children(engine, index, result, first_id);
+    }
+
+    pthread_mutex_lock(&engine->lock);
+    if (num_children > 0) {
+        engine->work_seq++;
+        pthread_cond_broadcast(&engine->work_cond);
+    }
+    if (result)
+        pwalk_queue_result(engine, result);
+    engine->pending--;
+    if (engine->pending == 0) {
+        pthread_cond_broadcast(&engine->work_cond);
+        pthread_cond_broadcast(&engine->result_cond);
+        pwalk_notify(engine);
+    }
+    pthread_mutex_unlock(&engine->lock);
+}
+
+static void *
+pwalk_worker(void *arg)
+{
+    PwalkWorker *worker = (PwalkWorker *)arg;
+    Pwalk *engine = worker->engine;
+    PwalkJob job;
+    unsigned long seq;
+    int done;
+
+    while (1) {
+        pthread_mutex_lock(&engine->lock);
+        seq = engine->work_seq;
+        done = engine->stop || engine->pending == 0;
+        pthread_mutex_unlock(&engine->lock);
+        if (done)
+            break;
+
+        if (pwalk_get_job(engine, worker->index, &job)) {
+            pwalk_process(engine, worker->index, &job);
+            continue;
+        }
+
+        /* Nothing to do or steal: wait for more work to be queued */
+        pthread_mutex_lock(&engine->lock);
+        while (!engine->stop && engine->pending > 0 && engine->work_seq == seq)
+            pthread_cond_wait(&engine->work_cond, &engine->lock);
+        pthread_mutex_unlock(&engine->lock);
+    }
+    return NULL;
+}
+
+/* Stop the workers (if still running) and free the engine */
+static void
+pwalk_free(Pwalk *engine)
+{
+    PwalkResult *result;
+    PwalkJob job;
+    int i;
+
+    pthread_mutex_lock(&engine->lock);
+    engine->stop = 1;
+    pthread_cond_broadcast(&engine->work_cond);
+    pthread_cond_broadcast(&engine->space_cond);
+    pthread_mutex_unlock(&engine->lock);
+
+    for (i = 0; i < engine->threads_started; i++)
+        pthread_join(engine->threads[i], NULL);
+
+    while ((result = engine->results_head) != NULL) {
+        engine->results_head = result->next;
+        pwalk_result_free(result);
+    }
+    for (i = 0; i < engine->num_workers; i++) {
+        while (pwalk_deque_take(&engine->deques[i], &job, 0))
+            free(job.path);
+        free(engine->deques[i].jobs);
+        pthread_mutex_destroy(&engine->deques[i].lock);
+    }
+    pthread_mutex_destroy(&engine->lock);
+    pthread_cond_destroy(&engine->work_cond);
+    pthread_cond_destroy(&engine->result_cond);
+    pthread_cond_destroy(&engine->space_cond);
+    free(engine->deques);
+    free(engine->workers);
+    free(engine->threads);
+    free(engine);
+}
+
+/* Create an engine and start walking path (which the engine takes
+   ownership of). If du isn't NULL, run in du mode, with top_size the
+   size of path itself; if scan isn't 0, run in scan mode. notify_fd is
+   the fd to write to when there's a result, or -1. Return NULL with
+   errno set on error. */
+static Pwalk *
+pwalk_start(char *path, int num_workers, int followlinks, Py_ssize_t max_results,
+            PwalkDu *du, unsigned long long top_size, int scan, int notify_fd)
+{
+    Pwalk *engine;
+    PwalkJob job;
+    int i, error;
+
+    engine = calloc(1, sizeof(Pwalk));
+    if (!engine) {
+        free(path);
+        errno = ENOMEM;
+        return NULL;
+    }
+    engine->num_workers = num_workers;
+    engine->followlinks = followlinks;
+    engine->max_results = max_results;
+    engine->du = du;
+    engine->scan = scan;
+    engine->notify_fd = notify_fd;
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->work_cond, NULL);
+    pthread_cond_init(&engine->result_cond, NULL);
+    pthread_cond_init(&engine->space_cond, NULL);
+
+    engine->threads = calloc(num_workers, sizeof(pthread_t));
+    engine->workers = calloc(num_workers, sizeof(PwalkWorker));
+    engine->deques = calloc(num_workers, sizeof(PwalkDeque));
+    if (!engine->threads || !engine->workers || !engine->deques) {
+        engine->num_workers = 0;
+        pwalk_free(engine);
+        free(path);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (i = 0; i < num_workers; i++) {
+        pthread_mutex_init(&engine->deques[i].lock, NULL);
+        engine->workers[i].engine = engine;
+        engine->workers[i].index = i;
+    }
+
+    job.path = path;
+    job.id = 0;
+    job.parent = -1;
+    job.size = top_size;
+    if (pwalk_deque_push(&engine->deques[0], &job) < 0) {
+        free(path);
+        pwalk_free(engine);
+        errno = ENOMEM;
+        return NULL;
+    }
+    engine->pending = 1;
+    engine->next_id = 1;
+
+    for (i = 0; i < num_workers; i++) {
+        error = pthread_create(&engine->threads[i], NULL, pwalk_worker,
+                               &engine->workers[i]);
+        if (error) {
+            if (engine->threads_started > 0)
+                break;
+            pwalk_free(engine);
+            errno = error;
+            return NULL;
+        }
+        engine->threads_started++;
+    }
+    return engine;
+}
+
+/* Wait up to timeout_ms for the next result. Return NULL if there's no
+   result yet; *done is set if the walk has finished. */
+static PwalkResult *
+pwalk_next_result(Pwalk *engine, int timeout_ms, int *done)
+{
+    PwalkResult *result;
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)timeout_ms * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&engine->lock);
+    while (!engine->results_head && engine->pending > 0) {
+        if (pthread_cond_timedwait(&engine->result_cond, &engine->lock,
+                                   &deadline) == ETIMEDOUT)
+            break;
+    }
+    result = engine->results_head;
+    if (result) {
+        engine->results_head = result->next;
+        if (!engine->results_head)
+            engine->results_tail = NULL;
+        engine->num_results--;
+        pthread_cond_signal(&engine->space_cond);
+    }
+    *done = !result && engine->pending == 0;
+    pthread_mutex_unlock(&engine->lock);
+    return result;
+}
+
+PyDoc_STRVAR(parallel_walk__doc__,
+"parallel_walk(top, workers=0, onerror=None, followlinks=False, queue_size=64)\n\
+-> iterator of (dirpath, dirnames, filenames) tuples\n\n\
+Walk the tree at top using a pool of native threads (by default one per\n\
+CPU, and at least 4). Directories are yielded in no particular order,\n\
+and modifying dirnames doesn't prune the walk. queue_size is the\n\
+maximum number of directory results buffered ahead of the caller.");
+
+typedef struct {
+    PyObject_HEAD
+    Pwalk *engine;
+    PyObject *onerror;
+    int return_bytes;
+} ParallelWalkIterator;
+
+static PyObject *
+pwalk_result_tuple(PwalkResult *result, int return_bytes)
+{
+    PyObject *top, *dirs, *nondirs, *name, *tuple = NULL;
+    Py_ssize_t pos, name_len;
+    const char *name_str;
+    int flags;
+
+    top = decode_fs_name(return_bytes, result->path, strlen(result->path));
+    dirs = PyList_New(0);
+    nondirs = PyList_New(0);
+    if (!top || !dirs || !nondirs)
+        goto done;
+
+    for (pos = 0; pos < result->names_len; pos += name_len + 2) {
+        flags = result->names[pos];
+        name_str = result->names + pos + 1;
+        name_len = strlen(name_str);
+        name = decode_fs_name(return_bytes, name_str, name_len);
+        if (!name)
+            goto done;
+        if (PyList_Append(flags & PWALK_ENTRY_DIR ? dirs : nondirs, name) < 0) {
+            Py_DECREF(name);
+            goto done;
+        }
+        Py_DECREF(name);
+    }
+    tuple = PyTuple_Pack(3, top, dirs, nondirs);
+
+done:
+    Py_XDECREF(top);
+    Py_XDECREF(dirs);
+    Py_XDECREF(nondirs);
+    return tuple;
+}
+
+static PyObject *
+ParallelWalkIterator_iternext(ParallelWalkIterator *it)
+{
+    PwalkResult *result;
+    PyObject *tuple, *filename;
+    int done, status;
+
+    if (!it->engine) {
+        PyErr_SetNone(PyExc_StopIteration);
+        return NULL;
+    }
+
+    while (1) {
+        SCANDIR_BEGIN_ALLOW_THREADS
+        result = pwalk_next_result(it->engine, 100, &done);
+        SCANDIR_END_ALLOW_THREADS
+
+        if (result) {
+            if (!result->error) {
+                tuple = pwalk_result_tuple(result, it->return_bytes);
+                pwalk_result_free(result);
+                return tuple;
+            }
+            filename = decode_fs_name(it->return_bytes, result->path,
+                                      strlen(result->path));
+            if (!filename) {
+                pwalk_result_free(result);
+                return NULL;
+            }
+            status = walk_onerror(it->onerror, result->error, filename);
+            Py_DECREF(filename);
+            pwalk_result_free(result);
+            if (status < 0)
+                return NULL;
+            continue;
+        }
+
+        if (done)
+            break;
+        /* Let Ctrl-C interrupt a long wait */
+        if (PyErr_CheckSignals() < 0)
+            return NULL;
+    }
+
+    SCANDIR_BEGIN_ALLOW_THREADS
+    pwalk_free(it->engine);
+    SCANDIR_END_ALLOW_THREADS
+    it->engine = NULL;
+    PyErr_SetNone(PyExc_StopIteration);
+    return NULL;
+}
+
+static void
+ParallelWalkIterator_dealloc(ParallelWalkIterator *it)
+{
+    if (it->engine) {
+        SCANDIR_BEGIN_ALLOW_THREADS
+        pwalk_free(it->engine);
+        SCANDIR_END_ALLOW_THREADS
+    }
+    Py_XDECREF(it->onerror);
+    Py_TYPE(it)->tp_free((PyObject *)it);
+}
+
+static PyTypeObject ParallelWalkIteratorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    MODNAME ".ParallelWalkIterator",        /* tp_name */
+    sizeof(ParallelWalkIterator),           /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    /* methods */
+    (destructor)ParallelWalkIterator_dealloc, /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    0,                                      /* tp_compare */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    0,                                      /* tp_doc */
+    0,                                      /* tp_traverse */
+    0,                                      /* tp_clear */
+    0,                                      /* tp_richcompare */
+    0,                                      /* tp_weaklistoffset */
+    PyObject_SelfIter,                      /* tp_iter */
+    (iternextfunc)ParallelWalkIterator_iternext, /* tp_iternext */
+};
+
+static int
+default_num_workers(void)
+{
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return num_cpus < PWALK_MIN_WORKERS ? PWALK_MIN_WORKERS : (int)num_cpus;
+}
+
+static PyObject *
+scandir_parallel_walk(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    ParallelWalkIterator *it;
+    static char *keywords[] = {"top", "workers", "onerror", "followlinks",
+                               "queue_size", NULL};
+    PyObject *top, *top_bytes;
+    PyObject *onerror = Py_None;
+    int workers = 0;
+    int followlinks = 0;
+    Py_ssize_t queue_size = PWALK_DEFAULT_QUEUE_SIZE;
+    char *path;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iOin:parallel_walk", keywords,
+                                     &top, &workers, &onerror, &followlinks,
+                                     &queue_size))
+        return NULL;
+
+#if PY_MAJOR_VERSION >= 3
+    if (!PyUnicode_Check(top) && !PyBytes_Check(top)) {
+#else
+    if (!PyUnicode_Check(top) && !PyString_Check(top)) {
+#endif
+        PyErr_SetString(PyExc_TypeError, "parallel_walk: top must be str or bytes");
+        return NULL;
+    }
+    if (workers < 0 || queue_size < 1) {
+        PyErr_SetString(PyExc_ValueError,
+                        "parallel_walk: workers must be >= 0 and queue_size >= 1");
+        return NULL;
+    }
+    if (workers == 0)
+        workers = default_num_workers();
+
+    top_bytes = encode_fs_name(top);
+    if (!top_bytes)
+        return NULL;
+    path = strdup(PyBytes_AS_STRING(top_bytes));
+    Py_DECREF(top_bytes);
+    if (!path)
+        return PyErr_NoMemory();
+
+    it = PyObject_New(ParallelWalkIterator, &ParallelWalkIteratorType);
+    if (!it) {
+        free(path);
+        return NULL;
+    }
+    Py_INCREF(onerror);
+    it->onerror = onerror;
+    it->return_bytes = PyBytes_Check(top);
+
+    SCANDIR_BEGIN_ALLOW_THREADS
+    it->engine = pwalk_start(path, workers, followlinks, queue_size, NULL, 0, 0, -1);
+    SCANDIR_END_ALLOW_THREADS
+    if (!it->engine) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        Py_DECREF(it);
+        return NULL;
+    }
+    return (PyObject *)it;
+}
+
+#endif /* !MS_WINDOWS */
+
+
+/* SECTION: Bulk stat of directory entries (POSIX only)
+
+prefetch_stat() stats a batch of DirEntry objects in one go with the GIL
+released, filling in their cached stat results. On Linux the whole batch
+is submitted to an io_uring as IORING_OP_STATX requests; where that's not
+available (kernels before 5.6, or io_uring disabled by a seccomp policy)
+the stats are spread over a pool of native threads instead.
+*/
+
+#ifndef MS_WINDOWS
+
+#if defined(HAVE_STATX) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/mman.h>
+#if defined(IO_URING_OP_SUPPORTED) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#define STAT_RING_MAX_ENTRIES 256
+#define STAT_JOBS_PER_THREAD 16
+
+typedef struct {
+    DirEntry *entry;
+    PyObject *bytes;            /* keeps path alive */
+    const char *path;
+    int dir_fd;                 /* -1 if path is the full path */
+    int follow;
+    int error;                  /* errno, or 0 on success */
+#ifdef HAVE_STATX
+    struct statx stx;
+#else
+    STRUCT_STAT st;
+#endif
+} StatJob;
+
+static void
+stat_job_run(StatJob *job)
+{
+    int result;
+
+    if (job->follow)
+        STATS_ADD(stat, 1);
+    else
+        STATS_ADD(lstat, 1);
+#ifdef HAVE_STATX
+    result = statx(job->dir_fd != -1 ? job->dir_fd : AT_FDCWD, job->path,
+                   job->follow ? 0 : AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS,
+                   &job->stx);
+#else
+#ifdef HAVE_FSTATAT
+    if (job->dir_fd != -1)
+        result = fstatat(job->dir_fd, job->path, &job->st,
+                         job->follow ? 0 : AT_SYMLINK_NOFOLLOW);
+    else
+#endif
+    if (job->follow)
+        result = STAT(job->path, &job->st);
+    else
+        result = LSTAT(job->path, &job->st);
+#endif
+    job->error = result == 0 ? 0 : errno;
+}
+
+typedef struct {
+    pthread_mutex_t lock;
+    StatJob *jobs;
+    Py_ssize_t num_jobs;
+    Py_ssize_t next;
+} StatPool;
+
+static void *
+stat_pool_worker(void *arg)
+{
+    StatPool *pool = (StatPool *)arg;
+    Py_ssize_t start, end;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        start = pool->next;
+        end = start + STAT_JOBS_PER_THREAD;
+        if (end > pool->num_jobs)
+            end = pool->num_jobs;
+        pool->next = end;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (start >= end)
+            return NULL;
+        for (; start < end; start++)
+            stat_job_run(&pool->jobs[start]);
+    }
+}
+
+/* Run the jobs on up to default_num_workers() threads, including the
+   calling one */
+static void
+stat_jobs_run_threads(StatJob *jobs, Py_ssize_t num_jobs)
+{
+    StatPool pool;
+    pthread_t *threads;
+    Py_ssize_t num_threads;
+    Py_ssize_t started = 0;
+    Py_ssize_t i;
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pool.jobs = jobs;
+    pool.num_jobs = num_jobs;
+    pool.next = 0;
+
+    num_threads = (num_jobs + STAT_JOBS_PER_THREAD - 1) / STAT_JOBS_PER_THREAD;
+    if (num_threads > default_num_workers())
+        num_threads = default_num_workers();
+    threads = num_threads > 1 ? malloc((num_threads - 1) * sizeof(pthread_t)) : NULL;
+    if (threads) {
+        for (; started < num_threads - 1; started++) {
+            if (pthread_create(&threads[started], NULL, stat_pool_worker, &pool) != 0)
+                break;
+        }
+    }
+
+    stat_pool_worker(&pool);
+
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&pool.lock);
+}
+
+#ifdef HAVE_IO_URING
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} StatRing;
+
+/* Set once io_uring turns out to be unusable, so later calls go straight
+   to the thread pool */
+static int stat_ring_unsupported = 0;
+
+static void
+stat_ring_close(StatRing *ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+}
+
+static void *
+stat_ring_map(int fd, size_t size, off_t offset)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, offset);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/* Set up a ring with room for entries submissions, and check that the
+   kernel supports IORING_OP_STATX. Return 0 on success, -1 if io_uring
+   can't be used. */
+static int
+stat_ring_open(StatRing *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    struct io_uring_probe *probe;
+    int supported;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+    if (!probe)
+        goto error;
+    supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+                        probe, 256) == 0 &&
+                probe->last_op >= IORING_OP_STATX &&
+                (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!supported)
+        goto error;
+
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes +
+                         params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = stat_ring_map(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+    if (!ring->sq_ring)
+        goto error;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ring = ring->sq_ring;
+    else {
+        ring->cq_ring = stat_ring_map(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+        if (!ring->cq_ring)
+            goto error;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = stat_ring_map(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+    if (!ring->sqes)
+        goto error;
+
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    return 0;
+
+error:
+    stat_ring_close(ring);
+    return -1;
+}
+
+/* Record the results of any completed jobs, and return how many */
+static Py_ssize_t
+stat_ring_reap(StatRing *ring, StatJob *jobs)
+{
+    Py_ssize_t reaped = 0;
+    unsigned head = *ring->cq_head;
+    struct io_uring_cqe *cqe;
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        jobs[(Py_ssize_t)cqe->user_data].error = cqe->res < 0 ? -cqe->res : 0;
+        head++;
+        reaped++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+/* Submit the jobs a ring-full at a time, waiting for each lot to complete.
+   Return the number of jobs done, which is less than num_jobs only if
+   io_uring_enter() failed. Every job submitted has completed by the time
+   this returns, as the kernel would otherwise still be writing to them;
+   the rest are jobs[done:]. */
+static Py_ssize_t
+stat_ring_run(StatRing *ring, StatJob *jobs, Py_ssize_t num_jobs)
+{
+    Py_ssize_t start, count, i;
+    Py_ssize_t completed, reaped;
+    unsigned to_submit;
+    unsigned tail, index;
+    struct io_uring_sqe *sqe;
+    StatJob *job;
+    int result;
+    int failed = 0;
+
+    for (start = 0; start < num_jobs; start += count) {
+        count = num_jobs - start;
+        if (count > ring->entries)
+            count = ring->entries;
+
+        tail = *ring->sq_tail;
+        for (i = start; i < start + count; i++) {
+            job = &jobs[i];
+            index = tail & *ring->sq_mask;
+            sqe = &ring->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            if (job->follow)
+                STATS_ADD(stat, 1);
+            else
+                STATS_ADD(lstat, 1);
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = job->dir_fd != -1 ? job->dir_fd : AT_FDCWD;
+            sqe->addr = (unsigned long)job->path;
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = (unsigned long)&job->stx;
+            sqe->statx_flags = job->follow ? 0 : AT_SYMLINK_NOFOLLOW;
+            sqe->user_data = (unsigned long long)i;
+            ring->sq_array[index] = index;
+            tail++;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        /* The kernel takes submissions in order, so after a failure the
+           unsubmitted ones are the last to_submit */
+        to_submit = (unsigned)count;
+        completed = 0;
+        while (completed < count - (failed ? to_submit : 0)) {
+            result = (int)syscall(__NR_io_uring_enter, ring->fd,
+                                  failed ? 0 : to_submit, 1,
+                                  IORING_ENTER_GETEVENTS, NULL, 0);
+            if (result >= 0) {
+                if (!failed)
+                    to_submit -= result;
+            }
+            else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                failed = 1;
+
+            reaped = stat_ring_reap(ring, jobs);
+            /* Transient failures (short of memory, or the completion
+               queue is full), or waiting without io_uring_enter() for
+               what's already submitted */
+            if (result < 0 && !reaped)
+                sched_yield();
+            completed += reaped;
+        }
+        if (failed)
+            return start + count - to_submit;
+    }
+    return num_jobs;
+}
+#endif /* HAVE_IO_URING */
+
+static void
+stat_jobs_run(StatJob *jobs, Py_ssize_t num_jobs, int use_io_uring)
+{
+    Py_ssize_t done = 0;
+#ifdef HAVE_IO_URING
+    StatRing ring;
+
+    if (use_io_uring && num_jobs > 1 && !stat_ring_unsupported) {
+        if (stat_ring_open(&ring, num_jobs < STAT_RING_MAX_ENTRIES ?
+                                  (unsigned)num_jobs : STAT_RING_MAX_ENTRIES) == 0) {
+            done = stat_ring_run(&ring, jobs, num_jobs);
+            stat_ring_close(&ring);
+        }
+        else
+            stat_ring_unsupported = 1;
+    }
+#endif
+
+    if (done < num_jobs)
+        stat_jobs_run_threads(jobs + done, num_jobs - done);
+}
+
+PyDoc_STRVAR(prefetch_stat__doc__,
+"prefetch_stat(entries, follow_symlinks=True, use_io_uring=True) -> int\n\n\
+Stat a batch of DirEntry objects from scandir() at once, caching the\n\
+results so that entry.stat() doesn't need a system call. On Linux this\n\
+uses io_uring if use_io_uring is true and it's available, otherwise a\n\
+pool of threads. Entries that can't be stat'ed are skipped (entry.stat()\n\
+will raise the error). Returns the number of entries stat'ed.");
+
+static PyObject *
+scandir_prefetch_stat(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"entries", "follow_symlinks", "use_io_uring", NULL};
+    PyObject *entries;
+    PyObject *seq;
+    PyObject *item;
+    PyObject **slot;
+    int follow_symlinks = 1;
+    int use_io_uring = 1;
+    StatJob *jobs;
+    StatJob *job;
+    DirEntry *entry;
+    Py_ssize_t num_entries, num_jobs = 0, num_done = 0;
+    Py_ssize_t i;
+    mode_t mode;
+    int failed = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|ii:prefetch_stat", keywords,
+                                     &entries, &follow_symlinks, &use_io_uring))
+        return NULL;
+
+    seq = PySequence_Fast(entries, "entries must be a sequence of DirEntry objects");
+    if (!seq)
+        return NULL;
+    num_entries = PySequence_Fast_GET_SIZE(seq);
+    jobs = PyMem_Malloc((num_entries ? num_entries : 1) * sizeof(StatJob));
+    if (!jobs) {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+
+    for (i = 0; i < num_entries; i++) {
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        if (!PyObject_TypeCheck(item, &DirEntryType)) {
+            PyErr_Format(PyExc_TypeError,
+                         "prefetch_stat: expected DirEntry, not %.200s",
+                         Py_TYPE(item)->tp_name);
+            failed = 1;
+            break;
+        }
+        entry = (DirEntry *)item;
+        job = &jobs[num_jobs];
+
+        /* Only symlinks need following, for everything else stat() is
+           the same as lstat() */
+#ifdef HAVE_DIRENT_D_TYPE
+        job->follow = follow_symlinks && entry->d_type == DT_LNK;
+#else
+        job->follow = 0;
+#endif
+        if (job->follow ? entry->stat : entry->lstat)
+            continue;
+
+        job->bytes = DirEntry_stat_path(entry, &job->dir_fd);
+        if (!job->bytes) {
+            failed = 1;
+            break;
+        }
+        job->path = PyBytes_AS_STRING(job->bytes);
+        /* The list could be changed while the GIL is released */
+        Py_INCREF(entry);
+        job->entry = entry;
+        job->error = 0;
+        entry->shared->fd_users++;
+        num_jobs++;
+    }
+
+    if (!failed && num_jobs) {
+        SCANDIR_BEGIN_ALLOW_THREADS
+        stat_jobs_run(jobs, num_jobs, use_io_uring);
+        SCANDIR_END_ALLOW_THREADS
+    }
+
+    for (i = 0; i < num_jobs; i++) {
+        job = &jobs[i];
+        entry = job->entry;
+        if (!failed && !job->error) {
+            slot = job->follow ? &entry->stat : &entry->lstat;
+            if (!*slot) {
+#ifdef HAVE_STATX
+                *slot = StatInfo_from_statx(&job->stx);
+                mode = job->stx.stx_mode;
+#else
+                *slot = StatInfo_from_stat(&job->st);
+                mode = job->st.st_mode;
+#endif
+                if (!*slot)
+                    failed = 1;
+                else if (follow_symlinks && !job->follow && !S_ISLNK(mode) &&
+                         !entry->stat) {
+                    Py_INCREF(entry->lstat);
+                    entry->stat = entry->lstat;
+                }
+            }
+            num_done++;
+        }
+        Py_DECREF(job->bytes);
+        scandir_shared_release_fd(entry->shared);
+        Py_DECREF(entry);
+    }
+
+    PyMem_Free(jobs);
+    Py_DECREF(seq);
+    if (failed)
+        return NULL;
+    return PyLong_FromSsize_t(num_done);
+}
+
+#endif /* !MS_WINDOWS */
+
+
+/* SECTION: Columnar directory listing (POSIX only)
+
+scandir_bulk() reads a whole directory with the GIL released into a few
+growing C arrays, then hands them back as one bytes object and three
+arrays rather than as a DirEntry object per entry.
+*/
+
+#if !defined(MS_WINDOWS) && PY_MAJOR_VERSION >= 3
+
+typedef struct {
+    char *names;                /* NUL-terminated names, back to back */
+    Py_ssize_t names_len;
+    Py_ssize_t names_size;
+    unsigned long long *offsets;    /* count + 1 offsets into names */
+    unsigned long long *inodes;
+    unsigned char *types;
+    Py_ssize_t count;
+    Py_ssize_t size;
+} BulkListing;
+
+static void
+bulk_listing_free(BulkListing *listing)
+{
+    free(listing->names);
+    free(listing->offsets);
+    free(listing->inodes);
+    free(listing->types);
+}
+
+/* Grow *p, an array of size items of item_size bytes, to new_size items.
+   Return 0 on success, -1 if out of memory (leaving *p as it was). */
+static int
+bulk_listing_grow(void **p, Py_ssize_t new_size, size_t item_size)
+{
+    void *new_p = realloc(*p, new_size * item_size);
+    if (!new_p)
+        return -1;
+    *p = new_p;
+    return 0;
+}
+
+static int
+bulk_listing_add(BulkListing *listing, DirRecord *record)
+{
+    Py_ssize_t size;
+
+    if (listing->count + 1 >= listing->size) {
+        size = listing->size ? listing->size * 2 : 1024;
+        if (bulk_listing_grow((void **)&listing->offsets, size + 1,
+                              sizeof(unsigned long long)) < 0 ||
+            bulk_listing_grow((void **)&listing->inodes, size,
+                              sizeof(unsigned long long)) < 0 ||
+            bulk_listing_grow((void **)&listing->types, size, 1) < 0)
+            return -1;
+        listing->size = size;
+    }
+    if (listing->names_len + record->name_len + 1 > listing->names_size) {
+        size = listing->names_size ? listing->names_size * 2 : 16384;
+        while (listing->names_len + record->name_len + 1 > size)
+            size *= 2;
+        if (bulk_listing_grow((void **)&listing->names, size, 1) < 0)
+            return -1;
+        listing->names_size = size;
+    }
+
+    listing->offsets[listing->count] = listing->names_len;
+    memcpy(listing->names + listing->names_len, record->name, record->name_len);
+    listing->names_len += record->name_len;
+    listing->names[listing->names_len++] = '\0';
+    listing->inodes[listing->count] = record->d_ino;
+    listing->types[listing->count] = record->d_type;
+    listing->count++;
+    return 0;
+}
+
+/* Read the whole directory, return 0 on success or -1 with errno set */
+static int
+bulk_listing_read(BulkListing *listing, DirReader *reader)
+{
+    DirRecord record;
+    int result;
+
+    while ((result = dir_reader_fill(reader)) > 0) {
+        while (dir_reader_next(reader, &record)) {
+            if (bulk_listing_add(listing, &record) < 0) {
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+    }
+    if (result < 0)
+        return -1;
+
+    /* The final offset is the end of the last name, so there's always
+       room for it */
+    if (!listing->offsets &&
+        bulk_listing_grow((void **)&listing->offsets, 1,
+                          sizeof(unsigned long long)) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    listing->offsets[listing->count] = listing->names_len;
+    return 0;
+}
+
+/* Return a new array.array of the given typecode holding a copy of size
+   bytes at buffer */
+static PyObject *
+bulk_listing_array(PyObject *array_type, const char *typecode,
+                   void *buffer, Py_ssize_t size)
+{
+    PyObject *array;
+    PyObject *view;
+    PyObject *result;
+
+    array = PyObject_CallFunction(array_type, "s", typecode);
+    if (!array)
+        return NULL;
+    if (size == 0)
+        return array;
+
+    view = PyMemoryView_FromMemory((char *)buffer, size, PyBUF_READ);
+    if (!view) {
+        Py_DECREF(array);
+        return NULL;
+    }
+    result = PyObject_CallMethod(array, "frombytes", "O", view);
+    Py_DECREF(view);
+    if (!result) {
+        Py_DECREF(array);
+        return NULL;
+    }
+    Py_DECREF(result);
+    return array;
+}
+
+PyDoc_STRVAR(bulk_listing__doc__,
+"BulkListing: Result from scandir_bulk().\n\n\
+names is a bytes object of the NUL-terminated entry names back to back;\n\
+offsets is an array('Q') of count + 1 offsets into names, so entry i's\n\
+name is names[offsets[i]:offsets[i + 1] - 1]; inodes is an array('Q')\n\
+and types an array('B') of the entries' d_type values (DT_UNKNOWN, 0,\n\
+where the file system doesn't provide one).");
+
+static PyStructSequence_Field bulk_listing_fields[] = {
+    {"names",   "NUL-terminated names as bytes"},
+    {"offsets", "array('Q') of offsets of each name in names"},
+    {"inodes",  "array('Q') of inode numbers"},
+    {"types",   "array('B') of d_type values"},
+    {0}
+};
+
+static PyStructSequence_Desc bulk_listing_desc = {
+    "scandir.BulkListing", /* name */
+    bulk_listing__doc__, /* doc */
+    bulk_listing_fields,
+    4
+};
+
+static PyTypeObject BulkListingType;
+
+PyDoc_STRVAR(scandir_bulk__doc__,
+"scandir_bulk(path='.', buffer_size=32768) -> BulkListing\n\n\
+Read all entries of the directory at path (or an open directory file\n\
+descriptor) into columnar arrays of names, inode numbers and d_type\n\
+values, without creating an object per entry.");
+
+static PyObject *
+scandir_bulk(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"path", "buffer_size", NULL};
+    path_t path;
+    Py_ssize_t buffer_size = DIR_READER_DEFAULT_BUFFER_SIZE;
+    DirReader reader;
+    BulkListing listing;
+    PyObject *array_module = NULL;
+    PyObject *array_type = NULL;
+    PyObject *result = NULL;
+    int error;
+
+    memset(&path, 0, sizeof(path));
+    path.function_name = "scandir_bulk";
+    path.nullable = 1;
+    path.fd = -1;
+#ifdef HAVE_DIR_READER_OPEN_FD
+    path.allow_fd = 1;
+#endif
+    memset(&listing, 0, sizeof(listing));
+    dir_reader_init(&reader);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O&n:scandir_bulk", keywords,
+                                     path_converter, &path, &buffer_size))
+        return NULL;
+    if (buffer_size < DIR_READER_MIN_BUFFER_SIZE ||
+            buffer_size > DIR_READER_MAX_BUFFER_SIZE) {
+        PyErr_Format(PyExc_ValueError,
+                     "scandir_bulk: buffer_size must be between %d and %d",
+                     DIR_READER_MIN_BUFFER_SIZE, DIR_READER_MAX_BUFFER_SIZE);
+        goto exit;
+    }
+
+    SCANDIR_BEGIN_ALLOW_THREADS
+#ifdef HAVE_DIR_READER_OPEN_FD
+    if (path.fd != -1) {
+        /* Read a duplicate so the caller's fd is left open */
+        int fd = dup(path.fd);
+        error = fd < 0 ? -1 : dir_reader_open_fd(&reader, fd, buffer_size);
+    }
+    else
+#endif
+    error = dir_reader_open(&reader, path.narrow ? path.narrow : ".", buffer_size);
+    if (error == 0) {
+        error = bulk_listing_read(&listing, &reader);
+        if (path.fd != -1)
+            lseek(dirfd(reader.dirp), 0, SEEK_SET);
+    }
+    if (reader.dirp) {
+        int saved_errno = errno;
+        dir_reader_close(&reader);
+        errno = saved_errno;
+    }
+    SCANDIR_END_ALLOW_THREADS
+
+    if (error < 0) {
+        path_error(&path);
+        goto exit;
+    }
+
+    array_module = PyImport_ImportModule("array");
+    if (!array_module)
+        goto exit;
+    array_type = PyObject_GetAttrString(array_module, "array");
+    if (!array_type)
+        goto exit;
+
+    result = PyStructSequence_New(&BulkListingType);
+    if (!result)
+        goto exit;
+    PyStructSequence_SET_ITEM(result, 0, PyBytes_FromStringAndSize(
+        listing.names ? listing.names : "", listing.names_len));
+    PyStructSequence_SET_ITEM(result, 1, bulk_listing_array(
+        array_type, "Q", listing.offsets,
+        (listing.count + 1) * sizeof(unsigned long long)));
+    PyStructSequence_SET_ITEM(result, 2, bulk_listing_array(
+        array_type, "Q", listing.inodes,
+        listing.count * sizeof(unsigned long long)));
+    PyStructSequence_SET_ITEM(result, 3, bulk_listing_array(
+        array_type, "B", listing.types, listing.count));
+    if (PyErr_Occurred())
+        Py_CLEAR(result);
+
+exit:
+    Py_XDECREF(array_type);
+    Py_XDECREF(array_module);
+    bulk_listing_free(&listing);
+    path_cleanup(&path);
+    return result;
+}
+
+#endif /* !MS_WINDOWS && PY_MAJOR_VERSION >= 3 */
+
+
+/* SECTION: Recursive glob support (POSIX only)
+
+glob_dir() does the per-directory work for scandir.glob(): a single pass
+over a directory that returns the paths matching one pattern component
+and, for "**", the subdirectories to descend into. Names are matched
+with the glob matcher before any Python objects are created, d_type
+avoids stat calls, and each directory under a "**" is only read once.
+*/
+
+#ifndef MS_WINDOWS
+
+/* Append the path *buffer[:prefix_len] + name to list, growing *buffer
+   to fit. Return 0 on success or -1 with an exception set. */
+static int
+glob_dir_append(PyObject *list, char **buffer, Py_ssize_t *buffer_size,
+                Py_ssize_t prefix_len, DirRecord *record, int return_bytes)
+{
+    PyObject *path;
+    int result;
+
+    if (prefix_len + record->name_len > *buffer_size) {
+        char *new_buffer = PyMem_Realloc(*buffer, prefix_len + record->name_len);
+
+        if (!new_buffer) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        *buffer = new_buffer;
+        *buffer_size = prefix_len + record->name_len;
+    }
+    memcpy(*buffer + prefix_len, record->name, record->name_len);
+    path = decode_fs_name(return_bytes, *buffer, prefix_len + record->name_len);
+    if (!path)
+        return -1;
+    result = PyList_Append(list, path);
+    Py_DECREF(path);
+    return result;
+}
+
+PyDoc_STRVAR(glob_dir__doc__,
+"glob_dir(path, pattern=None, dironly=False, subdirs=False) -> (paths, subdirs)\n\n\
+Read the directory at path once and return a list of the paths of the\n\
+entries whose names match the glob pattern (all entries if pattern is\n\
+None, and only directories if dironly is true), plus, if subdirs is\n\
+true, a list of the paths of its subdirectories. Like glob.glob(),\n\
+names starting with a dot are skipped unless the pattern starts with\n\
+one, and are never included in subdirs. An empty path reads the current\n\
+directory and returns bare names.");
+
+static PyObject *
+scandir_glob_dir(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"path", "pattern", "dironly", "subdirs", NULL};
+    PyObject *path_obj;
+    PyObject *pattern_obj = Py_None;
+    int dironly = 0;
+    int want_subdirs = 0;
+    PyObject *path_bytes = NULL;
+    PyObject *paths = NULL;
+    PyObject *subdirs = NULL;
+    PyObject *result = NULL;
+    GlobPattern pattern;
+    int have_pattern = 0;
+    int match_hidden = 0;
+    int return_bytes;
+    const char *dirpath;
+    char *buffer = NULL;
+    Py_ssize_t buffer_size, prefix_len;
+    DirReader reader;
+    DirRecord record;
+    int error, hidden, matched, is_dir, is_symlink;
+
+    dir_reader_init(&reader);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|Oii:glob_dir", keywords,
+                                     &path_obj, &pattern_obj, &dironly, &want_subdirs))
+        return NULL;
+
+#if PY_MAJOR_VERSION >= 3
+    if (!PyUnicode_Check(path_obj) && !PyBytes_Check(path_obj)) {
+#else
+    if (!PyUnicode_Check(path_obj) && !PyString_Check(path_obj)) {
+#endif
+        PyErr_SetString(PyExc_TypeError, "glob_dir: path must be str or bytes");
+        return NULL;
+    }
+    return_bytes = PyBytes_Check(path_obj);
+    path_bytes = encode_fs_name(path_obj);
+    if (!path_bytes)
+        return NULL;
+    dirpath = PyBytes_AS_STRING(path_bytes);
+    prefix_len = PyBytes_GET_SIZE(path_bytes);
+    if ((Py_ssize_t)strlen(dirpath) != prefix_len) {
+        PyErr_SetString(PyExc_ValueError, "glob_dir: embedded null character in path");
+        goto exit;
+    }
+
+    if (pattern_obj != Py_None) {
+        if (glob_compile_object(&pattern, pattern_obj) < 0)
+            goto exit;
+        have_pattern = 1;
+        match_hidden = pattern.num_tokens > 0 &&
+                       pattern.tokens[0].type == GLOB_CHAR && pattern.tokens[0].ch == '.';
+    }
+
+    /* The buffer holds the prefix "path/" followed by each name in turn */
+    buffer_size = prefix_len + 1 + 256;
+    buffer = PyMem_Malloc(buffer_size);
+    if (!buffer) {
+        PyErr_NoMemory();
+        goto exit;
+    }
+    memcpy(buffer, dirpath, prefix_len);
+    if (prefix_len > 0 && buffer[prefix_len - 1] != '/')
+        buffer[prefix_len++] = '/';
+    if (prefix_len == 0)
+        dirpath = ".";
+
+    paths = PyList_New(0);
+    if (!paths)
+        goto exit;
+    if (want_subdirs) {
+        subdirs = PyList_New(0);
+        if (!subdirs)
+            goto exit;
+    }
+
+    SCANDIR_BEGIN_ALLOW_THREADS
+    error = dir_reader_open(&reader, dirpath, DIR_READER_DEFAULT_BUFFER_SIZE);
+    SCANDIR_END_ALLOW_THREADS
+    if (error < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path_obj);
+        goto exit;
+    }
+
+    while (1) {
+        SCANDIR_BEGIN_ALLOW_THREADS
+        error = dir_reader_fill(&reader);
+        SCANDIR_END_ALLOW_THREADS
+        if (error < 0) {
+            PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path_obj);
+            goto exit;
+        }
+        if (error == 0)
+            break;
+
+        while (dir_reader_next(&reader, &record)) {
+            hidden = record.name[0] == '.';
+            matched = (!hidden || match_hidden) &&
+                      (!have_pattern || glob_match(&pattern, record.name, record.name_len));
+            if (!matched && (hidden || !want_subdirs))
+                continue;
+
+            is_dir = 0;
+            if (dironly || (want_subdirs && !hidden)) {
+                if (RECORD_NEEDS_STAT(&record)) {
+                    SCANDIR_BEGIN_ALLOW_THREADS
+                    dir_record_type(&reader, dirpath, &record, &is_dir, &is_symlink);
+                    SCANDIR_END_ALLOW_THREADS
+                }
+                else
+                    dir_record_type(&reader, dirpath, &record, &is_dir, &is_symlink);
+            }
+
+            if (matched && (is_dir || !dironly) &&
+                    glob_dir_append(paths, &buffer, &buffer_size, prefix_len,
+                                    &record, return_bytes) < 0)
+                goto exit;
+            if (want_subdirs && !hidden && is_dir &&
+                    glob_dir_append(subdirs, &buffer, &buffer_size, prefix_len,
+                                    &record, return_bytes) < 0)
+                goto exit;
+        }
+    }
+
+    result = PyTuple_Pack(2, paths, want_subdirs ? subdirs : Py_None);
+
+exit:
+    if (reader.dirp) {
+        SCANDIR_BEGIN_ALLOW_THREADS
+        dir_reader_close(&reader);
+        SCANDIR_END_ALLOW_THREADS
+    }
+    if (have_pattern)
+        glob_free(&pattern);
+    PyMem_Free(buffer);
+    Py_XDECREF(subdirs);
+    Py_XDECREF(paths);
+    Py_DECREF(path_bytes);
+    return result;
+}
+
+#endif /* !MS_WINDOWS */
+
+
+/* SECTION: Disk usage (POSIX only)
+
+du() adds up the disk usage of a tree on the parallel walk engine in du
+mode: the workers stat each entry with the GIL released and hand back
+only per-directory totals, so no DirEntry or stat_result objects are
+created. Hard links (and directories, when following symlinks) are only
+counted once, by (st_dev, st_ino).
+*/
+
+#ifndef MS_WINDOWS
+
+typedef struct {
+    char *path;                 /* NULL if the directory wasn't reached */
+    Py_ssize_t parent;
+    unsigned long long bytes;
+} DuSubtotal;
+
+/* Roll the per-directory totals up the tree and return them as a dict
+   mapping each directory's path to the total size under it */
+static PyObject *
+du_subtotals_dict(DuSubtotal *subtotals, Py_ssize_t count, int return_bytes)
+{
+    PyObject *dict, *key, *value;
+    Py_ssize_t i;
+    int error;
+
+    /* Children always have higher ids than their parents */
+    for (i = count - 1; i > 0; i--) {
+        if (subtotals[i].parent >= 0)
+            subtotals[subtotals[i].parent].bytes += subtotals[i].bytes;
+    }
+
+    dict = PyDict_New();
+    if (!dict)
+        return NULL;
+    for (i = 0; i < count; i++) {
+        if (!subtotals[i].path)
+            continue;
+        key = decode_fs_name(return_bytes, subtotals[i].path, strlen(subtotals[i].path));
+        value = PyLong_FromUnsignedLongLong(subtotals[i].bytes);
+        error = !key || !value || PyDict_SetItem(dict, key, value) < 0;
+        Py_XDECREF(key);
+        Py_XDECREF(value);
+        if (error) {
+            Py_DECREF(dict);
+            return NULL;
+        }
+    }
+    return dict;
+}
+
+PyDoc_STRVAR(du__doc__,
+"du(top, follow_symlinks=False, apparent=False, one_filesystem=False,\n\
+   subtotals=False, workers=0, onerror=None) -> (total, files, dirs, subtotals)\n\n\
+Return the disk usage in bytes of the tree at top (st_blocks * 512, or\n\
+st_size if apparent is true), and the number of files and directories\n\
+counted. Hard links are counted once. If subtotals is true, also return\n\
+a dict mapping each directory's path to the total size under it, else\n\
+None. The tree is read using workers native threads (by default one per\n\
+CPU, and at least 4). onerror is called with an OSError for directories\n\
+that can't be read, like walk().");
+
+static PyObject *
+scandir_du(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"top", "follow_symlinks", "apparent", "one_filesystem",
+                               "subtotals", "workers", "onerror", NULL};
+    PyObject *top, *top_bytes;
+    PyObject *onerror = Py_None;
+    int follow_symlinks = 0;
+    int want_subtotals = 0;
+    int workers = 0;
+    int return_bytes, done, status, error;
+    char *path;
+    struct stat st;
+    PwalkDu du;
+    Pwalk *engine = NULL;
+    PwalkResult *result;
+    DuSubtotal *subtotals = NULL;
+    Py_ssize_t num_subtotals = 0;
+    Py_ssize_t subtotals_size = 0;
+    Py_ssize_t i;
+    unsigned long long total = 0;
+    Py_ssize_t num_files = 0;
+    Py_ssize_t num_dirs = 0;
+    PyObject *subtotals_obj = NULL;
+    PyObject *filename;
+    PyObject *return_value = NULL;
+
+    memset(&du, 0, sizeof(du));
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iiiiiO:du", keywords,
+                                     &top, &follow_symlinks, &du.apparent,
+                                     &du.one_filesystem, &want_subtotals,
+                                     &workers, &onerror))
+        return NULL;
+
+#if PY_MAJOR_VERSION >= 3
+    if (!PyUnicode_Check(top) && !PyBytes_Check(top)) {
+#else
+    if (!PyUnicode_Check(top) && !PyString_Check(top)) {
+#endif
+        PyErr_SetString(PyExc_TypeError, "du: top must be str or bytes");
+        return NULL;
+    }
+    if (workers < 0) {
+        PyErr_SetString(PyExc_ValueError, "du: workers must be >= 0");
+        return NULL;
+    }
+    if (workers == 0)
+        workers = default_num_workers();
+    return_bytes = PyBytes_Check(top);
+
+    top_bytes = encode_fs_name(top);
+    if (!top_bytes)
+        return NULL;
+    path = strdup(PyBytes_AS_STRING(top_bytes));
+    Py_DECREF(top_bytes);
+    if (!path)
+        return PyErr_NoMemory();
+
+    /* Like walk(), a symlink to a directory at the top is followed */
+    STATS_ADD(stat, 1);
+    SCANDIR_BEGIN_ALLOW_THREADS
+    error = STAT(path, &st);
+    SCANDIR_END_ALLOW_THREADS
+    if (error < 0) {
+        free(path);
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, top);
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        free(path);
+        if (want_subtotals) {
+            subtotals_obj = PyDict_New();
+            if (!subtotals_obj)
+                return NULL;
+        }
+        else {
+            Py_INCREF(Py_None);
+            subtotals_obj = Py_None;
+        }
+        return Py_BuildValue("(KnnN)", (unsigned long long)du_size(&du, &st),
+                             (Py_ssize_t)1, (Py_ssize_t)0, subtotals_obj);
+    }
+
+    du.root_dev = st.st_dev;
+    inode_set_init(&du.seen);
+    if (follow_symlinks)
+        inode_set_add(&du.seen, st.st_dev, st.st_ino);
+
+    SCANDIR_BEGIN_ALLOW_THREADS
+    engine = pwalk_start(path, workers, follow_symlinks, PWALK_DEFAULT_QUEUE_SIZE,
+                         &du, du_size(&du, &st), 0, -1);
+    SCANDIR_END_ALLOW_THREADS
+    if (!engine) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        goto exit;
+    }
+
+    while (1) {
+        SCANDIR_BEGIN_ALLOW_THREADS
+        result = pwalk_next_result(engine, 100, &done);
+        SCANDIR_END_ALLOW_THREADS
+
+        if (!result) {
+            if (done)
+                break;
+            /* Let Ctrl-C interrupt a long wait */
+            if (PyErr_CheckSignals() < 0)
+                goto exit;
+            continue;
+        }
+
+        total += result->du_bytes;
+        num_files += result->du_files;
+        num_dirs++;
+        if (want_subtotals) {
+            if (result->id >= subtotals_size) {
+                Py_ssize_t new_size = subtotals_size ? subtotals_size * 2 : 1024;
+                DuSubtotal *new_subtotals;
+
+                while (new_size <= result->id)
+                    new_size *= 2;
+                new_subtotals = PyMem_Realloc(subtotals, new_size * sizeof(DuSubtotal));
+                if (!new_subtotals) {
+                    pwalk_result_free(result);
+                    PyErr_NoMemory();
+                    goto exit;
+                }
+                subtotals = new_subtotals;
+                memset(subtotals + subtotals_size, 0,
+                       (new_size - subtotals_size) * sizeof(DuSubtotal));
+                subtotals_size = new_size;
+            }
+            subtotals[result->id].parent = result->parent;
+            subtotals[result->id].bytes = result->du_bytes;
+            /* Take the path rather than copying it */
+            subtotals[result->id].path = result->path;
+            result->path = NULL;
+            if (result->id >= num_subtotals)
+                num_subtotals = result->id + 1;
+        }
+
+        if (result->error) {
+            const char *error_path = result->path ? result->path
+                                                  : subtotals[result->id].path;
+
+            filename = decode_fs_name(return_bytes, error_path, strlen(error_path));
+            status = filename ? walk_onerror(onerror, result->error, filename) : -1;
+            Py_XDECREF(filename);
+            if (status < 0) {
+                pwalk_result_free(result);
+                goto exit;
+            }
+        }
+        pwalk_result_free(result);
+    }
+
+    if (want_subtotals) {
+        subtotals_obj = du_subtotals_dict(subtotals, num_subtotals, return_bytes);
+        if (!subtotals_obj)
+            goto exit;
+    }
+    else {
+        Py_INCREF(Py_None);
+        subtotals_obj = Py_None;
+    }
+    return_value = Py_BuildValue("(KnnN)", total, num_files, num_dirs, subtotals_obj);
+
+exit:
+    if (engine) {
+        SCANDIR_BEGIN_ALLOW_THREADS
+        pwalk_free(engine);
+        SCANDIR_END_ALLOW_THREADS
+    }
+    for (i = 0; i < num_subtotals; i++)
+        free(subtotals[i].path);
+    PyMem_Free(subtotals);
+    inode_set_free(&du.seen);
+    return return_value;
+}
+
+#endif /* !MS_WINDOWS */
+
+
+/* SECTION: Tree snapshots (POSIX only)
+
+snapshot() walks a tree and writes a compact binary index of it, which
+scandir.Snapshot reads back using mmap. The file is a 64-byte header,
+then a 72-byte record per entry, then a string table of names:
+
+    header: magic "SCANSNAP", version, record_size, num_records,
+            records_offset, names_offset, names_size, byte_order, flags,
+            created_ns
+    record: name_offset, name_len, parent, first_child, num_children,
+            mode, ino, dev, size, mtime_ns, ctime_ns
+
+Numbers are in the writer's byte order (byte_order is 0x01020304 as
+written). Record 0 is the top directory, named by the top path. Each
+directory's entries are consecutive records sorted by name, so a path is
+found with a binary search per component. The tree is walked depth
+first with the GIL released, opening subdirectories relative to their
+parent and lstat'ing entries with fstatat(). Records are written as they
+go (a directory's first_child and num_children are patched in once it's
+read), and names are spooled to an unlinked temporary file next to the
+output, so memory use doesn't grow with the size of the tree. The file
+is written under a temporary name and renamed into place at the end.
+
+rescan() runs the same walk against an earlier snapshot (mmap'ed): a
+directory whose inode, mtime and ctime are unchanged still has the same
+names, so they're taken from the snapshot rather than read again, and
+unless check_files is true only its subdirectories are stat'ed. Other
+directories are read and merged with their old (sorted) entries to find
+what was added and removed. As with git's index, a directory changed
+within SNAPSHOT_RACY_NS of the snapshot being taken is always read
+again, as a later change could leave the same (coarse) timestamps. The
+changes are collected as the walk goes,
+and the new state can be written out as a snapshot for the next run.
+*/
+
+#ifndef MS_WINDOWS
+
+#include <sys/mman.h>
+
+#define SNAPSHOT_MAGIC "SCANSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304U
+#define SNAPSHOT_NO_INDEX 0xFFFFFFFFU
+#define SNAPSHOT_FLAG_BYTES 1           /* top was given as bytes */
+#define SNAPSHOT_BUFFER_RECORDS 4096
+#define SNAPSHOT_NAMES_BUFFER_SIZE (1024 * 1024)
+#define SNAPSHOT_DIRS_PER_STEP 256
+#define SNAPSHOT_RACY_NS 2000000000LL
+
+/* Kinds of change collected by rescan() */
+#define RESCAN_ADDED 'a'
+#define RESCAN_REMOVED 'r'
+#define RESCAN_MODIFIED 'm'
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t num_records;
+    uint64_t records_offset;
+    uint64_t names_offset;
+    uint64_t names_size;
+    uint32_t byte_order;
+    uint32_t flags;
+    int64_t created_ns;         /* when the walk started */
+} SnapshotHeader;
+
+typedef struct {
+    uint64_t name_offset;
+    uint32_t name_len;
+    uint32_t parent;            /* SNAPSHOT_NO_INDEX for the top */
+    uint32_t first_child;
+    uint32_t num_children;
+    uint32_t mode;
+    uint32_t reserved;
+    uint64_t ino;
+    uint64_t dev;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;           /* so rescan() can spot changed directories */
+} SnapshotRecord;
+
+/* An existing snapshot file mapped into memory */
+typedef struct {
+    char *map;
+    size_t map_size;
+    SnapshotRecord *records;
+    uint64_t num_records;
+    const char *names;
+    uint64_t names_size;
+    int64_t created_ns;
+} SnapshotMap;
+
+/* An entry of the directory being read; name is set from offset once
+   all the names have been read */
+typedef struct {
+    Py_ssize_t offset;
+    char *name;
+    Py_ssize_t name_len;
+    uint32_t index;             /* record index if it's a subdirectory */
+    uint32_t old;               /* index in the old snapshot, for rescan() */
+    int unchanged;              /* directory unchanged since the old snapshot */
+} SnapshotName;
+
+typedef struct {
+    DirReader reader;
+    char *path;
+    uint32_t index;
+    uint32_t old;
+    char *names;
+    Py_ssize_t names_len;
+    Py_ssize_t names_size;
+    SnapshotName *entries;
+    Py_ssize_t num_entries;
+    Py_ssize_t entries_size;
+    Py_ssize_t next;            /* next entry to consider walking into */
+} SnapshotFrame;
+
+typedef struct {
+    int fd;                     /* -1 if the records aren't being kept */
+    int names_fd;
+    SnapshotRecord *records;    /* records not yet written out */
+    uint64_t records_start;     /* index of records[0] */
+    Py_ssize_t records_len;
+    char *names;                /* names not yet written out */
+    Py_ssize_t names_len;
+    uint64_t names_size;        /* total size of the string table */
+    uint64_t num_records;
+    int64_t created_ns;
+    SnapshotFrame *stack;
+    Py_ssize_t depth;
+    Py_ssize_t stack_size;
+    /* Directories that couldn't be read */
+    char **error_paths;
+    int *error_codes;
+    Py_ssize_t num_errors;
+    Py_ssize_t errors_size;
+    /* For rescan(): the old snapshot, and the changes found as a series
+       of kind characters each followed by a NUL-terminated path */
+    SnapshotMap *old;
+    int check_files;
+    int corrupt;
+    char *changes;
+    Py_ssize_t changes_len;
+    Py_ssize_t changes_size;
+} SnapshotWriter;
+
+static int
+snapshot_write_at(int fd, const void *data, size_t len, uint64_t offset)
+{
+    const char *p = data;
+    ssize_t n;
+
+    while (len > 0) {
+        n = pwrite(fd, p, len, (off_t)offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int
+snapshot_flush_records(SnapshotWriter *w)
+{
+    if (w->fd >= 0 &&
+            snapshot_write_at(w->fd, w->records, w->records_len * sizeof(SnapshotRecord),
+                              sizeof(SnapshotHeader) +
+                              w->records_start * sizeof(SnapshotRecord)) < 0)
+        return -1;
+    w->records_start += w->records_len;
+    w->records_len = 0;
+    return 0;
+}
+
+static int
+snapshot_flush_names(SnapshotWriter *w)
+{
+    if (w->names_fd >= 0 &&
+            snapshot_write_at(w->names_fd, w->names, w->names_len,
+                              w->names_size - w->names_len) < 0)
+        return -1;
+    w->names_len = 0;
+    return 0;
+}
+
+/* Append a record for the entry name, with only the name and links
+   filled in. Return it, or NULL with errno set. */
+static SnapshotRecord *
+snapshot_append(SnapshotWriter *w, const char *name, Py_ssize_t name_len,
+                uint32_t parent)
+{
+    SnapshotRecord *record;
+
+    if (w->num_records >= SNAPSHOT_NO_INDEX) {
+        errno = EFBIG;
+        return NULL;
+    }
+    if (w->records_len == SNAPSHOT_BUFFER_RECORDS && snapshot_flush_records(w) < 0)
+        return NULL;
+    if (w->names_len + name_len > SNAPSHOT_NAMES_BUFFER_SIZE) {
+        if (snapshot_flush_names(w) < 0)
+            return NULL;
+    }
+
+    record = &w->records[w->records_len++];
+    memset(record, 0, sizeof(SnapshotRecord));
+    record->name_offset = w->names_size;
+    record->name_len = (uint32_t)name_len;
+    record->parent = parent;
+    record->first_child = (uint32_t)(w->num_records + 1);
+    w->num_records++;
+
+    if (name_len > SNAPSHOT_NAMES_BUFFER_SIZE) {
+        /* Only possible for a very long top path */
+        if (w->names_fd >= 0 &&
+                snapshot_write_at(w->names_fd, name, name_len, w->names_size) < 0)
+            return NULL;
+        w->names_size += name_len;
+        return record;
+    }
+    memcpy(w->names + w->names_len, name, name_len);
+    w->names_len += name_len;
+    w->names_size += name_len;
+    return record;
+}
+
+/* Append a record for the entry name with stat result st. Return it, or
+   NULL with errno set. */
+static SnapshotRecord *
+snapshot_add(SnapshotWriter *w, struct stat *st, const char *name,
+             Py_ssize_t name_len, uint32_t parent)
+{
+    SnapshotRecord *record;
+    unsigned long mnsec, cnsec;
+
+    record = snapshot_append(w, name, name_len, parent);
+    if (!record)
+        return NULL;
+    record->mode = (uint32_t)st->st_mode;
+    record->ino = (uint64_t)st->st_ino;
+    record->dev = (uint64_t)st->st_dev;
+    record->size = (uint64_t)st->st_size;
+#if defined(HAVE_STAT_TV_NSEC)
+    mnsec = st->st_mtim.tv_nsec;
+    cnsec = st->st_ctim.tv_nsec;
+#elif defined(HAVE_STAT_TV_NSEC2)
+    mnsec = st->st_mtimespec.tv_nsec;
+    cnsec = st->st_ctimespec.tv_nsec;
+#elif defined(HAVE_STAT_NSEC)
+    mnsec = st->st_mtime_nsec;
+    cnsec = st->st_ctime_nsec;
+#else
+    mnsec = cnsec = 0;
+#endif
+    record->mtime_ns = (int64_t)st->st_mtime * 1000000000 + mnsec;
+    record->ctime_ns = (int64_t)st->st_ctime * 1000000000 + cnsec;
+    return record;
+}
+
+/* Fill in a directory's first_child and num_children, in the buffer if
+   it's still there, otherwise in the file */
+static int
+snapshot_patch(SnapshotWriter *w, uint32_t index, uint32_t first_child,
+               uint32_t num_children)
+{
+    uint32_t fields[2];
+
+    if (index >= w->records_start) {
+        w->records[index - w->records_start].first_child = first_child;
+        w->records[index - w->records_start].num_children = num_children;
+        return 0;
+    }
+    if (w->fd < 0)
+        return 0;
+    fields[0] = first_child;
+    fields[1] = num_children;
+    return snapshot_write_at(w->fd, fields, sizeof(fields),
+                             sizeof(SnapshotHeader) + (uint64_t)index * sizeof(SnapshotRecord) +
+                             offsetof(SnapshotRecord, first_child));
+}
+
+/* Map the snapshot file at path. Return 0 on success, -1 with errno set
+   if it can't be read, or -2 if it isn't a snapshot in our byte order. */
+static int
+snapshot_map_open(SnapshotMap *map, const char *path)
+{
+    SnapshotHeader *header;
+    struct stat st;
+    int fd;
+
+    memset(map, 0, sizeof(SnapshotMap));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if ((uint64_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return -2;
+    }
+    map->map_size = (size_t)st.st_size;
+    map->map = mmap(NULL, map->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map->map == MAP_FAILED) {
+        map->map = NULL;
+        return -1;
+    }
+
+    header = (SnapshotHeader *)map->map;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, 8) != 0 ||
+            header->byte_order != SNAPSHOT_BYTE_ORDER ||
+            header->version != SNAPSHOT_VERSION ||
+            header->record_size != sizeof(SnapshotRecord) ||
+            header->num_records == 0 ||
+            header->num_records > SNAPSHOT_NO_INDEX ||
+            header->records_offset % 8 != 0 ||
+            header->records_offset > map->map_size ||
+            header->num_records > (map->map_size - header->records_offset) /
+                                  sizeof(SnapshotRecord) ||
+            header->names_offset > map->map_size ||
+            header->names_size > map->map_size - header->names_offset)
+        return -2;
+    map->records = (SnapshotRecord *)(map->map + header->records_offset);
+    map->num_records = header->num_records;
+    map->names = map->map + header->names_offset;
+    map->names_size = header->names_size;
+    map->created_ns = header->created_ns;
+    return 0;
+}
+
+static void
+snapshot_map_close(SnapshotMap *map)
+{
+    if (map->map)
+        munmap(map->map, map->map_size);
+    map->map = NULL;
+}
+
+/* Return the name of the old record (not NUL-terminated), or NULL if it's
+   out of range of the string table */
+static const char *
+snapshot_map_name(SnapshotMap *map, SnapshotRecord *record)
+{
+    if (record->name_offset > map->names_size ||
+            record->name_len > map->names_size - record->name_offset)
+        return NULL;
+    return map->names + record->name_offset;
+}
+
+/* Return nonzero if the children of old directory record index are in
+   range. They're always written after their parent, so this also stops a
+   corrupt file sending rescan round in circles. */
+static int
+snapshot_map_children_ok(SnapshotMap *map, uint32_t index)
+{
+    SnapshotRecord *record = &map->records[index];
+
+    if (record->num_children == 0)
+        return 1;
+    return record->first_child > index &&
+           record->first_child <= map->num_records &&
+           record->num_children <= map->num_records - record->first_child;
+}
+
+/* Return nonzero if a directory with the old record and new stat result
+   (as a record) still has the same names in it */
+static int
+rescan_dir_unchanged(SnapshotMap *map, SnapshotRecord *old, SnapshotRecord *new)
+{
+    return S_ISDIR(old->mode) && S_ISDIR(new->mode) && old->ino == new->ino &&
+           old->dev == new->dev && old->mtime_ns == new->mtime_ns &&
+           old->ctime_ns == new->ctime_ns &&
+           old->ctime_ns < map->created_ns - SNAPSHOT_RACY_NS;
+}
+
+static int
+rescan_modified(SnapshotRecord *old, SnapshotRecord *new)
+{
+    return old->mode != new->mode || old->ino != new->ino || old->dev != new->dev ||
+           old->size != new->size || old->mtime_ns != new->mtime_ns;
+}
+
+/* Note a change to name in directory dirpath (or to path name itself if
+   dirpath is NULL). Return 0 on success or -1 with errno set. */
+static int
+rescan_change(SnapshotWriter *w, char kind, const char *dirpath,
+              const char *name, Py_ssize_t name_len)
+{
+    char *path;
+    Py_ssize_t len;
+
+    path = dirpath ? join_path_raw(dirpath, name, name_len) : strdup(name);
+    if (!path)
+        return -1;
+    len = strlen(path);
+    if (w->changes_len + len + 2 > w->changes_size) {
+        Py_ssize_t new_size = w->changes_size ? w->changes_size * 2 : 4096;
+        char *changes;
+
+        while (new_size < w->changes_len + len + 2)
+            new_size *= 2;
+        changes = realloc(w->changes, new_size);
+        if (!changes) {
+            free(path);
+            errno = ENOMEM;
+            return -1;
+        }
+        w->changes = changes;
+        w->changes_size = new_size;
+    }
+    w->changes[w->changes_len++] = kind;
+    memcpy(w->changes + w->changes_len, path, len + 1);
+    w->changes_len += len + 1;
+    free(path);
+    return 0;
+}
+
+static int rescan_removed(SnapshotWriter *w, const char *dirpath, uint32_t index);
+
+/* Note everything under the old directory index, which was at path, as
+   removed */
+static int
+rescan_removed_children(SnapshotWriter *w, const char *path, uint32_t index)
+{
+    SnapshotRecord *record = &w->old->records[index];
+    uint32_t i;
+
+    if (!S_ISDIR(record->mode))
+        return 0;
+    if (!snapshot_map_children_ok(w->old, index)) {
+        w->corrupt = 1;
+        errno = EINVAL;
+        return -1;
+    }
+    for (i = 0; i < record->num_children; i++) {
+        if (rescan_removed(w, path, record->first_child + i) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Note the old entry index in directory dirpath, and everything under
+   it, as removed */
+static int
+rescan_removed(SnapshotWriter *w, const char *dirpath, uint32_t index)
+{
+    SnapshotRecord *record = &w->old->records[index];
+    const char *name = snapshot_map_name(w->old, record);
+    char *path;
+    int result;
+
+    if (!name) {
+        w->corrupt = 1;
+        errno = EINVAL;
+        return -1;
+    }
+    if (rescan_change(w, RESCAN_REMOVED, dirpath, name, record->name_len) < 0)
+        return -1;
+    if (!S_ISDIR(record->mode) || record->num_children == 0)
+        return 0;
+    path = join_path_raw(dirpath, name, record->name_len);
+    if (!path)
+        return -1;
+    result = rescan_removed_children(w, path, index);
+    free(path);
+    return result;
+}
+
+static int
+snapshot_name_cmp(const void *a, const void *b)
+{
+    const SnapshotName *x = a, *y = b;
+    int result = memcmp(x->name, y->name,
+                        x->name_len < y->name_len ? x->name_len : y->name_len);
+
+    if (result)
+        return result;
+    return x->name_len < y->name_len ? -1 : x->name_len > y->name_len;
+}
+
+/* Add name to frame's list of entries. Return 0 on success or -1 with
+   errno set. */
+static int
+snapshot_frame_add_name(SnapshotFrame *frame, const char *name, Py_ssize_t name_len,
+                        uint32_t old)
+{
+    SnapshotName *entry;
+
+    if (frame->num_entries == frame->entries_size) {
+        Py_ssize_t new_size = frame->entries_size ? frame->entries_size * 2 : 64;
+        SnapshotName *entries = realloc(frame->entries, new_size * sizeof(SnapshotName));
+        if (!entries) {
+            errno = ENOMEM;
+            return -1;
+        }
+        frame->entries = entries;
+        frame->entries_size = new_size;
+    }
+    /* Keep the NUL terminators for fstatat() and openat() */
+    if (frame->names_len + name_len + 1 > frame->names_size) {
+        Py_ssize_t new_size = frame->names_size ? frame->names_size * 2 : 4096;
+        char *names;
+        while (new_size < frame->names_len + name_len + 1)
+            new_size *= 2;
+        names = realloc(frame->names, new_size);
+        if (!names) {
+            errno = ENOMEM;
+            return -1;
+        }
+        frame->names = names;
+        frame->names_size = new_size;
+    }
+    entry = &frame->entries[frame->num_entries++];
+    entry->offset = frame->names_len;
+    entry->name_len = name_len;
+    entry->index = SNAPSHOT_NO_INDEX;
+    entry->old = old;
+    entry->unchanged = 0;
+    memcpy(frame->names + frame->names_len, name, name_len);
+    frame->names[frame->names_len + name_len] = '\0';
+    frame->names_len += name_len + 1;
+    return 0;
+}
+
+static void
+snapshot_frame_set_names(SnapshotFrame *frame)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < frame->num_entries; i++)
+        frame->entries[i].name = frame->names + frame->entries[i].offset;
+}
+
+/* Read the names in frame's directory and sort them. Return 0 on
+   success or -1 with errno set. */
+static int
+snapshot_read_names(SnapshotFrame *frame)
+{
+    DirRecord record;
+    int status;
+
+    while (1) {
+        if (!dir_reader_next(&frame->reader, &record)) {
+            status = dir_reader_fill(&frame->reader);
+            if (status < 0)
+                return -1;
+            if (status == 0)
+                break;
+            continue;
+        }
+        if (snapshot_frame_add_name(frame, record.name, record.name_len,
+                                    SNAPSHOT_NO_INDEX) < 0)
+            return -1;
+    }
+
+    snapshot_frame_set_names(frame);
+    if (frame->num_entries)
+        qsort(frame->entries, frame->num_entries, sizeof(SnapshotName), snapshot_name_cmp);
+    return 0;
+}
+
+/* Take the names in frame's directory from its entries in the old
+   snapshot, which are already sorted. Return 0 on success or -1 with
+   errno set. */
+static int
+rescan_old_names(SnapshotWriter *w, SnapshotFrame *frame)
+{
+    SnapshotRecord *dir = &w->old->records[frame->old];
+    SnapshotRecord *record;
+    const char *name;
+    uint32_t i;
+
+    if (!snapshot_map_children_ok(w->old, frame->old)) {
+        w->corrupt = 1;
+        errno = EINVAL;
+        return -1;
+    }
+    for (i = 0; i < dir->num_children; i++) {
+        record = &w->old->records[dir->first_child + i];
+        name = snapshot_map_name(w->old, record);
+        if (!name) {
+            w->corrupt = 1;
+            errno = EINVAL;
+            return -1;
+        }
+        if (snapshot_frame_add_name(frame, name, record->name_len, dir->first_child + i) < 0)
+            return -1;
+    }
+    snapshot_frame_set_names(frame);
+    return 0;
+}
+
+static void
+snapshot_frame_clear(SnapshotFrame *frame)
+{
+    dir_reader_close(&frame->reader);
+    free(frame->path);
+    free(frame->names);
+    free(frame->entries);
+}
+
+static int
+snapshot_add_error(SnapshotWriter *w, const char *path, int error)
+{
+    if (w->num_errors == w->errors_size) {
+        Py_ssize_t new_size = w->errors_size ? w->errors_size * 2 : 16;
+        char **paths = realloc(w->error_paths, new_size * sizeof(char *));
+        int *codes;
+
+        if (!paths)
+            return -1;
+        w->error_paths = paths;
+        codes = realloc(w->error_codes, new_size * sizeof(int));
+        if (!codes)
+            return -1;
+        w->error_codes = codes;
+        w->errors_size = new_size;
+    }
+    w->error_paths[w->num_errors] = strdup(path);
+    if (!w->error_paths[w->num_errors])
+        return -1;
+    w->error_codes[w->num_errors++] = error;
+    return 0;
+}
+
+/* Stat and add records for the entries of frame's directory */
+static int
+snapshot_add_entries(SnapshotWriter *w, SnapshotFrame *frame)
+{
+    SnapshotName *entry;
+    struct stat st;
+    Py_ssize_t i;
+
+    for (i = 0; i < frame->num_entries; i++) {
+        entry = &frame->entries[i];
+        /* Skip entries removed since the directory was read */
+        if (stat_at(&frame->reader, frame->path, entry->name, entry->name_len, &st, 0) < 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+            entry->index = (uint32_t)w->num_records;
+        if (!snapshot_add(w, &st, entry->name, entry->name_len, frame->index))
+            return -1;
+    }
+    return 0;
+}
+
+/* Like snapshot_add_entries(), but compare the entries with the ones in
+   the old snapshot and note what changed. If unchanged is true the names
+   came from the old snapshot. */
+static int
+rescan_add_entries(SnapshotWriter *w, SnapshotFrame *frame, int unchanged)
+{
+    SnapshotMap *old = w->old;
+    SnapshotRecord *dir = NULL, *old_record, *record;
+    SnapshotName *entry;
+    SnapshotName old_entry;
+    struct stat st;
+    uint32_t j = 0;
+    Py_ssize_t i;
+
+    if (frame->old != SNAPSHOT_NO_INDEX) {
+        dir = &old->records[frame->old];
+        if (!snapshot_map_children_ok(old, frame->old)) {
+            w->corrupt = 1;
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    for (i = 0; i < frame->num_entries; i++) {
+        entry = &frame->entries[i];
+        if (!unchanged && dir) {
+            /* Match up the names with the old ones, both are sorted */
+            while (j < dir->num_children) {
+                old_record = &old->records[dir->first_child + j];
+                old_entry.name = (char *)snapshot_map_name(old, old_record);
+                old_entry.name_len = old_record->name_len;
+                if (!old_entry.name) {
+                    w->corrupt = 1;
+                    errno = EINVAL;
+                    return -1;
+                }
+                if (snapshot_name_cmp(&old_entry, entry) < 0) {
+                    if (rescan_removed(w, frame->path, dir->first_child + j) < 0)
+                        return -1;
+                    j++;
+                    continue;
+                }
+                if (snapshot_name_cmp(&old_entry, entry) == 0)
+                    entry->old = dir->first_child + j++;
+                break;
+            }
+        }
+        old_record = entry->old != SNAPSHOT_NO_INDEX ? &old->records[entry->old] : NULL;
+
+        if (unchanged && !w->check_files && !S_ISDIR(old_record->mode)) {
+            /* Assume files in an unchanged directory are unchanged */
+            record = snapshot_append(w, entry->name, entry->name_len, frame->index);
+            if (!record)
+                return -1;
+            record->mode = old_record->mode;
+            record->ino = old_record->ino;
+            record->dev = old_record->dev;
+            record->size = old_record->size;
+            record->mtime_ns = old_record->mtime_ns;
+            record->ctime_ns = old_record->ctime_ns;
+            continue;
+        }
+
+        if (stat_at(&frame->reader, frame->path, entry->name, entry->name_len, &st, 0) < 0) {
+            if (old_record && rescan_removed(w, frame->path, entry->old) < 0)
+                return -1;
+            continue;
+        }
+        if (S_ISDIR(st.st_mode))
+            entry->index = (uint32_t)w->num_records;
+        record = snapshot_add(w, &st, entry->name, entry->name_len, frame->index);
+        if (!record)
+            return -1;
+
+        if (!old_record) {
+            if (rescan_change(w, RESCAN_ADDED, frame->path, entry->name, entry->name_len) < 0)
+                return -1;
+            continue;
+        }
+        if (rescan_modified(old_record, record) &&
+                rescan_change(w, RESCAN_MODIFIED, frame->path, entry->name, entry->name_len) < 0)
+            return -1;
+        if (S_ISDIR(old_record->mode) && !S_ISDIR(st.st_mode)) {
+            char *path = join_path_raw(frame->path, entry->name, entry->name_len);
+            int result = path ? rescan_removed_children(w, path, entry->old) : -1;
+
+            free(path);
+            if (result < 0)
+                return -1;
+        }
+        else if (S_ISDIR(st.st_mode)) {
+            if (S_ISDIR(old_record->mode))
+                entry->unchanged = rescan_dir_unchanged(old, old_record, record);
+            else
+                entry->old = SNAPSHOT_NO_INDEX;
+        }
+    }
+
+    while (!unchanged && dir && j < dir->num_children) {
+        if (rescan_removed(w, frame->path, dir->first_child + j++) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Open the directory for record index (path, or name in the directory
+   parent has open) as a new frame, and add records for its entries.
+   old is its index in the old snapshot (for rescan()), and if unchanged
+   is true its names are taken from there. Directories that can't be
+   read are noted in the writer's errors. Return 0 on success or -1 with
+   errno set on a write error. */
+static int
+snapshot_push(SnapshotWriter *w, SnapshotFrame *parent, char *path,
+              const char *name, Py_ssize_t name_len, uint32_t index,
+              uint32_t old, int unchanged)
+{
+    SnapshotFrame *frame;
+    uint32_t first_child;
+    int result;
+
+    if (w->depth == w->stack_size) {
+        Py_ssize_t new_size = w->stack_size ? w->stack_size * 2 : 16;
+        SnapshotFrame *stack = realloc(w->stack, new_size * sizeof(SnapshotFrame));
+        if (!stack) {
+            free(path);
+            errno = ENOMEM;
+            return -1;
+        }
+        w->stack = stack;
+        w->stack_size = new_size;
+        /* The parent frame may have moved */
+        if (parent)
+            parent = &w->stack[w->depth - 1];
+    }
+    frame = &w->stack[w->depth];
+    memset(frame, 0, sizeof(SnapshotFrame));
+    frame->path = path;
+    frame->index = index;
+    frame->old = old;
+
+    if (parent)
+        result = dir_reader_open_at(&frame->reader, &parent->reader, parent->path,
+                                    name, name_len, DIR_READER_DEFAULT_BUFFER_SIZE);
+    else
+        result = dir_reader_open(&frame->reader, path, DIR_READER_DEFAULT_BUFFER_SIZE);
+    if (result == 0) {
+        if (unchanged) {
+            result = rescan_old_names(w, frame);
+            if (result < 0 && w->corrupt) {
+                snapshot_frame_clear(frame);
+                return -1;
+            }
+        }
+        else
+            result = snapshot_read_names(frame);
+    }
+    if (result < 0) {
+        result = snapshot_add_error(w, path, errno);
+        snapshot_frame_clear(frame);
+        if (result < 0)
+            errno = ENOMEM;
+        return result;
+    }
+    /* Keep the directory open for fstatat() and openat(), until
+       DIR_READER_OPEN_PARENTS frames deeper are pushed */
+    dir_reader_release_buffer(&frame->reader);
+
+    first_child = (uint32_t)w->num_records;
+    if (w->old)
+        result = rescan_add_entries(w, frame, unchanged);
+    else
+        result = snapshot_add_entries(w, frame);
+    if (result < 0 ||
+            snapshot_patch(w, index, first_child, (uint32_t)(w->num_records - first_child)) < 0) {
+        snapshot_frame_clear(frame);
+        return -1;
+    }
+    w->depth++;
+    /* Only the last few frames keep their directories open, the rest
+       are reached by path */
+    if (w->depth > DIR_READER_OPEN_PARENTS)
+        dir_reader_close(&w->stack[w->depth - 1 - DIR_READER_OPEN_PARENTS].reader);
+    return 0;
+}
+
+/* Walk into up to max_dirs more directories. Return 1 if there's more
+   to do, 0 when finished, or -1 with errno set on a write error. */
+static int
+snapshot_step(SnapshotWriter *w, int max_dirs)
+{
+    SnapshotFrame *frame;
+    SnapshotName *entry;
+    char *path;
+
+    while (w->depth > 0) {
+        if (max_dirs-- <= 0)
+            return 1;
+        frame = &w->stack[w->depth - 1];
+        while (frame->next < frame->num_entries &&
+               frame->entries[frame->next].index == SNAPSHOT_NO_INDEX)
+            frame->next++;
+        if (frame->next == frame->num_entries) {
+            snapshot_frame_clear(frame);
+            w->depth--;
+            continue;
+        }
+        entry = &frame->entries[frame->next++];
+        path = join_path_raw(frame->path, entry->name, entry->name_len);
+        if (!path)
+            return -1;
+        if (snapshot_push(w, frame, path, entry->name, entry->name_len, entry->index,
+                          entry->old, entry->unchanged) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Write out the buffered records and names, the string table and the
+   header. Return 0 on success or -1 with errno set. */
+static int
+snapshot_finish(SnapshotWriter *w, int flags)
+{
+    SnapshotHeader header;
+    uint64_t names_offset, pos;
+    char *buffer;
+    ssize_t n;
+
+    if (snapshot_flush_records(w) < 0 || snapshot_flush_names(w) < 0)
+        return -1;
+    if (w->fd < 0)
+        return 0;
+
+    names_offset = sizeof(SnapshotHeader) + w->num_records * sizeof(SnapshotRecord);
+    buffer = malloc(SNAPSHOT_NAMES_BUFFER_SIZE);
+    if (!buffer) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (pos = 0; pos < w->names_size; pos += n) {
+        n = pread(w->names_fd, buffer, SNAPSHOT_NAMES_BUFFER_SIZE, (off_t)pos);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+        if (n <= 0 || snapshot_write_at(w->fd, buffer, n, names_offset + pos) < 0) {
+            if (n == 0)
+                errno = EIO;
+            free(buffer);
+            return -1;
+        }
+    }
+    free(buffer);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = SNAPSHOT_VERSION;
+    header.record_size = sizeof(SnapshotRecord);
+    header.num_records = w->num_records;
+    header.records_offset = sizeof(SnapshotHeader);
+    header.names_offset = names_offset;
+    header.names_size = w->names_size;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.flags = flags;
+    header.created_ns = w->created_ns;
+    return snapshot_write_at(w->fd, &header, sizeof(header), 0);
+}
+
+/* Create a temporary file in the same directory as out_path, returning
+   its name in *tmp_path (to free). If tmp_path is NULL it's unlinked
+   straight away so it's cleaned up however we exit. */
+static int
+snapshot_open_temp(const char *out_path, char **tmp_path)
+{
+    size_t len = strlen(out_path);
+    char *template = malloc(len + 8);
+    int fd;
+
+    if (!template) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(template, out_path, len);
+    memcpy(template + len, ".XXXXXX", 8);
+    fd = mkstemp(template);
+    if (fd >= 0 && tmp_path) {
+        *tmp_path = template;
+        return fd;
+    }
+    if (fd >= 0)
+        unlink(template);
+    free(template);
+    return fd;
+}
+
+static void
+snapshot_writer_free(SnapshotWriter *w)
+{
+    Py_ssize_t i;
+
+    while (w->depth > 0)
+        snapshot_frame_clear(&w->stack[--w->depth]);
+    free(w->stack);
+    for (i = 0; i < w->num_errors; i++)
+        free(w->error_paths[i]);
+    free(w->error_paths);
+    free(w->error_codes);
+    free(w->records);
+    free(w->names);
+    free(w->changes);
+    if (w->names_fd >= 0)
+        close(w->names_fd);
+    if (w->fd >= 0)
+        close(w->fd);
+}
+
+/* Walk the tree at top (already stat'ed as st) as snapshot() or, if
+   w->old is set, rescan() does, writing the records to out_path if it's
+   not NULL. Return 0 on success, or -1 with an exception set. */
+static int
+snapshot_run(SnapshotWriter *w, PyObject *top, const char *top_path, Py_ssize_t top_len,
+             struct stat *st, PyObject *out_file, const char *out_path, int flags)
+{
+    SnapshotRecord *record, *old_top;
+    uint32_t old = SNAPSHOT_NO_INDEX;
+    int unchanged = 0, status = 0, saved_errno;
+    char *tmp_path = NULL;
+    char *path;
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    w->created_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    w->records = malloc(SNAPSHOT_BUFFER_RECORDS * sizeof(SnapshotRecord));
+    w->names = malloc(SNAPSHOT_NAMES_BUFFER_SIZE);
+    if (!w->records || !w->names) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    SCANDIR_BEGIN_ALLOW_THREADS
+    if (out_path) {
+        w->fd = snapshot_open_temp(out_path, &tmp_path);
+        if (w->fd >= 0)
+            w->names_fd = snapshot_open_temp(out_path, NULL);
+        status = w->fd >= 0 && w->names_fd >= 0 ? 0 : -1;
+    }
+    record = status == 0 ? snapshot_add(w, st, top_path, top_len, SNAPSHOT_NO_INDEX) : NULL;
+    if (!record)
+        status = -1;
+    else if (w->old) {
+        /* Compare the top itself */
+        old_top = &w->old->records[0];
+        if (rescan_modified(old_top, record))
+            status = rescan_change(w, RESCAN_MODIFIED, NULL, top_path, top_len);
+        if (status == 0 && S_ISDIR(old_top->mode)) {
+            if (S_ISDIR(st->st_mode)) {
+                old = 0;
+                unchanged = rescan_dir_unchanged(w->old, old_top, record);
+            }
+            else
+                status = rescan_removed_children(w, top_path, 0);
+        }
+    }
+    if (status == 0 && S_ISDIR(st->st_mode)) {
+        path = strdup(top_path);
+        status = path ? snapshot_push(w, NULL, path, NULL, 0, 0, old, unchanged) : -1;
+    }
+    else if (status == 0)
+        status = snapshot_patch(w, 0, 1, 0);
+    SCANDIR_END_ALLOW_THREADS
+
+    /* Walk a chunk of directories at a time so Ctrl-C can interrupt */
+    while (status == 0) {
+        SCANDIR_BEGIN_ALLOW_THREADS
+        status = snapshot_step(w, SNAPSHOT_DIRS_PER_STEP);
+        SCANDIR_END_ALLOW_THREADS
+        if (status == 0)
+            break;
+        if (status == 1) {
+            if (PyErr_CheckSignals() < 0)
+                goto error;
+            status = 0;
+        }
+    }
+
+    if (status == 0) {
+        SCANDIR_BEGIN_ALLOW_THREADS
+        status = snapshot_finish(w, flags);
+        if (status == 0 && tmp_path)
+            status = rename(tmp_path, out_path);
+        SCANDIR_END_ALLOW_THREADS
+    }
+    if (status < 0) {
+        if (w->corrupt)
+            PyErr_SetString(PyExc_ValueError, "rescan: snapshot file is corrupt");
+        else
+            PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, out_file ? out_file : top);
+        goto error;
+    }
+    free(tmp_path);
+    return 0;
+
+error:
+    if (tmp_path) {
+        saved_errno = errno;
+        unlink(tmp_path);
+        free(tmp_path);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+/* Call onerror for each directory the walk couldn't read */
+static int
+snapshot_report_errors(SnapshotWriter *w, PyObject *onerror, int return_bytes)
+{
+    PyObject *filename;
+    Py_ssize_t i;
+    int status;
+
+    for (i = 0; i < w->num_errors; i++) {
+        filename = decode_fs_name(return_bytes, w->error_paths[i], strlen(w->error_paths[i]));
+        status = filename ? walk_onerror(onerror, w->error_codes[i], filename) : -1;
+        Py_XDECREF(filename);
+        if (status < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Parse top as a str or bytes path and stat it (following symlinks,
+   like walk() does at the top). Return 0 on success or -1 with an
+   exception set. */
+static int
+snapshot_stat_top(const char *func, PyObject *top, PyObject **top_bytes, struct stat *st)
+{
+    int status;
+
+#if PY_MAJOR_VERSION >= 3
+    if (!PyUnicode_Check(top) && !PyBytes_Check(top)) {
+#else
+    if (!PyUnicode_Check(top) && !PyString_Check(top)) {
+#endif
+        PyErr_Format(PyExc_TypeError, "%s: top must be str or bytes", func);
+        return -1;
+    }
+    *top_bytes = encode_fs_name(top);
+    if (!*top_bytes)
+        return -1;
+    STATS_ADD(stat, 1);
+    SCANDIR_BEGIN_ALLOW_THREADS
+    status = STAT(PyBytes_AS_STRING(*top_bytes), st);
+    SCANDIR_END_ALLOW_THREADS
+    if (status < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, top);
+        return -1;
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(snapshot__doc__,
+"snapshot(top, out_file, onerror=None) -> number of entries\n\n\
+Walk the tree at top (without following symlinks) and write a binary\n\
+index of the path, inode, device, mode, size, mtime and ctime of every\n\
+entry to out_file, for reading with scandir.Snapshot. onerror is called with\n\
+an OSError for each directory that couldn't be read, once the snapshot\n\
+has been written.");
+
+static PyObject *
+scandir_snapshot(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"top", "out_file", "onerror", NULL};
+    PyObject *top, *top_bytes = NULL;
+    PyObject *out_file, *out_bytes = NULL;
+    PyObject *onerror = Py_None;
+    PyObject *result = NULL;
+    SnapshotWriter w;
+    struct stat st;
+    int return_bytes;
+
+    memset(&w, 0, sizeof(w));
+    w.fd = w.names_fd = -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|O:snapshot", keywords,
+                                     &top, &out_file, &onerror))
+        return NULL;
+
+    if (snapshot_stat_top("snapshot", top, &top_bytes, &st) < 0)
+        goto exit;
+    return_bytes = PyBytes_Check(top);
+    out_bytes = encode_fs_name(out_file);
+    if (!out_bytes)
+        goto exit;
+    if (snapshot_run(&w, top, PyBytes_AS_STRING(top_bytes), PyBytes_GET_SIZE(top_bytes),
+                     &st, out_file, PyBytes_AS_STRING(out_bytes),
+                     return_bytes ? SNAPSHOT_FLAG_BYTES : 0) < 0)
+        goto exit;
+    if (snapshot_report_errors(&w, onerror, return_bytes) < 0)
+        goto exit;
+    result = PyLong_FromUnsignedLongLong(w.num_records);
+
+exit:
+    SCANDIR_BEGIN_ALLOW_THREADS
+    snapshot_writer_free(&w);
+    SCANDIR_END_ALLOW_THREADS
+    Py_XDECREF(top_bytes);
+    Py_XDECREF(out_bytes);
+    return result;
+}
+
+PyDoc_STRVAR(rescan__doc__,
+"rescan(snapshot_file, top, out_file=None, check_files=True, onerror=None)\n\
+    -> (added, removed, modified)\n\n\
+Compare the tree at top with the snapshot in snapshot_file and return\n\
+lists of the paths added, removed and modified since. Directories whose\n\
+inode, mtime and ctime are unchanged aren't read again; unless\n\
+check_files is true, the files in them aren't stat'ed either. If\n\
+out_file is given, a snapshot of the tree as it is now is written to it.");
+
+static PyObject *
+scandir_rescan(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"snapshot_file", "top", "out_file", "check_files",
+                               "onerror", NULL};
+    PyObject *snapshot_file, *snapshot_bytes = NULL;
+    PyObject *top, *top_bytes = NULL;
+    PyObject *out_file = Py_None, *out_bytes = NULL;
+    PyObject *onerror = Py_None;
+    PyObject *lists[3] = {NULL, NULL, NULL};
+    PyObject *path, *result = NULL;
+    SnapshotWriter w;
+    SnapshotMap old;
+    struct stat st;
+    Py_ssize_t pos, len;
+    int status, return_bytes, check_files = 1, i;
+
+    memset(&w, 0, sizeof(w));
+    memset(&old, 0, sizeof(old));
+    w.fd = w.names_fd = -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|OiO:rescan", keywords,
+                                     &snapshot_file, &top, &out_file, &check_files,
+                                     &onerror))
+        return NULL;
+
+    if (snapshot_stat_top("rescan", top, &top_bytes, &st) < 0)
+        goto exit;
+    return_bytes = PyBytes_Check(top);
+    snapshot_bytes = encode_fs_name(snapshot_file);
+    if (!snapshot_bytes)
+        goto exit;
+    if (out_file != Py_None) {
+        out_bytes = encode_fs_name(out_file);
+        if (!out_bytes)
+            goto exit;
+    }
+
+    SCANDIR_BEGIN_ALLOW_THREADS
+    status = snapshot_map_open(&old, PyBytes_AS_STRING(snapshot_bytes));
+    SCANDIR_END_ALLOW_THREADS
+    if (status == -1) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, snapshot_file);
+        goto exit;
+    }
+    if (status == -2) {
+        PyErr_SetString(PyExc_ValueError,
+                        "rescan: not a snapshot file written on this platform");
+        goto exit;
+    }
+
+    w.old = &old;
+    w.check_files = check_files;
+    if (snapshot_run(&w, top, PyBytes_AS_STRING(top_bytes), PyBytes_GET_SIZE(top_bytes),
+                     &st, out_bytes ? out_file : NULL,
+                     out_bytes ? PyBytes_AS_STRING(out_bytes) : NULL,
+                     return_bytes ? SNAPSHOT_FLAG_BYTES : 0) < 0)
+        goto exit;
+    if (snapshot_report_errors(&w, onerror, return_bytes) < 0)
+        goto exit;
+
+    for (i = 0; i < 3; i++) {
+        lists[i] = PyList_New(0);
+        if (!lists[i])
+            goto exit;
+    }
+    for (pos = 0; pos < w.changes_len; pos += len + 2) {
+        len = strlen(w.changes + pos + 1);
+        path = decode_fs_name(return_bytes, w.changes + pos + 1, len);
+        if (!path)
+            goto exit;
+        i = w.changes[pos] == RESCAN_ADDED ? 0 : w.changes[pos] == RESCAN_REMOVED ? 1 : 2;
+        status = PyList_Append(lists[i], path);
+        Py_DECREF(path);
+        if (status < 0)
+            goto exit;
+    }
+    result = PyTuple_Pack(3, lists[0], lists[1], lists[2]);
+
+exit:
+    SCANDIR_BEGIN_ALLOW_THREADS
+    snapshot_writer_free(&w);
+    snapshot_map_close(&old);
+    SCANDIR_END_ALLOW_THREADS
+    for (i = 0; i < 3; i++)
+        Py_XDECREF(lists[i]);
+    Py_XDECREF(top_bytes);
+    Py_XDECREF(snapshot_bytes);
+    Py_XDECREF(out_bytes);
+    return result;
+}
+
+#endif /* !MS_WINDOWS */
+
+
+/* SECTION: Tree diffs (POSIX only)
+
+diff_trees() walks two trees in lockstep. Each DiffFrame holds a
+directory of both trees open: both are read into sorted name lists and
+merged (with the GIL released), noting names found on only one side and
+entries that differ, and the names of subdirectories present on both
+sides to walk into next. The name lists are freed once merged, so memory
+use is bounded by the size of the largest directory times the depth of
+the tree. Only the last few frames keep their directories open for
+openat() and fstatat(), so that deep trees don't run out of file
+descriptors; older frames' directories are closed, and their entries
+reached by path. Entry types come from d_type where the file system
+provides it, and entries are only lstat'ed when a type is unknown or when
+compare asks for their size, mtime or mode. Symlinks are compared as
+links and never followed.
+*/
+
+#ifndef MS_WINDOWS
+
+/* Fields diff_trees() can compare */
+#define DIFF_SIZE 1
+#define DIFF_MTIME 2
+#define DIFF_MODE 4
+
+/* Kinds of difference, stored in DiffFrame.changes */
+#define DIFF_ADDED 'a'
+#define DIFF_REMOVED 'r'
+#define DIFF_MODIFIED 'm'
+
+PyDoc_STRVAR(diff_trees__doc__,
+"diff_trees(a, b, compare=('size', 'mtime'), onerror=None) -> iterator of\n\
+(kind, path, is_dir) tuples\n\n\
+Walk the trees at a and b in lockstep and yield the differences between\n\
+them: kind is 'added' (only in b), 'removed' (only in a) or 'modified',\n\
+path is relative to a and b, and is_dir tells whether the entry is a\n\
+directory in b (in a for removed entries). Added and removed directories\n\
+are reported once, without their contents. An entry is modified if its\n\
+type differs or, for non-directories, any of the stat fields named in\n\
+compare ('size', 'mtime', 'mode') does. onerror is called with an\n\
+OSError for each directory that couldn't be read.");
+
+typedef struct {
+    Py_ssize_t offset;
+    char *name;
+    Py_ssize_t name_len;
+    unsigned char d_type;
+} DiffName;
+
+/* A directory of one of the trees */
+typedef struct {
+    DirReader reader;
+    char *path;
+    char *names;
+    Py_ssize_t names_len;
+    Py_ssize_t names_size;
+    DiffName *entries;
+    Py_ssize_t num_entries;
+    Py_ssize_t entries_size;
+} DiffSide;
+
+typedef struct {
+    DiffSide a;
+    DiffSide b;
+    char *rel;                  /* relative path, "" for the tops */
+    /* The differences found, each a kind character and an is_dir
+       character followed by a NUL-terminated name */
+    char *changes;
+    Py_ssize_t changes_len;
+    Py_ssize_t changes_size;
+    Py_ssize_t changes_pos;
+    /* NUL-separated names of subdirectories on both sides */
+    char *walk_into;
+    Py_ssize_t walk_into_len;
+    Py_ssize_t walk_into_size;
+    Py_ssize_t walk_into_pos;
+} DiffFrame;
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *onerror;
+    char *a_path;
+    char *b_path;
+    int compare;
+    int return_bytes;
+    int started;
+    DiffFrame *stack;
+    Py_ssize_t depth;
+    Py_ssize_t stack_size;
+} DiffIterator;
+
+/* Append prefix (prefix_len bytes) then the NUL-terminated name to a
+   growable buffer. Return 0 on success or -1 with errno set. */
+static int
+diff_buffer_add(char **buffer, Py_ssize_t *len, Py_ssize_t *size,
+                const char *prefix, Py_ssize_t prefix_len,
+                const char *name, Py_ssize_t name_len)
+{
+    Py_ssize_t needed = *len + prefix_len + name_len + 1;
+
+    if (needed > *size) {
+        Py_ssize_t new_size = *size ? *size * 2 : 256;
+        char *new_buffer;
+        while (new_size < needed)
+            new_size *= 2;
+        new_buffer = realloc(*buffer, new_size);
+        if (!new_buffer) {
+            errno = ENOMEM;
+            return -1;
+        }
+        *buffer = new_buffer;
+        *size = new_size;
+    }
+    if (prefix_len)
+        memcpy(*buffer + *len, prefix, prefix_len);
+    memcpy(*buffer + *len + prefix_len, name, name_len);
+    (*buffer)[needed - 1] = '\0';
+    *len = needed;
+    return 0;
+}
+
+static int
+diff_name_cmp(const void *a, const void *b)
+{
+    const DiffName *x = a, *y = b;
+    int result = memcmp(x->name, y->name,
+                        x->name_len < y->name_len ? x->name_len : y->name_len);
+
+    if (result)
+        return result;
+    return x->name_len < y->name_len ? -1 : x->name_len > y->name_len;
+}
+
+/* Read the names in side's directory and sort them. Return 0 on success
+   or -1 with errno set. */
+static int
+diff_side_read(DiffSide *side)
+{
+    DirRecord record;
+    DiffName *entry;
+    Py_ssize_t offset, i;
+    int status;
+
+    while (1) {
+        if (!dir_reader_next(&side->reader, &record)) {
+            status = dir_reader_fill(&side->reader);
+            if (status < 0)
+                return -1;
+            if (status == 0)
+                break;
+            continue;
+        }
+        if (side->num_entries == side->entries_size) {
+            Py_ssize_t new_size = side->entries_size ? side->entries_size * 2 : 64;
+            DiffName *entries = realloc(side->entries, new_size * sizeof(DiffName));
+            if (!entries) {
+                errno = ENOMEM;
+                return -1;
+            }
+            side->entries = entries;
+            side->entries_size = new_size;
+        }
+        /* Keep the NUL terminators for fstatat() */
+        offset = side->names_len;
+        if (diff_buffer_add(&side->names, &side->names_len, &side->names_size,
+                            NULL, 0, record.name, record.name_len) < 0)
+            return -1;
+        entry = &side->entries[side->num_entries++];
+        entry->offset = offset;
+        entry->name_len = record.name_len;
+        entry->d_type = record.d_type;
+    }
+    dir_reader_release_buffer(&side->reader);
+
+    for (i = 0; i < side->num_entries; i++)
+        side->entries[i].name = side->names + side->entries[i].offset;
+    if (side->num_entries)
+        qsort(side->entries, side->num_entries, sizeof(DiffName), diff_name_cmp);
+    return 0;
+}
+
+/* Free side's name list but keep its directory open */
+static void
+diff_side_free_names(DiffSide *side)
+{
+    free(side->names);
+    side->names = NULL;
+    side->names_len = side->names_size = 0;
+    free(side->entries);
+    side->entries = NULL;
+    side->num_entries = side->entries_size = 0;
+}
+
+static void
+diff_side_clear(DiffSide *side)
+{
+    dir_reader_close(&side->reader);
+    free(side->path);
+    side->path = NULL;
+    diff_side_free_names(side);
+}
+
+/* Return the S_IFMT type of entry, from its d_type if known, else by
+   lstat'ing it (in which case *have_st is set). Return 0 if it no longer
+   exists. */
+static mode_t
+diff_entry_type(DiffSide *side, DiffName *entry, struct stat *st, int *have_st)
+{
+    *have_st = 0;
+#ifdef HAVE_DIRENT_D_TYPE
+    switch (entry->d_type) {
+    case DT_DIR:
+        return S_IFDIR;
+    case DT_REG:
+        return S_IFREG;
+    case DT_LNK:
+        return S_IFLNK;
+    case DT_FIFO:
+        return S_IFIFO;
+    case DT_CHR:
+        return S_IFCHR;
+    case DT_BLK:
+        return S_IFBLK;
+#ifdef S_IFSOCK
+    case DT_SOCK:
+        return S_IFSOCK;
+#endif
+    }
+#endif
+    if (stat_at(&side->reader, side->path, entry->name, entry->name_len, st, 0) < 0)
+        return 0;
+    *have_st = 1;
+    return st->st_mode & S_IFMT;
+}
+
+static int64_t
+diff_mtime_ns(struct stat *st)
+{
+    unsigned long nsec;
+
+#if defined(HAVE_STAT_TV_NSEC)
+    nsec = st->st_mtim.tv_nsec;
+#elif defined(HAVE_STAT_TV_NSEC2)
+    nsec = st->st_mtimespec.tv_nsec;
+#elif defined(HAVE_STAT_NSEC)
+    nsec = st->st_mtime_nsec;
+#else
+    nsec = 0;
+#endif
+    return (int64_t)st->st_mtime * 1000000000 + nsec;
+}
+
+/* Return 1 if the compared fields of two stat results differ, else 0 */
+static int
+diff_stat_differs(struct stat *a, struct stat *b, int compare)
+{
+    if ((compare & DIFF_SIZE) && a->st_size != b->st_size)
+        return 1;
+    if ((compare & DIFF_MTIME) && diff_mtime_ns(a) != diff_mtime_ns(b))
+        return 1;
+    if ((compare & DIFF_MODE) && a->st_mode != b->st_mode)
+        return 1;
+    return 0;
+}
+
+static int
+diff_add_change(DiffFrame *frame, char kind, int is_dir, DiffName *entry)
+{
+    char prefix[2];
+
+    prefix[0] = kind;
+    prefix[1] = is_dir ? 'd' : '-';
+    return diff_buffer_add(&frame->changes, &frame->changes_len, &frame->changes_size,
+                           prefix, 2, entry->name, entry->name_len);
+}
+
+/* Compare an entry that's in both a and b. Return 0 on success or -1
+   with errno set. */
+static int
+diff_compare_entry(DiffFrame *frame, DiffName *a, DiffName *b, int compare)
+{
+    struct stat a_st, b_st;
+    int a_have_st, b_have_st;
+    mode_t a_type = diff_entry_type(&frame->a, a, &a_st, &a_have_st);
+    mode_t b_type = diff_entry_type(&frame->b, b, &b_st, &b_have_st);
+
+    /* Treat entries that vanished while being compared as missing */
+    if (!a_type || !b_type) {
+        if (a_type)
+            return diff_add_change(frame, DIFF_REMOVED, a_type == S_IFDIR, a);
+        if (b_type)
+            return diff_add_change(frame, DIFF_ADDED, b_type == S_IFDIR, b);
+        return 0;
+    }
+    if (a_type != b_type)
+        return diff_add_change(frame, DIFF_MODIFIED, b_type == S_IFDIR, b);
+    if (a_type == S_IFDIR)
+        return diff_buffer_add(&frame->walk_into, &frame->walk_into_len,
+                               &frame->walk_into_size, NULL, 0, a->name, a->name_len);
+    if (!compare)
+        return 0;
+
+    if (!a_have_st &&
+            stat_at(&frame->a.reader, frame->a.path, a->name, a->name_len, &a_st, 0) < 0)
+        return diff_add_change(frame, DIFF_ADDED, 0, b);
+    if (!b_have_st &&
+            stat_at(&frame->b.reader, frame->b.path, b->name, b->name_len, &b_st, 0) < 0)
+        return diff_add_change(frame, DIFF_REMOVED, 0, a);
+    if (diff_stat_differs(&a_st, &b_st, compare))
+        return diff_add_change(frame, DIFF_MODIFIED, 0, b);
+    return 0;
+}
+
+/* Merge the sorted name lists of frame's two directories. Return 0 on
+   success or -1 with errno set. */
+static int
+diff_merge(DiffFrame *frame, int compare)
+{
+    DiffName *a, *b;
+    Py_ssize_t i = 0, j = 0;
+    struct stat st;
+    int have_st, cmp, result;
+
+    while (i < frame->a.num_entries || j < frame->b.num_entries) {
+        a = i < frame->a.num_entries ? &frame->a.entries[i] : NULL;
+        b = j < frame->b.num_entries ? &frame->b.entries[j] : NULL;
+        cmp = !a ? 1 : !b ? -1 : diff_name_cmp(a, b);
+        if (cmp < 0) {
+            mode_t type = diff_entry_type(&frame->a, a, &st, &have_st);
+            result = type ? diff_add_change(frame, DIFF_REMOVED, type == S_IFDIR, a) : 0;
+            i++;
+        }
+        else if (cmp > 0) {
+            mode_t type = diff_entry_type(&frame->b, b, &st, &have_st);
+            result = type ? diff_add_change(frame, DIFF_ADDED, type == S_IFDIR, b) : 0;
+            j++;
+        }
+        else {
+            result = diff_compare_entry(frame, a, b, compare);
+            i++;
+            j++;
+        }
+        if (result < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void
+diff_frame_clear(DiffFrame *frame)
+{
+    diff_side_clear(&frame->a);
+    diff_side_clear(&frame->b);
+    free(frame->rel);
+    free(frame->changes);
+    free(frame->walk_into);
+}
+
+/* Open, read and merge a directory of each tree (relative to the frame
+   at the top of the stack if name isn't NULL). Called with the GIL
+   released. Return 0 on success, or -1 with errno set and *error_path
+   set to the directory that failed, or NULL if out of memory. */
+static int
+diff_frame_read(DiffIterator *it, DiffFrame *frame, const char *name,
+                Py_ssize_t name_len, char **error_path)
+{
+    DiffFrame *parent = name ? &it->stack[it->depth - 1] : NULL;
+    DiffSide *sides[2];
+    DiffSide *parent_side;
+    int i, result;
+
+    sides[0] = &frame->a;
+    sides[1] = &frame->b;
+    *error_path = NULL;
+    for (i = 0; i < 2; i++) {
+        if (!sides[i]->path)
+            return -1;
+        if (parent) {
+            parent_side = i == 0 ? &parent->a : &parent->b;
+            result = dir_reader_open_at(&sides[i]->reader, &parent_side->reader,
+                                        parent_side->path, name, name_len,
+                                        DIR_READER_DEFAULT_BUFFER_SIZE);
+        }
+        else
+            result = dir_reader_open(&sides[i]->reader, sides[i]->path,
+                                     DIR_READER_DEFAULT_BUFFER_SIZE);
+        if (result < 0 || diff_side_read(sides[i]) < 0) {
+            *error_path = sides[i]->path;
+            return -1;
+        }
+    }
+
+    result = diff_merge(frame, it->compare);
+    diff_side_free_names(&frame->a);
+    diff_side_free_names(&frame->b);
+    return result;
+}
+
+/* Push a frame for the directory rel of both trees; name is its name in
+   the directory of the frame at the top of the stack, or NULL for the
+   tops. Takes ownership of rel, a_path and b_path. Return 1 if a frame
+   was pushed, 0 if a directory couldn't be read (and the error was
+   passed to onerror), or -1 with a Python exception set. */
+static int
+diff_push(DiffIterator *it, char *rel, char *a_path, char *b_path,
+          const char *name, Py_ssize_t name_len)
+{
+    DiffFrame *frame;
+    PyObject *filename;
+    char *error_path;
+    int result, error;
+
+    if (it->depth == it->stack_size) {
+        Py_ssize_t new_size = it->stack_size ? it->stack_size * 2 : 16;
+        DiffFrame *stack = PyMem_Resize(it->stack, DiffFrame, new_size);
+        if (!stack) {
+            free(rel);
+            free(a_path);
+            free(b_path);
+            PyErr_NoMemory();
+            return -1;
+        }
+        it->stack = stack;
+        it->stack_size = new_size;
+    }
+
+    frame = &it->stack[it->depth];
+    memset(frame, 0, sizeof(DiffFrame));
+    frame->rel = rel;
+    frame->a.path = a_path;
+    frame->b.path = b_path;
+    if (!rel) {
+        diff_frame_clear(frame);
+        PyErr_NoMemory();
+        return -1;
+    }
 
-#if PY_MAJOR_VERSION < 3 && defined(MS_WINDOWS)
+    SCANDIR_BEGIN_ALLOW_THREADS
+    result = diff_frame_read(it, frame, name, name_len, &error_path);
+    SCANDIR_END_ALLOW_THREADS
 
-PyObject *DirEntry_name_getter(DirEntry *self, void *closure) {
-    if (self->name_path_bytes) {
-        return PyUnicode_EncodeMBCS(PyUnicode_AS_UNICODE(self->name),
-                                    PyUnicode_GetSize(self->name), "strict");
-    } else {
-        Py_INCREF(self->name);
-        return self->name;
+    if (result < 0) {
+        error = errno;
+        if (!error_path) {
+            diff_frame_clear(frame);
+            PyErr_NoMemory();
+            return -1;
+        }
+        filename = decode_fs_name(it->return_bytes, error_path, strlen(error_path));
+        diff_frame_clear(frame);
+        if (!filename)
+            return -1;
+        result = walk_onerror(it->onerror, error, filename);
+        Py_DECREF(filename);
+        return result;
     }
-}
 
-PyObject *DirEntry_path_getter(DirEntry *self, void *closure) {
-    if (self->name_path_bytes) {
-        return PyUnicode_EncodeMBCS(PyUnicode_AS_UNICODE(self->path),
-                                    PyUnicode_GetSize(self->path), "strict");
-    } else {
-        Py_INCREF(self->path);
-        return self->path;
+    it->depth++;
+    /* Each frame has two directories open, so keep half as many frames
+       open as the other walks do */
+    if (it->depth > DIR_READER_OPEN_PARENTS / 2) {
+        frame = &it->stack[it->depth - 1 - DIR_READER_OPEN_PARENTS / 2];
+        SCANDIR_BEGIN_ALLOW_THREADS
+        dir_reader_close(&frame->a.reader);
+        dir_reader_close(&frame->b.reader);
+        SCANDIR_END_ALLOW_THREADS
     }
+    return 1;
 }
 
-static PyGetSetDef DirEntry_getset[] = {
-    {"name", (getter)DirEntry_name_getter, NULL,
-     "the entry's base filename, relative to scandir() \"path\" argument", NULL},
-    {"path", (getter)DirEntry_path_getter, NULL,
-     "the entry's full path name; equivalent to os.path.join(scandir_path, entry.name)", NULL},
-    {NULL}
-};
-
-#else
+static void
+diff_pop(DiffIterator *it)
+{
+    it->depth--;
+    SCANDIR_BEGIN_ALLOW_THREADS
+    diff_frame_clear(&it->stack[it->depth]);
+    SCANDIR_END_ALLOW_THREADS
+}
 
-static PyMemberDef DirEntry_members[] = {
-    {"name", T_OBJECT_EX, offsetof(DirEntry, name), READONLY,
-     "the entry's base filename, relative to scandir() \"path\" argument"},
-    {"path", T_OBJECT_EX, offsetof(DirEntry, path), READONLY,
-     "the entry's full path name; equivalent to os.path.join(scandir_path, entry.name)"},
-    {NULL}
-};
+/* Return a malloc'ed "rel/name", or a copy of name if rel is empty */
+static char *
+diff_join(const char *rel, const char *name, Py_ssize_t name_len)
+{
+    char *path;
 
-#endif
+    if (*rel)
+        return join_path_raw(rel, name, name_len);
+    path = malloc(name_len + 1);
+    if (path) {
+        memcpy(path, name, name_len);
+        path[name_len] = '\0';
+    }
+    return path;
+}
 
 static PyObject *
-DirEntry_repr(DirEntry *self)
+DiffIterator_iternext(DiffIterator *it)
 {
-#if PY_MAJOR_VERSION >= 3
-    return PyUnicode_FromFormat("<DirEntry %R>", self->name);
-#elif defined(MS_WINDOWS)
-    PyObject *name;
-    PyObject *name_repr;
-    PyObject *entry_repr;
+    DiffFrame *frame;
+    PyObject *path_obj;
+    const char *kind, *name;
+    char *path;
+    Py_ssize_t name_len;
+    int is_dir;
 
-    name = DirEntry_name_getter(self, NULL);
-    if (!name)
-        return NULL;
-    name_repr = PyObject_Repr(name);
-    Py_DECREF(name);
-    if (!name_repr)
-        return NULL;
-    entry_repr = PyString_FromFormat("<DirEntry %s>", PyString_AsString(name_repr));
-    Py_DECREF(name_repr);
-    return entry_repr;
-#else
-    PyObject *name_repr;
-    PyObject *entry_repr;
+    if (!it->started) {
+        it->started = 1;
+        if (diff_push(it, strdup(""), strdup(it->a_path), strdup(it->b_path),
+                      NULL, 0) < 0)
+            return NULL;
+    }
 
-    name_repr = PyObject_Repr(self->name);
-    if (!name_repr)
-        return NULL;
-    entry_repr = PyString_FromFormat("<DirEntry %s>", PyString_AsString(name_repr));
-    Py_DECREF(name_repr);
-    return entry_repr;
-#endif
+    while (it->depth > 0) {
+        frame = &it->stack[it->depth - 1];
+
+        if (frame->changes_pos < frame->changes_len) {
+            name = frame->changes + frame->changes_pos + 2;
+            name_len = strlen(name);
+            kind = frame->changes[frame->changes_pos] == DIFF_ADDED ? "added" :
+                   frame->changes[frame->changes_pos] == DIFF_REMOVED ? "removed" :
+                   "modified";
+            is_dir = frame->changes[frame->changes_pos + 1] == 'd';
+            frame->changes_pos += name_len + 3;
+
+            path = diff_join(frame->rel, name, name_len);
+            if (!path)
+                return PyErr_NoMemory();
+            path_obj = decode_fs_name(it->return_bytes, path, strlen(path));
+            free(path);
+            if (!path_obj)
+                return NULL;
+            return Py_BuildValue("(sNO)", kind, path_obj, is_dir ? Py_True : Py_False);
+        }
+
+        if (frame->walk_into_pos < frame->walk_into_len) {
+            name = frame->walk_into + frame->walk_into_pos;
+            name_len = strlen(name);
+            frame->walk_into_pos += name_len + 1;
+            if (diff_push(it, diff_join(frame->rel, name, name_len),
+                          join_path_raw(frame->a.path, name, name_len),
+                          join_path_raw(frame->b.path, name, name_len),
+                          name, name_len) < 0)
+                return NULL;
+            continue;
+        }
+
+        diff_pop(it);
+    }
+
+    PyErr_SetNone(PyExc_StopIteration);
+    return NULL;
 }
 
-static PyMethodDef DirEntry_methods[] = {
-    {"is_dir", (PyCFunction)DirEntry_is_dir, METH_VARARGS | METH_KEYWORDS,
-     "return True if the entry is a directory; cached per entry"
-    },
-    {"is_file", (PyCFunction)DirEntry_is_file, METH_VARARGS | METH_KEYWORDS,
-     "return True if the entry is a file; cached per entry"
-    },
-    {"is_symlink", (PyCFunction)DirEntry_py_is_symlink, METH_NOARGS,
-     "return True if the entry is a symbolic link; cached per entry"
-    },
-    {"stat", (PyCFunction)DirEntry_stat, METH_VARARGS | METH_KEYWORDS,
-     "return stat_result object for the entry; cached per entry"
-    },
-    {"inode", (PyCFunction)DirEntry_inode, METH_NOARGS,
-     "return inode of the entry; cached per entry",
-    },
-    {NULL}
-};
+static void
+DiffIterator_dealloc(DiffIterator *it)
+{
+    while (it->depth > 0)
+        diff_pop(it);
+    PyMem_Free(it->stack);
+    free(it->a_path);
+    free(it->b_path);
+    Py_XDECREF(it->onerror);
+    Py_TYPE(it)->tp_free((PyObject *)it);
+}
 
-static PyTypeObject DirEntryType = {
+static PyTypeObject DiffIteratorType = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    MODNAME ".DirEntry",                    /* tp_name */
-    sizeof(DirEntry),                       /* tp_basicsize */
+    MODNAME ".DiffIterator",                /* tp_name */
+    sizeof(DiffIterator),                   /* tp_basicsize */
     0,                                      /* tp_itemsize */
     /* methods */
-    (destructor)DirEntry_dealloc,           /* tp_dealloc */
+    (destructor)DiffIterator_dealloc,       /* tp_dealloc */
     0,                                      /* tp_print */
     0,                                      /* tp_getattr */
     0,                                      /* tp_setattr */
     0,                                      /* tp_compare */
-    (reprfunc)DirEntry_repr,                /* tp_repr */
+    0,                                      /* tp_repr */
     0,                                      /* tp_as_number */
     0,                                      /* tp_as_sequence */
     0,                                      /* tp_as_mapping */
@@ -1342,334 +9362,493 @@ static PyTypeObject DirEntryType = {
     0,                                      /* tp_clear */
     0,                                      /* tp_richcompare */
     0,                                      /* tp_weaklistoffset */
-    0,                                      /* tp_iter */
-    0,                                      /* tp_iternext */
-    DirEntry_methods,                       /* tp_methods */
-#if PY_MAJOR_VERSION < 3 && defined(MS_WINDOWS)
-    NULL,                                   /* tp_members */
-    DirEntry_getset,                        /* tp_getset */
-#else
-    DirEntry_members,                       /* tp_members */
-    NULL,                                   /* tp_getset */
-#endif
+    PyObject_SelfIter,                      /* tp_iter */
+    (iternextfunc)DiffIterator_iternext,    /* tp_iternext */
 };
 
-#ifdef MS_WINDOWS
-
-static wchar_t *
-join_path_filenameW(wchar_t *path_wide, wchar_t* filename)
+/* Convert compare, a sequence of stat field names, to DIFF_* flags.
+   Return 0 on success, -1 with an exception set on error. */
+static int
+diff_compare_flags(PyObject *compare, int *flags)
 {
-    Py_ssize_t path_len;
-    Py_ssize_t size;
-    wchar_t *result;
-    wchar_t ch;
-
-    if (!path_wide) { /* Default arg: "." */
-        path_wide = L".";
-        path_len = 1;
-    }
-    else {
-        path_len = wcslen(path_wide);
-    }
-
-    /* The +1's are for the path separator and the NUL */
-    size = path_len + 1 + wcslen(filename) + 1;
-    result = PyMem_New(wchar_t, size);
-    if (!result) {
-        PyErr_NoMemory();
-        return NULL;
-    }
-    wcscpy(result, path_wide);
-    if (path_len > 0) {
-        ch = result[path_len - 1];
-        if (ch != SEP && ch != ALTSEP && ch != L':')
-            result[path_len++] = SEP;
-        wcscpy(result + path_len, filename);
+    static const char *names[] = {"size", "mtime", "mode"};
+    PyObject *seq, *item;
+    Py_ssize_t i;
+    int j;
+
+    seq = PySequence_Fast(compare, "compare must be a sequence of field names");
+    if (!seq)
+        return -1;
+    *flags = 0;
+    for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        for (j = 0; j < 3; j++) {
+            if (str_equals(item, names[j]))
+                break;
+        }
+        if (j == 3) {
+            PyErr_SetString(PyExc_ValueError,
+                            "diff_trees: compare fields must be 'size', 'mtime' or 'mode'");
+            break;
+        }
+        *flags |= 1 << j;
     }
-    return result;
+    Py_DECREF(seq);
+    return PyErr_Occurred() ? -1 : 0;
 }
 
 static PyObject *
-DirEntry_from_find_data(path_t *path, WIN32_FIND_DATAW *dataW)
+scandir_diff_trees(PyObject *self, PyObject *args, PyObject *kwargs)
 {
-    DirEntry *entry;
-    BY_HANDLE_FILE_INFORMATION file_info;
-    ULONG reparse_tag;
-    wchar_t *joined_path;
-
-    entry = PyObject_New(DirEntry, &DirEntryType);
-    if (!entry)
+    static char *keywords[] = {"a", "b", "compare", "onerror", NULL};
+    PyObject *a, *b, *a_bytes = NULL, *b_bytes = NULL;
+    PyObject *compare = NULL;
+    PyObject *onerror = Py_None;
+    DiffIterator *it = NULL;
+    struct stat st;
+    int flags = DIFF_SIZE | DIFF_MTIME;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|OO:diff_trees", keywords,
+                                     &a, &b, &compare, &onerror))
         return NULL;
-    entry->name = NULL;
-    entry->path = NULL;
-    entry->stat = NULL;
-    entry->lstat = NULL;
-    entry->got_file_index = 0;
-#if PY_MAJOR_VERSION < 3
-    entry->name_path_bytes = path->object && PyBytes_Check(path->object);
-#endif
+    if (compare && diff_compare_flags(compare, &flags) < 0)
+        return NULL;
+    if (snapshot_stat_top("diff_trees", a, &a_bytes, &st) < 0 ||
+            snapshot_stat_top("diff_trees", b, &b_bytes, &st) < 0)
+        goto exit;
 
-    entry->name = PyUnicode_FromWideChar(dataW->cFileName, wcslen(dataW->cFileName));
-    if (!entry->name)
-        goto error;
+    it = PyObject_New(DiffIterator, &DiffIteratorType);
+    if (!it)
+        goto exit;
+    Py_INCREF(onerror);
+    it->onerror = onerror;
+    it->a_path = strdup(PyBytes_AS_STRING(a_bytes));
+    it->b_path = strdup(PyBytes_AS_STRING(b_bytes));
+    it->compare = flags;
+    it->return_bytes = PyBytes_Check(a);
+    it->started = 0;
+    it->stack = NULL;
+    it->depth = 0;
+    it->stack_size = 0;
+    if (!it->a_path || !it->b_path) {
+        Py_CLEAR(it);
+        PyErr_NoMemory();
+    }
 
-    joined_path = join_path_filenameW(path->wide, dataW->cFileName);
-    if (!joined_path)
-        goto error;
+exit:
+    Py_XDECREF(a_bytes);
+    Py_XDECREF(b_bytes);
+    return (PyObject *)it;
+}
 
-    entry->path = PyUnicode_FromWideChar(joined_path, wcslen(joined_path));
-    PyMem_Free(joined_path);
-    if (!entry->path)
-        goto error;
+#endif /* !MS_WINDOWS */
 
-    find_data_to_file_info_w(dataW, &file_info, &reparse_tag);
-    _Py_attribute_data_to_stat(&file_info, reparse_tag, &entry->win32_lstat);
 
-    return (PyObject *)entry;
+/* SECTION: inotify watches (Linux only)
 
-error:
-    Py_DECREF(entry);
-    return NULL;
-}
+Thin wrappers around the inotify system calls for scandir.TreeCache,
+which keeps an in-memory copy of a tree current as it changes. The
+descriptor is non-blocking; inotify_read() waits for events with poll()
+with the GIL released, then returns everything one read() gets as a list
+of (wd, mask, cookie, name) tuples, name being bytes or None. The IN_*
+mask constants are defined in scandir.py.
+*/
 
-#else /* POSIX */
+#if !defined(MS_WINDOWS) && defined(__linux__)
 
-static char *
-join_path_filename(char *path_narrow, char* filename, Py_ssize_t filename_len)
+#include <poll.h>
+#include <sys/inotify.h>
+
+#define HAVE_INOTIFY 1
+#define INOTIFY_BUFFER_SIZE 65536
+
+PyDoc_STRVAR(inotify_init__doc__,
+"inotify_init() -> fd\n\n\
+Create a non-blocking, close-on-exec inotify instance.");
+
+static PyObject *
+scandir_inotify_init(PyObject *self, PyObject *args)
 {
-    Py_ssize_t path_len;
-    Py_ssize_t size;
-    char *result;
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 
-    if (!path_narrow) { /* Default arg: "." */
-        path_narrow = ".";
-        path_len = 1;
-    }
-    else {
-        path_len = strlen(path_narrow);
-    }
+    if (fd < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    return PyLong_FromLong(fd);
+}
 
-    if (filename_len == -1)
-        filename_len = strlen(filename);
+PyDoc_STRVAR(inotify_add_watch__doc__,
+"inotify_add_watch(fd, path, mask) -> wd\n\n\
+Watch path for the events in mask; watching a directory that's already\n\
+watched returns the same wd. Raises OSError with errno ENOSPC when the\n\
+fs.inotify.max_user_watches limit is reached.");
 
-    /* The +1's are for the path separator and the NUL */
-    size = path_len + 1 + filename_len + 1;
-    result = PyMem_New(char, size);
-    if (!result) {
-        PyErr_NoMemory();
+static PyObject *
+scandir_inotify_add_watch(PyObject *self, PyObject *args)
+{
+    PyObject *path, *path_bytes;
+    unsigned int mask;
+    int fd, wd;
+
+    if (!PyArg_ParseTuple(args, "iOI:inotify_add_watch", &fd, &path, &mask))
         return NULL;
-    }
-    strcpy(result, path_narrow);
-    if (path_len > 0 && result[path_len - 1] != '/')
-        result[path_len++] = '/';
-    strcpy(result + path_len, filename);
-    return result;
+    path_bytes = encode_fs_name(path);
+    if (!path_bytes)
+        return NULL;
+    SCANDIR_BEGIN_ALLOW_THREADS
+    wd = inotify_add_watch(fd, PyBytes_AS_STRING(path_bytes), mask);
+    SCANDIR_END_ALLOW_THREADS
+    Py_DECREF(path_bytes);
+    if (wd < 0)
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+    return PyLong_FromLong(wd);
 }
 
+PyDoc_STRVAR(inotify_rm_watch__doc__,
+"inotify_rm_watch(fd, wd)\n\n\
+Stop watching wd. Errors (say if the watch is already gone) are ignored.");
+
 static PyObject *
-DirEntry_from_posix_info(path_t *path, char *name, Py_ssize_t name_len,
-                         ino_t d_ino
-#ifdef HAVE_DIRENT_D_TYPE
-                         , unsigned char d_type
-#endif
-                         )
+scandir_inotify_rm_watch(PyObject *self, PyObject *args)
 {
-    DirEntry *entry;
-    char *joined_path;
+    int fd, wd;
 
-    entry = PyObject_New(DirEntry, &DirEntryType);
-    if (!entry)
+    if (!PyArg_ParseTuple(args, "ii:inotify_rm_watch", &fd, &wd))
         return NULL;
-    entry->name = NULL;
-    entry->path = NULL;
-    entry->stat = NULL;
-    entry->lstat = NULL;
+    inotify_rm_watch(fd, wd);
+    Py_RETURN_NONE;
+}
 
-    joined_path = join_path_filename(path->narrow, name, name_len);
-    if (!joined_path)
-        goto error;
+PyDoc_STRVAR(inotify_read__doc__,
+"inotify_read(fd, timeout_ms=-1) -> [(wd, mask, cookie, name), ...]\n\n\
+Wait up to timeout_ms milliseconds (forever if negative) for events and\n\
+return those that are ready, or an empty list if there are none.");
 
-    if (!path->narrow || !PyBytes_Check(path->object)) {
-#if PY_MAJOR_VERSION >= 3
-        entry->name = PyUnicode_DecodeFSDefaultAndSize(name, name_len);
-        entry->path = PyUnicode_DecodeFSDefault(joined_path);
-#else
-        entry->name = PyUnicode_Decode(name, name_len,
-                                       FS_ENCODING, "strict");
-        entry->path = PyUnicode_Decode(joined_path, strlen(joined_path),
-                                       FS_ENCODING, "strict");
-#endif
-    }
-    else {
-        entry->name = PyBytes_FromStringAndSize(name, name_len);
-        entry->path = PyBytes_FromString(joined_path);
+static PyObject *
+scandir_inotify_read(PyObject *self, PyObject *args)
+{
+    struct pollfd pfd;
+    struct inotify_event *event;
+    PyObject *list = NULL, *name, *item;
+    char *buffer;
+    ssize_t n = 0, pos;
+    int fd, timeout_ms = -1, status;
+
+    if (!PyArg_ParseTuple(args, "i|i:inotify_read", &fd, &timeout_ms))
+        return NULL;
+    buffer = PyMem_Malloc(INOTIFY_BUFFER_SIZE);
+    if (!buffer)
+        return PyErr_NoMemory();
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    SCANDIR_BEGIN_ALLOW_THREADS
+    status = poll(&pfd, 1, timeout_ms);
+    if (status > 0)
+        n = read(fd, buffer, INOTIFY_BUFFER_SIZE);
+    SCANDIR_END_ALLOW_THREADS
+    if (status < 0 || n < 0) {
+        if (errno == EINTR) {
+            if (PyErr_CheckSignals() < 0)
+                goto exit;
+            n = 0;
+        }
+        else if (errno == EAGAIN)
+            n = 0;
+        else {
+            PyErr_SetFromErrno(PyExc_OSError);
+            goto exit;
+        }
     }
-    PyMem_Free(joined_path);
-    if (!entry->name || !entry->path)
-        goto error;
-
-#ifdef HAVE_DIRENT_D_TYPE
-    entry->d_type = d_type;
-#endif
-    entry->d_ino = d_ino;
 
-    return (PyObject *)entry;
+    list = PyList_New(0);
+    if (!list)
+        goto exit;
+    for (pos = 0; pos < n; pos += sizeof(struct inotify_event) + event->len) {
+        event = (struct inotify_event *)(buffer + pos);
+        if (event->len) {
+            /* The name is padded with NULs */
+            name = PyBytes_FromString(event->name);
+            if (!name)
+                goto error;
+        }
+        else {
+            Py_INCREF(Py_None);
+            name = Py_None;
+        }
+        item = Py_BuildValue("(iIIN)", event->wd, event->mask, event->cookie, name);
+        if (!item)
+            goto error;
+        status = PyList_Append(list, item);
+        Py_DECREF(item);
+        if (status < 0)
+            goto error;
+    }
+    goto exit;
 
 error:
-    Py_XDECREF(entry);
-    return NULL;
+    Py_CLEAR(list);
+exit:
+    PyMem_Free(buffer);
+    return list;
 }
 
-#endif
+#endif /* !MS_WINDOWS && __linux__ */
+
+
+/* SECTION: Async readers (POSIX only)
+
+async_scandir() and async_walk() run the parallel walk engine with a
+notify fd (an eventfd on Linux, a pipe elsewhere) for scandir.py's
+ascandir() and awalk() to watch with loop.add_reader(). When it's
+readable, AsyncReader.read() takes the results that are ready without
+blocking, up to about PWALK_SCAN_BATCH_SIZE entries so the loop isn't
+held up converting them all at once. The event loop wakes up once per
+batch of entries rather than once per entry, and no executor thread is
+tied up waiting on the filesystem.
+*/
 
+#ifndef MS_WINDOWS
 
 typedef struct {
     PyObject_HEAD
-    path_t path;
-#ifdef MS_WINDOWS
-    HANDLE handle;
-    WIN32_FIND_DATAW file_data;
-    int first_time;
-#else /* POSIX */
-    DIR *dirp;
-#endif
-} ScandirIterator;
-
-#ifdef MS_WINDOWS
+    Pwalk *engine;
+    int read_fd;
+    int write_fd;               /* the same as read_fd for an eventfd */
+    int return_bytes;
+    PyObject *onerror;
+    /* async_scandir(): holds the path and names of the entries, and the
+       errno to raise from the next read() if the directory can't be read */
+    ScandirIterator *owner;
+    int error;
+} AsyncReader;
 
-static void
-ScandirIterator_close(ScandirIterator *iterator)
+static int
+async_reader_open_fds(AsyncReader *reader)
 {
-    if (iterator->handle == INVALID_HANDLE_VALUE)
-        return;
+#ifdef HAVE_EVENTFD
+    reader->read_fd = reader->write_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return reader->read_fd < 0 ? -1 : 0;
+#else
+    int fds[2], i;
 
-    Py_BEGIN_ALLOW_THREADS
-    FindClose(iterator->handle);
-    Py_END_ALLOW_THREADS
-    iterator->handle = INVALID_HANDLE_VALUE;
+    if (pipe(fds) < 0)
+        return -1;
+    for (i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    reader->read_fd = fds[0];
+    reader->write_fd = fds[1];
+    return 0;
+#endif
 }
 
-static PyObject *
-ScandirIterator_iternext(ScandirIterator *iterator)
+/* Empty the notify fd, so it's only readable again once there's another
+   result queued */
+static void
+async_reader_drain(AsyncReader *reader)
 {
-    WIN32_FIND_DATAW *file_data = &iterator->file_data;
-    BOOL success;
+#ifdef HAVE_EVENTFD
+    uint64_t count;
 
-    /* Happens if the iterator is iterated twice */
-    if (iterator->handle == INVALID_HANDLE_VALUE) {
-        PyErr_SetNone(PyExc_StopIteration);
-        return NULL;
+    if (read(reader->read_fd, &count, sizeof(count)) < 0) {
+        /* EAGAIN: nothing written since the last read() */
     }
+#else
+    char buffer[256];
 
-    while (1) {
-        if (!iterator->first_time) {
-            Py_BEGIN_ALLOW_THREADS
-            success = FindNextFileW(iterator->handle, file_data);
-            Py_END_ALLOW_THREADS
-            if (!success) {
-                if (GetLastError() != ERROR_NO_MORE_FILES)
-                    return path_error(&iterator->path);
-                /* No more files found in directory, stop iterating */
-                break;
-            }
-        }
-        iterator->first_time = 0;
-
-        /* Skip over . and .. */
-        if (wcscmp(file_data->cFileName, L".") != 0 &&
-                wcscmp(file_data->cFileName, L"..") != 0)
-            return DirEntry_from_find_data(&iterator->path, file_data);
+    while (read(reader->read_fd, buffer, sizeof(buffer)) > 0)
+        ;
+#endif
+}
 
-        /* Loop till we get a non-dot directory or finish iterating */
+static void
+async_reader_close(AsyncReader *reader)
+{
+    if (reader->engine) {
+        SCANDIR_BEGIN_ALLOW_THREADS
+        pwalk_free(reader->engine);
+        SCANDIR_END_ALLOW_THREADS
+        reader->engine = NULL;
+    }
+    /* Only once the workers are gone, as they write to write_fd */
+    if (reader->read_fd != -1) {
+        close(reader->read_fd);
+        if (reader->write_fd != reader->read_fd)
+            close(reader->write_fd);
+        reader->read_fd = reader->write_fd = -1;
     }
+}
 
-    ScandirIterator_close(iterator);
+/* Append a DirEntry to list for each name in a scan mode result. Return
+   0 on success, -1 with an exception set on error. */
+static int
+async_scan_result_add(AsyncReader *reader, PwalkResult *result, PyObject *list)
+{
+    Py_ssize_t pos, name_len, i = 0;
+    char *name;
+    DirEntry *entry;
+    int status;
 
-    PyErr_SetNone(PyExc_StopIteration);
-    return NULL;
+    for (pos = 0; pos < result->names_len; pos += name_len + 2, i++) {
+        name = result->names + pos + 1;
+        name_len = strlen(name);
+        entry = (DirEntry *)DirEntry_from_posix_info(reader->owner, name, name_len,
+                                                     result->inodes[i]
+#ifdef HAVE_DIRENT_D_TYPE
+                                                     , (unsigned char)result->names[pos]
+#endif
+                                                     );
+        if (!entry)
+            return -1;
+        if (result->stats && result->stats[i].st_mode) {
+            entry->lstat = StatInfo_from_stat(&result->stats[i]);
+            if (!entry->lstat) {
+                Py_DECREF(entry);
+                return -1;
+            }
+        }
+        status = PyList_Append(list, (PyObject *)entry);
+        Py_DECREF(entry);
+        if (status < 0)
+            return -1;
+    }
+    if (result->error)
+        reader->error = result->error;
+    return 0;
 }
 
-#else /* POSIX */
-
-static void
-ScandirIterator_close(ScandirIterator *iterator)
+/* Append a (dirpath, dirnames, filenames) tuple to list for a walk
+   result, or call onerror if the directory couldn't be read. Return 0 on
+   success, -1 with an exception set on error. */
+static int
+async_walk_result_add(AsyncReader *reader, PwalkResult *result, PyObject *list)
 {
-    if (!iterator->dirp)
-        return;
+    PyObject *item;
+    int status;
 
-    Py_BEGIN_ALLOW_THREADS
-    closedir(iterator->dirp);
-    Py_END_ALLOW_THREADS
-    iterator->dirp = NULL;
-    return;
+    if (result->error) {
+        item = decode_fs_name(reader->return_bytes, result->path, strlen(result->path));
+        if (!item)
+            return -1;
+        status = walk_onerror(reader->onerror, result->error, item);
+    }
+    else {
+        item = pwalk_result_tuple(result, reader->return_bytes);
+        if (!item)
+            return -1;
+        status = PyList_Append(list, item);
+    }
+    Py_DECREF(item);
+    return status;
 }
 
 static PyObject *
-ScandirIterator_iternext(ScandirIterator *iterator)
+AsyncReader_fileno(AsyncReader *self)
 {
-    struct dirent *direntp;
-    Py_ssize_t name_len;
-    int is_dot;
-
-    /* Happens if the iterator is iterated twice */
-    if (!iterator->dirp) {
-        PyErr_SetNone(PyExc_StopIteration);
+    if (self->read_fd == -1) {
+        PyErr_SetString(PyExc_ValueError, "AsyncReader is closed");
         return NULL;
     }
+    return PyLong_FromLong(self->read_fd);
+}
 
-    while (1) {
-        errno = 0;
-        Py_BEGIN_ALLOW_THREADS
-        direntp = readdir(iterator->dirp);
-        Py_END_ALLOW_THREADS
-
-        if (!direntp) {
-            if (errno != 0)
-                return path_error(&iterator->path);
-            /* No more files found in directory, stop iterating */
+static PyObject *
+AsyncReader_read(AsyncReader *self)
+{
+    PwalkResult *result;
+    PyObject *list;
+    Py_ssize_t num_entries = 0;
+    int done = 0, status;
+
+    if (self->error) {
+        errno = self->error;
+        self->error = 0;
+        async_reader_close(self);
+        return path_error(&self->owner->path);
+    }
+    if (!self->engine)
+        Py_RETURN_NONE;
+
+    async_reader_drain(self);
+    list = PyList_New(0);
+    if (!list)
+        return NULL;
+    /* Results are only taken once queued, so this doesn't block */
+    while (!self->error && (result = pwalk_next_result(self->engine, 0, &done)) != NULL) {
+        num_entries += result->num_entries;
+        if (self->owner)
+            status = async_scan_result_add(self, result, list);
+        else
+            status = async_walk_result_add(self, result, list);
+        pwalk_result_free(result);
+        if (status < 0) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        if (num_entries >= PWALK_SCAN_BATCH_SIZE) {
+            /* There may be more results, so make sure the fd is readable */
+            pwalk_notify(self->engine);
             break;
         }
+    }
 
-        /* Skip over . and .. */
-        name_len = NAMLEN(direntp);
-        is_dot = direntp->d_name[0] == '.' &&
-                 (name_len == 1 || (direntp->d_name[1] == '.' && name_len == 2));
-        if (!is_dot) {
-            return DirEntry_from_posix_info(&iterator->path, direntp->d_name,
-                                            name_len, direntp->d_ino
-#ifdef HAVE_DIRENT_D_TYPE
-                                            , direntp->d_type
-#endif
-                                            );
+    if (PyList_GET_SIZE(list) == 0) {
+        if (self->error) {
+            Py_DECREF(list);
+            return AsyncReader_read(self);
+        }
+        if (done) {
+            Py_DECREF(list);
+            async_reader_close(self);
+            Py_RETURN_NONE;
         }
-
-        /* Loop till we get a non-dot directory or finish iterating */
     }
-
-    ScandirIterator_close(iterator);
-
-    PyErr_SetNone(PyExc_StopIteration);
-    return NULL;
+    else if (done || self->error) {
+        /* The notification for this was drained above, so make sure the
+           next read() isn't waited for forever */
+        pwalk_notify(self->engine);
+    }
+    return list;
 }
 
-#endif
+static PyObject *
+AsyncReader_py_close(AsyncReader *self)
+{
+    async_reader_close(self);
+    Py_RETURN_NONE;
+}
 
 static void
-ScandirIterator_dealloc(ScandirIterator *iterator)
+AsyncReader_dealloc(AsyncReader *self)
 {
-    ScandirIterator_close(iterator);
-    Py_XDECREF(iterator->path.object);
-    path_cleanup(&iterator->path);
-    Py_TYPE(iterator)->tp_free((PyObject *)iterator);
+    async_reader_close(self);
+    Py_XDECREF(self->onerror);
+    Py_XDECREF(self->owner);
+    Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
-static PyTypeObject ScandirIteratorType = {
+static PyMethodDef AsyncReader_methods[] = {
+    {"fileno", (PyCFunction)AsyncReader_fileno, METH_NOARGS,
+     "return the fd that's readable when read() has results"
+    },
+    {"read", (PyCFunction)AsyncReader_read, METH_NOARGS,
+     "return a list of the results that are ready (possibly empty) without\n"
+     "blocking, or None when there are no more"
+    },
+    {"close", (PyCFunction)AsyncReader_py_close, METH_NOARGS,
+     "stop the workers and close the fd"
+    },
+    {NULL}
+};
+
+static PyTypeObject AsyncReaderType = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    MODNAME ".ScandirIterator",             /* tp_name */
-    sizeof(ScandirIterator),                /* tp_basicsize */
+    MODNAME ".AsyncReader",                 /* tp_name */
+    sizeof(AsyncReader),                    /* tp_basicsize */
     0,                                      /* tp_itemsize */
     /* methods */
-    (destructor)ScandirIterator_dealloc,    /* tp_dealloc */
+    (destructor)AsyncReader_dealloc,        /* tp_dealloc */
     0,                                      /* tp_print */
     0,                                      /* tp_getattr */
     0,                                      /* tp_setattr */
@@ -1690,90 +9869,154 @@ static PyTypeObject ScandirIteratorType = {
     0,                                      /* tp_clear */
     0,                                      /* tp_richcompare */
     0,                                      /* tp_weaklistoffset */
-    PyObject_SelfIter,                      /* tp_iter */
-    (iternextfunc)ScandirIterator_iternext, /* tp_iternext */
+    0,                                      /* tp_iter */
+    0,                                      /* tp_iternext */
+    AsyncReader_methods,                    /* tp_methods */
 };
 
-static PyObject *
-posix_scandir(PyObject *self, PyObject *args, PyObject *kwargs)
+/* Create a reader and start an engine for path (which the reader takes
+   ownership of). Return NULL with an exception set on error. */
+static AsyncReader *
+async_reader_start(char *path, int workers, int followlinks, Py_ssize_t queue_size,
+                   int scan)
 {
-    ScandirIterator *iterator;
-    static char *keywords[] = {"path", NULL};
-#ifdef MS_WINDOWS
-    wchar_t *path_strW;
-#else
-    char *path;
-#endif
+    AsyncReader *reader;
 
-    iterator = PyObject_New(ScandirIterator, &ScandirIteratorType);
-    if (!iterator)
+    reader = PyObject_New(AsyncReader, &AsyncReaderType);
+    if (!reader) {
+        free(path);
         return NULL;
-    memset(&iterator->path, 0, sizeof(path_t));
-    iterator->path.function_name = "scandir";
-    iterator->path.nullable = 1;
+    }
+    reader->engine = NULL;
+    reader->return_bytes = 0;
+    reader->onerror = NULL;
+    reader->owner = NULL;
+    reader->error = 0;
+    if (async_reader_open_fds(reader) < 0) {
+        reader->read_fd = reader->write_fd = -1;
+        free(path);
+        PyErr_SetFromErrno(PyExc_OSError);
+        Py_DECREF(reader);
+        return NULL;
+    }
 
-#ifdef MS_WINDOWS
-    iterator->handle = INVALID_HANDLE_VALUE;
-#else
-    iterator->dirp = NULL;
-#endif
+    SCANDIR_BEGIN_ALLOW_THREADS
+    reader->engine = pwalk_start(path, workers, followlinks, queue_size, NULL, 0,
+                                 scan, reader->write_fd);
+    SCANDIR_END_ALLOW_THREADS
+    if (!reader->engine) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        Py_DECREF(reader);
+        return NULL;
+    }
+    return reader;
+}
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O&:scandir", keywords,
-                                     path_converter, &iterator->path))
-        goto error;
+PyDoc_STRVAR(async_scandir__doc__,
+"async_scandir(path='.', stat=False) -> AsyncReader\n\n\
+Read the directory at path in a native thread, returning a reader whose\n\
+read() gives lists of DirEntry objects as they're ready. If stat is\n\
+true, each entry is also lstat'ed in the thread, so stat() with\n\
+follow_symlinks=False doesn't need a system call.");
 
-    /* path_converter doesn't keep path.object around, so do it
-       manually for the lifetime of the iterator here (the refcount
-       is decremented in ScandirIterator_dealloc)
-    */
-    Py_XINCREF(iterator->path.object);
+static PyObject *
+scandir_async_scandir(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"path", "stat", NULL};
+    ScandirIterator *owner;
+    AsyncReader *reader;
+    int stat = 0;
+    char *path;
 
-#ifdef MS_WINDOWS
-    if (iterator->path.narrow) {
-        PyErr_SetString(PyExc_TypeError,
-                        "os.scandir() doesn't support bytes path on Windows, use Unicode instead");
-        goto error;
+    owner = ScandirIterator_new("async_scandir");
+    if (!owner)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O&i:async_scandir", keywords,
+                                     path_converter, &owner->path, &stat)) {
+        Py_DECREF(owner);
+        return NULL;
+    }
+    /* Kept for the lifetime of owner, like in posix_scandir() */
+    Py_XINCREF(owner->path.object);
+
+    path = owner->path.narrow ? owner->path.narrow : ".";
+    owner->shared->return_bytes = owner->path.narrow && PyBytes_Check(owner->path.object);
+    if (scandir_arena_set_prefix(&owner->shared->arena, path) < 0 ||
+            !(path = strdup(path))) {
+        Py_DECREF(owner);
+        return PyErr_NoMemory();
     }
-    iterator->first_time = 1;
-
-    path_strW = join_path_filenameW(iterator->path.wide, L"*.*");
-    if (!path_strW)
-        goto error;
 
-    Py_BEGIN_ALLOW_THREADS
-    iterator->handle = FindFirstFileW(path_strW, &iterator->file_data);
-    Py_END_ALLOW_THREADS
+    /* One worker, so the batches are queued in order */
+    reader = async_reader_start(path, 1, 0, PWALK_DEFAULT_QUEUE_SIZE,
+                                PWALK_SCAN | (stat ? PWALK_SCAN_STAT : 0));
+    if (!reader) {
+        Py_DECREF(owner);
+        return NULL;
+    }
+    reader->owner = owner;
+    return (PyObject *)reader;
+}
 
-    PyMem_Free(path_strW);
+PyDoc_STRVAR(async_walk__doc__,
+"async_walk(top, workers=0, onerror=None, followlinks=False, queue_size=64)\n\
+-> AsyncReader\n\n\
+Like parallel_walk(), but returning a reader whose read() gives lists of\n\
+(dirpath, dirnames, filenames) tuples as directories are read.");
 
-    if (iterator->handle == INVALID_HANDLE_VALUE) {
-        path_error(&iterator->path);
-        goto error;
-    }
-#else /* POSIX */
-    if (iterator->path.narrow)
-        path = iterator->path.narrow;
-    else
-        path = ".";
+static PyObject *
+scandir_async_walk(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"top", "workers", "onerror", "followlinks",
+                               "queue_size", NULL};
+    AsyncReader *reader;
+    PyObject *top, *top_bytes;
+    PyObject *onerror = Py_None;
+    int workers = 0;
+    int followlinks = 0;
+    Py_ssize_t queue_size = PWALK_DEFAULT_QUEUE_SIZE;
+    char *path;
 
-    errno = 0;
-    Py_BEGIN_ALLOW_THREADS
-    iterator->dirp = opendir(path);
-    Py_END_ALLOW_THREADS
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iOin:async_walk", keywords,
+                                     &top, &workers, &onerror, &followlinks,
+                                     &queue_size))
+        return NULL;
 
-    if (!iterator->dirp) {
-        path_error(&iterator->path);
-        goto error;
-    }
+#if PY_MAJOR_VERSION >= 3
+    if (!PyUnicode_Check(top) && !PyBytes_Check(top)) {
+#else
+    if (!PyUnicode_Check(top) && !PyString_Check(top)) {
 #endif
+        PyErr_SetString(PyExc_TypeError, "async_walk: top must be str or bytes");
+        return NULL;
+    }
+    if (workers < 0 || queue_size < 1) {
+        PyErr_SetString(PyExc_ValueError,
+                        "async_walk: workers must be >= 0 and queue_size >= 1");
+        return NULL;
+    }
+    if (workers == 0)
+        workers = default_num_workers();
 
-    return (PyObject *)iterator;
+    top_bytes = encode_fs_name(top);
+    if (!top_bytes)
+        return NULL;
+    path = strdup(PyBytes_AS_STRING(top_bytes));
+    Py_DECREF(top_bytes);
+    if (!path)
+        return PyErr_NoMemory();
 
-error:
-    Py_DECREF(iterator);
-    return NULL;
+    reader = async_reader_start(path, workers, followlinks, queue_size, 0);
+    if (!reader)
+        return NULL;
+    Py_INCREF(onerror);
+    reader->onerror = onerror;
+    reader->return_bytes = PyBytes_Check(top);
+    return (PyObject *)reader;
 }
 
+#endif /* !MS_WINDOWS */
+
 
 /* SECTION: Module and method definitions and initialization code */
 
@@ -1781,6 +10024,69 @@ static PyMethodDef scandir_methods[] = {
     {"scandir",         (PyCFunction)posix_scandir,
                         METH_VARARGS | METH_KEYWORDS,
                         posix_scandir__doc__},
+    {"enable_stats",    (PyCFunction)scandir_enable_stats,
+                        METH_VARARGS,
+                        enable_stats__doc__},
+    {"stats",           (PyCFunction)scandir_stats_dict,
+                        METH_NOARGS,
+                        stats__doc__},
+    {"reset_stats",     (PyCFunction)scandir_reset_stats,
+                        METH_NOARGS,
+                        reset_stats__doc__},
+#ifndef MS_WINDOWS
+    {"walk",            (PyCFunction)scandir_walk,
+                        METH_VARARGS | METH_KEYWORDS,
+                        walk__doc__},
+    {"parallel_walk",   (PyCFunction)scandir_parallel_walk,
+                        METH_VARARGS | METH_KEYWORDS,
+                        parallel_walk__doc__},
+    {"prefetch_stat",   (PyCFunction)scandir_prefetch_stat,
+                        METH_VARARGS | METH_KEYWORDS,
+                        prefetch_stat__doc__},
+    {"glob_dir",        (PyCFunction)scandir_glob_dir,
+                        METH_VARARGS | METH_KEYWORDS,
+                        glob_dir__doc__},
+    {"du",              (PyCFunction)scandir_du,
+                        METH_VARARGS | METH_KEYWORDS,
+                        du__doc__},
+    {"snapshot",        (PyCFunction)scandir_snapshot,
+                        METH_VARARGS | METH_KEYWORDS,
+                        snapshot__doc__},
+    {"rescan",          (PyCFunction)scandir_rescan,
+                        METH_VARARGS | METH_KEYWORDS,
+                        rescan__doc__},
+    {"diff_trees",      (PyCFunction)scandir_diff_trees,
+                        METH_VARARGS | METH_KEYWORDS,
+                        diff_trees__doc__},
+    {"async_scandir",   (PyCFunction)scandir_async_scandir,
+                        METH_VARARGS | METH_KEYWORDS,
+                        async_scandir__doc__},
+    {"async_walk",      (PyCFunction)scandir_async_walk,
+                        METH_VARARGS | METH_KEYWORDS,
+                        async_walk__doc__},
+    {"_set_ignore_d_type", (PyCFunction)scandir_set_ignore_d_type,
+                        METH_VARARGS,
+                        set_ignore_d_type__doc__},
+#ifdef HAVE_INOTIFY
+    {"inotify_init",    (PyCFunction)scandir_inotify_init,
+                        METH_NOARGS,
+                        inotify_init__doc__},
+    {"inotify_add_watch", (PyCFunction)scandir_inotify_add_watch,
+                        METH_VARARGS,
+                        inotify_add_watch__doc__},
+    {"inotify_rm_watch", (PyCFunction)scandir_inotify_rm_watch,
+                        METH_VARARGS,
+                        inotify_rm_watch__doc__},
+    {"inotify_read",    (PyCFunction)scandir_inotify_read,
+                        METH_VARARGS,
+                        inotify_read__doc__},
+#endif
+#if PY_MAJOR_VERSION >= 3
+    {"scandir_bulk",    (PyCFunction)scandir_bulk,
+                        METH_VARARGS | METH_KEYWORDS,
+                        scandir_bulk__doc__},
+#endif
+#endif
     {NULL, NULL},
 };
 
@@ -1823,13 +10129,32 @@ init_scandir(void)
     PyStructSequence_InitType(&StatResultType, &stat_result_desc);
     structseq_new = StatResultType.tp_new;
     StatResultType.tp_new = statresult_new;
+#if !defined(MS_WINDOWS) && PY_MAJOR_VERSION >= 3
+    PyStructSequence_InitType(&BulkListingType, &bulk_listing_desc);
+#endif
 
     if (PyType_Ready(&ScandirIteratorType) < 0)
         INIT_ERROR;
     if (PyType_Ready(&DirEntryType) < 0)
         INIT_ERROR;
+#ifndef MS_WINDOWS
+    if (PyType_Ready(&WalkIteratorType) < 0)
+        INIT_ERROR;
+    if (PyType_Ready(&ParallelWalkIteratorType) < 0)
+        INIT_ERROR;
+    if (PyType_Ready(&DiffIteratorType) < 0)
+        INIT_ERROR;
+    if (PyType_Ready(&StatInfoType) < 0)
+        INIT_ERROR;
+    if (PyType_Ready(&AsyncReaderType) < 0)
+        INIT_ERROR;
+#endif
 
     PyModule_AddObject(module, "DirEntry", (PyObject *)&DirEntryType);
+#ifndef MS_WINDOWS
+    Py_INCREF(&StatInfoType);
+    PyModule_AddObject(module, "StatInfo", (PyObject *)&StatInfoType);
+#endif
 
 #if PY_MAJOR_VERSION >= 3
     return module;
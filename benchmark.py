@@ -1,9 +1,16 @@
 """Simple benchmark to compare the speed of scandir.walk() with os.walk()."""
 
+import fnmatch
+import glob
+import json
 import optparse
 import os
+import platform
 import stat
+import subprocess
 import sys
+import tempfile
+import time
 import timeit
 
 import warnings
@@ -14,6 +21,13 @@ DEPTH = 4
 NUM_DIRS = 5
 NUM_FILES = 50
 
+# Sizes of the --suite trees, multiplied by --scale; see create_suite_tree()
+SUITE_WIDE_FILES = 1000000
+SUITE_DEEP_LEVELS = 1000
+SUITE_TREES = 'wide_flat,deep_narrow,mixed,dt_unknown'
+SUITE_WORKLOADS = 'scandir,walk,walk_stat,du'
+SUITE_BACKENDS = 'c,python,generic,os'
+
 
 def os_walk_pre_35(top, topdown=True, onerror=None, followlinks=False):
     """Pre Python 3.5 implementation of os.walk() that doesn't use scandir."""
@@ -44,12 +58,12 @@ def os_walk_pre_35(top, topdown=True, onerror=None, followlinks=False):
         yield top, dirs, nondirs
 
 
-def create_tree(path, depth=DEPTH):
+def create_tree(path, depth=DEPTH, num_files=NUM_FILES):
     """Create a directory tree at path with given depth, and NUM_DIRS and
-    NUM_FILES at each level.
+    num_files at each level.
     """
     os.mkdir(path)
-    for i in range(NUM_FILES):
+    for i in range(num_files):
         filename = os.path.join(path, 'file{0:03}.txt'.format(i))
         with open(filename, 'wb') as f:
             f.write(b'foo')
@@ -57,7 +71,521 @@ def create_tree(path, depth=DEPTH):
         return
     for i in range(NUM_DIRS):
         dirname = os.path.join(path, 'dir{0:03}'.format(i))
-        create_tree(dirname, depth - 1)
+        create_tree(dirname, depth - 1, num_files)
+
+
+def create_wide_dir(path, num_files):
+    """Create a single flat directory at path containing num_files empty
+    files.
+    """
+    os.mkdir(path)
+    for i in range(num_files):
+        open(os.path.join(path, 'file{0:07}'.format(i)), 'wb').close()
+
+
+def benchmark_wide(path, buffer_sizes):
+    """Time a bare scandir() loop over a very wide directory, using each of
+    the given buffer sizes with the C version of scandir. Also time keeping
+    every entry, where the per-entry object cost isn't reduced by reusing
+    DirEntry objects from the free list.
+    """
+    def do_scandir(**kwargs):
+        for entry in scandir.scandir_c(path, **kwargs):
+            pass
+
+    def do_scandir_kept():
+        entries = list(scandir.scandir_c(path))
+        del entries
+
+    def do_listdir():
+        os.listdir(path)
+
+    print("Priming the system's cache...")
+    do_listdir()
+
+    num_entries = len(os.listdir(path))
+    N = 3
+    listdir_time = min(timeit.timeit(do_listdir, number=1) for i in range(N))
+    print('os.listdir took {0:.3f}s ({1:.0f}ns per entry)'.format(
+          listdir_time, listdir_time * 1e9 / num_entries))
+    for buffer_size in buffer_sizes:
+        scandir_time = min(timeit.timeit(lambda: do_scandir(buffer_size=buffer_size), number=1)
+                           for i in range(N))
+        print('scandir buffer_size={0} took {1:.3f}s ({2:.0f}ns per entry)'.format(
+              buffer_size, scandir_time, scandir_time * 1e9 / num_entries))
+    kept_time = min(timeit.timeit(do_scandir_kept, number=1) for i in range(N))
+    print('scandir keeping all entries took {0:.3f}s ({1:.0f}ns per entry)'.format(
+          kept_time, kept_time * 1e9 / num_entries))
+
+
+def benchmark_filter(path, pattern):
+    """Compare filtering a very wide directory by name in Python with the
+    include= filter of the C scandir(), showing time and peak memory.
+    """
+    try:
+        import tracemalloc
+    except ImportError:
+        tracemalloc = None
+
+    def do_python_filter():
+        return [e for e in scandir.scandir_c(path) if fnmatch.fnmatchcase(e.name, pattern)]
+
+    def do_c_filter():
+        return list(scandir.scandir_c(path, include=pattern))
+
+    print("Priming the system's cache...")
+    num_matches = len(do_c_filter())
+    num_entries = len(os.listdir(path))
+    print('{0} of {1} entries match {2!r}'.format(num_matches, num_entries, pattern))
+
+    N = 3
+    for name, func, num_created in [('Python fnmatch filter', do_python_filter, num_entries),
+                                    ('C include filter', do_c_filter, num_matches)]:
+        elapsed = min(timeit.timeit(func, number=1) for i in range(N))
+        peak = ''
+        if tracemalloc is not None:
+            tracemalloc.start()
+            func()
+            peak = ', peak {0:.1f}MB'.format(tracemalloc.get_traced_memory()[1] / 1e6)
+            tracemalloc.stop()
+        print('{0} took {1:.3f}s ({2} DirEntry objects created{3})'.format(
+              name, elapsed, num_created, peak))
+
+
+def benchmark_du(path, workers):
+    """Compare get_tree_size() with scandir.du(), which also counts the
+    sizes of directories and symlinks themselves, so totals differ a bit.
+    """
+    print("Priming the system's cache...")
+    usage = scandir.du(path, apparent=True)
+    print('{0} files and {1} directories, {2} bytes'.format(usage.files, usage.dirs, usage.total))
+
+    N = 3
+    tree_size_time = min(timeit.timeit(lambda: get_tree_size(path), number=1) for i in range(N))
+    print('get_tree_size took {0:.3f}s'.format(tree_size_time))
+    for num_workers in workers:
+        du_time = min(timeit.timeit(lambda: scandir.du(path, apparent=True, workers=num_workers),
+                                    number=1)
+                      for i in range(N))
+        print('scandir.du with {0} workers took {1:.3f}s -- {2:.1f}x as fast'.format(
+              num_workers, du_time, tree_size_time / du_time))
+
+
+def benchmark_snapshot(path, out_file):
+    """Time writing a snapshot of the tree at path to out_file with the
+    native and Python versions of snapshot(), then opening it and looking
+    up every path in it, compared with lstat'ing every path.
+    """
+    print("Priming the system's cache...")
+    num_entries = scandir.snapshot(path, out_file)
+    print('{0} entries, {1} bytes'.format(num_entries, os.path.getsize(out_file)))
+
+    N = 3
+    for name, func in [('snapshot_python', scandir.snapshot_python),
+                       ('snapshot (C)', scandir.snapshot)]:
+        elapsed = min(timeit.timeit(lambda: func(path, out_file), number=1) for i in range(N))
+        print('{0} took {1:.3f}s'.format(name, elapsed))
+
+    open_time = min(timeit.timeit(lambda: scandir.Snapshot(out_file).close(), number=1)
+                    for i in range(N))
+    print('Snapshot() took {0:.6f}s to open'.format(open_time))
+    snap = scandir.Snapshot(out_file)
+    paths = [p for p, entry in snap.items()]
+    lookup_time = min(timeit.timeit(lambda: [snap.lookup(p) for p in paths], number=1)
+                      for i in range(N))
+    lstat_time = min(timeit.timeit(lambda: [os.lstat(p) for p in paths], number=1)
+                     for i in range(N))
+    snap.close()
+    print('Snapshot.lookup() of every path took {0:.3f}s, os.lstat() {1:.3f}s'.format(
+          lookup_time, lstat_time))
+
+    # Directories changed in the last couple of seconds are always read
+    # again, so this is only representative of a tree that's been idle
+    for check_files in [True, False]:
+        elapsed = min(timeit.timeit(lambda: scandir.rescan(out_file, check_files=check_files),
+                                    number=1)
+                      for i in range(N))
+        print('rescan(check_files={0}) of the unchanged tree took {1:.3f}s'.format(
+              check_files, elapsed))
+
+
+def benchmark_glob(path, pattern):
+    """Compare the standard library's glob.glob() with scandir.glob() for
+    the given (usually recursive) pattern relative to path.
+    """
+    if sys.version_info < (3, 5):
+        recursive_kwargs = {}
+    else:
+        recursive_kwargs = {'recursive': True}
+    pattern = os.path.join(path, pattern)
+
+    print("Priming the system's cache...")
+    num_matches = len(scandir.glob(pattern, **recursive_kwargs))
+    print('{0} paths match {1!r}'.format(num_matches, pattern))
+
+    N = 3
+    glob_time = min(timeit.timeit(lambda: glob.glob(pattern, **recursive_kwargs), number=1)
+                    for i in range(N))
+    scandir_time = min(timeit.timeit(lambda: scandir.glob(pattern, **recursive_kwargs), number=1)
+                       for i in range(N))
+    print('glob.glob took {0:.3f}s, scandir.glob took {1:.3f}s -- {2:.1f}x as fast'.format(
+          glob_time, scandir_time, glob_time / scandir_time))
+
+
+def benchmark_parallel(path, workers):
+    """Compare scandir.walk() with scandir.parallel_walk() using the given
+    numbers of worker threads.
+    """
+    def do_walk(walk_func, **kwargs):
+        num_dirs = 0
+        for root, dirs, files in walk_func(path, **kwargs):
+            num_dirs += 1
+        return num_dirs
+
+    print("Priming the system's cache...")
+    num_dirs = do_walk(scandir.walk)
+
+    N = 3
+    walk_time = min(timeit.timeit(lambda: do_walk(scandir.walk), number=1)
+                    for i in range(N))
+    print('walk took {0:.3f}s for {1} directories'.format(walk_time, num_dirs))
+    for num_workers in workers:
+        parallel_time = min(timeit.timeit(lambda: do_walk(scandir.parallel_walk,
+                                                          workers=num_workers),
+                                          number=1)
+                            for i in range(N))
+        print('parallel_walk workers={0} took {1:.3f}s -- {2:.1f}x as fast'.format(
+              num_workers, parallel_time, walk_time / parallel_time))
+
+
+def drop_caches():
+    """Drop the OS's page, dentry and inode caches, so the next walk reads
+    from the disk. Only possible as root on Linux; return False if not.
+    """
+    if hasattr(os, 'sync'):
+        os.sync()
+    try:
+        with open('/proc/sys/vm/drop_caches', 'w') as f:
+            f.write('3\n')
+    except (IOError, OSError):
+        return False
+    return True
+
+
+def benchmark_prefetch(path, prefetches):
+    """Compare cold-cache walk() of the tree at path, lstat'ing every file
+    as a stand-in for processing each directory, with and without the
+    given numbers of prefetched directories.
+    """
+    def do_walk(prefetch):
+        num_dirs = 0
+        for root, dirs, files in scandir.walk(path, prefetch=prefetch):
+            num_dirs += 1
+            for name in files:
+                os.lstat(os.path.join(root, name))
+        return num_dirs
+
+    cold = drop_caches()
+    if not cold:
+        print("WARNING: can't drop caches (needs root on Linux), timing warm runs")
+
+    def timed_walk(prefetch):
+        drop_caches()
+        return timeit.timeit(lambda: do_walk(prefetch), number=1)
+
+    N = 3
+    walk_time = min(timed_walk(0) for i in range(N))
+    print('walk took {0:.3f}s for {1} directories ({2} cache)'.format(
+          walk_time, do_walk(0), 'cold' if cold else 'warm'))
+    for prefetch in prefetches:
+        prefetch_time = min(timed_walk(prefetch) for i in range(N))
+        print('walk prefetch={0} took {1:.3f}s -- {2:.2f}x as fast'.format(
+              prefetch, prefetch_time, walk_time / prefetch_time))
+
+
+def create_deep_tree(path, levels):
+    """Create a chain of levels nested directories named "d" at path,
+    each holding a single file.
+    """
+    for i in range(levels):
+        os.mkdir(path)
+        open(os.path.join(path, 'file.txt'), 'wb').close()
+        path = os.path.join(path, 'd')
+
+
+def create_mixed_tree(path, num_files):
+    """Create a tree like create_tree() does, and add symlinks to a file,
+    a directory and a missing file to every directory in it.
+    """
+    create_tree(path, num_files=num_files)
+    for root, dirs, files in os.walk(path):
+        os.symlink(files[0], os.path.join(root, 'link_file'))
+        os.symlink('.', os.path.join(root, 'link_dir'))
+        os.symlink('missing', os.path.join(root, 'link_broken'))
+
+
+def create_suite_tree(name, scale):
+    """Create (if it doesn't exist yet) and return the path of the tree for
+    the suite's tree shape name, relative to this script, with its number
+    of files or levels multiplied by scale. The dt_unknown shape is the
+    mixed tree, read with d_type hidden.
+    """
+    base = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'benchsuite')
+    if name == 'wide_flat':
+        count = max(1, int(SUITE_WIDE_FILES * scale))
+        create = create_wide_dir
+    elif name == 'deep_narrow':
+        count = max(1, int(SUITE_DEEP_LEVELS * scale))
+        create = create_deep_tree
+    else:
+        count = max(1, int(NUM_FILES * scale))
+        create = create_mixed_tree
+        name = 'mixed'
+    path = os.path.join(base, '{0}_{1}'.format(name, count))
+    if not os.path.exists(path):
+        if not os.path.exists(base):
+            os.mkdir(base)
+        print('Creating {0} tree at {1}: count={2}'.format(name, path, count))
+        create(path, count)
+    return path
+
+
+def suite_functions(backend):
+    """Return a (scandir, walk, du) tuple of the functions to use for the
+    given backend, or None if it's not available here. The Python
+    versions of walk() and du() call the scandir module's scandir(), so
+    that's switched to the backend's by run_suite_workload().
+    """
+    if backend == 'c':
+        if scandir.scandir_c is None:
+            return None
+        return (scandir.scandir_c, scandir.walk_c or scandir.walk_python,
+                scandir.du_c or scandir.du_python)
+    if backend == 'python':
+        if scandir.scandir_python is None:
+            return None
+        return (scandir.scandir_python, scandir.walk_python, scandir.du_python)
+    if backend == 'generic':
+        return (scandir.scandir_generic, scandir.walk_python, scandir.du_python)
+    if not hasattr(os, 'scandir'):
+        return None
+    return (os.scandir, os.walk, scandir.du_python)
+
+
+def suite_workload(path, workload, functions):
+    """Return a function that runs workload on the tree at path using the
+    (scandir, walk, du) functions given. The scandir workload lists every
+    directory (found beforehand) and calls is_dir() on each entry; walk
+    and walk_stat walk the tree, the latter also lstat'ing every file.
+    """
+    scandir_func, walk_func, du_func = functions
+    join = os.path.join
+
+    if workload == 'scandir':
+        dir_paths = [root for root, dirs, files in os.walk(path)]
+
+        def run():
+            for dir_path in dir_paths:
+                for entry in scandir_func(dir_path):
+                    entry.is_dir()
+    elif workload == 'walk':
+        def run():
+            for root, dirs, files in walk_func(path):
+                pass
+    elif workload == 'walk_stat':
+        def run():
+            for root, dirs, files in walk_func(path):
+                for name in files:
+                    os.lstat(join(root, name))
+    elif workload == 'du':
+        def run():
+            du_func(path)
+    else:
+        def run():
+            pass
+    return run
+
+
+def run_suite_workload(path, workload, backend, ignore_d_type):
+    """Set up scandir for backend (and d_type hiding), run workload once
+    and restore things. Used for --suite-run, so that strace only sees
+    the one run.
+    """
+    functions = suite_functions(backend)
+    original_scandir = scandir.scandir
+    scandir.scandir = functions[0]
+    if ignore_d_type:
+        scandir._scandir._set_ignore_d_type(True)
+    try:
+        suite_workload(path, workload, functions)()
+    finally:
+        scandir.scandir = original_scandir
+        if ignore_d_type:
+            scandir._scandir._set_ignore_d_type(False)
+
+
+def count_syscalls(path, workload, backend, ignore_d_type):
+    """Return the number of system calls a single run of workload makes,
+    found by running this script with --suite-run under strace, less
+    those of a run that does nothing. Return None if strace isn't
+    available.
+    """
+    def run_strace(workload):
+        fd, out_file = tempfile.mkstemp(prefix='benchstrace')
+        os.close(fd)
+        args = [sys.executable, os.path.abspath(__file__), '--suite-run',
+                ','.join([path, workload, backend, str(int(ignore_d_type))])]
+        try:
+            with open(os.devnull, 'w') as devnull:
+                try:
+                    subprocess.call(['strace', '-f', '-qq', '-o', out_file] + args,
+                                    stdout=devnull, stderr=devnull)
+                except OSError:
+                    return None
+            num_calls = 0
+            with open(out_file) as f:
+                for line in f:
+                    # Calls interrupted by another thread's show up on two
+                    # lines, the second with "<... name resumed>"
+                    if ' resumed>' in line:
+                        continue
+                    call = line.split(None, 1)[-1]
+                    if not call.startswith(('+++', '---')):
+                        num_calls += 1
+            return num_calls
+        finally:
+            os.remove(out_file)
+
+    baseline = run_strace('none')
+    if baseline is None:
+        return None
+    return max(0, run_strace(workload) - baseline)
+
+
+def count_entries(path):
+    """Return the number of entries (files, directories and symlinks) in
+    the tree at path, not counting path itself.
+    """
+    return sum(len(dirs) + len(files) for root, dirs, files in os.walk(path))
+
+
+def run_suite(out_file, scale, trees, workloads, backends):
+    """Run every combination of the given tree shapes, workloads and
+    backends, timing each warm (best of 3 after a priming run) and cold
+    (best of 3, dropping caches before each), and write the results
+    along with system calls and peak traced memory allocated per run as
+    JSON to out_file.
+    """
+    try:
+        import tracemalloc
+    except ImportError:
+        tracemalloc = None
+
+    # The Python walk() and du() recurse once per level of deep_narrow
+    sys.setrecursionlimit(max(sys.getrecursionlimit(), SUITE_DEEP_LEVELS * 10))
+    cold_supported = drop_caches()
+    if not cold_supported:
+        print("WARNING: can't drop caches (needs root on Linux), skipping cold runs")
+    have_strace = True
+
+    def best_time(run, cold):
+        times = []
+        for i in range(N):
+            if cold:
+                drop_caches()
+            times.append(timeit.timeit(run, number=1))
+        return min(times)
+
+    for backend in backends[:]:
+        if suite_functions(backend) is None:
+            print('Skipping {0} backend, not available'.format(backend))
+            backends.remove(backend)
+
+    N = 3
+    results = []
+    original_scandir = scandir.scandir
+    for tree in trees:
+        path = create_suite_tree(tree, scale)
+        num_entries = count_entries(path)
+        ignore_d_type = tree == 'dt_unknown'
+        for workload in workloads:
+            for backend in backends:
+                functions = suite_functions(backend)
+                if ignore_d_type and backend != 'c':
+                    # d_type can only be hidden from the C backend
+                    continue
+                if ignore_d_type and not hasattr(scandir._scandir, '_set_ignore_d_type'):
+                    continue
+
+                run = suite_workload(path, workload, functions)
+                scandir.scandir = functions[0]
+                if ignore_d_type:
+                    scandir._scandir._set_ignore_d_type(True)
+                try:
+                    run()
+                    warm_time = best_time(run, False)
+                    cold_time = best_time(run, True) if cold_supported else None
+                    peak_alloc = None
+                    if tracemalloc is not None:
+                        tracemalloc.start()
+                        run()
+                        peak_alloc = tracemalloc.get_traced_memory()[1]
+                        tracemalloc.stop()
+                finally:
+                    scandir.scandir = original_scandir
+                    if ignore_d_type:
+                        scandir._scandir._set_ignore_d_type(False)
+
+                syscalls = None
+                if have_strace:
+                    syscalls = count_syscalls(path, workload, backend, ignore_d_type)
+                    if syscalls is None:
+                        print('WARNING: strace not found, not counting system calls')
+                        have_strace = False
+
+                def per_entry(value, factor=1):
+                    if value is None:
+                        return None
+                    return value * factor / max(num_entries, 1)
+
+                result = {
+                    'tree': tree,
+                    'workload': workload,
+                    'backend': backend,
+                    'entries': num_entries,
+                    'warm_seconds': warm_time,
+                    'warm_ns_per_entry': per_entry(warm_time, 1e9),
+                    'cold_seconds': cold_time,
+                    'cold_ns_per_entry': per_entry(cold_time, 1e9),
+                    'syscalls': syscalls,
+                    'syscalls_per_entry': per_entry(syscalls),
+                    'peak_alloc_bytes': peak_alloc,
+                }
+                results.append(result)
+                print('{0:<12} {1:<10} {2:<8} {3:>8.0f}ns warm {4:>8}ns cold '
+                      '{5:>6} syscalls {6:>10} bytes per entry'.format(
+                          tree, workload, backend, result['warm_ns_per_entry'],
+                          '-' if cold_time is None else '{0:.0f}'.format(
+                              result['cold_ns_per_entry']),
+                          '-' if syscalls is None else '{0:.2f}'.format(
+                              result['syscalls_per_entry']),
+                          '-' if peak_alloc is None else '{0:.1f}'.format(
+                              per_entry(peak_alloc))))
+
+    output = {
+        'version': 1,
+        'time': time.strftime('%Y-%m-%dT%H:%M:%SZ', time.gmtime()),
+        'python': sys.version.split()[0],
+        'platform': platform.platform(),
+        'scale': scale,
+        'repeat': N,
+        'cold_supported': cold_supported,
+        'results': results,
+    }
+    with open(out_file, 'w') as f:
+        json.dump(output, f, indent=2, sort_keys=True)
+        f.write('\n')
+    print('Wrote {0} results to {1}'.format(len(results), out_file))
 
 
 def get_tree_size(path):
@@ -134,14 +662,112 @@ if __name__ == '__main__':
 
 Create a large directory tree named "benchtree" (relative to this script) and
 benchmark os.walk() versus scandir.walk(). If tree_dir is specified, benchmark
-using it instead of creating a tree."""
+using it instead of creating a tree.
+
+With --wide, create a single flat directory with the given number of files
+(named "benchwide_N") and benchmark scandir() itself with a range of
+buffer sizes, showing the cost per entry. With --filter too, compare
+filtering its names with a glob pattern in Python and in C.
+
+With --parallel, benchmark scandir.walk() against scandir.parallel_walk()
+using the given numbers of worker threads.
+
+With --glob, benchmark glob.glob() against scandir.glob() for the given
+pattern, relative to the tree (for example --glob "**/*.txt").
+
+With --du, benchmark get_tree_size() against scandir.du() using the given
+numbers of worker threads.
+
+With --snapshot, benchmark writing a snapshot of the tree to the given
+file with scandir.snapshot(), opening and looking up paths in it, and
+rescanning the tree against it.
+
+With --prefetch, benchmark walk() with a cold cache (dropping caches
+needs root on Linux) against walk() prefetching the given numbers of
+upcoming directories.
+
+With --suite, run the regression suite and write its results as JSON to
+the given file: each workload (scandir only, walk, walk plus lstat, and
+du) on each tree shape (a wide flat directory of 1M files, a chain of
+1000 directories, a tree with symlinks, and the same tree read as if
+the file system didn't provide d_type), with each backend (the C,
+ctypes and generic scandir(), and os.scandir()). Each is timed warm and
+cold (if caches can be dropped), with system calls counted if strace
+is installed and peak memory allocated (as traced by tracemalloc). Use
+--scale to shrink the trees, and --trees, --workloads and --backends to
+pick a subset. The trees are kept under "benchsuite" for later runs."""
     parser = optparse.OptionParser(usage=usage)
     parser.add_option('-s', '--size', action='store_true',
                       help='get size of directory tree while walking')
     parser.add_option('-c', '--scandir', type='choice', choices=['best', 'generic', 'c', 'python', 'os'], default='best',
                       help='version of scandir() to use, default "%default"')
+    parser.add_option('-w', '--wide', type='int', default=0,
+                      help='benchmark scandir() on a flat directory of this many files')
+    parser.add_option('-b', '--buffer-sizes', default='4096,32768,262144,1048576',
+                      help='comma-separated buffer sizes to use with --wide, default "%default"')
+    parser.add_option('-f', '--filter', default='',
+                      help='with --wide, compare filtering names with this glob pattern in Python and in C')
+    parser.add_option('-p', '--parallel', default='',
+                      help='comma-separated worker counts to compare parallel_walk() against walk()')
+    parser.add_option('-g', '--glob', default='',
+                      help='benchmark glob.glob() against scandir.glob() with this pattern')
+    parser.add_option('-d', '--du', default='',
+                      help='comma-separated worker counts to compare du() against get_tree_size()')
+    parser.add_option('-n', '--snapshot', default='',
+                      help='benchmark snapshot() writing to this file, and reading it back')
+    parser.add_option('-r', '--prefetch', default='',
+                      help='comma-separated prefetch counts to compare cold-cache walk() against')
+    parser.add_option('-j', '--suite', default='',
+                      help='run the benchmark suite and write JSON results to this file')
+    parser.add_option('--scale', type='float', default=1.0,
+                      help='with --suite, multiply the sizes of the trees by this, default %default')
+    parser.add_option('--trees', default=SUITE_TREES,
+                      help='comma-separated tree shapes for --suite, default "%default"')
+    parser.add_option('--workloads', default=SUITE_WORKLOADS,
+                      help='comma-separated workloads for --suite, default "%default"')
+    parser.add_option('--backends', default=SUITE_BACKENDS,
+                      help='comma-separated backends for --suite, default "%default"')
+    parser.add_option('--suite-run', default='', help=optparse.SUPPRESS_HELP)
     options, args = parser.parse_args()
 
+    if options.suite_run:
+        # Run by count_syscalls(): path,workload,backend,ignore_d_type
+        path, workload, backend, ignore_d_type = options.suite_run.split(',')
+        sys.setrecursionlimit(max(sys.getrecursionlimit(), SUITE_DEEP_LEVELS * 10))
+        run_suite_workload(path, workload, backend, int(ignore_d_type))
+        sys.exit(0)
+    if options.suite:
+        def names(option, allowed):
+            values = option.split(',')
+            for value in values:
+                if value not in allowed.split(','):
+                    parser.error('unknown name {0!r}, expected one of {1}'.format(value, allowed))
+            return values
+        run_suite(options.suite, options.scale, names(options.trees, SUITE_TREES),
+                  names(options.workloads, SUITE_WORKLOADS),
+                  names(options.backends, SUITE_BACKENDS))
+        sys.exit(0)
+
+    if options.wide:
+        if scandir.scandir_c is None:
+            print("ERROR: Compiled C version of scandir not found!")
+            sys.exit(1)
+        if args:
+            wide_dir = args[0]
+        else:
+            wide_dir = os.path.join(os.path.dirname(__file__),
+                                    'benchwide_{0}'.format(options.wide))
+            if not os.path.exists(wide_dir):
+                print('Creating wide directory at {0}: num_files={1}'.format(
+                    wide_dir, options.wide))
+                create_wide_dir(wide_dir, options.wide)
+        buffer_sizes = [int(b) for b in options.buffer_sizes.split(',')]
+        if options.filter:
+            benchmark_filter(wide_dir, options.filter)
+        else:
+            benchmark_wide(wide_dir, buffer_sizes)
+        sys.exit(0)
+
     if args:
         tree_dir = args[0]
     else:
@@ -151,6 +777,25 @@ using it instead of creating a tree."""
                 tree_dir, DEPTH, NUM_DIRS, NUM_FILES))
             create_tree(tree_dir)
 
+    if options.glob:
+        benchmark_glob(tree_dir, options.glob)
+        sys.exit(0)
+    if options.du:
+        if scandir.du_c is None:
+            print("ERROR: Native version of du not found!")
+            sys.exit(1)
+        benchmark_du(tree_dir, [int(w) for w in options.du.split(',')])
+        sys.exit(0)
+    if options.snapshot:
+        benchmark_snapshot(tree_dir, options.snapshot)
+        sys.exit(0)
+    if options.prefetch:
+        if scandir.walk_c is None:
+            print("ERROR: Native version of walk not found!")
+            sys.exit(1)
+        benchmark_prefetch(tree_dir, [int(p) for p in options.prefetch.split(',')])
+        sys.exit(0)
+
     if options.scandir == 'generic':
         scandir.scandir = scandir.scandir_generic
     elif options.scandir == 'c':
@@ -168,7 +813,7 @@ using it instead of creating a tree."""
             print("ERROR: Python 3.5's os.scandir() not found!")
             sys.exit(1)
         scandir.scandir = os.scandir
-    elif hasattr(os, 'scandir'):
+    elif scandir.walk_c is None and hasattr(os, 'scandir'):
         scandir.scandir = os.scandir
 
     if scandir.scandir == getattr(os, 'scandir', None):
@@ -183,10 +828,23 @@ using it instead of creating a tree."""
         print('ERROR: Unsure which version of scandir we are using!')
         sys.exit(1)
 
+    if scandir.scandir != scandir.scandir_c:
+        # The native walk() always uses the C scandir internals
+        scandir.walk = scandir.walk_python
+    elif scandir.walk_c is not None:
+        print('Using native C version of walk')
+
     if hasattr(os, 'scandir'):
         os.walk = os_walk_pre_35
         print('Comparing against pre-Python 3.5 version of os.walk()')
     else:
         print('Comparing against builtin version of os.walk()')
 
+    if options.parallel:
+        if scandir.parallel_walk_c is None:
+            print("ERROR: Native version of parallel_walk not found!")
+            sys.exit(1)
+        benchmark_parallel(tree_dir, [int(w) for w in options.parallel.split(',')])
+        sys.exit(0)
+
     benchmark(tree_dir, get_size=options.size)
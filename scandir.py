@@ -18,12 +18,20 @@ LICENSE.txt for the full license text.
 
 from __future__ import division
 
-from errno import ENOENT
-from os import listdir, lstat, stat, strerror
-from os.path import join, islink
-from stat import S_IFDIR, S_IFLNK, S_IFREG
+from errno import ENOENT, ENOSPC
+from os import close as close_fd, listdir, lstat, stat, strerror
+from os.path import join, islink, isdir, lexists, normpath, split
+from stat import S_IFDIR, S_IFLNK, S_IFMT, S_IFREG, S_ISDIR
+import array
 import collections
+import fnmatch
+import mmap
+import re
+import select
+import struct
 import sys
+import threading
+import time
 
 try:
     import _scandir
@@ -41,7 +49,9 @@ if _scandir is None and ctypes is None:
                   "or ctypes, using slow generic fallback")
 
 __version__ = '1.10.1'
-__all__ = ['scandir', 'walk']
+__all__ = ['scandir', 'walk', 'parallel_walk', 'prefetch_stat', 'scandir_bulk',
+           'glob', 'iglob', 'du', 'snapshot', 'Snapshot', 'rescan', 'diff_trees',
+           'TreeCache', 'ascandir', 'awalk']
 
 # Windows FILE_ATTRIBUTE constants for interpreting the
 # FIND_DATA.dwFileAttributes member
@@ -600,12 +610,89 @@ else:
     DirEntry = GenericDirEntry
 
 
-def _walk(top, topdown=True, onerror=None, followlinks=False):
+def _walk(top, topdown=True, onerror=None, followlinks=False, prefetch=0,
+          order='dfs', max_depth=None, frontier_memory=None,
+          dedupe_dirs=False, dedupe_files=False):
     """Like Python 3.5's implementation of os.walk() -- faster than
     the pre-Python 3.5 version as it uses scandir() internally.
+
+    The native walk() can read up to prefetch upcoming subdirectories of
+    each directory on a helper thread, to warm the cache for them while
+    the caller is busy with the current one; here prefetch is ignored.
+
+    With order='bfs' the walk is breadth-first (and always top-down), a
+    level at a time. max_depth stops the walk descending more than that
+    many levels below top. The native walk() spills a breadth-first
+    walk's queue of directories to a temporary file once it's over
+    frontier_memory bytes; here it's always kept in memory.
+
+    dedupe_dirs skips directories whose (st_dev, st_ino) has already
+    been walked, so following a symlink cycle terminates. dedupe_files
+    leaves out of the file lists hard links to files already listed,
+    using entry.inode() and the st_dev of their directory.
+    """
+    if order not in ('dfs', 'bfs'):
+        raise ValueError("walk: order must be 'dfs' or 'bfs'")
+    if prefetch < 0:
+        raise ValueError('walk: prefetch must not be negative')
+    if max_depth is not None and max_depth < 0:
+        raise ValueError('walk: max_depth must not be negative')
+    if order == 'bfs':
+        if not topdown or prefetch:
+            raise ValueError("walk: order='bfs' is always top-down, without prefetch")
+    if dedupe_dirs or dedupe_files:
+        seen = (set() if dedupe_dirs else None, set() if dedupe_files else None)
+    else:
+        seen = None
+    if order == 'bfs':
+        return _walk_bfs(top, onerror, followlinks, max_depth, seen)
+    return _walk_dfs(top, topdown, onerror, followlinks, max_depth, seen)
+
+
+def _walk_seen(top, seen):
+    """Return (walked, dev): whether top has already been walked, and
+    its st_dev (or None if unknown) for keying its files.
     """
+    try:
+        st = stat(top)
+    except OSError:
+        # Left for scandir() to report
+        return False, None
+    if not st.st_ino:
+        # No inode numbers on this platform
+        return False, None
+    seen_dirs = seen[0]
+    if seen_dirs is not None:
+        key = (st.st_dev, st.st_ino)
+        if key in seen_dirs:
+            return True, None
+        seen_dirs.add(key)
+    return False, st.st_dev
+
+
+def _seen_file(entry, dev, seen):
+    """Return whether a file with entry's inode has already been listed."""
+    seen_files = seen[1]
+    if seen_files is None or dev is None:
+        return False
+    try:
+        key = (dev, entry.inode())
+    except OSError:
+        return False
+    if key in seen_files:
+        return True
+    seen_files.add(key)
+    return False
+
+
+def _walk_dfs(top, topdown, onerror, followlinks, max_depth, seen):
     dirs = []
     nondirs = []
+    dev = None
+    if seen is not None:
+        walked, dev = _walk_seen(top, seen)
+        if walked:
+            return
 
     # We may not have read permission for top, in which case we can't
     # get a list of the files the directory contains.  os.walk
@@ -639,10 +726,10 @@ def _walk(top, topdown=True, onerror=None, followlinks=False):
 
         if is_dir:
             dirs.append(entry.name)
-        else:
+        elif seen is None or not _seen_file(entry, dev, seen):
             nondirs.append(entry.name)
 
-        if not topdown and is_dir:
+        if not topdown and is_dir and max_depth != 0:
             # Bottom-up: recurse into sub-directory, but exclude symlinks to
             # directories if followlinks is False
             if followlinks:
@@ -658,7 +745,8 @@ def _walk(top, topdown=True, onerror=None, followlinks=False):
                 walk_into = not is_symlink
 
             if walk_into:
-                for entry in walk(entry.path, topdown, onerror, followlinks):
+                for entry in _walk_dfs(entry.path, topdown, onerror, followlinks,
+                                       _sub_depth(max_depth), seen):
                     yield entry
 
     # Yield before recursion if going top down
@@ -666,6 +754,8 @@ def _walk(top, topdown=True, onerror=None, followlinks=False):
         yield top, dirs, nondirs
 
         # Recurse into sub-directories
+        if max_depth == 0:
+            return
         for name in dirs:
             new_path = join(top, name)
             # Issue #23605: os.path.islink() is used instead of caching
@@ -673,21 +763,1508 @@ def _walk(top, topdown=True, onerror=None, followlinks=False):
             # the caller can replace the directory entry during the "yield"
             # above.
             if followlinks or not islink(new_path):
-                for entry in walk(new_path, topdown, onerror, followlinks):
+                for entry in _walk_dfs(new_path, topdown, onerror, followlinks,
+                                       _sub_depth(max_depth), seen):
                     yield entry
     else:
         # Yield after recursion if going bottom up
         yield top, dirs, nondirs
 
 
-if IS_PY3 or sys.platform != 'win32':
+def _sub_depth(max_depth):
+    return None if max_depth is None else max_depth - 1
+
+
+def _walk_bfs(top, onerror, followlinks, max_depth, seen):
+    queue = collections.deque([(top, 0)])
+    while queue:
+        path, depth = queue.popleft()
+        dirs = []
+        nondirs = []
+        dev = None
+        if seen is not None:
+            walked, dev = _walk_seen(path, seen)
+            if walked:
+                continue
+        try:
+            for entry in scandir(path):
+                try:
+                    is_dir = entry.is_dir()
+                except OSError:
+                    is_dir = False
+                if is_dir:
+                    dirs.append(entry.name)
+                elif seen is None or not _seen_file(entry, dev, seen):
+                    nondirs.append(entry.name)
+        except OSError as error:
+            if onerror is not None:
+                onerror(error)
+            continue
+
+        yield path, dirs, nondirs
+
+        # Queued after the yield, so the caller can prune dirs
+        if max_depth is not None and depth >= max_depth:
+            continue
+        for name in dirs:
+            new_path = join(path, name)
+            if followlinks or not islink(new_path):
+                queue.append((new_path, depth + 1))
+
+
+walk_python = _walk
+
+# The native walk() is only available on POSIX systems
+walk_c = getattr(_scandir, 'walk', None)
+
+if walk_c is not None:
+    walk = walk_c
+elif IS_PY3 or sys.platform != 'win32':
     walk = _walk
 else:
     # Fix for broken unicode handling on Windows on Python 2.x, see:
     # https://github.com/benhoyt/scandir/issues/54
     file_system_encoding = sys.getfilesystemencoding()
 
-    def walk(top, topdown=True, onerror=None, followlinks=False):
+    def walk(top, topdown=True, onerror=None, followlinks=False, prefetch=0,
+             order='dfs', max_depth=None, frontier_memory=None,
+             dedupe_dirs=False, dedupe_files=False):
         if isinstance(top, bytes):
             top = top.decode(file_system_encoding)
-        return _walk(top, topdown, onerror, followlinks)
+        return _walk(top, topdown, onerror, followlinks, prefetch, order, max_depth,
+                     frontier_memory, dedupe_dirs, dedupe_files)
+
+
+parallel_walk_c = getattr(_scandir, 'parallel_walk', None)
+
+
+def parallel_walk(top, workers=None, onerror=None, followlinks=False):
+    """Like walk(), but read directories concurrently using a pool of
+    native threads (workers of them, by default one per CPU and at least
+    4), which helps most on high-latency filesystems like NFS.
+
+    Unlike walk(), directories are yielded in no particular order (neither
+    top-down nor bottom-up), and modifying dirnames in-place has no effect
+    on which directories are walked. Falls back to a regular top-down
+    walk() if the native version isn't available.
+    """
+    if parallel_walk_c is None:
+        return walk(top, onerror=onerror, followlinks=followlinks)
+    return parallel_walk_c(top, workers or 0, onerror, followlinks)
+
+
+async_scandir_c = getattr(_scandir, 'async_scandir', None)
+async_walk_c = getattr(_scandir, 'async_walk', None)
+
+
+def _running_loop():
+    import asyncio
+    return getattr(asyncio, 'get_running_loop', asyncio.get_event_loop)()
+
+
+class _AsyncBatches(object):
+    """Async iterator over the items of a native AsyncReader, waiting for
+    its fd to be readable with loop.add_reader() whenever it has nothing
+    ready. Without one, batches (an iterator of lists) is advanced in the
+    loop's default executor instead.
+    """
+
+    def __init__(self, reader=None, batches=None):
+        self._reader = reader
+        self._batches = batches
+        self._items = collections.deque()
+        self._done = False
+        self._watching = None   # (loop, fd, future) while waiting on the reader
+
+    def __aiter__(self):
+        return self
+
+    def __anext__(self):
+        loop = _running_loop()
+        future = loop.create_future()
+        if self._items or self._done:
+            self._resolve(future)
+        elif self._reader is not None:
+            self._watch(loop, future)
+        else:
+            batch = loop.run_in_executor(None, next, self._batches, None)
+            batch.add_done_callback(lambda batch: self._batch_done(batch, future))
+        return future
+
+    def _add(self, batch):
+        if batch is None:
+            self._done = True
+        else:
+            self._items.extend(batch)
+
+    def _resolve(self, future):
+        if future.done():
+            return
+        if self._items:
+            future.set_result(self._items.popleft())
+        else:
+            self.close()
+            future.set_exception(StopAsyncIteration())
+
+    def _watch(self, loop, future):
+        fd = self._reader.fileno()
+
+        def ready():
+            if future.done():
+                return
+            try:
+                self._add(self._reader.read())
+            except Exception as error:
+                self._unwatch()
+                future.set_exception(error)
+                return
+            if self._items or self._done:
+                self._unwatch()
+                self._resolve(future)
+
+        self._watching = (loop, fd, future)
+        loop.add_reader(fd, ready)
+        # Also stop watching if the caller is cancelled
+        future.add_done_callback(self._unwatch)
+
+    def _unwatch(self, future=None):
+        if self._watching is None:
+            return
+        loop, fd, waiter = self._watching
+        if future is None or future is waiter:
+            self._watching = None
+            loop.remove_reader(fd)
+
+    def _batch_done(self, batch, future):
+        if future.done():
+            return
+        if batch.exception() is not None:
+            future.set_exception(batch.exception())
+            return
+        self._add(batch.result())
+        self._resolve(future)
+
+    def close(self):
+        """Stop reading; also called once all the items are returned."""
+        self._unwatch()
+        self._done = True
+        self._items.clear()
+        if self._reader is not None:
+            self._reader.close()
+
+    def __aenter__(self):
+        future = _running_loop().create_future()
+        future.set_result(self)
+        return future
+
+    def __aexit__(self, *args):
+        self.close()
+        future = _running_loop().create_future()
+        future.set_result(None)
+        return future
+
+
+def ascandir(path='.', stat=False):
+    """Async iterator version of scandir(path), for use with asyncio:
+    "async for entry in ascandir(path)". The directory is read by a native
+    thread, and entries are handed to the event loop in batches, so it
+    isn't blocked on a slow filesystem. If stat is true, each entry is
+    also lstat'ed by the thread, so entry.stat(follow_symlinks=False)
+    doesn't need a system call. Without the C extension, the directory is
+    read in the loop's default executor instead.
+    """
+    if async_scandir_c is not None:
+        return _AsyncBatches(reader=async_scandir_c(path, stat))
+
+    def batches():
+        entries = list(scandir(path))
+        if stat:
+            prefetch_stat(entries, follow_symlinks=False)
+        yield entries
+    return _AsyncBatches(batches=batches())
+
+
+def awalk(top, workers=None, onerror=None, followlinks=False):
+    """Async iterator version of parallel_walk(), for use with asyncio:
+    "async for dirpath, dirnames, filenames in awalk(top)". Directories
+    are read by a pool of native threads, and yielded in no particular
+    order as they're ready; modifying dirnames has no effect. Without the
+    C extension, a top-down walk() is run in the loop's default executor.
+    """
+    if async_walk_c is not None:
+        return _AsyncBatches(reader=async_walk_c(top, workers or 0, onerror, followlinks))
+    results = walk(top, onerror=onerror, followlinks=followlinks)
+    return _AsyncBatches(batches=([result] for result in results))
+
+
+def _prefetch_stat(entries, follow_symlinks=True):
+    """Python version of prefetch_stat(): stat each entry in turn."""
+    count = 0
+    for entry in entries:
+        try:
+            entry.stat(follow_symlinks=follow_symlinks)
+        except OSError:
+            continue
+        count += 1
+    return count
+
+
+prefetch_stat_python = _prefetch_stat
+
+# The native prefetch_stat() is only available on POSIX systems, and only
+# takes DirEntry objects from the C scandir()
+prefetch_stat_c = getattr(_scandir, 'prefetch_stat', None)
+
+
+def prefetch_stat(entries, follow_symlinks=True):
+    """Stat a batch of DirEntry objects at once, caching the results so
+    that entry.stat() doesn't need a system call; returns the number of
+    entries stat'ed. Entries that can't be stat'ed are skipped.
+
+    With the C scandir() on Linux the stats are submitted together using
+    io_uring (or run on a pool of threads where that's not available),
+    which is much faster than one stat at a time on cold caches and
+    network filesystems.
+    """
+    entries = list(entries)
+    if prefetch_stat_c is not None and all(type(e) is DirEntry_c for e in entries):
+        return prefetch_stat_c(entries, follow_symlinks)
+    return _prefetch_stat(entries, follow_symlinks)
+
+
+# d_type values used in scandir_bulk() results
+DT_UNKNOWN = 0
+DT_DIR = 4
+DT_REG = 8
+DT_LNK = 10
+
+BulkListing = collections.namedtuple('BulkListing', 'names offsets inodes types')
+
+try:
+    array.array('Q')
+    _offset_typecode = 'Q'
+except ValueError:
+    # 'Q' isn't available before Python 3.3
+    _offset_typecode = 'L'
+
+
+def _scandir_bulk(path='.'):
+    """Python version of scandir_bulk(), built from scandir()."""
+    names = []
+    offsets = array.array(_offset_typecode)
+    inodes = array.array(_offset_typecode)
+    types = array.array('B')
+    offset = 0
+    for entry in scandir(path):
+        name = entry.name
+        if not isinstance(name, bytes):
+            name = name.encode(sys.getfilesystemencoding(),
+                               'surrogateescape' if IS_PY3 else 'strict')
+        names.append(name + b'\0')
+        offsets.append(offset)
+        offset += len(name) + 1
+        inodes.append(entry.inode())
+        if entry.is_symlink():
+            types.append(DT_LNK)
+        elif entry.is_dir(follow_symlinks=False):
+            types.append(DT_DIR)
+        elif entry.is_file(follow_symlinks=False):
+            types.append(DT_REG)
+        else:
+            types.append(DT_UNKNOWN)
+    offsets.append(offset)
+    return BulkListing(b''.join(names), offsets, inodes, types)
+
+
+scandir_bulk_python = _scandir_bulk
+
+# The native scandir_bulk() is only available on POSIX systems on Python 3
+scandir_bulk_c = getattr(_scandir, 'scandir_bulk', None)
+
+if scandir_bulk_c is not None:
+    scandir_bulk = scandir_bulk_c
+else:
+    scandir_bulk = _scandir_bulk
+
+
+_magic_check = re.compile('([*?[])')
+_magic_check_bytes = re.compile(b'([*?[])')
+
+
+def _has_magic(s):
+    if isinstance(s, bytes):
+        return _magic_check_bytes.search(s) is not None
+    return _magic_check.search(s) is not None
+
+
+def _is_hidden(name):
+    return name[:1] in ('.', b'.')
+
+
+def _is_recursive(pattern):
+    return pattern in ('**', b'**')
+
+
+def _glob_dir(dirname, pattern=None, dironly=False, subdirs=False):
+    """Python version of the C glob_dir(): return the paths of the entries
+    in dirname whose names match pattern (all of them if pattern is None,
+    only directories if dironly is true), plus a list of the paths of its
+    subdirectories if subdirs is true (else None). Names starting with a
+    dot are skipped unless the pattern starts with one.
+    """
+    paths = []
+    dirs = [] if subdirs else None
+    match_hidden = pattern is not None and _is_hidden(pattern)
+    for entry in scandir(dirname or (b'.' if isinstance(dirname, bytes) else '.')):
+        name = entry.name
+        hidden = _is_hidden(name)
+        matched = ((not hidden or match_hidden) and
+                   (pattern is None or fnmatch.fnmatchcase(name, pattern)))
+        if not matched and (hidden or not subdirs):
+            continue
+        is_dir = (dironly or (subdirs and not hidden)) and entry.is_dir()
+        path = join(dirname, name) if dirname else name
+        if matched and (is_dir or not dironly):
+            paths.append(path)
+        if subdirs and not hidden and is_dir:
+            dirs.append(path)
+    return paths, dirs
+
+
+glob_dir_python = _glob_dir
+
+# The native glob_dir() is only available on POSIX systems
+glob_dir_c = getattr(_scandir, 'glob_dir', None)
+
+
+def _rlistdir(dirname, dironly, glob_dir):
+    try:
+        paths, subdirs = glob_dir(dirname, None, dironly, True)
+    except OSError:
+        return
+    # Yield in the same order as glob.glob(): each name followed by
+    # everything under it, if it's a directory
+    i = 0
+    for path in paths:
+        yield path
+        if i < len(subdirs) and subdirs[i] == path:
+            i += 1
+            for y in _rlistdir(path, dironly, glob_dir):
+                yield y
+
+
+def _glob_tree(dirname, pattern, dironly, glob_dir):
+    # Fused version of "dirname/**/pattern" that reads each directory once
+    try:
+        paths, subdirs = glob_dir(dirname, pattern, dironly, True)
+    except OSError:
+        return
+    for path in paths:
+        yield path
+    for subdir in subdirs:
+        for path in _glob_tree(subdir, pattern, dironly, glob_dir):
+            yield path
+
+
+def _glob2(dirname, pattern, dironly, glob_dir):
+    # Matches the directory itself (with a trailing slash, or as an empty
+    # string at the top) and everything below it that isn't hidden
+    yield join(dirname, pattern[:0])
+    for path in _rlistdir(dirname, dironly, glob_dir):
+        yield path
+
+
+def _glob1(dirname, pattern, dironly, glob_dir):
+    try:
+        return glob_dir(dirname, pattern, dironly)[0]
+    except OSError:
+        return []
+
+
+def _glob0(dirname, basename, dironly, glob_dir):
+    path = join(dirname, basename)
+    if not basename:
+        # A pattern ending with a slash only matches directories
+        if isdir(dirname):
+            return [path]
+    elif lexists(path):
+        return [path]
+    return []
+
+
+def _iglob(pathname, recursive, dironly, glob_dir):
+    dirname, basename = split(pathname)
+    if not _has_magic(pathname):
+        if basename:
+            if lexists(pathname):
+                yield pathname
+        elif isdir(dirname):
+            # Patterns ending with a slash should match only directories
+            yield pathname
+        return
+
+    if recursive and _has_magic(basename) and not _is_recursive(basename):
+        parent, last = split(dirname)
+        if _is_recursive(last):
+            if parent and _has_magic(parent):
+                dirs = _iglob(parent, recursive, True, glob_dir)
+            else:
+                dirs = [parent]
+            for dirname in dirs:
+                for path in _glob_tree(dirname, basename, dironly, glob_dir):
+                    yield path
+            return
+
+    if dirname and dirname != pathname and _has_magic(dirname):
+        # Only directories matching the leading components are listed, so
+        # the search never descends into a directory that can't match
+        dirs = _iglob(dirname, recursive, True, glob_dir)
+    else:
+        dirs = [dirname]
+    if not _has_magic(basename):
+        glob_in_dir = _glob0
+    elif recursive and _is_recursive(basename):
+        glob_in_dir = _glob2
+    else:
+        glob_in_dir = _glob1
+    for dirname in dirs:
+        for path in glob_in_dir(dirname, basename, dironly, glob_dir):
+            yield path
+
+
+def _make_iglob(glob_dir):
+    def iglob(pathname, recursive=False):
+        """Return an iterator of the paths matching pathname, a shell-style
+        pattern, like glob.iglob(). If recursive is true, a "**" path
+        component matches any files and zero or more directories.
+        """
+        it = _iglob(pathname, recursive, False, glob_dir)
+        if recursive and _is_recursive(pathname):
+            # Skip the empty string for the top directory itself
+            next(it)
+        return it
+    return iglob
+
+
+iglob_python = _make_iglob(_glob_dir)
+
+if glob_dir_c is not None:
+    iglob_c = _make_iglob(glob_dir_c)
+    iglob = iglob_c
+else:
+    iglob_c = None
+    iglob = iglob_python
+
+
+def glob(pathname, recursive=False):
+    """Return a list of the paths matching pathname, a shell-style
+    pattern, like glob.glob(). Names starting with a dot are only matched
+    by pattern components that start with a dot. If recursive is true, a
+    "**" path component matches any files and zero or more directories.
+
+    With the C extension each directory is read and matched by the native
+    glob_dir(), which uses d_type to avoid stat calls and creates no
+    objects for names that don't match; "**/pattern" reads each directory
+    under the "**" just once.
+    """
+    return list(iglob(pathname, recursive=recursive))
+
+
+DiskUsage = collections.namedtuple('DiskUsage', 'total files dirs subtotals')
+
+
+def _du(top, follow_symlinks=False, apparent=False, one_filesystem=False,
+        subtotals=False, workers=None, onerror=None):
+    """Python version of du(), built from scandir(); workers is ignored."""
+    def size_of(st):
+        blocks = getattr(st, 'st_blocks', None)
+        if apparent or blocks is None:
+            return st.st_size
+        return blocks * 512
+
+    def du_dir(path, st):
+        counts[1] += 1
+        total = size_of(st)
+        try:
+            entries = list(scandir(path))
+        except OSError as error:
+            if onerror is not None:
+                onerror(error)
+            entries = []
+        for entry in entries:
+            try:
+                entry_st = entry.stat(follow_symlinks=follow_symlinks)
+            except OSError:
+                # Count a broken symlink itself when following symlinks
+                if not follow_symlinks:
+                    continue
+                try:
+                    entry_st = entry.stat(follow_symlinks=False)
+                except OSError:
+                    continue
+            key = (entry_st.st_dev, entry_st.st_ino)
+            if S_ISDIR(entry_st.st_mode):
+                if one_filesystem and entry_st.st_dev != top_st.st_dev:
+                    continue
+                if follow_symlinks:
+                    if key in seen:
+                        continue
+                    seen.add(key)
+                total += du_dir(entry.path, entry_st)
+            else:
+                if entry_st.st_nlink > 1 or follow_symlinks:
+                    if key in seen:
+                        continue
+                    seen.add(key)
+                counts[0] += 1
+                total += size_of(entry_st)
+        if totals is not None:
+            totals[path] = total
+        return total
+
+    top_st = stat(top)
+    totals = {} if subtotals else None
+    if not S_ISDIR(top_st.st_mode):
+        return DiskUsage(size_of(top_st), 1, 0, totals)
+    seen = set()
+    if follow_symlinks:
+        seen.add((top_st.st_dev, top_st.st_ino))
+    counts = [0, 0]
+    total = du_dir(top, top_st)
+    return DiskUsage(total, counts[0], counts[1], totals)
+
+
+du_python = _du
+
+# The native du() is only available on POSIX systems
+du_c = getattr(_scandir, 'du', None)
+
+
+def du(top, follow_symlinks=False, apparent=False, one_filesystem=False,
+       subtotals=False, workers=None, onerror=None):
+    """Return the disk usage of the tree at top as a DiskUsage tuple of
+    (total, files, dirs, subtotals), like "du -s -B1". total is the sum of
+    st_blocks * 512 (or st_size if apparent is true) over the directories
+    and files counted; hard links are only counted once. Symlinks aren't
+    followed unless follow_symlinks is true, and with one_filesystem,
+    directories on other file systems are skipped.
+
+    If subtotals is true, subtotals is a dict mapping each directory's
+    path to the total size of the tree under it (else None). onerror is
+    called with an OSError for each directory that can't be read.
+
+    The native version stats everything on a pool of workers threads
+    (see parallel_walk()) without creating any DirEntry or stat_result
+    objects.
+    """
+    if du_c is None:
+        return _du(top, follow_symlinks, apparent, one_filesystem, subtotals,
+                   workers, onerror)
+    return DiskUsage(*du_c(top, follow_symlinks, apparent, one_filesystem,
+                           subtotals, workers or 0, onerror))
+
+
+# Snapshot file format, see the "Tree snapshots" section of _scandir.c
+SNAPSHOT_MAGIC = b'SCANSNAP'
+SNAPSHOT_VERSION = 1
+SNAPSHOT_BYTE_ORDER = 0x01020304
+SNAPSHOT_NO_INDEX = 0xFFFFFFFF
+SNAPSHOT_FLAG_BYTES = 1
+_SNAPSHOT_RACY_NS = 2000000000
+_SNAPSHOT_HEADER = '8sIIQQQQIIq'
+_SNAPSHOT_RECORD = 'QIIIIIIQQQqq'
+
+SnapshotEntry = collections.namedtuple(
+    'SnapshotEntry',
+    'name parent mode ino dev size mtime_ns ctime_ns first_child num_children')
+
+
+def _fs_encode(name):
+    if isinstance(name, bytes):
+        return name
+    return name.encode(sys.getfilesystemencoding(),
+                       'surrogateescape' if IS_PY3 else 'strict')
+
+
+def _fs_decode(name):
+    return name.decode(sys.getfilesystemencoding(),
+                       'surrogateescape' if IS_PY3 else 'strict')
+
+
+def _snapshot(top, out_file, onerror=None):
+    """Python version of snapshot(), built from scandir()."""
+    record = struct.Struct('=' + _SNAPSHOT_RECORD)
+    records = []
+    names = []
+    names_size = [0]
+    errors = []
+    created_ns = int(time.time() * 1000000000)
+
+    def add(name, st, parent):
+        mtime_ns = getattr(st, 'st_mtime_ns', None)
+        ctime_ns = getattr(st, 'st_ctime_ns', None)
+        if mtime_ns is None:
+            mtime_ns = int(st.st_mtime * 1000000000)
+            ctime_ns = int(st.st_ctime * 1000000000)
+        records.append([names_size[0], len(name), parent, len(records) + 1, 0,
+                        st.st_mode, 0, st.st_ino, st.st_dev, st.st_size, mtime_ns,
+                        ctime_ns])
+        names.append(name)
+        names_size[0] += len(name)
+
+    def add_dir(path, index):
+        try:
+            entries = sorted((_fs_encode(entry.name), entry) for entry in scandir(path))
+        except OSError as error:
+            errors.append(error)
+            return
+        first_child = len(records)
+        subdirs = []
+        for name, entry in entries:
+            try:
+                st = entry.stat(follow_symlinks=False)
+            except OSError:
+                continue
+            if S_ISDIR(st.st_mode):
+                subdirs.append((entry.path, len(records)))
+            add(name, st, index)
+        records[index][3] = first_child
+        records[index][4] = len(records) - first_child
+        for subdir, subdir_index in subdirs:
+            add_dir(subdir, subdir_index)
+
+    top_st = stat(top)
+    add(_fs_encode(top), top_st, SNAPSHOT_NO_INDEX)
+    if S_ISDIR(top_st.st_mode):
+        add_dir(top, 0)
+
+    header_size = struct.calcsize('=' + _SNAPSHOT_HEADER)
+    names_offset = header_size + len(records) * record.size
+    with open(out_file, 'wb') as f:
+        f.write(struct.pack('=' + _SNAPSHOT_HEADER, SNAPSHOT_MAGIC, SNAPSHOT_VERSION,
+                            record.size, len(records), header_size, names_offset,
+                            names_size[0], SNAPSHOT_BYTE_ORDER,
+                            SNAPSHOT_FLAG_BYTES if isinstance(top, bytes) else 0,
+                            created_ns))
+        for fields in records:
+            f.write(record.pack(*fields))
+        f.write(b''.join(names))
+    if onerror is not None:
+        for error in errors:
+            onerror(error)
+    return len(records)
+
+
+snapshot_python = _snapshot
+
+# The native snapshot() is only available on POSIX systems
+snapshot_c = getattr(_scandir, 'snapshot', None)
+
+
+def snapshot(top, out_file, onerror=None):
+    """Walk the tree at top (without following symlinks, except at the
+    top) and write a binary index of it to out_file, for reading back
+    with Snapshot. Each entry's name, mode, inode, device, size, mtime and
+    ctime is recorded. onerror is called with an OSError for each
+    directory that couldn't be read. Return the number of entries written.
+
+    The native version walks the tree with the GIL released, using
+    openat() and fstatat() relative to each open directory, and streams
+    records to the file as it goes.
+    """
+    if snapshot_c is None:
+        return _snapshot(top, out_file, onerror)
+    return snapshot_c(top, out_file, onerror)
+
+
+class Snapshot(object):
+    """Read-only view of a file written by snapshot(), memory-mapped so
+    that opening it is instant whatever its size and only the records
+    that are used get read in.
+
+    Entries are numbered from 0, the top directory, in the order they were
+    written: the entries of each directory are consecutive and sorted by
+    name. snap[i] is a SnapshotEntry for entry i, where parent, first_child
+    and num_children are entry numbers. lookup() finds an entry by path
+    with a binary search of each directory it goes through.
+    """
+
+    def __init__(self, path):
+        self.filename = path
+        with open(path, 'rb') as f:
+            header_size = struct.calcsize('=' + _SNAPSHOT_HEADER)
+            header = f.read(header_size)
+            if len(header) < header_size or header[:8] != SNAPSHOT_MAGIC:
+                raise ValueError('{0!r} is not a snapshot file'.format(path))
+            # The file is in the byte order of the machine that wrote it
+            if struct.unpack('<I', header[48:52])[0] == SNAPSHOT_BYTE_ORDER:
+                order = '<'
+            else:
+                order = '>'
+            (_, version, record_size, self._num_records, self._records_offset,
+             self._names_offset, names_size, _, flags,
+             self.created_ns) = struct.unpack(
+                order + _SNAPSHOT_HEADER, header)
+            self._record = struct.Struct(order + _SNAPSHOT_RECORD)
+            # Just name_offset, name_len, parent, first_child and num_children
+            self._links = struct.Struct(order + 'QIIII')
+            if version != SNAPSHOT_VERSION or record_size != self._record.size:
+                raise ValueError('unsupported snapshot version {0} in {1!r}'.format(
+                                 version, path))
+            self._map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        if len(self._map) < self._names_offset + names_size:
+            self._map.close()
+            raise ValueError('{0!r} is truncated'.format(path))
+        self._is_bytes = bool(flags & SNAPSHOT_FLAG_BYTES)
+
+    def close(self):
+        self._map.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def __len__(self):
+        return self._num_records
+
+    def _fields(self, index):
+        if index < 0:
+            index += self._num_records
+        if not 0 <= index < self._num_records:
+            raise IndexError('snapshot index out of range')
+        return self._record.unpack_from(
+            self._map, self._records_offset + index * self._record.size)
+
+    def _name(self, fields):
+        start = self._names_offset + fields[0]
+        return self._map[start:start + fields[1]]
+
+    def _decode(self, name):
+        return name if self._is_bytes else _fs_decode(name)
+
+    def __getitem__(self, index):
+        fields = self._fields(index)
+        parent = None if fields[2] == SNAPSHOT_NO_INDEX else fields[2]
+        return SnapshotEntry(self._decode(self._name(fields)), parent, fields[5],
+                             fields[7], fields[8], fields[9], fields[10],
+                             fields[11], fields[3], fields[4])
+
+    def __iter__(self):
+        for index in range(self._num_records):
+            yield self[index]
+
+    def children(self, index):
+        """Return the range of entry numbers in directory entry index."""
+        fields = self._fields(index)
+        if index < 0:
+            index += self._num_records
+        first, count = fields[3], fields[4]
+        # Children are always written after their parent
+        if count and not index < first <= self._num_records - count:
+            raise ValueError('{0!r} is corrupt'.format(self.filename))
+        return range(first, first + count)
+
+    def path(self, index):
+        """Return the full path of entry index, starting with the top path."""
+        names = []
+        while True:
+            fields = self._fields(index)
+            names.append(self._name(fields))
+            if fields[2] == SNAPSHOT_NO_INDEX:
+                break
+            index = fields[2]
+        return self._decode(join(*reversed(names)))
+
+    def lookup(self, path):
+        """Return the entry number of path, which may be relative to the top
+        directory or start with the top path. Raise KeyError if it isn't
+        in the snapshot.
+        """
+        top = self._name(self._fields(0))
+        encoded = _fs_encode(path)
+        if encoded == top:
+            return 0
+        prefix = join(top, b'')
+        if encoded.startswith(prefix):
+            encoded = encoded[len(prefix):]
+        data = self._map
+        unpack_from = self._links.unpack_from
+        records_offset = self._records_offset
+        record_size = self._record.size
+        names_offset = self._names_offset
+        index = 0
+        for name in encoded.split(b'/' if sys.platform != 'win32' else b'\\'):
+            if not name or name == b'.':
+                continue
+            _, _, _, lo, num_children = unpack_from(data, records_offset + index * record_size)
+            end = hi = lo + num_children
+            while lo < hi:
+                mid = (lo + hi) // 2
+                start, length = unpack_from(data, records_offset + mid * record_size)[:2]
+                if data[names_offset + start:names_offset + start + length] < name:
+                    lo = mid + 1
+                else:
+                    hi = mid
+            if lo == end:
+                raise KeyError(path)
+            start, length = unpack_from(data, records_offset + lo * record_size)[:2]
+            if data[names_offset + start:names_offset + start + length] != name:
+                raise KeyError(path)
+            index = lo
+        return index
+
+    def items(self):
+        """Yield a (path, SnapshotEntry) pair for every entry in order,
+        without walking up the tree for each path like path() does.
+        """
+        dir_paths = {}
+        for index in range(self._num_records):
+            entry = self[index]
+            if entry.parent is None:
+                path = entry.name
+            else:
+                path = join(dir_paths[entry.parent], entry.name)
+            if S_ISDIR(entry.mode):
+                dir_paths[index] = path
+            yield path, entry
+
+
+SnapshotDelta = collections.namedtuple('SnapshotDelta', 'added removed modified')
+
+
+def _rescan(snapshot_file, top, out_file=None, check_files=True, onerror=None):
+    """Python version of rescan(), built from scandir() and Snapshot. It
+    writes out_file with a fresh snapshot() rather than as it goes.
+    """
+    added, removed, modified = [], [], []
+    errors = []
+    snap = Snapshot(snapshot_file)
+
+    def old_name(index):
+        return snap._name(snap._fields(index))
+
+    def old_key(index):
+        fields = snap._fields(index)
+        if not have_ns:
+            return fields[5:6] + fields[7:10] + (int(round(fields[10] / 1000.0)),
+                                                 int(round(fields[11] / 1000.0)))
+        return (fields[5],) + fields[7:12]
+
+    def stat_key(st):
+        mtime_ns = getattr(st, 'st_mtime_ns', None)
+        ctime_ns = getattr(st, 'st_ctime_ns', None)
+        if mtime_ns is None:
+            # Round to microseconds, as that's all a float time holds
+            return (st.st_mode, st.st_ino, st.st_dev, st.st_size,
+                    int(round(st.st_mtime * 1000000)), int(round(st.st_ctime * 1000000)))
+        return (st.st_mode, st.st_ino, st.st_dev, st.st_size, mtime_ns, ctime_ns)
+
+    def times_match(old, new, fields):
+        # Float times only hold microseconds and may round either way
+        slop = 0 if have_ns else 1
+        return all(abs(old[i] - new[i]) <= slop for i in fields)
+
+    def is_modified(old, new):
+        return old[:4] != new[:4] or not times_match(old, new, (4,))
+
+    def dir_unchanged(old, new):
+        # Same inode, mtime and ctime, so the same names in it (unless it
+        # was changed so close to the snapshot that the times may match)
+        created = snap.created_ns if have_ns else snap.created_ns // 1000
+        racy = _SNAPSHOT_RACY_NS if have_ns else _SNAPSHOT_RACY_NS // 1000
+        return (S_ISDIR(old[0]) and S_ISDIR(new[0]) and old[1:3] == new[1:3] and
+                times_match(old, new, (4, 5)) and old[5] < created - racy)
+
+    def removed_children(path, index):
+        if S_ISDIR(old_key(index)[0]):
+            for child in snap.children(index):
+                removed_tree(path, child)
+
+    def removed_tree(dirpath, index):
+        path = join(dirpath, old_name(index))
+        removed.append(path)
+        removed_children(path, index)
+
+    def rescan_dir(path, index, unchanged):
+        old = {}
+        if index is not None:
+            old = dict((old_name(child), child) for child in snap.children(index))
+        if unchanged:
+            names = old
+        else:
+            try:
+                names = set(_fs_encode(entry.name) for entry in
+                            scandir(path if isinstance(top, bytes) else _fs_decode(path)))
+            except OSError as error:
+                errors.append(error)
+                return
+        subdirs = []
+        for name in sorted(set(names) | set(old)):
+            child_path = join(path, name)
+            old_index = old.get(name)
+            if name not in names:
+                removed_tree(path, old_index)
+                continue
+            if unchanged and not check_files and not S_ISDIR(old_key(old_index)[0]):
+                continue
+            try:
+                new = stat_key(lstat(child_path))
+            except OSError:
+                if old_index is not None:
+                    removed_tree(path, old_index)
+                continue
+            if old_index is None:
+                added.append(child_path)
+                if S_ISDIR(new[0]):
+                    subdirs.append((child_path, None, False))
+                continue
+            old_entry = old_key(old_index)
+            if is_modified(old_entry, new):
+                modified.append(child_path)
+            if S_ISDIR(old_entry[0]) and not S_ISDIR(new[0]):
+                removed_children(child_path, old_index)
+            elif S_ISDIR(new[0]):
+                if S_ISDIR(old_entry[0]):
+                    subdirs.append((child_path, old_index, dir_unchanged(old_entry, new)))
+                else:
+                    subdirs.append((child_path, None, False))
+        for subdir in subdirs:
+            rescan_dir(*subdir)
+
+    try:
+        top_bytes = _fs_encode(top)
+        top_st = stat(top_bytes)
+        have_ns = hasattr(top_st, 'st_mtime_ns')
+        new = stat_key(top_st)
+        old_top = old_key(0)
+        if is_modified(old_top, new):
+            modified.append(top_bytes)
+        if S_ISDIR(old_top[0]) and not S_ISDIR(new[0]):
+            removed_children(top_bytes, 0)
+        elif S_ISDIR(new[0]):
+            if S_ISDIR(old_top[0]):
+                rescan_dir(top_bytes, 0, dir_unchanged(old_top, new))
+            else:
+                rescan_dir(top_bytes, None, False)
+    finally:
+        snap.close()
+
+    if out_file is not None:
+        _snapshot(top, out_file)
+    if onerror is not None:
+        for error in errors:
+            onerror(error)
+    if not isinstance(top, bytes):
+        added, removed, modified = [[_fs_decode(path) for path in paths]
+                                    for paths in (added, removed, modified)]
+    return added, removed, modified
+
+
+rescan_python = _rescan
+
+# The native rescan() is only available on POSIX systems
+rescan_c = getattr(_scandir, 'rescan', None)
+
+
+def rescan(snapshot, top=None, out_file=None, check_files=True, onerror=None):
+    """Compare the tree at top with snapshot (a Snapshot or the path of a
+    snapshot file) and return a SnapshotDelta of lists of the paths
+    (added, removed, modified) since, in walk order. top defaults to the
+    top path of the snapshot. Everything under an added or removed
+    directory is listed too. An entry is modified if its mode, inode,
+    device, size or mtime changed.
+
+    A directory whose inode, mtime and ctime are unchanged must still
+    have the same names in it, so it isn't read again. With check_files
+    false, the files in such a directory aren't stat'ed either (so
+    changes to their contents aren't seen), and the work done is
+    proportional to the number of directories plus what changed. If
+    out_file is given, a snapshot of
+    the tree as it is now is written to it for the next rescan(). onerror
+    is called with an OSError for each directory that couldn't be read.
+    """
+    if isinstance(snapshot, Snapshot):
+        snapshot_file = snapshot.filename
+        if top is None:
+            top = snapshot[0].name
+    else:
+        snapshot_file = snapshot
+        if top is None:
+            with Snapshot(snapshot_file) as snap:
+                top = snap[0].name
+    if rescan_c is None:
+        return SnapshotDelta(*_rescan(snapshot_file, top, out_file, check_files, onerror))
+    return SnapshotDelta(*rescan_c(snapshot_file, top, out_file, check_files, onerror))
+
+
+TreeDiff = collections.namedtuple('TreeDiff', 'kind path is_dir')
+
+_DIFF_FIELDS = ('size', 'mtime', 'mode')
+
+
+def _diff_trees(a, b, compare=('size', 'mtime'), onerror=None):
+    """Python version of diff_trees(), built from scandir(). Like the
+    native version it checks the tops and compare before returning its
+    iterator.
+    """
+    for field in compare:
+        if field not in _DIFF_FIELDS:
+            raise ValueError("diff_trees: compare fields must be 'size', 'mtime' or 'mode'")
+    stat(a)
+    stat(b)
+
+    def entry_type(entry):
+        # d_type (where available) gives the type without a stat call
+        if entry.is_dir(follow_symlinks=False):
+            return S_IFDIR
+        if entry.is_symlink():
+            return S_IFLNK
+        if entry.is_file(follow_symlinks=False):
+            return S_IFREG
+        return S_IFMT(entry.stat(follow_symlinks=False).st_mode)
+
+    def stat_differs(a_st, b_st):
+        if 'size' in compare and a_st.st_size != b_st.st_size:
+            return True
+        if 'mtime' in compare:
+            if getattr(a_st, 'st_mtime_ns', a_st.st_mtime) != \
+                    getattr(b_st, 'st_mtime_ns', b_st.st_mtime):
+                return True
+        return 'mode' in compare and a_st.st_mode != b_st.st_mode
+
+    def read_dir(path):
+        try:
+            return dict((entry.name, entry) for entry in scandir(path))
+        except OSError as error:
+            if onerror is not None:
+                onerror(error)
+            return None
+
+    def diff_dir(rel, a_dir, b_dir):
+        a_entries = read_dir(a_dir)
+        if a_entries is None:
+            return [], []
+        b_entries = read_dir(b_dir)
+        if b_entries is None:
+            return [], []
+        changes = []
+        subdirs = []
+        for name in sorted(set(a_entries) | set(b_entries)):
+            path = join(rel, name) if rel else name
+            types = []
+            for entry in (a_entries.get(name), b_entries.get(name)):
+                try:
+                    types.append(entry and entry_type(entry))
+                except OSError:
+                    # Treat entries that vanished as missing
+                    types.append(None)
+            a_type, b_type = types
+            if not a_type:
+                if b_type:
+                    changes.append(TreeDiff('added', path, b_type == S_IFDIR))
+            elif not b_type:
+                changes.append(TreeDiff('removed', path, a_type == S_IFDIR))
+            elif a_type != b_type:
+                changes.append(TreeDiff('modified', path, b_type == S_IFDIR))
+            elif a_type == S_IFDIR:
+                subdirs.append((path, join(a_dir, name), join(b_dir, name)))
+            elif compare:
+                try:
+                    a_st = a_entries[name].stat(follow_symlinks=False)
+                except OSError:
+                    changes.append(TreeDiff('added', path, False))
+                    continue
+                try:
+                    b_st = b_entries[name].stat(follow_symlinks=False)
+                except OSError:
+                    changes.append(TreeDiff('removed', path, False))
+                    continue
+                if stat_differs(a_st, b_st):
+                    changes.append(TreeDiff('modified', path, False))
+        return changes, subdirs
+
+    def diff_all():
+        # A stack of iterators over each level's subdirectories keeps the
+        # native version's order: a directory's differences, then each
+        # subdirectory's in turn
+        stack = [iter([(a[:0], a, b)])]
+        while stack:
+            for rel, a_dir, b_dir in stack[-1]:
+                changes, subdirs = diff_dir(rel, a_dir, b_dir)
+                for change in changes:
+                    yield change
+                stack.append(iter(subdirs))
+                break
+            else:
+                stack.pop()
+
+    return diff_all()
+
+
+diff_trees_python = _diff_trees
+
+# The native diff_trees() is only available on POSIX systems
+diff_trees_c = getattr(_scandir, 'diff_trees', None)
+
+
+def diff_trees(a, b, compare=('size', 'mtime'), onerror=None):
+    """Walk the trees at a and b in lockstep and yield a TreeDiff(kind,
+    path, is_dir) for each difference between them. kind is 'added'
+    (only in b), 'removed' (only in a) or 'modified'; path is relative to
+    a and b; is_dir is true if the entry is a directory in b (in a for
+    removed entries). Added and removed directories are reported once,
+    without their contents, and symlinks are compared as links.
+
+    An entry is modified if its type differs or, for non-directories,
+    if any of the stat fields named in compare ('size', 'mtime', 'mode')
+    do; with compare=() only names and types are compared, which needs
+    no stat calls where the file system reports d_type. onerror is
+    called with an OSError for each directory that can't be read (and
+    that directory is skipped).
+
+    The native version merges each pair of directories' sorted names
+    with the GIL released, and only holds the directories on the current
+    path in memory.
+    """
+    if diff_trees_c is None:
+        return _diff_trees(a, b, compare, onerror)
+    return (TreeDiff._make(change) for change in diff_trees_c(a, b, compare, onerror))
+
+
+# inotify event masks, from <sys/inotify.h>
+IN_MODIFY = 0x2
+IN_ATTRIB = 0x4
+IN_CLOSE_WRITE = 0x8
+IN_MOVED_FROM = 0x40
+IN_MOVED_TO = 0x80
+IN_CREATE = 0x100
+IN_DELETE = 0x200
+IN_DELETE_SELF = 0x400
+IN_MOVE_SELF = 0x800
+IN_Q_OVERFLOW = 0x4000
+IN_IGNORED = 0x8000
+IN_ONLYDIR = 0x1000000
+IN_DONT_FOLLOW = 0x2000000
+IN_EXCL_UNLINK = 0x4000000
+IN_ISDIR = 0x40000000
+
+_TREE_CACHE_MASK = (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |
+                    IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR |
+                    IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+_TREE_CACHE_REMOVE = IN_DELETE | IN_MOVED_FROM
+_TREE_CACHE_UPDATE = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO
+
+
+class CachedEntry(object):
+    """A directory entry from a TreeCache. Like DirEntry, but its lstat()
+    result is taken when it's cached (and again whenever it changes), so
+    only stat() of a symlink makes a system call.
+    """
+    __slots__ = ('name', 'path', '_lstat')
+
+    def __init__(self, name, path, lstat_result):
+        self.name = name
+        self.path = path
+        self._lstat = lstat_result
+
+    def stat(self, follow_symlinks=True):
+        if follow_symlinks and self._lstat.st_mode & 0o170000 == S_IFLNK:
+            return stat(self.path)
+        return self._lstat
+
+    def is_dir(self, follow_symlinks=True):
+        try:
+            st = self.stat(follow_symlinks=follow_symlinks)
+        except OSError as e:
+            if e.errno != ENOENT:
+                raise
+            return False  # Broken symlink
+        return st.st_mode & 0o170000 == S_IFDIR
+
+    def is_file(self, follow_symlinks=True):
+        try:
+            st = self.stat(follow_symlinks=follow_symlinks)
+        except OSError as e:
+            if e.errno != ENOENT:
+                raise
+            return False  # Broken symlink
+        return st.st_mode & 0o170000 == S_IFREG
+
+    def is_symlink(self):
+        return self._lstat.st_mode & 0o170000 == S_IFLNK
+
+    def inode(self):
+        return self._lstat.st_ino
+
+    def __str__(self):
+        return '<{0}: {1!r}>'.format(self.__class__.__name__, self.name)
+
+    __repr__ = __str__
+
+
+class TreeCache(object):
+    """In-memory copy of the tree at top, kept current with inotify (so
+    Linux only). After one walk of the tree, scandir() and walk() of
+    directories under top are served from memory, as CachedEntry objects,
+    without any system calls.
+
+    A background thread applies changes as inotify reports them; call
+    sync() to apply any that are pending right now, say after changing the
+    tree yourself. Directories that can't be watched, for example once
+    fs.inotify.max_user_watches is reached, are listed in unwatched and
+    read from disk instead. If the kernel's event queue overflows, the
+    whole tree is read again (counted in overflows).
+    """
+
+    def __init__(self, top, background=True):
+        if getattr(_scandir, 'inotify_init', None) is None:
+            raise NotImplementedError('TreeCache needs inotify, which is only on Linux')
+        self.top = normpath(top)
+        stat(self.top)  # Raise OSError now if it doesn't exist
+        self.unwatched = set()
+        self.overflows = 0
+        self._fd = _scandir.inotify_init()
+        # _lock guards the maps below, and is only held briefly, never
+        # while reading from disk. _sync_lock is held by whichever thread
+        # is applying events, the only one that changes the maps.
+        self._lock = threading.RLock()
+        self._sync_lock = threading.Lock()
+        self._dirs = {}         # path of each cached directory -> {name: CachedEntry}
+        self._wd_paths = {}
+        self._path_wds = {}
+        self._closed = False
+        self._thread = None
+        self._load(self.top)
+        if background:
+            self._thread = threading.Thread(target=self._run, name='TreeCache')
+            self._thread.daemon = True
+            self._thread.start()
+
+    def _read_tree(self, path):
+        """Watch and read the tree at path from disk, without touching the
+        cache. Return its {path: entries}, {path: wd} and unwatched paths.
+        """
+        dirs = {}
+        wds = {}
+        unwatched = set()
+        stack = [path]
+        while stack:
+            path = stack.pop()
+            # Watch before listing, so nothing created in between is missed
+            try:
+                wd = _scandir.inotify_add_watch(self._fd, path, _TREE_CACHE_MASK)
+            except OSError as error:
+                if error.errno == ENOSPC:
+                    unwatched.add(path)
+                continue
+            try:
+                dir_entries = list(scandir(path))
+            except OSError:
+                _scandir.inotify_rm_watch(self._fd, wd)
+                continue
+            prefetch_stat(dir_entries, follow_symlinks=False)
+            entries = {}
+            for entry in dir_entries:
+                try:
+                    st = entry.stat(follow_symlinks=False)
+                except OSError:
+                    continue
+                entries[entry.name] = CachedEntry(entry.name, entry.path, st)
+                if S_ISDIR(st.st_mode):
+                    stack.append(entry.path)
+            wds[path] = wd
+            dirs[path] = entries
+        return dirs, wds, unwatched
+
+    def _load(self, path):
+        dirs, wds, unwatched = self._read_tree(path)
+        with self._lock:
+            for path, wd in wds.items():
+                old_wd = self._path_wds.get(path)
+                if old_wd is not None and old_wd != wd:
+                    del self._wd_paths[old_wd]
+                self._wd_paths[wd] = path
+                self._path_wds[path] = wd
+            self._dirs.update(dirs)
+            self.unwatched.update(unwatched)
+
+    def _drop(self, path):
+        stack = [path]
+        while stack:
+            path = stack.pop()
+            self.unwatched.discard(path)
+            wd = self._path_wds.pop(path, None)
+            if wd is not None:
+                del self._wd_paths[wd]
+                _scandir.inotify_rm_watch(self._fd, wd)
+            entries = self._dirs.pop(path, None)
+            if entries:
+                stack.extend(entry.path for entry in entries.values()
+                             if S_ISDIR(entry._lstat.st_mode))
+
+    def _reload(self):
+        # Directories still there keep their watches, as watching one
+        # again gives the same wd
+        dirs, wds, unwatched = self._read_tree(self.top)
+        with self._lock:
+            new_wds = set(wds.values())
+            for wd in self._wd_paths:
+                if wd not in new_wds:
+                    try:
+                        _scandir.inotify_rm_watch(self._fd, wd)
+                    except OSError:
+                        # Already gone with its directory
+                        pass
+            self._dirs = dirs
+            self._wd_paths = dict((wd, path) for path, wd in wds.items())
+            self._path_wds = wds
+            self.unwatched = unwatched
+
+    def _handle(self, events):
+        # Only this thread changes the maps, so it can read them without
+        # _lock, and takes it just to change them
+        for wd, mask, cookie, name in events:
+            if mask & IN_Q_OVERFLOW:
+                # Events have been lost, so start again
+                self.overflows += 1
+                self._reload()
+                continue
+            path = self._wd_paths.get(wd)
+            if path is None:
+                continue
+            if mask & IN_IGNORED:
+                # The watch is gone, say the file system was unmounted
+                with self._lock:
+                    self._drop(path)
+                continue
+            entries = self._dirs.get(path)
+            if name is None or entries is None:
+                # Deletes and moves of the directory itself are handled
+                # by its parent
+                continue
+            if not isinstance(self.top, bytes):
+                name = _fs_decode(name)
+            child = join(path, name)
+            old = entries.get(name)
+            old_is_dir = old is not None and S_ISDIR(old._lstat.st_mode)
+            if not mask & (_TREE_CACHE_REMOVE | _TREE_CACHE_UPDATE):
+                continue
+            st = None
+            if not mask & _TREE_CACHE_REMOVE:
+                try:
+                    st = lstat(child)
+                except OSError:
+                    pass
+            with self._lock:
+                if st is None:
+                    entries.pop(name, None)
+                else:
+                    entries[name] = CachedEntry(name, child, st)
+                if old_is_dir and (st is None or not S_ISDIR(st.st_mode)):
+                    self._drop(child)
+            if (st is not None and S_ISDIR(st.st_mode) and
+                    child not in self._dirs and child not in self.unwatched):
+                self._load(child)
+
+    def _run(self):
+        poller = select.poll()
+        poller.register(self._fd, select.POLLIN)
+        while not self._closed:
+            if poller.poll(100):
+                self.sync()
+
+    def sync(self):
+        """Apply any changes inotify has reported that haven't been yet."""
+        with self._sync_lock:
+            while not self._closed:
+                events = _scandir.inotify_read(self._fd, 0)
+                if not events:
+                    break
+                self._handle(events)
+
+    def close(self):
+        """Stop watching the tree and free the cache."""
+        if self._closed:
+            return
+        self._closed = True
+        if self._thread is not None:
+            self._thread.join()
+        with self._sync_lock, self._lock:
+            close_fd(self._fd)
+            self._dirs.clear()
+            self._wd_paths.clear()
+            self._path_wds.clear()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    @property
+    def num_watches(self):
+        return len(self._wd_paths)
+
+    def scandir(self, path=None):
+        """Like scandir(path), reading from memory if path is a cached
+        directory (by default the top) and from disk otherwise.
+        """
+        if path is None:
+            path = self.top
+        key = normpath(path)
+        with self._lock:
+            entries = self._dirs.get(key)
+            if entries is not None:
+                entries = list(entries.values())
+        if entries is None:
+            return scandir(path)
+        if path != key:
+            entries = [CachedEntry(e.name, join(path, e.name), e._lstat) for e in entries]
+        return iter(entries)
+
+    def _islink(self, dirpath, name):
+        with self._lock:
+            entries = self._dirs.get(normpath(dirpath))
+            entry = entries.get(name) if entries is not None else None
+        if entry is None:
+            return islink(join(dirpath, name))
+        return entry.is_symlink()
+
+    def walk(self, top=None, topdown=True, onerror=None, followlinks=False):
+        """Like walk(top), reading cached directories from memory. top
+        defaults to the top of the cache.
+        """
+        if top is None:
+            top = self.top
+        try:
+            entries = list(self.scandir(top))
+        except OSError as error:
+            if onerror is not None:
+                onerror(error)
+            return
+
+        dirs = []
+        nondirs = []
+        for entry in entries:
+            try:
+                is_dir = entry.is_dir()
+            except OSError:
+                is_dir = False
+            if is_dir:
+                dirs.append(entry.name)
+            else:
+                nondirs.append(entry.name)
+            if not topdown and is_dir and (followlinks or not entry.is_symlink()):
+                for result in self.walk(entry.path, topdown, onerror, followlinks):
+                    yield result
+
+        if topdown:
+            yield top, dirs, nondirs
+            for name in dirs:
+                if followlinks or not self._islink(top, name):
+                    for result in self.walk(join(top, name), topdown, onerror, followlinks):
+                        yield result
+        else:
+            yield top, dirs, nondirs
@@ -0,0 +1,142 @@
+"""Tests for the ascandir() and awalk() async iterators."""
+
+import os
+import shutil
+import sys
+import unittest
+
+import scandir
+
+try:
+    import asyncio
+except ImportError:
+    asyncio = None
+
+if sys.version_info >= (3, 5):
+    # Kept out of the source so the module still imports on Python 2
+    exec('''
+async def collect(aiterable, limit=None):
+    items = []
+    async with aiterable:
+        async for item in aiterable:
+            items.append(item)
+            if len(items) == limit:
+                break
+    return items
+
+
+async def collect_while_ticking(aiterable):
+    ticks = []
+
+    async def tick():
+        while True:
+            ticks.append(None)
+            await asyncio.sleep(0)
+
+    task = asyncio.ensure_future(tick())
+    try:
+        items = await asyncio.wait_for(collect(aiterable), 10)
+    finally:
+        task.cancel()
+    return items, len(ticks)
+''')
+
+
+class TestAsync(unittest.TestCase):
+    temp_dir = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'asynctemp')
+    native = True
+
+    def setUp(self):
+        # temp_dir/
+        #     file0 ... file9
+        #     dir0/ ... dir3/
+        #         sub/
+        #             file
+        self.addCleanup(shutil.rmtree, self.temp_dir, True)
+        shutil.rmtree(self.temp_dir, True)
+        for i in range(4):
+            sub = os.path.join(self.temp_dir, 'dir{0}'.format(i), 'sub')
+            os.makedirs(sub)
+            open(os.path.join(sub, 'file'), 'w').close()
+        for i in range(10):
+            open(os.path.join(self.temp_dir, 'file{0}'.format(i)), 'w').close()
+        if not self.native:
+            self.patch('async_scandir_c', None)
+            self.patch('async_walk_c', None)
+        self.loop = asyncio.new_event_loop()
+        self.addCleanup(self.loop.close)
+
+    def patch(self, name, value):
+        self.addCleanup(setattr, scandir, name, getattr(scandir, name))
+        setattr(scandir, name, value)
+
+    def run_collect(self, aiterable, limit=None):
+        return self.loop.run_until_complete(collect(aiterable, limit))
+
+    def test_ascandir(self):
+        # Enough entries for a few batches
+        for i in range(10, 1100):
+            open(os.path.join(self.temp_dir, 'file{0}'.format(i)), 'w').close()
+        entries = self.run_collect(scandir.ascandir(self.temp_dir))
+        expected = dict((e.name, e.is_dir()) for e in scandir.scandir(self.temp_dir))
+        self.assertEqual(len(expected), 1104)
+        self.assertEqual(dict((e.name, e.is_dir()) for e in entries), expected)
+        for entry in entries:
+            self.assertEqual(entry.path, os.path.join(self.temp_dir, entry.name))
+
+    def test_ascandir_stat(self):
+        entries = self.run_collect(scandir.ascandir(self.temp_dir, stat=True))
+        for entry in entries:
+            st = os.lstat(entry.path)
+            self.assertEqual(entry.stat(follow_symlinks=False).st_ino, st.st_ino)
+            self.assertEqual(entry.inode(), st.st_ino)
+
+    def test_ascandir_missing(self):
+        missing = os.path.join(self.temp_dir, 'missing')
+        with self.assertRaises(OSError) as context:
+            self.run_collect(scandir.ascandir(missing))
+        self.assertEqual(context.exception.filename, missing)
+
+    def test_ascandir_break(self):
+        self.assertEqual(len(self.run_collect(scandir.ascandir(self.temp_dir), 10)), 10)
+
+    def normalize(self, output):
+        return sorted((top, sorted(dirs), sorted(files)) for top, dirs, files in output)
+
+    def test_awalk(self):
+        expected = self.normalize(scandir.walk_python(self.temp_dir))
+        self.assertEqual(len(expected), 9)
+        for workers in (None, 1, 4):
+            output = self.run_collect(scandir.awalk(self.temp_dir, workers=workers))
+            self.assertEqual(self.normalize(output), expected)
+
+    def test_other_tasks(self):
+        # Other tasks keep running while waiting for batches
+        for aiterable, count in [(scandir.awalk(self.temp_dir), 9),
+                                 (scandir.ascandir(self.temp_dir), 14)]:
+            items, ticks = self.loop.run_until_complete(collect_while_ticking(aiterable))
+            self.assertEqual(len(items), count)
+            self.assertTrue(ticks > 0)
+
+    def test_awalk_bytes(self):
+        top = self.temp_dir.encode(sys.getfilesystemencoding())
+        for root, dirs, files in self.run_collect(scandir.awalk(top)):
+            self.assertTrue(isinstance(root, bytes))
+            self.assertTrue(all(isinstance(name, bytes) for name in dirs + files))
+
+    def test_awalk_onerror(self):
+        errors = []
+        missing = os.path.join(self.temp_dir, 'missing')
+        self.assertEqual(self.run_collect(scandir.awalk(missing, onerror=errors.append)), [])
+        self.assertEqual(len(errors), 1)
+        self.assertEqual(errors[0].filename, missing)
+
+
+class TestAsyncPython(TestAsync):
+    native = False
+
+
+if asyncio is None or sys.version_info < (3, 5):
+    del TestAsync, TestAsyncPython
+elif scandir.async_scandir_c is None:
+    del TestAsync
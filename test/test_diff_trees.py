@@ -0,0 +1,188 @@
+"""Tests for scandir.diff_trees()."""
+
+import os
+import shutil
+import sys
+import time
+import unittest
+
+import scandir
+
+try:
+    import resource
+except ImportError:
+    resource = None
+
+
+class TestDiffTrees(unittest.TestCase):
+    testfn = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'difftemp')
+    diff_func = staticmethod(scandir.diff_trees_python)
+
+    def setUp(self):
+        # Build the same tree at TESTFN/a and TESTFN/b:
+        #     same                  10 bytes
+        #     size                  10 bytes
+        #     gone
+        #     olddir/
+        #       x
+        #     tofile/
+        #     sub/
+        #       deep/
+        #         f
+        #       g
+        # then change b
+        self.addCleanup(shutil.rmtree, self.testfn, True)
+        shutil.rmtree(self.testfn, True)
+        self.a = os.path.join(self.testfn, 'a')
+        self.b = os.path.join(self.testfn, 'b')
+        past = time.time() - 3600
+        for top in [self.a, self.b]:
+            for path in ['olddir', 'tofile', os.path.join('sub', 'deep')]:
+                os.makedirs(os.path.join(top, path))
+            for path, size in [('same', 10), ('size', 10), ('gone', 0),
+                               (os.path.join('olddir', 'x'), 0),
+                               (os.path.join('sub', 'deep', 'f'), 0),
+                               (os.path.join('sub', 'g'), 0)]:
+                self.write(os.path.join(top, path), size)
+                os.utime(os.path.join(top, path), (past, past))
+
+    def write(self, path, size):
+        with open(path, 'wb') as f:
+            f.write(b'x' * size)
+
+    def change_b(self):
+        b = self.b
+        self.write(os.path.join(b, 'size'), 20)
+        os.remove(os.path.join(b, 'gone'))
+        shutil.rmtree(os.path.join(b, 'olddir'))
+        os.rmdir(os.path.join(b, 'tofile'))
+        self.write(os.path.join(b, 'tofile'), 0)
+        self.write(os.path.join(b, 'new'), 0)
+        os.makedirs(os.path.join(b, 'newdir', 'inside'))
+        self.write(os.path.join(b, 'sub', 'deep', 'f'), 0)
+        self.write(os.path.join(b, 'sub', 'deep', 'h'), 0)
+
+    def diff(self, *args, **kwargs):
+        return sorted(tuple(change) for change in self.diff_func(self.a, self.b, *args, **kwargs))
+
+    def test_same(self):
+        self.assertEqual(self.diff(), [])
+        self.assertEqual(self.diff(compare=()), [])
+        self.assertEqual(self.diff(compare=('size', 'mtime', 'mode')), [])
+
+    def test_changes(self):
+        self.change_b()
+        self.assertEqual(self.diff(), [
+            ('added', 'new', False),
+            ('added', 'newdir', True),
+            ('added', os.path.join('sub', 'deep', 'h'), False),
+            ('modified', 'size', False),
+            ('modified', os.path.join('sub', 'deep', 'f'), False),
+            ('modified', 'tofile', False),
+            ('removed', 'gone', False),
+            ('removed', 'olddir', True),
+        ])
+
+    def test_compare(self):
+        self.change_b()
+        # Without comparing stat fields, only names and types are compared
+        self.assertEqual([change for change in self.diff(compare=())
+                          if change[0] == 'modified'],
+                         [('modified', 'tofile', False)])
+        modified = [change[1] for change in self.diff(compare=['size'])
+                    if change[0] == 'modified']
+        self.assertEqual(sorted(modified), ['size', 'tofile'])
+        os.chmod(os.path.join(self.b, 'same'), 0o600)
+        os.chmod(os.path.join(self.a, 'same'), 0o644)
+        self.assertTrue(('modified', 'same', False) in self.diff(compare=['mode']))
+        self.assertRaises(ValueError, self.diff_func, self.a, self.b, ['bogus'])
+
+    def test_type_change(self):
+        os.rmdir(os.path.join(self.a, 'tofile'))
+        self.write(os.path.join(self.a, 'tofile'), 0)
+        os.remove(os.path.join(self.a, 'same'))
+        os.mkdir(os.path.join(self.a, 'same'))
+        self.assertEqual(self.diff(compare=()), [('modified', 'same', False),
+                                                 ('modified', 'tofile', True)])
+
+    if hasattr(os, 'symlink'):
+        def test_symlinks(self):
+            os.symlink('same', os.path.join(self.a, 'link'))
+            os.symlink('size', os.path.join(self.b, 'link'))
+            # Symlinks aren't followed; a target of the same length looks the same
+            self.assertEqual(self.diff(compare=['size']), [])
+            self.assertEqual(self.diff(compare=()), [])
+            os.remove(os.path.join(self.b, 'link'))
+            os.symlink('sub', os.path.join(self.b, 'link'))
+            self.assertEqual(self.diff(compare=['size']), [('modified', 'link', False)])
+            os.remove(os.path.join(self.a, 'same'))
+            os.symlink('size', os.path.join(self.a, 'same'))
+            self.assertEqual(self.diff(compare=()), [('modified', 'same', False)])
+
+    def test_order(self):
+        self.change_b()
+        paths = [change.path for change in scandir.diff_trees(self.a, self.b)]
+        # A directory's differences come before its subdirectories'
+        self.assertEqual(paths[-2:], [os.path.join('sub', 'deep', 'f'),
+                                      os.path.join('sub', 'deep', 'h')])
+        self.assertEqual(sorted(paths[:-2]), sorted(['gone', 'new', 'newdir', 'olddir',
+                                                     'size', 'tofile']))
+
+    def test_bytes(self):
+        self.change_b()
+        encoding = sys.getfilesystemencoding()
+        changes = list(self.diff_func(self.a.encode(encoding), self.b.encode(encoding)))
+        self.assertTrue(('added', b'new', False) in [tuple(change) for change in changes])
+
+    def test_wrapper(self):
+        self.change_b()
+        changes = list(scandir.diff_trees(self.a, self.b))
+        self.assertEqual(sorted(tuple(change) for change in changes), self.diff())
+        self.assertTrue(all(isinstance(change, scandir.TreeDiff) for change in changes))
+
+    def test_missing(self):
+        missing = os.path.join(self.testfn, 'missing')
+        self.assertRaises(OSError, self.diff_func, missing, self.b)
+        self.assertRaises(OSError, self.diff_func, self.a, missing)
+
+    if hasattr(os, 'geteuid') and os.geteuid() != 0:
+        def test_onerror(self):
+            errors = []
+            sub = os.path.join(self.b, 'sub')
+            self.write(os.path.join(sub, 'new'), 0)
+            os.chmod(sub, 0)
+            try:
+                changes = list(self.diff_func(self.a, self.b, onerror=errors.append))
+            finally:
+                os.chmod(sub, 0o755)
+            self.assertEqual([error.filename for error in errors], [sub])
+            self.assertEqual(changes, [])
+
+
+if scandir.diff_trees_c is not None:
+    class TestDiffTreesC(TestDiffTrees):
+        diff_func = staticmethod(scandir.diff_trees_c)
+
+        def test_matches_python(self):
+            self.change_b()
+            for compare in [(), ('size',), ('size', 'mtime', 'mode')]:
+                self.assertEqual(self.diff(compare=compare),
+                                 sorted(scandir.diff_trees_python(self.a, self.b, compare)))
+
+        def test_deep_tree(self):
+            # Only the last few frames keep their directories open, so a
+            # difference at the bottom of trees deeper than the open file
+            # limit is still found
+            if resource is None:
+                self.skipTest('needs resource.setrlimit()')
+            deep = os.path.join(*['d'] * 150)
+            for top, size in [(self.a, 0), (self.b, 10)]:
+                os.makedirs(os.path.join(top, deep))
+                self.write(os.path.join(top, deep, 'f'), size)
+            soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+            resource.setrlimit(resource.RLIMIT_NOFILE, (100, hard))
+            self.addCleanup(resource.setrlimit, resource.RLIMIT_NOFILE, (soft, hard))
+            errors = []
+            self.assertEqual(self.diff(onerror=errors.append),
+                             [('modified', os.path.join(deep, 'f'), False)])
+            self.assertEqual(errors, [])
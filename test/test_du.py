@@ -0,0 +1,128 @@
+"""Tests for scandir.du()."""
+
+import os
+import shutil
+import sys
+import unittest
+
+import scandir
+
+
+class TestDu(unittest.TestCase):
+    testfn = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'dutemp')
+    du_func = staticmethod(scandir.du_python)
+
+    def setUp(self):
+        # Build:
+        #     TESTFN/
+        #       a                   100 bytes
+        #       sub/
+        #         b                 1000 bytes
+        #         hardlink          a hard link to sub/b
+        #         subsub/
+        #           c               10 bytes
+        #       link_to_a           a symlink to a
+        #       link_to_sub         a symlink to sub
+        self.addCleanup(shutil.rmtree, self.testfn, True)
+        shutil.rmtree(self.testfn, True)
+        self.sub = os.path.join(self.testfn, 'sub')
+        self.subsub = os.path.join(self.sub, 'subsub')
+        os.makedirs(self.subsub)
+        for path, size in [(os.path.join(self.testfn, 'a'), 100),
+                           (os.path.join(self.sub, 'b'), 1000),
+                           (os.path.join(self.subsub, 'c'), 10)]:
+            with open(path, 'wb') as f:
+                f.write(b'x' * size)
+        self.has_links = hasattr(os, 'link') and hasattr(os, 'symlink')
+        if self.has_links:
+            os.link(os.path.join(self.sub, 'b'), os.path.join(self.sub, 'hardlink'))
+            os.symlink(os.path.join(self.testfn, 'a'), os.path.join(self.testfn, 'link_to_a'))
+            os.symlink(self.sub, os.path.join(self.testfn, 'link_to_sub'))
+
+    def dir_size(self, path):
+        return os.lstat(path).st_size
+
+    def link_size(self, name):
+        return os.lstat(os.path.join(self.testfn, name)).st_size
+
+    def test_apparent(self):
+        usage = self.du_func(self.testfn, apparent=True)
+        dirs_size = sum(self.dir_size(p) for p in [self.testfn, self.sub, self.subsub])
+        expected = 1110 + dirs_size
+        if self.has_links:
+            expected += self.link_size('link_to_a') + self.link_size('link_to_sub')
+        self.assertEqual(usage.total, expected)
+        self.assertEqual(usage.dirs, 3)
+        self.assertEqual(usage.files, 5 if self.has_links else 3)
+        self.assertIsNone(usage.subtotals)
+
+    def test_blocks(self):
+        usage = self.du_func(self.testfn)
+        if hasattr(os.lstat(self.testfn), 'st_blocks'):
+            self.assertEqual(usage.total % 512, 0)
+        self.assertTrue(usage.total > 0)
+
+    def test_subtotals(self):
+        usage = self.du_func(self.testfn, apparent=True, subtotals=True)
+        subsub_total = 10 + self.dir_size(self.subsub)
+        sub_total = 1000 + self.dir_size(self.sub) + subsub_total
+        self.assertEqual(usage.subtotals, {
+            self.testfn: usage.total,
+            self.sub: sub_total,
+            self.subsub: subsub_total,
+        })
+
+    def test_follow_symlinks(self):
+        if not self.has_links:
+            return
+        usage = self.du_func(self.testfn, apparent=True)
+        followed = self.du_func(self.testfn, follow_symlinks=True, apparent=True)
+        # Everything the links point to is only counted once
+        self.assertEqual(followed.total, usage.total - self.link_size('link_to_a') -
+                         self.link_size('link_to_sub'))
+        self.assertEqual(followed.files, 3)
+        self.assertEqual(followed.dirs, 3)
+
+    def test_one_filesystem(self):
+        self.assertEqual(self.du_func(self.testfn, one_filesystem=True),
+                         self.du_func(self.testfn))
+
+    def test_file(self):
+        path = os.path.join(self.testfn, 'a')
+        self.assertEqual(self.du_func(path, apparent=True), (100, 1, 0, None))
+
+    def test_bytes(self):
+        top = self.testfn.encode(sys.getfilesystemencoding())
+        usage = self.du_func(top, subtotals=True)
+        self.assertEqual(usage.total, self.du_func(self.testfn).total)
+        self.assertTrue(top in usage.subtotals)
+
+    def test_missing(self):
+        self.assertRaises(OSError, self.du_func, os.path.join(self.testfn, 'missing'))
+
+    if hasattr(os, 'geteuid') and os.geteuid() != 0:
+        def test_onerror(self):
+            errors = []
+            os.chmod(self.subsub, 0)
+            try:
+                usage = self.du_func(self.testfn, apparent=True, onerror=errors.append)
+            finally:
+                os.chmod(self.subsub, 0o755)
+            self.assertEqual(len(errors), 1)
+            self.assertEqual(errors[0].filename, self.subsub)
+            # The unreadable directory itself is still counted
+            self.assertEqual(usage.dirs, 3)
+
+
+if scandir.du_c is not None:
+    class TestDuC(TestDu):
+        du_func = staticmethod(scandir.du)
+
+        def test_matches_python(self):
+            for kwargs in [{}, {'apparent': True}, {'follow_symlinks': True}]:
+                self.assertEqual(scandir.du(self.testfn, subtotals=True, **kwargs),
+                                 scandir.du_python(self.testfn, subtotals=True, **kwargs))
+
+        def test_workers(self):
+            self.assertEqual(scandir.du(self.testfn, workers=1), scandir.du(self.testfn, workers=8))
+            self.assertRaises(ValueError, scandir.du, self.testfn, workers=-1)
@@ -0,0 +1,116 @@
+"""Tests for scandir.glob(), checked against the standard library's glob."""
+
+from __future__ import unicode_literals
+
+import glob
+import os
+import shutil
+import sys
+import unittest
+
+import scandir
+
+IS_PY3 = sys.version_info >= (3, 0)
+
+
+class TestGlob(unittest.TestCase):
+    testfn = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'globtemp')
+    iglob_func = staticmethod(scandir.iglob_python)
+
+    def setUp(self):
+        # Build:
+        #     TESTFN/
+        #       a.parquet
+        #       .hidden.parquet
+        #       _SUCCESS
+        #       year=2020/
+        #         day=01/           two parquet files and a hidden one
+        #         day=02/           one parquet file and an empty dir
+        #       .tmp/               a hidden dir with a parquet file
+        #       link/               a symlink to year=2020/day=02
+        #       broken              a dangling symlink
+        self.addCleanup(shutil.rmtree, self.testfn, True)
+        shutil.rmtree(self.testfn, True)
+        day1 = os.path.join(self.testfn, 'year=2020', 'day=01')
+        day2 = os.path.join(self.testfn, 'year=2020', 'day=02')
+        os.makedirs(day1)
+        os.makedirs(os.path.join(day2, 'empty'))
+        os.makedirs(os.path.join(self.testfn, '.tmp'))
+        for path in [os.path.join(self.testfn, 'a.parquet'),
+                     os.path.join(self.testfn, '.hidden.parquet'),
+                     os.path.join(self.testfn, '_SUCCESS'),
+                     os.path.join(day1, 'part-0.parquet'),
+                     os.path.join(day1, 'part-1.parquet'),
+                     os.path.join(day1, '.part-0.parquet.crc'),
+                     os.path.join(day2, 'part-0.parquet'),
+                     os.path.join(self.testfn, '.tmp', 'part-9.parquet')]:
+            with open(path, 'w'):
+                pass
+        if hasattr(os, 'symlink'):
+            try:
+                os.symlink(os.path.abspath(day2), os.path.join(self.testfn, 'link'))
+                os.symlink(os.path.join(self.testfn, 'missing'),
+                           os.path.join(self.testfn, 'broken'))
+            except (NotImplementedError, OSError):
+                pass
+
+    def check(self, pattern, recursive=False):
+        for pattern in [os.path.join(self.testfn, pattern), pattern]:
+            expected = glob.glob(pattern, recursive=True) if recursive else glob.glob(pattern)
+            self.assertEqual(list(self.iglob_func(pattern, recursive=recursive)),
+                             expected, pattern)
+
+    def test_patterns(self):
+        old_cwd = os.getcwd()
+        os.chdir(self.testfn)
+        try:
+            for pattern in ['*', '*.parquet', '.*', '*/*/*.parquet', 'year=*/day=0[!1]/*',
+                            'year=2020/day=01/part-?.parquet', '*/', '*/*/', 'link/*',
+                            'broken', 'missing/*', '_SUCCESS', '[_a]*', '*[]]']:
+                self.check(pattern)
+        finally:
+            os.chdir(old_cwd)
+
+    if IS_PY3 and sys.version_info >= (3, 5):
+        def test_recursive(self):
+            old_cwd = os.getcwd()
+            os.chdir(self.testfn)
+            try:
+                for pattern in ['**', '**/', '**/*.parquet', '**/.*', 'year=2020/**',
+                                'year=2020/**/*.parquet', '*/**/part-0*', '**/day=*/*',
+                                '**/**/*.parquet', '**/empty', '.tmp/**/*.parquet']:
+                    self.check(pattern, recursive=True)
+                # Without recursive=True "**" is just like "*"
+                self.check('**/*.parquet')
+            finally:
+                os.chdir(old_cwd)
+
+    def test_bytes(self):
+        pattern = os.path.join(self.testfn, '*', '*', '*.parquet').encode(
+            sys.getfilesystemencoding())
+        self.assertEqual(sorted(self.iglob_func(pattern)), sorted(glob.glob(pattern)))
+
+    def test_glob(self):
+        self.assertEqual(sorted(scandir.glob(os.path.join(self.testfn, '*.parquet'))),
+                         [os.path.join(self.testfn, 'a.parquet')])
+
+
+if scandir.iglob_c is not None:
+    class TestGlobC(TestGlob):
+        iglob_func = staticmethod(scandir.iglob_c)
+
+        def test_glob_dir(self):
+            day2 = os.path.join(self.testfn, 'year=2020', 'day=02')
+            paths, subdirs = scandir.glob_dir_c(day2, '*', False, True)
+            self.assertEqual(sorted(paths), sorted(os.path.join(day2, name)
+                                                   for name in ['empty', 'part-0.parquet']))
+            self.assertEqual(subdirs, [os.path.join(day2, 'empty')])
+            self.assertEqual(scandir.glob_dir_c(day2, '*', True),
+                             ([os.path.join(day2, 'empty')], None))
+            self.assertRaises(OSError, scandir.glob_dir_c, os.path.join(self.testfn, 'missing'))
+            self.assertRaises(TypeError, scandir.glob_dir_c, 1)
+
+        def test_non_ascii_class(self):
+            # Classes match a character rather than a byte
+            self.assertEqual(list(self.iglob_func(os.path.join(self.testfn, '[\u018F_]*'))),
+                             [os.path.join(self.testfn, '_SUCCESS')])
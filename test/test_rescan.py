@@ -0,0 +1,222 @@
+"""Tests for scandir.rescan()."""
+
+import os
+import shutil
+import struct
+import sys
+import time
+import unittest
+
+import scandir
+
+try:
+    import resource
+except ImportError:
+    resource = None
+
+
+class TestRescan(unittest.TestCase):
+    testfn = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'rescantemp')
+    rescan_func = staticmethod(scandir.rescan_python)
+    # What rescan_func writes its out_file like
+    snapshot_func = staticmethod(scandir.snapshot_python)
+
+    def setUp(self):
+        # Build:
+        #     TESTFN/
+        #       tree/
+        #         b                 10 bytes
+        #         keep/
+        #           f1              10 bytes
+        #         change/
+        #           f2
+        #           f3
+        #         gone/
+        #           sub/
+        #             x
+        #         tofile/
+        #           y
+        #       snap                the snapshot file
+        self.addCleanup(shutil.rmtree, self.testfn, True)
+        shutil.rmtree(self.testfn, True)
+        self.top = os.path.join(self.testfn, 'tree')
+        for path in ['keep', 'change', os.path.join('gone', 'sub'), 'tofile']:
+            os.makedirs(os.path.join(self.top, path))
+        for path, size in [('b', 10), (os.path.join('keep', 'f1'), 10),
+                           (os.path.join('change', 'f2'), 0),
+                           (os.path.join('change', 'f3'), 0),
+                           (os.path.join('gone', 'sub', 'x'), 0),
+                           (os.path.join('tofile', 'y'), 0)]:
+            self.write(path, size)
+        # Backdate everything so the changes below always change mtimes
+        past = time.time() - 3600
+        for dirpath, dirnames, filenames in os.walk(self.top):
+            for name in dirnames + filenames:
+                os.utime(os.path.join(dirpath, name), (past, past))
+        os.utime(self.top, (past, past))
+        self.snap_path = os.path.join(self.testfn, 'snap')
+        scandir.snapshot(self.top, self.snap_path)
+
+    def write(self, path, size, mode='wb'):
+        with open(os.path.join(self.top, path), mode) as f:
+            f.write(b'x' * size)
+
+    def path(self, *names):
+        return os.path.join(self.top, *names)
+
+    def age_snapshot(self):
+        # Make the snapshot look like it was taken well after anything in
+        # the tree changed, so unchanged directories aren't read again
+        with open(self.snap_path, 'r+b') as f:
+            f.seek(56)
+            f.write(struct.pack('=q', int((time.time() + 3600) * 1000000000)))
+
+    def change_tree(self):
+        self.write(os.path.join('change', 'new'), 0)
+        os.remove(self.path('change', 'f3'))
+        self.write('b', 5, 'ab')
+        shutil.rmtree(self.path('gone'))
+        os.mkdir(self.path('newdir'))
+        self.write(os.path.join('newdir', 'z'), 0)
+        shutil.rmtree(self.path('tofile'))
+        self.write('tofile', 0)
+        self.write(os.path.join('keep', 'f1'), 20)
+
+    def test_unchanged(self):
+        for check_files in [True, False]:
+            self.assertEqual(self.rescan_func(self.snap_path, self.top, check_files=check_files),
+                             ([], [], []))
+
+    def test_changes(self):
+        self.change_tree()
+        added, removed, modified = self.rescan_func(self.snap_path, self.top)
+        self.assertEqual(sorted(added), sorted([self.path('change', 'new'), self.path('newdir'),
+                                                self.path('newdir', 'z')]))
+        self.assertEqual(sorted(removed), sorted([self.path('change', 'f3'), self.path('gone'),
+                                                  self.path('gone', 'sub'),
+                                                  self.path('gone', 'sub', 'x'),
+                                                  self.path('tofile', 'y')]))
+        self.assertEqual(sorted(modified), sorted([self.top, self.path('b'),
+                                                   self.path('change'),
+                                                   self.path('keep', 'f1'),
+                                                   self.path('tofile')]))
+
+    def test_check_files(self):
+        self.age_snapshot()
+        self.write(os.path.join('keep', 'f1'), 20)
+        self.assertEqual(self.rescan_func(self.snap_path, self.top, check_files=False),
+                         ([], [], []))
+        self.assertEqual(self.rescan_func(self.snap_path, self.top),
+                         ([], [], [self.path('keep', 'f1')]))
+
+    def test_racy(self):
+        # Without aging, every directory was changed too recently to trust
+        self.write(os.path.join('keep', 'f1'), 20)
+        self.assertEqual(self.rescan_func(self.snap_path, self.top, check_files=False),
+                         ([], [], [self.path('keep', 'f1')]))
+
+    def test_aged_changes(self):
+        self.age_snapshot()
+        self.change_tree()
+        added, removed, modified = self.rescan_func(self.snap_path, self.top,
+                                                    check_files=False)
+        self.assertEqual(len(added), 3)
+        self.assertEqual(len(removed), 5)
+        # keep/f1 isn't checked
+        self.assertEqual(sorted(modified), sorted([self.top, self.path('b'),
+                                                   self.path('change'),
+                                                   self.path('tofile')]))
+
+    def test_out_file(self):
+        self.age_snapshot()
+        self.change_tree()
+        out_file = os.path.join(self.testfn, 'out')
+        self.rescan_func(self.snap_path, self.top, out_file)
+        with open(out_file, 'rb') as f:
+            rescanned = f.read()
+        self.snapshot_func(self.top, out_file)
+        with open(out_file, 'rb') as f:
+            fresh = f.read()
+        # The same apart from the created_ns time
+        self.assertEqual(rescanned[:56] + rescanned[64:], fresh[:56] + fresh[64:])
+        self.assertEqual(self.rescan_func(out_file, self.top), ([], [], []))
+
+    def test_bytes(self):
+        self.change_tree()
+        top = self.top.encode(sys.getfilesystemencoding())
+        added, removed, modified = self.rescan_func(self.snap_path, top)
+        self.assertTrue(os.path.join(top, b'newdir', b'z') in added)
+
+    def test_wrapper(self):
+        self.change_tree()
+        expected = self.rescan_func(self.snap_path, self.top)
+        delta = scandir.rescan(self.snap_path)
+        self.assertEqual(delta, expected)
+        self.assertEqual(delta.added, expected[0])
+        with scandir.Snapshot(self.snap_path) as snap:
+            self.assertEqual(scandir.rescan(snap), expected)
+
+    def test_errors(self):
+        self.assertRaises(EnvironmentError, self.rescan_func,
+                          os.path.join(self.testfn, 'missing'), self.top)
+        self.assertRaises(OSError, self.rescan_func, self.snap_path,
+                          os.path.join(self.testfn, 'missing'))
+        bad = os.path.join(self.testfn, 'bad')
+        with open(bad, 'wb') as f:
+            f.write(b'x' * 100)
+        self.assertRaises(ValueError, self.rescan_func, bad, self.top)
+
+    def test_corrupt_children(self):
+        # A directory listed as its own first child would be walked forever
+        with scandir.Snapshot(self.snap_path) as snap:
+            index = snap.lookup('gone')
+            offset = snap._records_offset + index * snap._record.size + 16
+        with open(self.snap_path, 'r+b') as f:
+            f.seek(offset)
+            f.write(struct.pack('=I', index))
+        with scandir.Snapshot(self.snap_path) as snap:
+            self.assertRaises(ValueError, snap.children, index)
+        shutil.rmtree(self.path('gone'))
+        self.assertRaises(ValueError, self.rescan_func, self.snap_path, self.top)
+
+    if hasattr(os, 'geteuid') and os.geteuid() != 0:
+        def test_onerror(self):
+            errors = []
+            change = self.path('change')
+            os.chmod(change, 0o300)
+            try:
+                self.rescan_func(self.snap_path, self.top, onerror=errors.append)
+            finally:
+                os.chmod(change, 0o755)
+            self.assertEqual([error.filename for error in errors], [change])
+
+
+if scandir.rescan_c is not None:
+    class TestRescanC(TestRescan):
+        rescan_func = staticmethod(scandir.rescan_c)
+        snapshot_func = staticmethod(scandir.snapshot_c)
+
+        def test_matches_python(self):
+            self.change_tree()
+            for check_files in [True, False]:
+                self.assertEqual(scandir.rescan_c(self.snap_path, self.top, None, check_files),
+                                 scandir.rescan_python(self.snap_path, self.top, None,
+                                                       check_files))
+
+        def test_deep_tree(self):
+            # Only the last few directories are kept open, so a change at
+            # the bottom of a tree deeper than the open file limit is found
+            if resource is None:
+                self.skipTest('needs resource.setrlimit()')
+            deep = self.path(*['d'] * 150)
+            os.makedirs(deep)
+            self.write(os.path.join(deep, 'f'), 0)
+            scandir.snapshot_c(self.top, self.snap_path)
+            self.write(os.path.join(deep, 'f'), 10)
+            soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+            resource.setrlimit(resource.RLIMIT_NOFILE, (100, hard))
+            self.addCleanup(resource.setrlimit, resource.RLIMIT_NOFILE, (soft, hard))
+            errors = []
+            self.assertEqual(self.rescan_func(self.snap_path, self.top, onerror=errors.append),
+                             ([], [], [os.path.join(deep, 'f')]))
+            self.assertEqual(errors, [])
@@ -2,6 +2,7 @@
 
 from __future__ import unicode_literals
 
+import fnmatch
 import os
 import shutil
 import sys
@@ -14,6 +15,11 @@ try:
 except ImportError:
     has_scandir = False
 
+try:
+    import resource
+except ImportError:
+    resource = None
+
 FILE_ATTRIBUTE_DIRECTORY = 16
 
 TEST_PATH = os.path.abspath(os.path.join(os.path.dirname(__file__), 'testdir'))
@@ -295,6 +301,20 @@ if has_scandir:
                 TestMixin.setUp(self)
 
 
+        if hasattr(scandir._scandir, '_set_ignore_d_type'):
+            class TestScandirCNoDType(TestScandirC):
+                # As on file systems that don't fill in d_type
+                def setUp(self):
+                    TestScandirC.setUp(self)
+                    scandir._scandir._set_ignore_d_type(True)
+                    self.addCleanup(scandir._scandir._set_ignore_d_type, False)
+
+                def test_walk_matches(self):
+                    walked = list(scandir.walk_c(TEST_PATH))
+                    scandir._scandir._set_ignore_d_type(False)
+                    self.assertEqual(walked, list(scandir.walk_c(TEST_PATH)))
+
+
     class TestScandirDirEntry(unittest.TestCase):
         def setUp(self):
             if not os.path.exists(TEST_PATH):
@@ -306,9 +326,450 @@ if has_scandir:
             assert isinstance(entry, scandir.DirEntry)
 
 
+    if getattr(scandir, 'scandir_c', None) and sys.platform != 'win32':
+        class TestScandirBufferSize(unittest.TestCase):
+            wide_path = os.path.join(os.path.dirname(__file__), 'widedir')
+
+            def setUp(self):
+                os.mkdir(self.wide_path)
+                for i in range(500):
+                    create_file(os.path.join(self.wide_path, 'file{0:04}.txt'.format(i)))
+
+            def tearDown(self):
+                shutil.rmtree(self.wide_path)
+
+            def test_small_buffer(self):
+                # Forces many batches, each holding only a few entries
+                names = sorted(e.name for e in scandir.scandir_c(self.wide_path, buffer_size=1024))
+                self.assertEqual(names, sorted(os.listdir(self.wide_path)))
+
+            def test_large_buffer(self):
+                names = sorted(e.name for e in scandir.scandir_c(self.wide_path, buffer_size=1 << 20))
+                self.assertEqual(names, sorted(os.listdir(self.wide_path)))
+
+            def test_buffer_too_small(self):
+                self.assertRaises(ValueError, scandir.scandir_c, self.wide_path, buffer_size=16)
+
+            def test_buffer_too_large(self):
+                # getdents64() would truncate it to an unsigned int
+                for func in [scandir.scandir_c, scandir.scandir_bulk_c]:
+                    if func is None:
+                        continue
+                    self.assertRaises(ValueError, func, self.wide_path, buffer_size=2 ** 32)
+                    self.assertRaises(ValueError, func, self.wide_path, buffer_size=2 ** 26 + 1)
+
+        class TestScandirArena(unittest.TestCase):
+            wide_path = os.path.join(os.path.dirname(__file__), 'arenadir')
+
+            def setUp(self):
+                # Enough long names to need several arena blocks
+                os.mkdir(self.wide_path)
+                self.names = ['{0:04}{1}'.format(i, 'x' * 100) for i in range(1500)]
+                for name in self.names:
+                    create_file(os.path.join(self.wide_path, name))
+
+            def tearDown(self):
+                shutil.rmtree(self.wide_path)
+
+            def test_entries_kept(self):
+                entries = list(scandir.scandir_c(self.wide_path))
+                self.assertEqual(sorted(e.name for e in entries), self.names)
+                self.assertEqual(sorted(e.path for e in entries),
+                                 [os.path.join(self.wide_path, n) for n in self.names])
+
+            def test_some_entries_kept(self):
+                # Entries dropped straight away let the arena be reused, the
+                # ones kept must be unaffected
+                kept = []
+                for i, entry in enumerate(scandir.scandir_c(self.wide_path)):
+                    if i % 100 == 99:
+                        kept.append(entry)
+                for entry in kept:
+                    self.assertTrue(entry.name in self.names)
+                    self.assertEqual(entry.stat().st_size, 4)
+
+            def test_unfinished_iterators(self):
+                # Entries don't keep their iterator's directory open, so
+                # dropping unfinished iterators doesn't run out of fds
+                if resource is None:
+                    self.skipTest('needs resource.setrlimit()')
+                soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+                resource.setrlimit(resource.RLIMIT_NOFILE, (100, hard))
+                self.addCleanup(resource.setrlimit, resource.RLIMIT_NOFILE, (soft, hard))
+                entries = [next(scandir.scandir_c(self.wide_path)) for i in range(300)]
+                for entry in entries:
+                    self.assertTrue(entry.name in self.names)
+                    # Stat'ed by full path now the directory is closed
+                    self.assertEqual(entry.stat(follow_symlinks=False).st_size, 4)
+
+
+        class TestScandirFd(unittest.TestCase):
+            def setUp(self):
+                if not os.path.exists(TEST_PATH):
+                    setup_main()
+
+            # Python 2's pyconfig.h doesn't define HAVE_FDOPENDIR
+            @unittest.skipIf(not IS_PY3, 'scandir(fd) needs fdopendir()')
+            def test_fd(self):
+                fd = os.open(TEST_PATH, os.O_RDONLY)
+                try:
+                    entries = sorted(scandir.scandir_c(fd), key=lambda e: e.name)
+                    self.assertEqual([e.name for e in entries],
+                                     sorted(os.listdir(TEST_PATH)))
+                    # Like os.scandir(fd), path is just the name
+                    self.assertEqual([e.path for e in entries], [e.name for e in entries])
+                    entries = dict((e.name, e) for e in entries)
+                    self.assertEqual(entries['file2.txt'].stat().st_size, 8)
+                    self.assertTrue(entries['subdir'].is_dir())
+
+                    # The caller's fd is left open and can be scanned again
+                    self.assertEqual(len(list(scandir.scandir_c(fd))), len(entries))
+                finally:
+                    os.close(fd)
+
+            def test_default_path(self):
+                # Not an fd: scans the current directory
+                old_cwd = os.getcwd()
+                os.chdir(TEST_PATH)
+                try:
+                    entries = sorted(scandir.scandir_c(), key=lambda e: e.name)
+                finally:
+                    os.chdir(old_cwd)
+                self.assertEqual([e.name for e in entries], sorted(os.listdir(TEST_PATH)))
+                self.assertEqual([e.path for e in entries], ['./' + e.name for e in entries])
+
+            def test_stat_while_iterating(self):
+                # Stats relative to the still-open directory fd
+                for entry in scandir.scandir_c(TEST_PATH):
+                    st = entry.stat(follow_symlinks=False)
+                    self.assertEqual(st.st_ino, os.lstat(entry.path).st_ino)
+
+        class TestScandirStatFields(unittest.TestCase):
+            def setUp(self):
+                if not os.path.exists(TEST_PATH):
+                    setup_main()
+
+            def get_entry(self, name):
+                for entry in scandir.scandir_c(TEST_PATH):
+                    if entry.name == name:
+                        return entry
+
+            def test_fields(self):
+                entry = self.get_entry('file2.txt')
+                full = os.stat(entry.path)
+                st = entry.stat(fields=('st_size', 'st_mtime'))
+                self.assertEqual(st.st_size, 8)
+                if hasattr(full, 'st_mtime_ns'):
+                    self.assertEqual(st.st_mtime_ns, full.st_mtime_ns)
+                else:
+                    self.assertAlmostEqual(st.st_mtime, full.st_mtime, places=6)
+                if sys.platform.startswith('linux'):
+                    # Only the requested fields are filled in
+                    self.assertIsNone(st.st_mode)
+                    self.assertIsNone(st.st_atime)
+                # ... and the partial result isn't cached
+                self.assertEqual(entry.stat().st_mode, full.st_mode)
+
+            def test_no_sync(self):
+                entry = self.get_entry('file2.txt')
+                st = entry.stat(sync=False)
+                self.assertEqual(st.st_size, 8)
+                self.assertEqual(st.st_mode, os.stat(entry.path).st_mode)
+
+            def test_cached_full_result(self):
+                entry = self.get_entry('file2.txt')
+                full = entry.stat()
+                self.assertIs(entry.stat(fields=['st_size']), full)
+
+            def test_bad_fields(self):
+                if not sys.platform.startswith('linux'):
+                    self.skipTest('fields are only checked where statx is used')
+                entry = self.get_entry('file2.txt')
+                self.assertRaises(ValueError, entry.stat, fields=['st_foo'])
+                self.assertRaises(TypeError, entry.stat, fields=[1])
+
+        class TestStatInfo(unittest.TestCase):
+            fields = ['st_mode', 'st_ino', 'st_dev', 'st_nlink', 'st_uid', 'st_gid',
+                      'st_size', 'st_atime', 'st_mtime', 'st_ctime', 'st_atime_ns',
+                      'st_mtime_ns', 'st_ctime_ns', 'st_blksize', 'st_blocks',
+                      'st_rdev', 'st_flags', 'st_gen', 'st_birthtime']
+
+            def setUp(self):
+                if not os.path.exists(TEST_PATH):
+                    setup_main()
+                if symlinks_supported and not os.path.exists(
+                        os.path.join(TEST_PATH, 'linkdir', 'linksubdir')):
+                    setup_symlinks()
+
+            def check(self, st, expected):
+                self.assertTrue(isinstance(st, scandir._scandir.StatInfo))
+                for field in self.fields:
+                    if hasattr(expected, field):
+                        self.assertEqual(getattr(st, field), getattr(expected, field), field)
+                self.assertEqual(tuple(st), tuple(expected))
+
+            def test_fields(self):
+                for path in [TEST_PATH, os.path.join(TEST_PATH, 'linkdir')]:
+                    for entry in scandir.scandir_c(path):
+                        self.check(entry.stat(follow_symlinks=False), os.lstat(entry.path))
+                        self.check(entry.stat(), os.stat(entry.path))
+
+            def test_prefetched(self):
+                entries = list(scandir.scandir_c(TEST_PATH))
+                scandir.prefetch_stat(entries, follow_symlinks=False)
+                for entry in entries:
+                    self.check(entry.stat(follow_symlinks=False), os.lstat(entry.path))
+
+            def test_sequence(self):
+                path = os.path.join(TEST_PATH, 'file2.txt')
+                entry = [e for e in scandir.scandir_c(TEST_PATH) if e.name == 'file2.txt'][0]
+                st = entry.stat()
+                expected = os.stat(path)
+                self.assertEqual(len(st), 10)
+                self.assertEqual(st[6], 8)
+                self.assertEqual(st[-4], st.st_size)
+                self.assertEqual(st[7:], (int(expected.st_atime), int(expected.st_mtime),
+                                          int(expected.st_ctime)))
+                mode, ino, dev, nlink, uid, gid, size, atime, mtime, ctime = st
+                self.assertEqual((mode, size), (expected.st_mode, 8))
+                self.assertRaises(IndexError, lambda: st[10])
+                self.assertRaises(AttributeError, getattr, st, 'st_foo')
+                self.assertTrue(st == expected and not st != expected)
+                self.assertTrue(st == tuple(expected))
+                self.assertEqual(hash(st), hash(tuple(expected)))
+                self.assertTrue(repr(st).startswith('scandir.StatInfo(st_mode='))
+
+
+            def setUp(self):
+                if not os.path.exists(TEST_PATH):
+                    setup_main()
+
+            def check_prefetch(self, use_io_uring):
+                entries = list(scandir.scandir_c(TEST_PATH))
+                count = scandir.prefetch_stat_c(entries, use_io_uring=use_io_uring)
+                self.assertEqual(count, len(entries))
+                for entry in entries:
+                    st = entry.stat(follow_symlinks=False)
+                    self.assertIs(entry.stat(follow_symlinks=False), st)
+                    self.assertEqual(st.st_ino, os.lstat(entry.path).st_ino)
+                    self.assertEqual(entry.stat().st_size, os.stat(entry.path).st_size)
+                # Everything is cached now, so there's nothing left to stat
+                self.assertEqual(scandir.prefetch_stat_c(entries), 0)
+
+            def test_io_uring(self):
+                self.check_prefetch(True)
+
+            def test_threads(self):
+                self.check_prefetch(False)
+
+            def test_missing(self):
+                path = os.path.join(TEST_PATH, 'to_be_removed.txt')
+                with open(path, 'w'):
+                    pass
+                try:
+                    entries = list(scandir.scandir_c(TEST_PATH))
+                finally:
+                    os.remove(path)
+                count = scandir.prefetch_stat(entries)
+                self.assertEqual(count, len(entries) - 1)
+                missing = [e for e in entries if e.name == 'to_be_removed.txt'][0]
+                self.assertRaises(OSError, missing.stat)
+
+            def test_type_error(self):
+                self.assertRaises(TypeError, scandir.prefetch_stat_c, [1])
+
+        class TestScandirFilter(unittest.TestCase):
+            def setUp(self):
+                if not os.path.exists(TEST_PATH):
+                    setup_main()
+
+            def names(self, path=TEST_PATH, **kwargs):
+                return sorted(e.name for e in scandir.scandir_c(path, **kwargs))
+
+            def test_include(self):
+                self.assertEqual(self.names(include='*.txt'), ['file1.txt', 'file2.txt'])
+                self.assertEqual(self.names(include=['sub*', '*2.txt']), ['file2.txt', 'subdir'])
+                self.assertEqual(self.names(include=[]), [])
+
+            def test_exclude(self):
+                self.assertEqual(self.names(exclude='file?.txt'),
+                                 sorted(n for n in os.listdir(TEST_PATH) if not n.endswith('.txt')))
+                self.assertEqual(self.names(include='file*', exclude='*1*'), ['file2.txt'])
+
+            def test_types(self):
+                self.assertEqual(self.names(types=(scandir.DT_DIR,)),
+                                 sorted(n for n in os.listdir(TEST_PATH)
+                                        if os.path.isdir(os.path.join(TEST_PATH, n))))
+                self.assertEqual(self.names(types=[scandir.DT_REG], include='*1*'), ['file1.txt'])
+
+            def test_types_no_d_type(self):
+                # Entries are lstat'ed to find their types
+                if not hasattr(scandir._scandir, '_set_ignore_d_type'):
+                    return
+                expected = [self.names(types=(scandir.DT_DIR,)), self.names(types=(scandir.DT_REG,))]
+                scandir._scandir._set_ignore_d_type(True)
+                self.addCleanup(scandir._scandir._set_ignore_d_type, False)
+                for order in [None, 'name']:
+                    self.assertEqual([self.names(types=(scandir.DT_DIR,), order=order),
+                                      self.names(types=(scandir.DT_REG,), order=order)],
+                                     expected)
+
+            def test_unicode(self):
+                path = os.path.join(TEST_PATH, 'subdir')
+                self.assertEqual(self.names(path, include='?nicod\u018F.*'), ['unicod\u018F.txt'])
+                names = os.listdir(path)
+                for pattern in ['*[\u018F]*', '*[\u0180-\u01FF].txt', '*[!\u018F].txt',
+                                '*[a-\u018F].txt', '*d[\u018E-\u0190\xe9]', '*[!a-\uFFFF]*']:
+                    self.assertEqual(self.names(path, include=pattern),
+                                     sorted(n for n in names if fnmatch.fnmatchcase(n, pattern)),
+                                     pattern)
+
+            def test_bytes(self):
+                path = TEST_PATH.encode(sys.getfilesystemencoding())
+                entries = list(scandir.scandir_c(path, include=b'*.txt'))
+                self.assertEqual(sorted(e.name for e in entries), [b'file1.txt', b'file2.txt'])
+
+            def test_matches_fnmatch(self):
+                names = os.listdir(os.path.join(TEST_PATH, 'subdir'))
+                for pattern in ['*', '?', '*.*', 'f*1*t', '[fu]*', '[!f]*', '[a-f]*', '*[!t]', '**t', '[]]*']:
+                    self.assertEqual(self.names(os.path.join(TEST_PATH, 'subdir'), include=pattern),
+                                     sorted(n for n in names if fnmatch.fnmatchcase(n, pattern)),
+                                     pattern)
+
+            def test_errors(self):
+                self.assertRaises(TypeError, scandir.scandir_c, TEST_PATH, include=1)
+                self.assertRaises(TypeError, scandir.scandir_c, TEST_PATH, exclude=[1])
+                self.assertRaises(ValueError, scandir.scandir_c, TEST_PATH, types=[16])
+                self.assertRaises(TypeError, scandir.scandir_c, TEST_PATH, types=['dir'])
+
+        class TestScandirOrder(unittest.TestCase):
+            def setUp(self):
+                if not os.path.exists(TEST_PATH):
+                    setup_main()
+
+            def names(self, path=TEST_PATH, **kwargs):
+                return [e.name for e in scandir.scandir_c(path, **kwargs)]
+
+            def test_name(self):
+                for path in [TEST_PATH, os.path.join(TEST_PATH, 'subdir')]:
+                    names = self.names(path, order='name')
+                    self.assertEqual(names, sorted(names, key=lambda n: n.encode('utf-8')))
+                    self.assertEqual(sorted(names), sorted(os.listdir(path)))
+
+            def test_inode(self):
+                entries = list(scandir.scandir_c(TEST_PATH, order='inode'))
+                inodes = [e.inode() for e in entries]
+                self.assertEqual(inodes, sorted(inodes))
+                self.assertEqual(sorted(e.name for e in entries), sorted(os.listdir(TEST_PATH)))
+                for entry in entries:
+                    self.assertEqual(entry.inode(), os.lstat(entry.path).st_ino)
+                    self.assertEqual(entry.is_dir(), os.path.isdir(entry.path))
+
+            def test_empty(self):
+                path = os.path.join(TEST_PATH, 'order_empty')
+                os.mkdir(path)
+                try:
+                    for order in ['name', 'inode']:
+                        self.assertEqual(self.names(path, order=order), [])
+                finally:
+                    os.rmdir(path)
+
+            def test_native(self):
+                self.assertEqual(self.names(order='native'), self.names())
+                self.assertEqual(self.names(order=None), self.names())
+
+            def test_filters(self):
+                self.assertEqual(self.names(order='name', include='*.txt'),
+                                 ['file1.txt', 'file2.txt'])
+                self.assertEqual(self.names(order='name', types=[scandir.DT_DIR]),
+                                 sorted(n for n in os.listdir(TEST_PATH)
+                                        if os.path.isdir(os.path.join(TEST_PATH, n))))
+
+            def test_large(self):
+                # More entries than fit in one batch
+                path = os.path.join(TEST_PATH, 'order_large')
+                os.mkdir(path)
+                try:
+                    for i in range(300):
+                        open(os.path.join(path, 'file%03d' % (299 - i)), 'w').close()
+                    self.assertEqual(self.names(path, order='name', buffer_size=1024),
+                                     ['file%03d' % i for i in range(300)])
+                    entries = list(scandir.scandir_c(path, order='inode', buffer_size=1024))
+                    self.assertEqual(len(entries), 300)
+                    self.assertEqual([e.inode() for e in entries],
+                                     sorted(e.inode() for e in entries))
+                finally:
+                    shutil.rmtree(path)
+
+            def test_bytes(self):
+                path = TEST_PATH.encode(sys.getfilesystemencoding())
+                names = [e.name for e in scandir.scandir_c(path, order='name')]
+                self.assertEqual(names, sorted(names))
+
+            def test_errors(self):
+                self.assertRaises(ValueError, scandir.scandir_c, TEST_PATH, order='size')
+                self.assertRaises(ValueError, scandir.scandir_c, TEST_PATH, order=1)
+
+
 if hasattr(os, 'scandir'):
     class TestScandirOS(TestMixin, unittest.TestCase):
         def setUp(self):
             self.scandir_func = os.scandir
             self.has_file_attributes = True
             TestMixin.setUp(self)
+
+
+class TestBulkMixin(object):
+    def setUp(self):
+        if not os.path.exists(TEST_PATH):
+            setup_main()
+
+    def get_names(self, listing):
+        return [listing.names[listing.offsets[i]:listing.offsets[i + 1] - 1]
+                for i in range(len(listing.inodes))]
+
+    def test_basic(self):
+        listing = self.bulk_func(TEST_PATH)
+        self.assertEqual(len(listing.offsets), len(listing.inodes) + 1)
+        self.assertEqual(len(listing.types), len(listing.inodes))
+        self.assertEqual(listing.offsets[-1], len(listing.names))
+
+        names = self.get_names(listing)
+        self.assertEqual(sorted(names), sorted(os.listdir(TEST_PATH.encode(
+            sys.getfilesystemencoding()))))
+        for name, inode, d_type in zip(names, listing.inodes, listing.types):
+            path = os.path.join(TEST_PATH.encode(sys.getfilesystemencoding()), name)
+            self.assertEqual(inode, os.lstat(path).st_ino)
+            if d_type != scandir.DT_UNKNOWN:
+                self.assertEqual(d_type == scandir.DT_DIR, os.path.isdir(path))
+
+    def test_empty(self):
+        path = os.path.join(TEST_PATH, 'linkdir', 'emptydir')
+        os.mkdir(path)
+        try:
+            listing = self.bulk_func(path)
+        finally:
+            os.rmdir(path)
+        self.assertEqual(listing.names, b'')
+        self.assertEqual(list(listing.offsets), [0])
+        self.assertEqual(len(listing.inodes), 0)
+
+    def test_missing(self):
+        self.assertRaises(OSError, self.bulk_func, os.path.join(TEST_PATH, 'missing'))
+
+
+if has_scandir:
+    class TestBulkPython(TestBulkMixin, unittest.TestCase):
+        bulk_func = staticmethod(scandir.scandir_bulk_python)
+
+    if scandir.scandir_bulk_c is not None:
+        class TestBulkC(TestBulkMixin, unittest.TestCase):
+            bulk_func = staticmethod(scandir.scandir_bulk_c)
+
+            def test_fd(self):
+                fd = os.open(TEST_PATH, os.O_RDONLY)
+                try:
+                    self.assertEqual(sorted(self.get_names(self.bulk_func(fd))),
+                                     sorted(self.get_names(self.bulk_func(TEST_PATH))))
+                finally:
+                    os.close(fd)
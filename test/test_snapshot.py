@@ -0,0 +1,176 @@
+"""Tests for scandir.snapshot() and scandir.Snapshot."""
+
+import os
+import shutil
+import stat
+import sys
+import time
+import unittest
+
+import scandir
+
+try:
+    import resource
+except ImportError:
+    resource = None
+
+
+class TestSnapshot(unittest.TestCase):
+    testfn = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'snaptemp')
+    snapshot_func = staticmethod(scandir.snapshot_python)
+
+    def setUp(self):
+        # Build:
+        #     TESTFN/
+        #       tree/
+        #         b                 10 bytes
+        #         a/
+        #           z
+        #           empty/
+        #         c/
+        #           d               100 bytes
+        #         link              a symlink to a
+        #       snap                the snapshot file
+        self.addCleanup(shutil.rmtree, self.testfn, True)
+        shutil.rmtree(self.testfn, True)
+        self.top = os.path.join(self.testfn, 'tree')
+        os.makedirs(os.path.join(self.top, 'a', 'empty'))
+        os.makedirs(os.path.join(self.top, 'c'))
+        for path, size in [(os.path.join(self.top, 'b'), 10),
+                           (os.path.join(self.top, 'a', 'z'), 0),
+                           (os.path.join(self.top, 'c', 'd'), 100)]:
+            with open(path, 'wb') as f:
+                f.write(b'x' * size)
+        self.has_symlink = hasattr(os, 'symlink')
+        if self.has_symlink:
+            os.symlink('a', os.path.join(self.top, 'link'))
+        self.snap_path = os.path.join(self.testfn, 'snap')
+
+    def open_snapshot(self, top=None):
+        count = self.snapshot_func(top or self.top, self.snap_path)
+        snap = scandir.Snapshot(self.snap_path)
+        self.addCleanup(snap.close)
+        self.assertEqual(len(snap), count)
+        return snap
+
+    def expected_paths(self):
+        paths = [self.top]
+        for dirpath, dirnames, filenames in os.walk(self.top):
+            paths.extend(os.path.join(dirpath, name) for name in dirnames + filenames)
+        return paths
+
+    def test_entries(self):
+        snap = self.open_snapshot()
+        paths = [path for path, entry in snap.items()]
+        self.assertEqual(sorted(paths), sorted(self.expected_paths()))
+        for index, (path, entry) in enumerate(snap.items()):
+            self.assertEqual(snap.path(index), path)
+            self.assertEqual(snap[index], entry)
+            st = os.lstat(path)
+            self.assertEqual(entry.mode, st.st_mode)
+            self.assertEqual(entry.ino, st.st_ino)
+            self.assertEqual(entry.dev, st.st_dev)
+            self.assertEqual(entry.size, st.st_size)
+            if hasattr(st, 'st_mtime_ns'):
+                self.assertEqual(entry.mtime_ns, st.st_mtime_ns)
+                self.assertEqual(entry.ctime_ns, st.st_ctime_ns)
+        self.assertEqual(snap[-1], snap[len(snap) - 1])
+        self.assertRaises(IndexError, snap.__getitem__, len(snap))
+
+    def test_layout(self):
+        snap = self.open_snapshot()
+        top = snap[0]
+        self.assertEqual(top.name, self.top)
+        self.assertIsNone(top.parent)
+        names = [snap[i].name for i in snap.children(0)]
+        self.assertEqual(names, ['a', 'b', 'c', 'link'] if self.has_symlink else ['a', 'b', 'c'])
+        for index in snap.children(0):
+            self.assertEqual(snap[index].parent, 0)
+        a = snap.lookup('a')
+        self.assertEqual([snap[i].name for i in snap.children(a)], ['empty', 'z'])
+        self.assertEqual(list(snap.children(snap.lookup('a/empty'))), [])
+        if self.has_symlink:
+            self.assertTrue(stat.S_ISLNK(snap[snap.lookup('link')].mode))
+
+    def test_lookup(self):
+        snap = self.open_snapshot()
+        self.assertEqual(snap.lookup(''), 0)
+        self.assertEqual(snap.lookup(self.top), 0)
+        for path in ['a', 'b', 'c', 'a/z', 'a/empty', 'c/d']:
+            index = snap.lookup(path)
+            self.assertEqual(snap.path(index), os.path.join(self.top, *path.split('/')))
+            self.assertEqual(snap.lookup(os.path.join(self.top, path)), index)
+        for path in ['missing', 'a/missing', 'b/c', 'c/d/e', '0', 'zz']:
+            self.assertRaises(KeyError, snap.lookup, path)
+
+    def test_file(self):
+        snap = self.open_snapshot(os.path.join(self.top, 'c', 'd'))
+        self.assertEqual(len(snap), 1)
+        self.assertEqual(snap[0].size, 100)
+        self.assertEqual(len(snap.children(0)), 0)
+
+    def test_bytes(self):
+        top = self.top.encode(sys.getfilesystemencoding())
+        snap = self.open_snapshot(top)
+        self.assertEqual(snap[0].name, top)
+        self.assertEqual(snap.path(snap.lookup(b'c/d')), os.path.join(top, b'c', b'd'))
+
+    def test_created_ns(self):
+        before = int(time.time() * 1000000000)
+        snap = self.open_snapshot()
+        self.assertTrue(before - 1000000000 <= snap.created_ns <= before + 1000000000)
+
+    def test_not_snapshot(self):
+        with open(self.snap_path, 'wb') as f:
+            f.write(b'not a snapshot')
+        self.assertRaises(ValueError, scandir.Snapshot, self.snap_path)
+
+    def test_missing(self):
+        self.assertRaises(OSError, self.snapshot_func,
+                          os.path.join(self.testfn, 'missing'), self.snap_path)
+
+    if hasattr(os, 'geteuid') and os.geteuid() != 0:
+        def test_onerror(self):
+            errors = []
+            c = os.path.join(self.top, 'c')
+            os.chmod(c, 0)
+            try:
+                self.snapshot_func(self.top, self.snap_path, onerror=errors.append)
+            finally:
+                os.chmod(c, 0o755)
+            self.assertEqual([error.filename for error in errors], [c])
+            snap = scandir.Snapshot(self.snap_path)
+            self.addCleanup(snap.close)
+            self.assertEqual(len(snap.children(snap.lookup('c'))), 0)
+
+
+if scandir.snapshot_c is not None:
+    class TestSnapshotC(TestSnapshot):
+        snapshot_func = staticmethod(scandir.snapshot)
+
+        def test_matches_python(self):
+            scandir.snapshot(self.top, self.snap_path)
+            with open(self.snap_path, 'rb') as f:
+                native = f.read()
+            scandir.snapshot_python(self.top, self.snap_path)
+            with open(self.snap_path, 'rb') as f:
+                python = f.read()
+            # Everything but the created_ns times in the headers matches
+            if sys.version_info >= (3, 3):
+                self.assertEqual(native[:56] + native[64:], python[:56] + python[64:])
+            else:
+                self.assertEqual(len(native), len(python))
+
+        def test_deep_tree(self):
+            # Only the last few directories are kept open, so a tree deeper
+            # than the open file limit still gives a complete snapshot
+            if resource is None:
+                self.skipTest('needs resource.setrlimit()')
+            os.makedirs(os.path.join(self.top, *['d'] * 150))
+            soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+            resource.setrlimit(resource.RLIMIT_NOFILE, (100, hard))
+            self.addCleanup(resource.setrlimit, resource.RLIMIT_NOFILE, (soft, hard))
+            errors = []
+            count = self.snapshot_func(self.top, self.snap_path, onerror=errors.append)
+            self.assertEqual(errors, [])
+            self.assertEqual(count, len(self.expected_paths()))
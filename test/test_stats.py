@@ -0,0 +1,107 @@
+"""Tests for the _scandir instrumentation counters."""
+
+import os
+import shutil
+import sys
+import unittest
+
+import scandir
+
+_scandir = scandir._scandir
+
+
+class TestStats(unittest.TestCase):
+    testfn = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'statstemp')
+
+    def setUp(self):
+        # TESTFN/
+        #     file1 file2 file3
+        #     sub/
+        #       file4
+        self.addCleanup(shutil.rmtree, self.testfn, True)
+        shutil.rmtree(self.testfn, True)
+        os.makedirs(os.path.join(self.testfn, 'sub'))
+        for path in ['file1', 'file2', 'file3', os.path.join('sub', 'file4')]:
+            open(os.path.join(self.testfn, path), 'w').close()
+        self.addCleanup(_scandir.reset_stats)
+        self.addCleanup(_scandir.enable_stats, False)
+        _scandir.reset_stats()
+
+    def count(self, func, *args, **kwargs):
+        _scandir.reset_stats()
+        self.assertFalse(_scandir.enable_stats())
+        try:
+            func(*args, **kwargs)
+        finally:
+            self.assertTrue(_scandir.enable_stats(False))
+        return _scandir.stats()
+
+    def test_disabled(self):
+        list(scandir.walk_c(self.testfn))
+        stats = _scandir.stats()
+        self.assertEqual(sorted(stats), sorted([
+            'opendir', 'readdir', 'stat', 'lstat', 'name_bytes_decoded',
+            'dir_entries', 'stat_cache_hits', 'lstat_cache_hits', 'gil_released_ns']))
+        self.assertEqual(sum(stats.values()), 0)
+
+    def test_scandir(self):
+        # Names are only decoded when scanning a str path
+        path = self.testfn
+        if isinstance(path, bytes):
+            path = path.decode(sys.getfilesystemencoding())
+
+        def scan():
+            entries = list(scandir.scandir_c(path))
+            for entry in entries:
+                entry.name
+                entry.stat(follow_symlinks=False)
+                entry.stat(follow_symlinks=False)
+                entry.stat()
+        stats = self.count(scan)
+        self.assertEqual(stats['opendir'], 1)
+        if sys.platform.startswith('linux'):
+            # Entries are read in one batch, then an empty read at the end
+            self.assertEqual(stats['readdir'], 2)
+        self.assertEqual(stats['dir_entries'], 4)
+        self.assertEqual(stats['name_bytes_decoded'], len('file1file2file3sub'))
+        self.assertEqual(stats['lstat'], 4)
+        self.assertEqual(stats['stat'], 0)
+        # One hit from the second lstat of each entry, and one more as
+        # stat() of something that isn't a symlink is its lstat()
+        self.assertEqual(stats['lstat_cache_hits'], 4 + 4)
+        self.assertEqual(stats['stat_cache_hits'], 0)
+        self.assertEqual(self.count(scandir.scandir_c, self.testfn)['dir_entries'], 0)
+
+    def test_walk(self):
+        stats = self.count(list, scandir.walk_c(self.testfn))
+        self.assertEqual(stats['opendir'], 2)
+        if sys.platform.startswith('linux'):
+            self.assertEqual(stats['readdir'], 4)
+        self.assertEqual(stats['dir_entries'], 0)
+        # The top-down walk checks that sub isn't a symlink before going in
+        self.assertEqual(stats['lstat'], 1)
+        self.assertTrue(stats['gil_released_ns'] > 0)
+        _scandir._set_ignore_d_type(True)
+        try:
+            stats = self.count(list, scandir.walk_c(self.testfn))
+        finally:
+            _scandir._set_ignore_d_type(False)
+        # Every entry, then sub again before going in
+        self.assertEqual(stats['lstat'], 5 + 1)
+
+    def test_worker_threads(self):
+        stats = self.count(scandir.du_c, self.testfn, False, False, False, False, 4)
+        self.assertEqual(stats['opendir'], 2)
+        # The top, then every entry in the tree
+        self.assertEqual(stats['stat'], 1)
+        self.assertEqual(stats['lstat'], 5)
+
+    def test_reset(self):
+        self.count(list, scandir.walk_c(self.testfn))
+        self.assertNotEqual(_scandir.stats()['opendir'], 0)
+        _scandir.reset_stats()
+        self.assertEqual(sum(_scandir.stats().values()), 0)
+
+
+if getattr(_scandir, 'stats', None) is None or sys.platform == 'win32':
+    del TestStats
@@ -0,0 +1,206 @@
+"""Tests for scandir.TreeCache."""
+
+import errno
+import os
+import shutil
+import sys
+import threading
+import time
+import unittest
+
+import scandir
+
+HAS_INOTIFY = getattr(scandir._scandir, 'inotify_init', None) is not None
+
+
+def sorted_walk(walk):
+    return sorted((dirpath, sorted(dirnames), sorted(filenames))
+                  for dirpath, dirnames, filenames in walk)
+
+
+class TestTreeCache(unittest.TestCase):
+    testfn = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'cachetemp')
+
+    def setUp(self):
+        # Build:
+        #     TESTFN/
+        #       a                   10 bytes
+        #       sub/
+        #         b
+        #         subsub/
+        #           c
+        #       link                a symlink to sub
+        self.addCleanup(shutil.rmtree, self.testfn, True)
+        shutil.rmtree(self.testfn, True)
+        os.makedirs(self.path('sub', 'subsub'))
+        for path, size in [(self.path('a'), 10), (self.path('sub', 'b'), 0),
+                           (self.path('sub', 'subsub', 'c'), 0)]:
+            self.write(path, size)
+        if hasattr(os, 'symlink'):
+            os.symlink('sub', self.path('link'))
+        self.cache = scandir.TreeCache(self.testfn, background=False)
+        self.addCleanup(self.cache.close)
+
+    def path(self, *names):
+        return os.path.join(self.testfn, *names)
+
+    def write(self, path, size):
+        with open(path, 'wb') as f:
+            f.write(b'x' * size)
+
+    def names(self, path):
+        return sorted(entry.name for entry in self.cache.scandir(path))
+
+    def check_matches_disk(self):
+        self.cache.sync()
+        self.assertEqual(sorted_walk(self.cache.walk()), sorted_walk(os.walk(self.testfn)))
+        self.assertEqual(sorted_walk(self.cache.walk(topdown=False)),
+                         sorted_walk(os.walk(self.testfn, topdown=False)))
+        for dirpath, dirnames, filenames in os.walk(self.testfn):
+            for entry in self.cache.scandir(dirpath):
+                if dirpath not in self.cache.unwatched:
+                    self.assertTrue(isinstance(entry, scandir.CachedEntry))
+                self.assertEqual(entry.path, os.path.join(dirpath, entry.name))
+                st = os.lstat(entry.path)
+                self.assertEqual(entry.stat(follow_symlinks=False).st_size, st.st_size)
+                self.assertEqual(entry.inode(), st.st_ino)
+
+    def test_initial(self):
+        self.check_matches_disk()
+        self.assertEqual(self.cache.num_watches, 3)
+        self.assertEqual(self.names(None), sorted(os.listdir(self.testfn)))
+        entry = dict((e.name, e) for e in self.cache.scandir())['a']
+        self.assertTrue(entry.is_file())
+        self.assertFalse(entry.is_dir())
+        self.assertEqual(entry.stat().st_size, 10)
+
+    def test_symlink(self):
+        if not hasattr(os, 'symlink'):
+            return
+        entry = dict((e.name, e) for e in self.cache.scandir())['link']
+        self.assertTrue(entry.is_symlink())
+        self.assertTrue(entry.is_dir())
+        self.assertFalse(entry.is_dir(follow_symlinks=False))
+        walked = [dirpath for dirpath, dirnames, filenames in self.cache.walk(followlinks=True)]
+        self.assertTrue(self.path('link', 'subsub') in walked)
+
+    def test_changes(self):
+        self.write(self.path('new'), 5)
+        os.remove(self.path('sub', 'b'))
+        self.write(self.path('a'), 20)
+        self.check_matches_disk()
+        self.assertEqual(self.names(self.path('sub')), ['subsub'])
+
+    def test_new_dirs(self):
+        os.makedirs(self.path('new', 'deeper'))
+        self.write(self.path('new', 'deeper', 'd'), 0)
+        self.check_matches_disk()
+        self.assertEqual(self.names(self.path('new', 'deeper')), ['d'])
+        self.assertEqual(self.cache.num_watches, 5)
+
+    def test_removed_dirs(self):
+        shutil.rmtree(self.path('sub'))
+        self.check_matches_disk()
+        self.assertEqual(self.cache.num_watches, 1)
+        self.assertRaises(OSError, self.cache.scandir, self.path('sub'))
+
+    def test_rename(self):
+        os.rename(self.path('sub'), self.path('moved'))
+        self.write(self.path('moved', 'subsub', 'e'), 0)
+        self.check_matches_disk()
+        self.assertEqual(self.names(self.path('moved', 'subsub')), ['c', 'e'])
+
+    def test_replace(self):
+        shutil.rmtree(self.path('sub'))
+        self.write(self.path('sub'), 0)
+        os.remove(self.path('a'))
+        os.mkdir(self.path('a'))
+        self.check_matches_disk()
+
+    def test_overflow(self):
+        self.write(self.path('new'), 0)
+        # Simulate the kernel dropping events
+        self.cache._handle([(-1, scandir.IN_Q_OVERFLOW, 0, None)])
+        self.assertEqual(self.cache.overflows, 1)
+        self.check_matches_disk()
+        self.assertEqual(self.cache.num_watches, 3)
+
+    def test_reload_doesnt_block_readers(self):
+        # The tree is read from disk without holding the cache's lock
+        read_tree = self.cache._read_tree
+        names = []
+
+        def reading_read_tree(path):
+            thread = threading.Thread(target=lambda: names.extend(self.names(None)))
+            thread.start()
+            thread.join(5)
+            self.assertFalse(thread.is_alive())
+            return read_tree(path)
+
+        inotify_read = scandir._scandir.inotify_read
+        events = [[(-1, scandir.IN_Q_OVERFLOW, 0, None)]]
+
+        def overflowed_inotify_read(fd, timeout):
+            return events.pop() if events else inotify_read(fd, timeout)
+
+        self.cache._read_tree = reading_read_tree
+        scandir._scandir.inotify_read = overflowed_inotify_read
+        try:
+            self.cache.sync()
+        finally:
+            scandir._scandir.inotify_read = inotify_read
+        self.assertEqual(self.cache.overflows, 1)
+        self.assertEqual(sorted(names), sorted(os.listdir(self.testfn)))
+        self.check_matches_disk()
+
+    def test_watch_limit(self):
+        self.cache.close()
+        add_watch = scandir._scandir.inotify_add_watch
+        subsub = self.path('sub', 'subsub')
+
+        def limited_add_watch(fd, path, mask):
+            if path == subsub:
+                raise OSError(errno.ENOSPC, os.strerror(errno.ENOSPC), path)
+            return add_watch(fd, path, mask)
+
+        scandir._scandir.inotify_add_watch = limited_add_watch
+        try:
+            self.cache = scandir.TreeCache(self.testfn, background=False)
+        finally:
+            scandir._scandir.inotify_add_watch = add_watch
+        self.assertEqual(self.cache.unwatched, set([subsub]))
+        # Unwatched directories are read from disk
+        self.write(os.path.join(subsub, 'd'), 0)
+        entries = list(self.cache.scandir(subsub))
+        self.assertEqual(sorted(e.name for e in entries), ['c', 'd'])
+        self.assertFalse(isinstance(entries[0], scandir.CachedEntry))
+        self.check_matches_disk()
+
+    def test_unnormalized_path(self):
+        path = self.testfn + os.sep + os.path.join('.', 'sub') + os.sep
+        for entry in self.cache.scandir(path):
+            self.assertEqual(entry.path, os.path.join(path, entry.name))
+
+    def test_bytes(self):
+        top = self.testfn.encode(sys.getfilesystemencoding())
+        with scandir.TreeCache(top, background=False) as cache:
+            self.write(self.path('new'), 0)
+            cache.sync()
+            self.assertTrue(b'new' in [entry.name for entry in cache.scandir()])
+
+    def test_background(self):
+        with scandir.TreeCache(self.testfn) as cache:
+            self.write(self.path('new'), 0)
+            for i in range(100):
+                if 'new' in [entry.name for entry in cache.scandir()]:
+                    break
+                time.sleep(0.02)
+            else:
+                self.fail('background thread never saw the new file')
+
+    def test_missing(self):
+        self.assertRaises(OSError, scandir.TreeCache, self.path('missing'))
+
+
+if not HAS_INOTIFY:
+    del TestTreeCache
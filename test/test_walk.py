@@ -1,5 +1,6 @@
 """Tests for scandir.walk(), copied from CPython's tests for os.walk()."""
 
+import functools
 import os
 import shutil
 import sys
@@ -7,13 +8,17 @@ import unittest
 
 import scandir
 
-walk_func = scandir.walk
+try:
+    import resource
+except ImportError:
+    resource = None
 
 IS_PY3 = sys.version_info >= (3, 0)
 
 
 class TestWalk(unittest.TestCase):
     testfn = os.path.join(os.path.dirname(__file__), 'temp')
+    walk_func = staticmethod(scandir.walk_python)
 
     def test_traversal(self):
         # Build:
@@ -61,7 +66,7 @@ class TestWalk(unittest.TestCase):
             sub2_tree = (sub2_path, [], ["tmp3"])
 
         # Walk top-down.
-        all = list(walk_func(walk_path))
+        all = list(self.walk_func(walk_path))
         self.assertEqual(len(all), 4)
         # We can't know which order SUB1 and SUB2 will appear in.
         # Not flipped:  TESTFN, SUB1, SUB11, SUB2
@@ -75,7 +80,7 @@ class TestWalk(unittest.TestCase):
 
         # Prune the search.
         all = []
-        for root, dirs, files in walk_func(walk_path):
+        for root, dirs, files in self.walk_func(walk_path):
             all.append((root, dirs, files))
             # Don't descend into SUB1.
             if 'SUB1' in dirs:
@@ -86,7 +91,7 @@ class TestWalk(unittest.TestCase):
         self.assertEqual(all[1], sub2_tree)
 
         # Walk bottom-up.
-        all = list(walk_func(walk_path, topdown=False))
+        all = list(self.walk_func(walk_path, topdown=False))
         self.assertEqual(len(all), 4)
         # We can't know which order SUB1 and SUB2 will appear in.
         # Not flipped:  SUB11, SUB1, SUB2, TESTFN
@@ -100,7 +105,7 @@ class TestWalk(unittest.TestCase):
 
         if has_symlink:
             # Walk, following symlinks.
-            for root, dirs, files in walk_func(walk_path, followlinks=True):
+            for root, dirs, files in self.walk_func(walk_path, followlinks=True):
                 if root == link_path:
                     self.assertEqual(dirs, [])
                     self.assertEqual(files, ["tmp4"])
@@ -111,7 +116,7 @@ class TestWalk(unittest.TestCase):
         # Test creating a directory and adding it to dirnames
         sub3_path = os.path.join(walk_path, "SUB3")
         all = []
-        for root, dirs, files in walk_func(walk_path):
+        for root, dirs, files in self.walk_func(walk_path):
             all.append((root, dirs, files))
             if 'SUB1' in dirs:
                 os.makedirs(sub3_path)
@@ -138,6 +143,7 @@ class TestWalk(unittest.TestCase):
 
 class TestWalkSymlink(unittest.TestCase):
     temp_dir = os.path.join(os.path.dirname(__file__), 'temp')
+    walk_func = staticmethod(scandir.walk_python)
 
     def setUp(self):
         os.mkdir(self.temp_dir)
@@ -161,7 +167,7 @@ class TestWalkSymlink(unittest.TestCase):
             # Windows versions before Vista don't support symbolic links
             return
 
-        output = sorted(walk_func(self.temp_dir))
+        output = sorted(self.walk_func(self.temp_dir))
         dirs = sorted(output[0][1])
         files = sorted(output[0][2])
         self.assertEqual(dirs, ['dir'])
@@ -185,7 +191,7 @@ class TestWalkSymlink(unittest.TestCase):
             # Windows versions before Vista don't support symbolic links
             return
 
-        output = sorted(walk_func(self.temp_dir))
+        output = sorted(self.walk_func(self.temp_dir))
         dirs = sorted(output[0][1])
         files = sorted(output[0][2])
         self.assertEqual(dirs, ['dir', 'link_to_dir'])
@@ -195,7 +201,7 @@ class TestWalkSymlink(unittest.TestCase):
         self.assertEqual(output[1][1], [])
         self.assertEqual(output[1][2], ['subfile'])
 
-        output = sorted(walk_func(self.temp_dir, followlinks=True))
+        output = sorted(self.walk_func(self.temp_dir, followlinks=True))
         dirs = sorted(output[0][1])
         files = sorted(output[0][2])
         self.assertEqual(dirs, ['dir', 'link_to_dir'])
@@ -207,3 +213,273 @@ class TestWalkSymlink(unittest.TestCase):
         self.assertEqual(os.path.basename(output[2][0]), 'link_to_dir')
         self.assertEqual(output[2][1], [])
         self.assertEqual(output[2][2], ['subfile'])
+
+
+class TestWalkOrder(unittest.TestCase):
+    testfn = os.path.join(os.path.dirname(__file__), 'temp')
+    walk_func = staticmethod(scandir.walk_python)
+
+    def setUp(self):
+        # testfn/dir{0..2}/sub{0..2}/leaf/, each directory with a file
+        self.addCleanup(shutil.rmtree, self.testfn, True)
+        for i in range(3):
+            for j in range(3):
+                path = os.path.join(self.testfn, 'dir{0}'.format(i), 'sub{0}'.format(j))
+                os.makedirs(os.path.join(path, 'leaf'))
+                open(os.path.join(path, 'file'), 'w').close()
+            open(os.path.join(self.testfn, 'dir{0}'.format(i), 'file'), 'w').close()
+
+    def level(self, path):
+        return os.path.relpath(path, self.testfn).count(os.sep) + (path != self.testfn)
+
+    def test_bfs(self):
+        output = list(self.walk_func(self.testfn, order='bfs'))
+        self.assertEqual(len(output), 1 + 3 + 9 + 9)
+        levels = [self.level(root) for root, dirs, files in output]
+        self.assertEqual(levels, sorted(levels))
+        self.assertEqual(sorted(output), sorted(self.walk_func(self.testfn)))
+
+    def test_bfs_prune(self):
+        output = []
+        for root, dirs, files in self.walk_func(self.testfn, order='bfs'):
+            output.append(root)
+            if 'dir1' in dirs:
+                dirs.remove('dir1')
+        self.assertEqual(len(output), 1 + 2 + 6 + 6)
+        self.assertFalse(any('dir1' in root for root in output))
+
+    def test_max_depth(self):
+        for max_depth, count in [(0, 1), (1, 4), (2, 13), (3, 22), (10, 22)]:
+            for kwargs in [{}, {'topdown': False}, {'order': 'bfs'}]:
+                output = list(self.walk_func(self.testfn, max_depth=max_depth, **kwargs))
+                self.assertEqual(len(output), count)
+                self.assertTrue(all(self.level(root) <= max_depth for root, d, f in output))
+
+    def test_errors(self):
+        self.assertRaises(ValueError, self.walk_func, self.testfn, order='random')
+        self.assertRaises(ValueError, self.walk_func, self.testfn, topdown=False, order='bfs')
+        self.assertRaises(ValueError, self.walk_func, self.testfn, prefetch=4, order='bfs')
+        self.assertRaises(ValueError, self.walk_func, self.testfn, max_depth=-1)
+
+
+class TestWalkDedupe(unittest.TestCase):
+    testfn = os.path.join(os.path.dirname(__file__), 'temp')
+    walk_func = staticmethod(scandir.walk_python)
+
+    def setUp(self):
+        # testfn/
+        #     file, link_to_file (a hard link to file)
+        #     dir/
+        #         subfile, link_to_subfile (a hard link to subfile)
+        #         loop -> ..
+        #     link_to_dir -> dir
+        if not hasattr(os, 'symlink') or not hasattr(os, 'link') or sys.platform == 'win32':
+            self.skipTest('needs symlinks and hard links')
+        self.addCleanup(shutil.rmtree, self.testfn, True)
+        dir_name = os.path.join(self.testfn, 'dir')
+        os.makedirs(dir_name)
+        for path, link in [(self.testfn, 'link_to_file'), (dir_name, 'link_to_subfile')]:
+            name = os.path.join(path, link[len('link_to_'):])
+            open(name, 'w').close()
+            os.link(name, os.path.join(path, link))
+        os.symlink('..', os.path.join(dir_name, 'loop'))
+        os.symlink('dir', os.path.join(self.testfn, 'link_to_dir'))
+
+    def walk(self, **kwargs):
+        output = []
+        for root, dirs, files in self.walk_func(self.testfn, **kwargs):
+            output.append((root, sorted(dirs), sorted(files)))
+            # Without dedupe_dirs a cycle would never end
+            self.assertTrue(len(output) < 100)
+        return output
+
+    def test_dedupe_dirs(self):
+        for kwargs in [{}, {'topdown': False}, {'order': 'bfs'}]:
+            output = self.walk(followlinks=True, dedupe_dirs=True, **kwargs)
+            # dir is only walked once, through dir or link_to_dir
+            self.assertEqual(len(output), 2)
+            roots = set(os.path.relpath(root, self.testfn) for root, d, f in output)
+            self.assertTrue('.' in roots)
+            self.assertTrue(roots & set(['dir', 'link_to_dir']))
+            for root, dirs, files in output:
+                self.assertEqual(len(files), 2)
+
+        # Without followlinks symlinks aren't walked anyway
+        self.assertEqual(self.walk(dedupe_dirs=True), self.walk())
+
+    def test_dedupe_files(self):
+        for kwargs in [{}, {'topdown': False}, {'order': 'bfs'}]:
+            output = self.walk(dedupe_files=True, **kwargs)
+            self.assertEqual(len(output), 2)
+            for root, dirs, files in output:
+                # One name for each file, whichever was read first
+                self.assertEqual(len(files), 1)
+                self.assertTrue(files[0].endswith('file'))
+
+    def test_dedupe_both(self):
+        output = self.walk(followlinks=True, dedupe_dirs=True, dedupe_files=True)
+        self.assertEqual(sum(len(files) for root, dirs, files in output), 2)
+
+
+if scandir.walk_c is not None:
+    class TestWalkOrderC(TestWalkOrder):
+        walk_func = staticmethod(scandir.walk_c)
+
+        def test_frontier_spill(self):
+            expected = list(scandir.walk_c(self.testfn, order='bfs'))
+            for frontier_memory in (0, 100):
+                it = scandir.walk_c(self.testfn, order='bfs', frontier_memory=frontier_memory)
+                self.assertEqual(list(it), expected)
+                self.assertTrue(it.frontier_spilled > 0)
+            it = scandir.walk_c(self.testfn, order='bfs')
+            list(it)
+            self.assertEqual(it.frontier_spilled, 0)
+
+        def test_bytes_bfs(self):
+            top = self.testfn.encode(sys.getfilesystemencoding())
+            output = list(scandir.walk_c(top, order='bfs', frontier_memory=0))
+            self.assertEqual(len(output), 22)
+            self.assertEqual(output[0][0], top)
+            for root, dirs, files in output:
+                self.assertTrue(isinstance(root, bytes))
+
+    class TestWalkDedupeC(TestWalkDedupe):
+        walk_func = staticmethod(scandir.walk_c)
+
+        def test_one_stat_per_dir(self):
+            # Files are keyed by d_ino, so only directories are stat'ed
+            _scandir = scandir._scandir
+            if getattr(_scandir, 'stats', None) is None:
+                return
+            self.addCleanup(_scandir.enable_stats, False)
+            counts = []
+            for kwargs in [{}, {'dedupe_files': True}]:
+                _scandir.reset_stats()
+                _scandir.enable_stats(True)
+                self.walk(**kwargs)
+                _scandir.enable_stats(False)
+                stats = _scandir.stats()
+                counts.append((stats['stat'], stats['lstat']))
+            self.assertEqual(counts[1], (counts[0][0] + 2, counts[0][1]))
+
+    class TestWalkC(TestWalk):
+        walk_func = staticmethod(scandir.walk_c)
+
+        def test_onerror(self):
+            errors = []
+            missing = os.path.join(self.testfn, 'missing')
+            os.mkdir(self.testfn)
+            self.assertEqual(list(self.walk_func(missing, onerror=errors.append)), [])
+            self.assertEqual(len(errors), 1)
+            self.assertTrue(isinstance(errors[0], OSError))
+            self.assertEqual(errors[0].filename, missing)
+
+            # Without onerror, unreadable directories are silently skipped
+            self.assertEqual(list(self.walk_func(missing)), [])
+
+        def test_bytes(self):
+            os.makedirs(os.path.join(self.testfn, 'sub'))
+            open(os.path.join(self.testfn, 'sub', 'file'), 'w').close()
+            top = self.testfn.encode(sys.getfilesystemencoding())
+            for topdown in (True, False):
+                output = sorted(self.walk_func(top, topdown=topdown))
+                self.assertEqual(output, [
+                    (top, [b'sub'], []),
+                    (os.path.join(top, b'sub'), [], [b'file']),
+                ])
+
+        def test_deep_tree(self):
+            # Only the last few directories are kept open, so a tree deeper
+            # than the open file limit is still walked completely
+            if resource is None:
+                self.skipTest('needs resource.setrlimit()')
+            os.makedirs(os.path.join(self.testfn, *['d'] * 150))
+            soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+            resource.setrlimit(resource.RLIMIT_NOFILE, (100, hard))
+            self.addCleanup(resource.setrlimit, resource.RLIMIT_NOFILE, (soft, hard))
+            for topdown in (True, False):
+                errors = []
+                output = list(self.walk_func(self.testfn, topdown=topdown,
+                                             onerror=errors.append))
+                self.assertEqual(errors, [])
+                self.assertEqual(len(output), 151)
+
+    class TestWalkSymlinkC(TestWalkSymlink):
+        walk_func = staticmethod(scandir.walk_c)
+
+    class TestWalkPrefetchC(TestWalk):
+        walk_func = staticmethod(functools.partial(scandir.walk_c, prefetch=1))
+
+        def test_matches_walk(self):
+            for i in range(4):
+                for j in range(4):
+                    os.makedirs(os.path.join(self.testfn, 'dir{0}'.format(i), 'sub{0}'.format(j)))
+                open(os.path.join(self.testfn, 'dir{0}'.format(i), 'file'), 'w').close()
+            for topdown in (True, False):
+                expected = list(scandir.walk_c(self.testfn, topdown=topdown))
+                for prefetch in (1, 3, 100):
+                    self.assertEqual(list(scandir.walk_c(self.testfn, topdown=topdown,
+                                                         prefetch=prefetch)),
+                                     expected)
+
+        def test_abandoned(self):
+            for i in range(20):
+                os.makedirs(os.path.join(self.testfn, 'dir{0}'.format(i)))
+            it = scandir.walk_c(self.testfn, prefetch=8)
+            next(it)
+            # Deleting it stops the prefetch thread
+            del it
+
+        def test_errors(self):
+            self.assertRaises(ValueError, scandir.walk_c, self.testfn, prefetch=-1)
+            os.mkdir(self.testfn)
+
+    class TestWalkSymlinkPrefetchC(TestWalkSymlink):
+        walk_func = staticmethod(functools.partial(scandir.walk_c, prefetch=4))
+
+
+class TestParallelWalk(unittest.TestCase):
+    temp_dir = os.path.join(os.path.dirname(__file__), 'temp')
+
+    def setUp(self):
+        for i in range(5):
+            for j in range(5):
+                path = os.path.join(self.temp_dir, 'dir{0}'.format(i), 'sub{0}'.format(j))
+                os.makedirs(path)
+                for k in range(3):
+                    open(os.path.join(path, 'file{0}'.format(k)), 'w').close()
+        open(os.path.join(self.temp_dir, 'file'), 'w').close()
+
+    def tearDown(self):
+        shutil.rmtree(self.temp_dir)
+
+    def normalize(self, output):
+        return sorted((top, sorted(dirs), sorted(files)) for top, dirs, files in output)
+
+    def test_same_as_walk(self):
+        expected = self.normalize(scandir.walk_python(self.temp_dir))
+        self.assertEqual(len(expected), 31)
+        for workers in (None, 1, 3, 16):
+            output = self.normalize(scandir.parallel_walk(self.temp_dir, workers=workers))
+            self.assertEqual(output, expected)
+
+    def test_onerror(self):
+        errors = []
+        missing = os.path.join(self.temp_dir, 'missing')
+        self.assertEqual(list(scandir.parallel_walk(missing, onerror=errors.append)), [])
+        self.assertEqual(len(errors), 1)
+        self.assertEqual(errors[0].filename, missing)
+
+    def test_bytes(self):
+        top = self.temp_dir.encode(sys.getfilesystemencoding())
+        for root, dirs, files in scandir.parallel_walk(top):
+            self.assertTrue(isinstance(root, bytes))
+            self.assertTrue(all(isinstance(name, bytes) for name in dirs + files))
+
+    def test_abandoned(self):
+        # Dropping a partly consumed iterator must stop the worker threads
+        if scandir.parallel_walk_c is None:
+            return
+        it = scandir.parallel_walk_c(self.temp_dir, workers=4, queue_size=1)
+        next(it)
+        del it